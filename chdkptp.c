@@ -29,6 +29,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <getopt.h>
 #include <unistd.h>
 #include <signal.h>
@@ -87,6 +88,7 @@
 
 #include "sockutil.h"
 #include "ptpcam.h"
+#include "lvpump.h"
 
 #include <lua.h>
 #include <lualib.h>
@@ -105,6 +107,8 @@
 #include "lbuf.h"
 #include "liveimg.h"
 #include "rawimg.h"
+#include "tiffifd.h"
+#include "lvserve.h"
 #include "luautil.h"
 
 // workaround for error building with CD using old mingw
@@ -819,6 +823,20 @@ reset_device (struct usb_device *dev)
 /*
 get pointers out of user data in given arg
 */
+#ifdef CHDKPTP_THREADS
+/*
+params lock_func, the live view pump thread shares the connection with the Lua thread
+*/
+static void ptp_lock_func(PTPParams *params, int lock) {
+	PTP_CON_STATE *ptp_cs = (PTP_CON_STATE *)params->data;
+	if(lock) {
+		pthread_mutex_lock(&ptp_cs->ptp_lock);
+	} else {
+		pthread_mutex_unlock(&ptp_cs->ptp_lock);
+	}
+}
+#endif
+
 static void get_connection_data(lua_State *L,int narg, PTPParams **params,PTP_CON_STATE **ptp_cs) {
 	*params = (PTPParams *)luaL_checkudata(L,narg,CHDK_CONNECTION_META);
 	*ptp_cs = (PTP_CON_STATE *)((*params)->data);
@@ -826,6 +844,9 @@ static void get_connection_data(lua_State *L,int narg, PTPParams **params,PTP_CO
 
 static void close_connection(PTPParams *params,PTP_CON_STATE *ptp_cs)
 {
+	if(ptp_cs->live_pump) {
+		lvpump_stop(ptp_cs->live_pump);
+	}
 	if(ptp_cs->connected) {
 		close_camera(ptp_cs,params);
 	}
@@ -839,7 +860,14 @@ static int check_connection_status_usb(PTP_CON_STATE *ptp_cs) {
 	if(!ptp_cs->connected) {// never initialized
 		return 0;
 	}
-	if(usb_ptp_get_device_status(ptp_cs,devstatus) < 0) {
+#ifdef CHDKPTP_THREADS
+	pthread_mutex_lock(&ptp_cs->ptp_lock);
+#endif
+	int r = usb_ptp_get_device_status(ptp_cs,devstatus);
+#ifdef CHDKPTP_THREADS
+	pthread_mutex_unlock(&ptp_cs->ptp_lock);
+#endif
+	if(r < 0) {
 		return 0;
 	}
 	return (devstatus[1] == 0x2001);
@@ -1204,6 +1232,10 @@ static int chdk_connection(lua_State *L) {
 	ptp_cs = malloc(sizeof(PTP_CON_STATE));
 	params->data = ptp_cs; // this will be set on connect, but we want set so it can be collected even if we don't connect
 	memset(ptp_cs,0,sizeof(PTP_CON_STATE));
+#ifdef CHDKPTP_THREADS
+	pthread_mutex_init(&ptp_cs->ptp_lock,NULL);
+	params->lock_func = ptp_lock_func;
+#endif
 	if(con_type == PTP_CON_USB) {
 		strcpy(ptp_cs->usb.dev,dev);
 		strcpy(ptp_cs->usb.bus,bus);
@@ -1608,19 +1640,63 @@ static int chdk_script_status(lua_State *L) {
 	lua_setfield(L, -2, "msg");
 	return 1;
 }
+typedef struct {
+	lBuf_t *buf; // lbuf to re-use, or NULL
+	char *new_bytes; // allocated if buf was missing, not owned or too small
+	unsigned new_len;
+} live_data_buf_t;
+
+/*
+getdata alloc_func for get_live_data
+data is read directly into buf if it is large enough, otherwise a new buffer is allocated as lbuf_reuse_size
+it only replaces the contents of buf once the transfer succeeds
+*/
+static void *live_data_alloc(PTPParams *params, PTPGetdataParams *gdparams, uint64_t size) {
+	PTP_CON_STATE *ptp_cs = (PTP_CON_STATE *)params->data;
+	live_data_buf_t *ld = (live_data_buf_t *)gdparams->handler_data;
+	if(size > UINT_MAX/2) {
+		return NULL;
+	}
+	unsigned alloc_len = lbuf_reuse_size(ld->buf,size);
+	if(!alloc_len) {
+		return ld->buf->bytes;
+	}
+	ld->new_bytes = malloc(alloc_len);
+	if(!ld->new_bytes) {
+		return NULL;
+	}
+	ld->new_len = alloc_len;
+	ptp_cs->live_alloc_count++;
+	ptp_cs->live_alloc_bytes += alloc_len;
+	return ld->new_bytes;
+}
+
 /*
 lbuf=con:get_live_data(lbuf,flags)
 lbuf - lbuf to re-use, will be created if nil
+data is read directly into lbuf when its allocation is large enough, see get_counters live_alloc
 throws error on failure
 */
 static int chdk_get_live_data(lua_State *L) {
   	CHDK_CONNECTION_METHOD;
 	CHDK_ENSURE_CONNECTED;
-	lBuf_t *buf = lbuf_getlbuf(L,2);
+	live_data_buf_t ld;
+	ld.buf = lbuf_getlbuf(L,2);
+	ld.new_bytes = NULL;
+	ld.new_len = 0;
 	unsigned flags=lua_tonumber(L,3);
 	char *data=NULL;
 	unsigned data_size = 0;
-	api_check_ptp_throw(L,ptp_chdk_get_live_data(params,flags,&data,&data_size));
+	uint16_t status = ptp_chdk_get_live_data_alloc(params,flags,live_data_alloc,&ld,&data,&data_size);
+	unsigned alloc_len = (ld.new_bytes)?ld.new_len:(ld.buf?ld.buf->alloc_len:0);
+	if(status == PTP_RC_OK && data && data_size > alloc_len) {
+		status = PTP_ERROR_IO;
+	}
+	if(status != PTP_RC_OK || !data || !data_size) {
+		// a re-used buffer may be partially overwritten, but the previous frame is kept if it was replaced
+		free(ld.new_bytes);
+	}
+	api_check_ptp_throw(L,status);
 
 	if(!data) {
 		return api_throw_error_critical(L,"internal_error","no data");
@@ -1628,20 +1704,168 @@ static int chdk_get_live_data(lua_State *L) {
 	if(!data_size) {
 		return api_throw_error_critical(L,"internal_error","zero data size");
 	}
-	if(buf) {
-		if(buf->flags & LBUF_FL_FREE) {
-			free(buf->bytes);
-		}
-		buf->bytes = data;
-		buf->len = data_size;
-		buf->flags = LBUF_FL_FREE;
-		lua_pushvalue(L,2); // copy it to stack top for return
-	} else {
-		lbuf_create(L,data,data_size,LBUF_FL_FREE);
+	if(!lbuf_push_reuse_data(L,2,ld.new_bytes,ld.new_len,data_size)) {
+		free(ld.new_bytes);
+		return luaL_error(L,"failed to create lbuf");
 	}
 	return 1;
 }
 
+/*
+get the connection pump, creating if needed. returns NULL if threads are not supported
+*/
+static lvpump_t *get_live_pump(PTPParams *params, PTP_CON_STATE *ptp_cs) {
+	if(!ptp_cs->live_pump) {
+		ptp_cs->live_pump = lvpump_create(params);
+	}
+	return ptp_cs->live_pump;
+}
+
+/*
+status[,err]=con:live_pump_start(flags,opts)
+fetch live data with flags in a background thread into a ring of frame buffers, see get_live_data
+opts {
+	frames=number -- buffers in the ring, default 3
+	interval=number -- minimum ms between fetches, default 0 = as fast as possible
+}
+if already running, flags and interval are updated
+returns false, msg if threads are not supported
+*/
+static int chdk_live_pump_start(lua_State *L) {
+	CHDK_CONNECTION_METHOD;
+	CHDK_ENSURE_CONNECTED;
+	unsigned flags = lua_tonumber(L,2);
+	unsigned nframes = LVPUMP_DEFAULT_FRAMES;
+	unsigned interval = 0;
+	if(lua_istable(L,3)) {
+		nframes = lu_table_optnumber(L,3,"frames",LVPUMP_DEFAULT_FRAMES);
+		interval = lu_table_optnumber(L,3,"interval",0);
+	}
+	lvpump_t *pump = get_live_pump(params,ptp_cs);
+	if(!pump) {
+		lua_pushboolean(L,0);
+		lua_pushstring(L,"live pump requires thread support");
+		return 2;
+	}
+	if(!lvpump_start(pump,flags,nframes,interval)) {
+		lua_pushboolean(L,0);
+		lua_pushstring(L,"failed to start live pump thread");
+		return 2;
+	}
+	lua_pushboolean(L,1);
+	return 1;
+}
+
+/*
+con:live_pump_stop()
+waits for any fetch in progress to complete
+*/
+static int chdk_live_pump_stop(lua_State *L) {
+	CHDK_CONNECTION_METHOD;
+	if(ptp_cs->live_pump) {
+		lvpump_stop(ptp_cs->live_pump);
+	}
+	return 0;
+}
+
+/*
+lbuf,seq,time=con:live_pump_get_frame(lbuf,after_seq,timeout)
+lbuf - lbuf to re-use, will be created if nil. re-used without allocating if large enough
+after_seq - only return a frame newer than this, default 0
+timeout - ms to wait for a newer frame, default 0
+returns the latest frame, its sequence number and the time it was received in seconds since the epoch
+returns nil if there is no newer frame, or the pump was stopped
+throws if the pump stopped on error
+*/
+static int chdk_live_pump_get_frame(lua_State *L) {
+	CHDK_CONNECTION_METHOD;
+	lBuf_t *buf = lbuf_getlbuf(L,2);
+	unsigned after_seq = luaL_optnumber(L,3,0);
+	unsigned timeout = luaL_optnumber(L,4,0);
+	if(!ptp_cs->live_pump) {
+		lua_pushnil(L);
+		return 1;
+	}
+	lvpump_frame_t *f = lvpump_acquire(ptp_cs->live_pump,after_seq,timeout);
+	if(!f) {
+		lvpump_stats_t stats;
+		lvpump_get_stats(ptp_cs->live_pump,&stats);
+		api_check_ptp_throw(L,stats.status);
+		lua_pushnil(L);
+		return 1;
+	}
+	// copy to a re-used lbuf, so steady state doesn't allocate
+	unsigned alloc_len = lbuf_reuse_size(buf,f->len);
+	buf = lbuf_push_reuse(L,2,f->len);
+	if(!buf) {
+		lvpump_release(ptp_cs->live_pump,f);
+		return luaL_error(L,"malloc failed");
+	}
+	if(alloc_len) {
+		ptp_cs->live_alloc_count++;
+		ptp_cs->live_alloc_bytes += alloc_len;
+	}
+	memcpy(buf->bytes,f->data,f->len);
+	unsigned seq = f->seq;
+	uint64_t time_us = f->time_us;
+	lvpump_release(ptp_cs->live_pump,f);
+	lua_pushnumber(L,seq);
+	lua_pushnumber(L,(lua_Number)time_us/1000000);
+	return 3;
+}
+
+/*
+stats=con:live_pump_stats()
+stats {
+	running=bool
+	status=number -- PTP status of the last fetch
+	seq=number -- sequence number of the latest frame
+	fetched=number -- frames fetched since start
+	dropped=number -- frames replaced before being picked up by get_frame
+	allocs=number -- frame buffer allocations since start
+	alloc_bytes=number
+	last_fetch_ms=number -- duration of the last fetch
+	fetch_ms=number -- total time spent fetching since start
+	elapsed_ms=number -- time since start
+}
+returns nil if the pump has never been started
+*/
+static int chdk_live_pump_stats(lua_State *L) {
+	CHDK_CONNECTION_METHOD;
+	if(!ptp_cs->live_pump) {
+		lua_pushnil(L);
+		return 1;
+	}
+	lvpump_stats_t stats;
+	lvpump_get_stats(ptp_cs->live_pump,&stats);
+	struct timeval tv;
+	gettimeofday(&tv,NULL);
+	uint64_t now_us = (uint64_t)tv.tv_sec*1000000 + tv.tv_usec;
+
+	lua_createtable(L,0,10);
+	lua_pushboolean(L,stats.running);
+	lua_setfield(L,-2,"running");
+	lua_pushnumber(L,stats.status);
+	lua_setfield(L,-2,"status");
+	lua_pushnumber(L,stats.seq);
+	lua_setfield(L,-2,"seq");
+	lua_pushnumber(L,stats.fetched);
+	lua_setfield(L,-2,"fetched");
+	lua_pushnumber(L,stats.dropped);
+	lua_setfield(L,-2,"dropped");
+	lua_pushnumber(L,stats.allocs);
+	lua_setfield(L,-2,"allocs");
+	lua_pushnumber(L,stats.alloc_bytes);
+	lua_setfield(L,-2,"alloc_bytes");
+	lua_pushnumber(L,(lua_Number)stats.last_fetch_us/1000);
+	lua_setfield(L,-2,"last_fetch_ms");
+	lua_pushnumber(L,(lua_Number)stats.fetch_us/1000);
+	lua_setfield(L,-2,"fetch_ms");
+	lua_pushnumber(L,(lua_Number)(now_us - stats.start_us)/1000);
+	lua_setfield(L,-2,"elapsed_ms");
+	return 1;
+}
+
 // TODO these assume numbers are 0 based and contiguous 
 static const char* script_msg_type_to_name(unsigned type_id) {
 	const char *names[]={"none","error","return","user"};
@@ -1954,11 +2178,16 @@ static int chdk_connection_gc(lua_State *L) {
 
 	//printf("collecting connection %s:%s\n",ptp_cs->usb.bus,ptp_cs->usb.dev);
 
+	// stop before closing, the pump thread uses the connection
+	lvpump_destroy(ptp_cs->live_pump);
 	if(ptp_cs->connected) {
 		//printf("disconnecting...");
 		close_camera(ptp_cs,params);
 		//printf("done\n");
 	}
+#ifdef CHDKPTP_THREADS
+	pthread_mutex_destroy(&ptp_cs->ptp_lock);
+#endif
 	free(ptp_cs);
 	return 0;
 }
@@ -1966,16 +2195,21 @@ static int chdk_connection_gc(lua_State *L) {
 static int chdk_reset_counters(lua_State *L) {
 	CHDK_CONNECTION_METHOD;
 	ptp_cs->write_count = ptp_cs->read_count = 0;
+	ptp_cs->live_alloc_count = ptp_cs->live_alloc_bytes = 0;
 	return 0;
 }
 
 static int chdk_get_counters(lua_State *L) {
 	CHDK_CONNECTION_METHOD;
-	lua_createtable(L,0,2);
+	lua_createtable(L,0,4);
 	lua_pushnumber(L,ptp_cs->write_count);
 	lua_setfield(L,-2,"write");
 	lua_pushnumber(L,ptp_cs->read_count);
 	lua_setfield(L,-2,"read");
+	lua_pushnumber(L,ptp_cs->live_alloc_count);
+	lua_setfield(L,-2,"live_alloc");
+	lua_pushnumber(L,ptp_cs->live_alloc_bytes);
+	lua_setfield(L,-2,"live_alloc_bytes");
 	return 1;
 }
 
@@ -2246,6 +2480,10 @@ static const luaL_Reg chdkconnection[] = {
   {"get_ptp_devinfo", chdk_get_ptp_devinfo},
   {"get_con_devinfo", chdk_get_con_devinfo}, // does not need to be connected, returns connection spec at minimum
   {"get_live_data",chdk_get_live_data},
+  {"live_pump_start",chdk_live_pump_start},
+  {"live_pump_stop",chdk_live_pump_stop},
+  {"live_pump_get_frame",chdk_live_pump_get_frame},
+  {"live_pump_stats",chdk_live_pump_stats},
   {"capture_ready", chdk_capture_ready},
   {"capture_get_chunk", chdk_capture_get_chunk},
   {"reset_counters",chdk_reset_counters},
@@ -2655,6 +2893,8 @@ int main(int argc, char ** argv)
 	luaopen_lfs(L);
 	luaopen_lbuf(L);
 	luaopen_rawimg(L);	
+	luaopen_tiffifd(L);
+	luaopen_lvserve(L);
 	chdkptp_registerlibs(L);
 	int r=exec_lua_string(L,"require('main')");
 	uninit_gui_libs(L);
@@ -66,6 +66,10 @@ DEBUG=1
 # not used by default, but source included and should build on any linux
 LUASIGNAL_SUPPORT=1
 
+# threads for bulk raw image operations, live view background fetch (-pump in lvdump, lvfocus and lvserve) and lvserve
+# enabled by default, uncomment to disable
+#THREAD_SUPPORT=
+
 # include svn revision in build number
 #USE_SVNREV=1
 
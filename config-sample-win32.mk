@@ -63,6 +63,10 @@ LIBUSB_LIB_DIR=$(LIBUSB_DIR)/lib/gcc
 # compile with debug support 
 DEBUG=1
 
+# threads for bulk raw image operations, live view background fetch (-pump in lvdump, lvfocus and lvserve) and lvserve
+# enabled by default, uncomment to disable
+#THREAD_SUPPORT=
+
 # include svn revision in build number
 #USE_SVNREV=1
 
@@ -116,6 +116,11 @@ ifeq ($(OSTYPE),Linux)
 LUASIGNAL_SUPPORT=1
 endif
 
+# use threads for bulk raw image operations, live view background fetch (-pump in lvdump, lvfocus and lvserve)
+# and the lvserve live view server. without them, -pump and lvserve fail with an error
+# requires pthreads, on windows provided by mingw winpthreads
+THREAD_SUPPORT=1
+
 # should expand to directory if it exists
 USE_SVNREV:=$(wildcard $(TOPDIR)/.svn)
 
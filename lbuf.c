@@ -18,12 +18,33 @@
  */
 #include <stdint.h>
 #include <string.h>
+#include <errno.h>
 #include <stdlib.h>
+#include <limits.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 #include <lua.h>
 #include <lualib.h>
 #include <lauxlib.h>
 #include "lbuf.h"
 #include "luautil.h"
+
+/*
+lbuf backed by a file mapping, created by lbuf.mmap
+buf must be first, so the userdata can be used anywhere an lBuf_t is expected
+*/
+typedef struct {
+	lBuf_t buf;
+	void *map; // start of mapping, page aligned, bytes may be offset from this
+	size_t map_len;
+} lBufMap_t;
+
 /*
 create a new lbuf and push it on the stack
 */
@@ -35,11 +56,88 @@ int lbuf_create(lua_State *L,void *data,unsigned len,unsigned flags) {
 	buf->len=len;
 	buf->bytes=data;
 	buf->flags=flags;
+	buf->alloc_len=len;
 	luaL_getmetatable(L, LBUF_META);
 	lua_setmetatable(L, -2);
 	return 1;
 }
 
+/*
+size to replace an allocation of alloc_len bytes that is too small for len
+at least double the old, so buffers re-used with varying sizes settle quickly
+*/
+unsigned lbuf_grow_size(unsigned alloc_len, unsigned len) {
+	if(alloc_len*2 > len && alloc_len < UINT_MAX/2) {
+		return alloc_len*2;
+	}
+	return len?len:1;
+}
+
+/*
+allocation size for a re-used lbuf to hold len bytes, or 0 if buf can hold them in its existing allocation
+buf may be NULL. only buffers owned by lbuf are re-used
+*/
+unsigned lbuf_reuse_size(const lBuf_t *buf, unsigned len) {
+	if(buf && (buf->flags & LBUF_FL_FREE) && !(buf->flags & LBUF_FL_READONLY)) {
+		if(buf->alloc_len >= len && buf->bytes) {
+			return 0;
+		}
+		return lbuf_grow_size(buf->alloc_len,len);
+	}
+	return len?len:1;
+}
+
+/*
+push the lbuf at index with length len, or a new one if index is not an lbuf
+data: NULL to keep the existing allocation, if lbuf_reuse_size returned 0
+	otherwise a malloc'd allocation of alloc_len bytes, which replaces the old contents
+returns NULL with nothing pushed if creating a new lbuf fails, in which case data is not freed
+*/
+lBuf_t *lbuf_push_reuse_data(lua_State *L, int index, char *data, unsigned alloc_len, unsigned len) {
+	lBuf_t *buf = lbuf_getlbuf(L,index);
+	if(buf) {
+		if(data) {
+			if(buf->flags & LBUF_FL_FREE) {
+				free(buf->bytes);
+			}
+			buf->bytes = data;
+			buf->alloc_len = alloc_len;
+			buf->flags = LBUF_FL_FREE;
+		}
+		lua_pushvalue(L,index);
+	} else {
+		if(!data || !lbuf_create(L,data,len,LBUF_FL_FREE)) {
+			return NULL;
+		}
+		buf = lbuf_getlbuf(L,-1);
+		buf->alloc_len = alloc_len;
+	}
+	buf->len = len;
+	return buf;
+}
+
+/*
+push an lbuf of len bytes, re-using the lbuf at index if it owns an allocation of at least len
+otherwise its contents are replaced by a new allocation as lbuf_reuse_size
+a new lbuf is created if index is not an lbuf
+contents are undefined. returns NULL with nothing pushed if allocation fails
+*/
+lBuf_t *lbuf_push_reuse(lua_State *L, int index, unsigned len) {
+	unsigned alloc_len = lbuf_reuse_size(lbuf_getlbuf(L,index),len);
+	char *data = NULL;
+	if(alloc_len) {
+		data = malloc(alloc_len);
+		if(!data) {
+			return NULL;
+		}
+	}
+	lBuf_t *buf = lbuf_push_reuse_data(L,index,data,alloc_len,len);
+	if(!buf) {
+		free(data);
+	}
+	return buf;
+}
+
 /*
 check whether given stack index is an lbuf, and if so, return it
 */
@@ -355,6 +453,9 @@ read count bytes into lbuf starting at offset
 */
 static int lbuf_fread(lua_State *L) {
 	lBuf_t *buf = (lBuf_t *)luaL_checkudata(L,1,LBUF_META);
+	if(buf->flags & LBUF_FL_READONLY) {
+		return luaL_error(L,"attempt to set readonly lbuf");
+	}
 	FILE **pf = ((FILE **)luaL_checkudata(L, 2, LUA_FILEHANDLE));
 	if(!*pf) {
 		return luaL_error(L,"attempt to access closed file");
@@ -420,6 +521,9 @@ TODO maybe add range, dest?
 */
 static int lbuf_reverse_bytes(lua_State *L) {
 	lBuf_t *buf = (lBuf_t *)luaL_checkudata(L,1,LBUF_META);
+	if(buf->flags & LBUF_FL_READONLY) {
+		return luaL_error(L,"attempt to set readonly lbuf");
+	}
 	// not optimized
 	int i;
 	for(i=0;i<buf->len-1;i+=2) {
@@ -448,6 +552,9 @@ TODO support negative offset to indicate from end?
 */
 static int lbuf_fill(lua_State *L) {
 	lBuf_t *buf = (lBuf_t *)luaL_checkudata(L,1,LBUF_META);
+	if(buf->flags & LBUF_FL_READONLY) {
+		return luaL_error(L,"attempt to set readonly lbuf");
+	}
 	const char *fill_val;
 	size_t fill_len;
 	if(lua_type(L,2) == LUA_TUSERDATA) {
@@ -500,6 +607,20 @@ static int lbuf_fill(lua_State *L) {
 	return 1;
 }
 
+/*
+mode=lbuf:mapped()
+returns 'r' or 'c' for lbufs created by lbuf.mmap, otherwise false
+*/
+static int lbuf_mapped(lua_State *L) {
+	lBuf_t *buf = (lBuf_t *)luaL_checkudata(L,1,LBUF_META);
+	if(buf->flags & LBUF_FL_MMAP) {
+		lua_pushstring(L,(buf->flags & LBUF_FL_READONLY)?"r":"c");
+	} else {
+		lua_pushboolean(L,0);
+	}
+	return 1;
+}
+
 static const luaL_Reg lbuf_methods[] = {
   {"len", lbuf_len},
   {"string", lbuf_string},
@@ -521,6 +642,7 @@ static const luaL_Reg lbuf_methods[] = {
   {"fwrite",lbuf_fwrite},
   {"reverse_bytes",lbuf_reverse_bytes},
   {"fill",lbuf_fill},
+  {"mapped",lbuf_mapped},
   {NULL, NULL}
 };
 
@@ -564,8 +686,139 @@ static int lbuf_new(lua_State *L) {
 	return 1;
 }
 
+/*
+lbuf=lbuf.mmap(path[,mode[,offset[,len]]])
+create an lbuf backed by a mapping of len bytes of the file starting at offset
+mode:
+	'r' read only, default. Attempts to modify with lbuf methods are errors
+	'c' copy on write, modifications are private and never written to the file
+offset: default 0
+len: default rest of file
+pages are only read from the file when accessed, and the mapping is released on gc
+the file must not be truncated or replaced in place while mapped
+C modules like rawimg do not check the read only flag, use 'c' for anything that may be modified
+returns lbuf or false,error
+*/
+static int lbuf_mmap(lua_State *L) {
+	const char *path = luaL_checkstring(L,1);
+	const char *mode = luaL_optstring(L,2,"r");
+	double offset_arg = luaL_optnumber(L,3,0);
+	int cow;
+	if(strcmp(mode,"r") == 0) {
+		cow = 0;
+	} else if(strcmp(mode,"c") == 0) {
+		cow = 1;
+	} else {
+		return luaL_error(L,"invalid mode");
+	}
+	if(offset_arg < 0) {
+		return luaL_error(L,"invalid offset");
+	}
+	uint64_t offset = offset_arg;
+	uint64_t flen;
+	uint64_t align;
+	void *map;
+#ifdef _WIN32
+	HANDLE fh = CreateFileA(path,GENERIC_READ,FILE_SHARE_READ,NULL,OPEN_EXISTING,FILE_ATTRIBUTE_NORMAL,NULL);
+	if(fh == INVALID_HANDLE_VALUE) {
+		lua_pushboolean(L,0);
+		lua_pushfstring(L,"%s: open failed %d",path,(int)GetLastError());
+		return 2;
+	}
+	LARGE_INTEGER fsize;
+	if(!GetFileSizeEx(fh,&fsize)) {
+		CloseHandle(fh);
+		lua_pushboolean(L,0);
+		lua_pushfstring(L,"%s: get size failed %d",path,(int)GetLastError());
+		return 2;
+	}
+	flen = fsize.QuadPart;
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+	align = si.dwAllocationGranularity;
+#else
+	int fd = open(path,O_RDONLY);
+	if(fd < 0) {
+		lua_pushboolean(L,0);
+		lua_pushfstring(L,"%s: %s",path,strerror(errno));
+		return 2;
+	}
+	struct stat st;
+	if(fstat(fd,&st) != 0) {
+		close(fd);
+		lua_pushboolean(L,0);
+		lua_pushfstring(L,"%s: %s",path,strerror(errno));
+		return 2;
+	}
+	flen = st.st_size;
+	align = sysconf(_SC_PAGESIZE);
+#endif
+	const char *err = NULL;
+	uint64_t len = 0;
+	if(offset >= flen) {
+		err = "offset >= file size";
+	} else {
+		len = luaL_optnumber(L,4,flen - offset);
+		if(offset + len > flen) {
+			err = "offset + len > file size";
+		} else if(len == 0 || len > UINT32_MAX) {
+			err = "invalid len";
+		}
+	}
+	if(err) {
+#ifdef _WIN32
+		CloseHandle(fh);
+#else
+		close(fd);
+#endif
+		lua_pushboolean(L,0);
+		lua_pushstring(L,err);
+		return 2;
+	}
+	// mapping must start on a page (windows: allocation granularity) boundary
+	uint64_t map_off = offset - offset % align;
+	size_t map_len = len + (offset - map_off);
+#ifdef _WIN32
+	HANDLE mh = CreateFileMapping(fh,NULL,cow?PAGE_WRITECOPY:PAGE_READONLY,0,0,NULL);
+	CloseHandle(fh);
+	if(!mh) {
+		lua_pushboolean(L,0);
+		lua_pushfstring(L,"%s: CreateFileMapping failed %d",path,(int)GetLastError());
+		return 2;
+	}
+	map = MapViewOfFile(mh,cow?FILE_MAP_COPY:FILE_MAP_READ,(DWORD)(map_off >> 32),(DWORD)map_off,map_len);
+	// view keeps the mapping object open
+	CloseHandle(mh);
+	if(!map) {
+		lua_pushboolean(L,0);
+		lua_pushfstring(L,"%s: MapViewOfFile failed %d",path,(int)GetLastError());
+		return 2;
+	}
+#else
+	map = mmap(NULL,map_len,cow?(PROT_READ|PROT_WRITE):PROT_READ,cow?MAP_PRIVATE:MAP_SHARED,fd,map_off);
+	// mapping remains valid after close
+	close(fd);
+	if(map == MAP_FAILED) {
+		lua_pushboolean(L,0);
+		lua_pushfstring(L,"%s: mmap failed %s",path,strerror(errno));
+		return 2;
+	}
+#endif
+	lBufMap_t *mbuf = (lBufMap_t *)lua_newuserdata(L,sizeof(lBufMap_t));
+	mbuf->buf.len = len;
+	mbuf->buf.bytes = (char *)map + (offset - map_off);
+	mbuf->buf.flags = LBUF_FL_MMAP | (cow?0:LBUF_FL_READONLY);
+	mbuf->buf.alloc_len = len;
+	mbuf->map = map;
+	mbuf->map_len = map_len;
+	luaL_getmetatable(L, LBUF_META);
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
 static const luaL_Reg lbuf_funcs[] = {
   {"new", lbuf_new},
+  {"mmap", lbuf_mmap},
   {NULL, NULL}
 };
 
@@ -577,8 +830,26 @@ static int lbuf_gc(lua_State *L) {
 		free(buf->bytes);
 		// ensure anything on the C side sees this as empty before final gc
 		buf->len=0;
+		buf->alloc_len=0;
 		buf->bytes=NULL;
 	}	
+	// check the size rather than flags, the mapping must be released even if code that
+	// re-uses lbufs replaced the contents
+	if(lua_objlen(L,1) == sizeof(lBufMap_t)) {
+		lBufMap_t *mbuf = (lBufMap_t *)buf;
+		if(mbuf->map) {
+#ifdef _WIN32
+			UnmapViewOfFile(mbuf->map);
+#else
+			munmap(mbuf->map,mbuf->map_len);
+#endif
+			mbuf->map = NULL;
+			if(buf->flags & LBUF_FL_MMAP) {
+				buf->len=0;
+				buf->bytes=NULL;
+			}
+		}
+	}
 	return 0;
 }
 
@@ -23,13 +23,19 @@
 #define LBUF_METHODS "lbuf.lbuf_methods"
 #define LBUF_FL_FREE 0x1
 #define LBUF_FL_READONLY 0x2
+#define LBUF_FL_MMAP 0x4 // created by lbuf.mmap, see lbuf_gc
 typedef struct {
 	unsigned len;
 	unsigned flags;
 	char *bytes;
+	unsigned alloc_len; // allocated size of bytes, may be larger than len for buffers re-used by get_live_data
 } lBuf_t;
 int lbuf_create(lua_State *L,void *data,unsigned len,unsigned flags);
 lBuf_t* lbuf_getlbuf(lua_State *L,int i);
+unsigned lbuf_grow_size(unsigned alloc_len, unsigned len);
+unsigned lbuf_reuse_size(const lBuf_t *buf, unsigned len);
+lBuf_t *lbuf_push_reuse_data(lua_State *L, int index, char *data, unsigned alloc_len, unsigned len);
+lBuf_t *lbuf_push_reuse(lua_State *L, int index, unsigned len);
 int luaopen_lbuf(lua_State *L);
 #endif
 
@@ -24,6 +24,7 @@
 #include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
+#include <math.h>
 #include <lua.h>
 #include <lualib.h>
 #include <lauxlib.h>
@@ -34,6 +35,8 @@
 #include "core/live_view.h"
 #include "lbuf.h"
 #include "liveimg.h"
+#include "liveimg_yuv.h"
+#include "lvcodec.h"
 #include "luautil.h"
 /*
 planar img
@@ -140,24 +143,6 @@ static unsigned get_palette_size(unsigned type) {
 	return 0;
 }
 
-static uint8_t clip_yuv(int v) {
-	if (v<0) return 0;
-	if (v>255) return 255;
-	return v;
-}
-
-static uint8_t yuv_to_r(uint8_t y, int8_t v) {
-	return clip_yuv(((y<<12) +          v*5743 + 2048)>>12);
-}
-
-static uint8_t yuv_to_g(uint8_t y, int8_t u, int8_t v) {
-	return clip_yuv(((y<<12) - u*1411 - v*2925 + 2048)>>12);
-}
-
-static uint8_t yuv_to_b(uint8_t y, int8_t u) {
-	return clip_yuv(((y<<12) + u*7258          + 2048)>>12);
-}
-
 static uint8_t clamp_uint8(unsigned v) {
 	return (v>255)?255:v;
 }
@@ -261,146 +246,55 @@ void palette_type5_to_rgba(const char *palette, uint8_t pixel,palette_entry_rgba
 	palette_AYUV_to_rgba(palette, pixel, pal_rgb, 4);
 }
 
-void yuv_live_to_cd_rgb(const char *p_yuv,
+/*
+convert rows with the given row function, starting at the end to flip for CD
+bpp: 12 for YUV8 groups of 4 pixels, 16 for YUV8B/C groups of 2
+*/
+static void yuv_rows_to_cd_rgb(liveimg_yuv_row_fn row_fn,
+						unsigned bpp,
+						const char *p_yuv,
 						unsigned buf_width,
 						unsigned width,unsigned height,
 						int skip,
 						uint8_t *r,uint8_t *g,uint8_t *b) {
-	unsigned x,row;
-	unsigned row_inc = (buf_width*12)/8;
-	const char *p;
-	// start at end to flip for CD
+	unsigned row;
+	unsigned row_inc = (buf_width*bpp)/8;
+	unsigned group_pixels = (bpp == 12)?4:2;
+	unsigned groups = (width + group_pixels - 1)/group_pixels;
+	unsigned out_inc = skip?groups*group_pixels/2:groups*group_pixels;
 	const char *p_row = p_yuv + (height - 1) * row_inc;
 	for(row=0;row<height;row++,p_row -= row_inc) {
-		for(x=0,p=p_row;x<width;x+=4,p+=6) {
-			*r++ = yuv_to_r(p[1],p[2]);
-			*g++ = yuv_to_g(p[1],p[0],p[2]);
-			*b++ = yuv_to_b(p[1],p[0]);
-
-			*r++ = yuv_to_r(p[3],p[2]);
-			*g++ = yuv_to_g(p[3],p[0],p[2]);
-			*b++ = yuv_to_b(p[3],p[0]);
-			if(!skip) {
-				// TODO it might be better to use the next pixels U and V values
-				*r++ = yuv_to_r(p[4],p[2]);
-				*g++ = yuv_to_g(p[4],p[0],p[2]);
-				*b++ = yuv_to_b(p[4],p[0]);
-
-				*r++ = yuv_to_r(p[5],p[2]);
-				*g++ = yuv_to_g(p[5],p[0],p[2]);
-				*b++ = yuv_to_b(p[5],p[0]);
-			}
-		}
+		row_fn((const uint8_t *)p_row,groups,skip,r,g,b);
+		r += out_inc;
+		g += out_inc;
+		b += out_inc;
 	}
 }
 
-void yuvb_live_to_cd_rgb(const char *p_yuv,
+void yuv_live_to_cd_rgb(const char *p_yuv,
 						unsigned buf_width,
 						unsigned width,unsigned height,
 						int skip,
 						uint8_t *r,uint8_t *g,uint8_t *b) {
-	unsigned x,row;
-	unsigned row_inc = (buf_width*16)/8;
-	const char *p;
-	// start at end to flip for CD
-	const char *p_row = p_yuv + (height - 1) * row_inc;
-	for(row=0;row<height;row++,p_row -= row_inc) {
-		for(x=0,p=p_row;x<width;x+=2,p+=4) {
-			char p2 = p[2] - 0x80;
-			char p0 = p[0] - 0x80;
-			*r++ = yuv_to_r(p[1],p2);
-			*g++ = yuv_to_g(p[1],p0,p2);
-			*b++ = yuv_to_b(p[1],p0);
-
-			if(!skip) {
-				*r++ = yuv_to_r(p[3],p2);
-				*g++ = yuv_to_g(p[3],p0,p2);
-				*b++ = yuv_to_b(p[3],p0);
-			}
-		}
-	}
+	yuv_rows_to_cd_rgb(liveimg_yuv_get_impl()->yuv8,12,p_yuv,buf_width,width,height,skip,r,g,b);
 }
 
-void yuvc_live_to_cd_rgb(const char *p_yuv,
+void yuvb_live_to_cd_rgb(const char *p_yuv,
 						unsigned buf_width,
 						unsigned width,unsigned height,
 						int skip,
 						uint8_t *r,uint8_t *g,uint8_t *b) {
-	unsigned x,row;
-	unsigned row_inc = (buf_width*16)/8;
-	const char *p;
-	// start at end to flip for CD
-	const char *p_row = p_yuv + (height - 1) * row_inc;
-	for(row=0;row<height;row++,p_row -= row_inc) {
-		for(x=0,p=p_row;x<width;x+=2,p+=4) {
-			char p2 = p[2];
-			char p0 = p[0];
-			*r++ = yuv_to_r(p[1],p2);
-			*g++ = yuv_to_g(p[1],p0,p2);
-			*b++ = yuv_to_b(p[1],p0);
-
-			if(!skip) {
-				*r++ = yuv_to_r(p[3],p2);
-				*g++ = yuv_to_g(p[3],p0,p2);
-				*b++ = yuv_to_b(p[3],p0);
-			}
-		}
-	}
+	yuv_rows_to_cd_rgb(liveimg_yuv_get_impl()->yuv8b,16,p_yuv,buf_width,width,height,skip,r,g,b);
 }
 
-// C&P, handles alpha channel
-void yuvb_live_to_cd_rgba(const char *p_yuv,
-						unsigned buf_width,
-						unsigned width,unsigned height,
-						int skip,
-						uint8_t *r,uint8_t *g,uint8_t *b,uint8_t *a) {
-	unsigned x,row;
-	unsigned row_inc = (buf_width*16)/8;
-	const char *p;
-	const unsigned *u;
-	// start at end to flip for CD
-	const char *p_row = p_yuv + (height - 1) * row_inc;
-	for(row=0;row<height;row++,p_row -= row_inc) {
-		for(x=0,p=p_row;x<width;x+=2,p+=4) {
-			char p2 = p[2] - 0x80;
-			char p0 = p[0] - 0x80;
-			u = (unsigned *)p;
-			*r++ = yuv_to_r(p[1],p2);
-			*g++ = yuv_to_g(p[1],p0,p2);
-			*b++ = yuv_to_b(p[1],p0);
-			*a++ = *u==0x800080?0:255; // TODO alpha hack should only be used if real alpha not present
-
-			if(!skip) {
-				*r++ = yuv_to_r(p[3],p2);
-				*g++ = yuv_to_g(p[3],p0,p2);
-				*b++ = yuv_to_b(p[3],p0);
-				*a++ = *u==0x800080?0:255;
-			}
-		}
-	}
-}
-void opacity_live_to_cd_a(const char *p_opac,
+void yuvc_live_to_cd_rgb(const char *p_yuv,
 						unsigned buf_width,
 						unsigned width,unsigned height,
 						int skip,
-						uint8_t *a) {
-	unsigned x,row;
-	unsigned row_inc = buf_width;
-	const char *p;
-	// start at end to flip for CD
-	const char *p_row = p_opac + (height - 1) * row_inc;
-	// TODO could memcpy rows if not skipping
-	for(row=0;row<height;row++,p_row -= row_inc) {
-		for(x=0,p=p_row;x<width;x+=2,p+=2) {
-			*a++ = *p;
-			if(!skip) {
-				*a++ = *(p+1);
-			}
-		}
-	}
+						uint8_t *r,uint8_t *g,uint8_t *b) {
+	yuv_rows_to_cd_rgb(liveimg_yuv_get_impl()->yuv8c,16,p_yuv,buf_width,width,height,skip,r,g,b);
 }
 
-
 static void pimg_destroy(liveimg_pimg_t *im) {
 	free(im->data);
 	im->width = im->height = 0;
@@ -633,13 +527,154 @@ static lv_framebuffer_desc *get_bmo_desc(lv_data_header *frame,int data_len,cons
 	return check_fb_desc(frame,desc,bpp,data_len,err);
 }
 
+/*
+validate opacity for YUV bitmaps or palette for palette bitmaps, setting bmo if present
+returns NULL if valid, otherwise an error message
+*/
+static const char *check_bm_extra(lv_data_header *frame,int data_len,lv_framebuffer_desc *bm,lv_framebuffer_desc **bmo) {
+	const char *err;
+	*bmo = NULL;
+	// currently only d6 YUV overlay has alpha channel
+	if (bm->fb_type == LV_FB_YUV8B) {
+		// YUV bitmap should only be sent by supporting protocol, so no additional check needed
+		*bmo=get_bmo_desc(frame,data_len,&err);
+		if(!*bmo) {
+			return err;
+		}
+		// code currently assumes identical dimensions
+		if(bm->visible_width != (*bmo)->visible_width
+			|| bm->visible_height != (*bmo)->visible_height) {
+			return "opacity buffer size != bitmap size";
+		}
+	} else {
+		if(get_palette_size(frame->palette_type) + frame->palette_data_start > data_len) {
+			return "data < palette size";
+		}
+	}
+	return NULL;
+}
+
+/*
+rectangle of the viewport to convert, with the range of YUV groups that covers it
+*/
+typedef struct {
+	liveimg_yuv_row_fn row_fn;
+	const uint8_t *data; // first group of the first row of the rectangle
+	unsigned row_inc;
+	unsigned groups; // groups converted for each row
+	unsigned row_pixels; // output pixels converted for each row
+	unsigned offset; // output pixel of the left edge of the rectangle in the converted row
+	unsigned x,y,width,height; // rectangle in output pixels, x and width are halved with skip
+	unsigned scale; // integer upscaling of the output
+	int skip;
+} vp_rect_t;
+
+#define VP_RECT_MAX_SCALE 16
+
+/*
+set up rect from the x, y, width, height and scale fields of the opts table at index,
+defaulting to the whole viewport at scale 1. x and width are viewport pixels
+the rectangle is clipped to the visible area
+returns NULL if valid, otherwise an error message
+*/
+static const char *vp_rect_init(lua_State *L,int index,vp_rect_t *rect,lv_framebuffer_desc *vp,const char *frame_data,int skip) {
+	const liveimg_yuv_impl_t *impl = liveimg_yuv_get_impl();
+	unsigned par = skip?2:1;
+	unsigned group_pixels = 2;
+	unsigned group_bytes = 4;
+	unsigned bpp = 16;
+	if(vp->fb_type == LV_FB_YUV8) {
+		rect->row_fn = impl->yuv8;
+		group_pixels = 4;
+		group_bytes = 6;
+		bpp = 12;
+	} else if(vp->fb_type == LV_FB_YUV8B) {
+		rect->row_fn = impl->yuv8b;
+	} else {
+		rect->row_fn = impl->yuv8c;
+	}
+	int x = 0, y = 0;
+	int width = vp->visible_width, height = vp->visible_height;
+	int scale = 1;
+	if(lua_istable(L,index)) {
+		x = lu_table_optnumber(L,index,"x",x);
+		y = lu_table_optnumber(L,index,"y",y);
+		width = lu_table_optnumber(L,index,"width",width);
+		height = lu_table_optnumber(L,index,"height",height);
+		scale = lu_table_optnumber(L,index,"scale",scale);
+	}
+	if(scale < 1 || scale > VP_RECT_MAX_SCALE) {
+		return "invalid scale";
+	}
+	if(x < 0) {
+		width += x;
+		x = 0;
+	}
+	if(y < 0) {
+		height += y;
+		y = 0;
+	}
+	if(x + width > (int)vp->visible_width) {
+		width = (int)vp->visible_width - x;
+	}
+	if(y + height > (int)vp->visible_height) {
+		height = (int)vp->visible_height - y;
+	}
+	// output pixels, with skip only the first half of each group is converted
+	unsigned ox = x/par;
+	unsigned ow = (width > 0)?width/par:0;
+	if(ox + ow > vp->visible_width/par) {
+		ow = vp->visible_width/par - ox;
+	}
+	if(!ow || height <= 0) {
+		return "ROI outside viewport";
+	}
+	unsigned group_out = group_pixels/par;
+	unsigned first_group = ox/group_out;
+	rect->groups = (ox + ow - 1)/group_out - first_group + 1;
+	rect->row_pixels = rect->groups*group_out;
+	rect->offset = ox - first_group*group_out;
+	rect->row_inc = (vp->buffer_width*bpp)/8;
+	rect->data = (const uint8_t *)frame_data + vp->data_start + y*rect->row_inc + first_group*group_bytes;
+	rect->x = ox;
+	rect->y = y;
+	rect->width = ow;
+	rect->height = height;
+	rect->scale = scale;
+	rect->skip = skip;
+	return NULL;
+}
+
+/*
+repeat each pixel of a row of width pixels of depth bytes scale times
+may be done in place, with dst == src
+*/
+static void scale_row(uint8_t *dst,const uint8_t *src,unsigned width,unsigned depth,unsigned scale) {
+	unsigned x = width;
+	// right to left, so in place expansion never overwrites unread pixels
+	while(x--) {
+		uint8_t px[4];
+		memcpy(px,src + x*depth,depth);
+		uint8_t *d = dst + x*depth*scale;
+		unsigned i;
+		for(i=0;i<scale;i++,d+=depth) {
+			memcpy(d,px,depth);
+		}
+	}
+}
+
 /*
 convert viewport data to RGB pimg
-pimg=liveimg.get_viewport_pimg(pimg,live_frame,skip)
+pimg=liveimg.get_viewport_pimg(pimg,live_frame,skip[,opts])
 pimg: pimg to re-use, created if nil, replaced if size doesn't match
 live_fream: from get_live_data
 skip: boolean - if true, each U Y V Y Y Y is converted to 2 pixels, otherwise 4
+opts:{
+	x, y, width, height -- convert only this rectangle in viewport pixels, clipped to the visible area
+	scale=number -- repeat each pixel scale times in x and y, 1-16, default 1
+}
 returns nil if info does not contain a live view
+with opts, only the YUV groups covering the rectangle are converted
 */
 static int liveimg_get_viewport_pimg(lua_State *L) {
 	lv_data_header *frame;
@@ -669,6 +704,20 @@ static int liveimg_get_viewport_pimg(lua_State *L) {
 		return 1;
 	}
 
+	vp_rect_t rect;
+	int use_rect = lua_istable(L,4);
+	unsigned out_width = vwidth;
+	unsigned out_height = vp->visible_height;
+	if(use_rect) {
+		const char *err = vp_rect_init(L,4,&rect,vp,frame_lb->bytes,skip);
+		if(err) {
+			return luaL_error(L,err);
+		}
+		out_width = rect.width*rect.scale;
+		out_height = rect.height*rect.scale;
+		dispsize = out_width*out_height;
+	}
+
 	if(im && dispsize != im->width*im->height) {
 		pimg_destroy(im);
 		im = NULL;
@@ -676,16 +725,41 @@ static int liveimg_get_viewport_pimg(lua_State *L) {
 	if(im) {
 		lua_pushvalue(L, 1); // copy im onto top for return
 		// set width and height, could have changed without changing byte count
-		im->width = vwidth;
-		im->height = vp->visible_height;
+		im->width = out_width;
+		im->height = out_height;
 	} else { // create an new im 
 		pimg_create(L);
 		im = luaL_checkudata(L,-1,LIVEIMG_PIMG_META);
-		if(!pimg_init_rgb(im,vwidth,vp->visible_height)) {
+		if(!pimg_init_rgb(im,out_width,out_height)) {
 			return luaL_error(L,"failed to create image");
 		}
 	}
 
+	if(use_rect) {
+		uint8_t *row_rgb = malloc(rect.row_pixels*3);
+		if(!row_rgb) {
+			return luaL_error(L,"malloc failed");
+		}
+		uint8_t *planes[3] = {row_rgb,row_rgb + rect.row_pixels,row_rgb + 2*rect.row_pixels};
+		uint8_t *im_planes[3] = {im->r,im->g,im->b};
+		const uint8_t *src = rect.data;
+		unsigned y,i,j;
+		for(y=0;y<rect.height;y++,src += rect.row_inc) {
+			rect.row_fn(src,rect.groups,skip,planes[0],planes[1],planes[2]);
+			// flip for CD, each source row becomes scale rows
+			unsigned out_y = (rect.height - 1 - y)*rect.scale;
+			for(i=0;i<3;i++) {
+				uint8_t *row = im_planes[i] + out_y*out_width;
+				scale_row(row,planes[i] + rect.offset,rect.width,1,rect.scale);
+				for(j=1;j<rect.scale;j++) {
+					memcpy(row + j*out_width,row,out_width);
+				}
+			}
+		}
+		free(row_rgb);
+		return 1;
+	}
+
 	if (vp->fb_type == LV_FB_YUV8) {
 		yuv_live_to_cd_rgb(frame_lb->bytes+vp->data_start,
 						vp->buffer_width,
@@ -711,19 +785,217 @@ static int liveimg_get_viewport_pimg(lua_State *L) {
 	return 1;
 }
 
-static void convert_palette(palette_entry_rgba_t *pal_rgba,lv_data_header *frame) {
-	const char *pal=NULL;
-	palette_convert_t *convert=get_palette_convert(frame->palette_type);
-	if(!convert || !frame->palette_data_start) {
-		convert = get_palette_convert(1);
-		pal = palette_type1_default;
+/*
+converted palettes, keyed by a hash of the palette type and data
+the palette rarely changes between frames, so it is only converted when a new one is seen
+only used from the Lua thread
+*/
+#define PALETTE_CACHE_SIZE 4
+#define PALETTE_MAX_SIZE (256*4)
+
+typedef struct {
+	uint32_t hash;
+	unsigned type;
+	unsigned size; // 0 = unused
+	unsigned last_used;
+	uint8_t data[PALETTE_MAX_SIZE]; // source palette, to confirm a hash match
+	palette_entry_rgba_t rgba[256];
+} palette_cache_entry_t;
+
+static palette_cache_entry_t palette_cache[PALETTE_CACHE_SIZE];
+static unsigned palette_cache_clock;
+static unsigned palette_cache_hits;
+static unsigned palette_cache_misses;
+
+// FNV-1a
+static uint32_t palette_hash(unsigned type,const uint8_t *data,unsigned size) {
+	uint32_t h = 2166136261U ^ type;
+	h *= 16777619U;
+	unsigned i;
+	for(i=0;i<size;i++) {
+		h = (h ^ data[i])*16777619U;
+	}
+	return h;
+}
+
+/*
+return the RGBA palette for frame, converting it only if not cached
+frame palette must have been validated by check_bm_extra
+*/
+static const palette_entry_rgba_t *get_palette_rgba(lv_data_header *frame) {
+	unsigned type = frame->palette_type;
+	const uint8_t *pal;
+	palette_convert_t *convert = get_palette_convert(type);
+	if(!convert || !convert->to_rgba || !frame->palette_data_start) {
+		type = 1;
+		convert = get_palette_convert(type);
+		pal = (const uint8_t *)palette_type1_default;
 	} else {
-		pal = ((char *)frame + frame->palette_data_start);
+		pal = (const uint8_t *)frame + frame->palette_data_start;
+	}
+	unsigned size = convert->num_entries*4;
+	uint32_t hash = palette_hash(type,pal,size);
+	palette_cache_entry_t *e = NULL;
+	unsigned i;
+	palette_cache_clock++;
+	for(i=0;i<PALETTE_CACHE_SIZE;i++) {
+		palette_cache_entry_t *c = &palette_cache[i];
+		if(c->size == size && c->hash == hash && c->type == type && memcmp(c->data,pal,size) == 0) {
+			c->last_used = palette_cache_clock;
+			palette_cache_hits++;
+			return c->rgba;
+		}
+		// replace unused or least recently used
+		if(!e || c->last_used < e->last_used) {
+			e = c;
+		}
 	}
+	palette_cache_misses++;
+	e->hash = hash;
+	e->type = type;
+	e->size = size;
+	e->last_used = palette_cache_clock;
+	memcpy(e->data,pal,size);
 	yuv_palette_to_rgba_fn fn = convert->to_rgba;
-	int i;
 	for(i=0;i<256;i++) {
-		fn(pal,i,&pal_rgba[i]);
+		fn((const char *)pal,i,&e->rgba[i]);
+	}
+	return e->rgba;
+}
+
+/*
+hits,misses=liveimg.palette_cache_stats([reset])
+reset: boolean - if true, clear the counts after returning them
+*/
+static int liveimg_palette_cache_stats(lua_State *L) {
+	lua_pushnumber(L,palette_cache_hits);
+	lua_pushnumber(L,palette_cache_misses);
+	if(lua_toboolean(L,1)) {
+		palette_cache_hits = palette_cache_misses = 0;
+	}
+	return 2;
+}
+
+/*
+bitmap data for direct conversion, set up by get_bitmap_source
+*/
+typedef struct {
+	lv_framebuffer_desc *bm;
+	const uint8_t *data; // NULL if the frame has no bitmap data
+	const uint8_t *opacity; // YUV8B opacity, NULL to treat black as transparent
+	unsigned opacity_width;
+	const palette_entry_rgba_t *pal; // palette bitmaps only, from the palette cache
+	liveimg_yuv_row_fn row_fn; // YUV8B bitmaps only
+} bitmap_source_t;
+
+/*
+validate the bitmap in frame and set up src
+returns NULL if valid, otherwise an error message
+*/
+static const char *get_bitmap_source(bitmap_source_t *src,lv_data_header *frame,int data_len) {
+	const char *err;
+	lv_framebuffer_desc *bmo;
+	src->data = src->opacity = NULL;
+	src->bm = get_bm_desc(frame,data_len,&err);
+	if(!src->bm) {
+		return err;
+	}
+	if(!src->bm->data_start || !src->bm->visible_width || !src->bm->visible_height) {
+		return NULL;
+	}
+	err = check_bm_extra(frame,data_len,src->bm,&bmo);
+	if(err) {
+		return err;
+	}
+	if(bmo && bmo->data_start) {
+		src->opacity = (const uint8_t *)frame + bmo->data_start;
+		src->opacity_width = bmo->buffer_width;
+	}
+	if(src->bm->fb_type == LV_FB_YUV8B) {
+		src->row_fn = liveimg_yuv_get_impl()->yuv8b;
+	} else {
+		src->pal = get_palette_rgba(frame);
+	}
+	src->data = (const uint8_t *)frame + src->bm->data_start;
+	return NULL;
+}
+
+/*
+convert row y of the bitmap to planar r, g, b, a, visible_width/par pixels
+palette bitmaps are a lookup per pixel, YUV uses the viewport row conversion
+*/
+static void bitmap_source_row(const bitmap_source_t *src,unsigned y,int skip,
+								uint8_t *r,uint8_t *g,uint8_t *b,uint8_t *a) {
+	unsigned par = skip?2:1;
+	unsigned width = src->bm->visible_width/par;
+	unsigned x;
+	if(src->bm->fb_type != LV_FB_YUV8B) {
+		const uint8_t *p = src->data + y*src->bm->buffer_width;
+		for(x=0;x<width;x++,p+=par) {
+			const palette_entry_rgba_t *c = &src->pal[*p];
+			r[x] = c->r;
+			g[x] = c->g;
+			b[x] = c->b;
+			a[x] = c->a;
+		}
+		return;
+	}
+	const uint8_t *p = src->data + y*src->bm->buffer_width*2;
+	unsigned groups = src->bm->visible_width/2;
+	src->row_fn(p,groups,skip,r,g,b);
+	// odd width, last pixel is the first of an incomplete group
+	if(!skip && groups*2 < width) {
+		const uint8_t *pg = p + groups*4;
+		int8_t u = pg[0] ^ 0x80;
+		int8_t v = pg[2] ^ 0x80;
+		r[width-1] = yuv_to_r(pg[1],v);
+		g[width-1] = yuv_to_g(pg[1],u,v);
+		b[width-1] = yuv_to_b(pg[1],u);
+	}
+	if(src->opacity) {
+		const uint8_t *po = src->opacity + y*src->opacity_width;
+		if(!skip) {
+			memcpy(a,po,width);
+		} else {
+			for(x=0;x<width;x++) {
+				a[x] = po[x*2];
+			}
+		}
+		return;
+	}
+	// TODO alpha hack should only be used if real alpha not present
+	for(x=0;x<width;x++) {
+		const uint8_t *pg = p + ((x*par) & ~1u)*2;
+		a[x] = (pg[0] == 0x80 && pg[1] == 0 && pg[2] == 0x80 && pg[3] == 0)?0:255;
+	}
+}
+
+/*
+convert row y of the bitmap to packed RGBA, visible_width/par pixels
+scratch: 4*visible_width bytes, used for YUV bitmaps
+*/
+static void bitmap_source_row_packed(const bitmap_source_t *src,unsigned y,int skip,uint8_t *dst,uint8_t *scratch) {
+	unsigned par = skip?2:1;
+	unsigned width = src->bm->visible_width/par;
+	unsigned x;
+	if(src->bm->fb_type != LV_FB_YUV8B) {
+		// palette entries are already packed RGBA
+		const uint8_t *p = src->data + y*src->bm->buffer_width;
+		for(x=0;x<width;x++,p+=par,dst+=4) {
+			memcpy(dst,&src->pal[*p],4);
+		}
+		return;
+	}
+	uint8_t *r = scratch;
+	uint8_t *g = r + width;
+	uint8_t *b = g + width;
+	uint8_t *a = b + width;
+	bitmap_source_row(src,y,skip,r,g,b,a);
+	for(x=0;x<width;x++) {
+		*dst++ = r[x];
+		*dst++ = g[x];
+		*dst++ = b[x];
+		*dst++ = a[x];
 	}
 }
 
@@ -736,50 +1008,25 @@ skip: boolean - if true, every other pixel in the x axis is discarded (for viewp
 returns nil if info does not contain a bitmap
 */
 static int liveimg_get_bitmap_pimg(lua_State *L) {
-	palette_entry_rgba_t pal_rgba[256];
-
-	lv_data_header *frame;
-	lv_framebuffer_desc *bm;
-	lv_framebuffer_desc *bmo=NULL;
-
 	liveimg_pimg_t *im = pimg_get(L,1);
 	lBuf_t *frame_lb = luaL_checkudata(L,2,LBUF_META);
 	int skip = lua_toboolean(L,3);
 	// pixel aspect ratio
 	int par = (skip == 1)?2:1;
 
-	frame = (lv_data_header *)frame_lb->bytes;
-	const char *fb_desc_err;
-	bm = get_bm_desc(frame,frame_lb->len,&fb_desc_err);
-	if(!bm) {
-		return luaL_error(L,fb_desc_err);
+	bitmap_source_t bms;
+	const char *err = get_bitmap_source(&bms,(lv_data_header *)frame_lb->bytes,frame_lb->len);
+	if(err) {
+		return luaL_error(L,err);
 	}
-
-	unsigned vwidth = bm->visible_width/par;
-	unsigned dispsize = vwidth*bm->visible_height;
-
 // no data or zero sized image, return nil
-	if(!bm->data_start || !dispsize) {
+	if(!bms.data || !(bms.bm->visible_width/par)) {
 		lua_pushnil(L);
 		return 1;
 	}
-	// currently only d6 YUV overlay has alpha channel
-	if (bm->fb_type == LV_FB_YUV8B) {
-		// YUV bitmap should only be sent by supporting protocol, so no additional check needed
-		bmo=get_bmo_desc(frame,frame_lb->len,&fb_desc_err);
-		if(!bmo) {
-			return luaL_error(L,fb_desc_err);
-		}
-		// code currently assumes identical dimensions
-		if(bm->visible_width != bmo->visible_width
-			|| bm->visible_height != bmo->visible_height) {
-			return luaL_error(L,"opacity buffer size != bitmap size");
-		}
-	} else {
-		if(get_palette_size(frame->palette_type) + frame->palette_data_start > frame_lb->len) {
-			return luaL_error(L,"data < palette size");
-		}
-	}
+	unsigned vwidth = bms.bm->visible_width/par;
+	unsigned height = bms.bm->visible_height;
+	unsigned dispsize = vwidth*height;
 
 	if(im && dispsize != im->width*im->height) {
 		pimg_destroy(im);
@@ -790,53 +1037,452 @@ static int liveimg_get_bitmap_pimg(lua_State *L) {
 	} else { // create an new im 
 		pimg_create(L);
 		im = luaL_checkudata(L,-1,LIVEIMG_PIMG_META);
-		if(!pimg_init_rgba(im,vwidth,bm->visible_height)) {
+		if(!pimg_init_rgba(im,vwidth,height)) {
 			return luaL_error(L,"failed to create image");
 		}
 	}
 
-	if (bm->fb_type == LV_FB_YUV8B) {
-		yuvb_live_to_cd_rgba(frame_lb->bytes+bm->data_start,
-						bm->buffer_width,
-						bm->visible_width,
-						bm->visible_height,
-						skip,
-						im->r,im->g,im->b,im->a);
-		// use alpha if available
-		if(bmo && bmo->data_start) {
-			opacity_live_to_cd_a(frame_lb->bytes+bmo->data_start,
-								bmo->buffer_width,
-								bmo->visible_width,
-								bmo->visible_height,
-								skip,
-								im->a);
-		}
+	unsigned y;
+	// flip for CD
+	for(y=0;y<height;y++) {
+		unsigned offset = (height - 1 - y)*vwidth;
+		bitmap_source_row(&bms,y,skip,im->r + offset,im->g + offset,im->b + offset,im->a + offset);
+	}
+	return 1;
+}
+
+/*
+push an lbuf of size bytes for packed output, re-using the one at index if the size matches
+returns the data
+*/
+static uint8_t *packed_lbuf(lua_State *L,int index,unsigned size) {
+	lBuf_t *buf = lbuf_getlbuf(L,index);
+	if(buf && buf->len == size && !(buf->flags & LBUF_FL_READONLY)) {
+		lua_pushvalue(L,index);
+		return (uint8_t *)buf->bytes;
+	}
+	char *data = malloc(size);
+	if(!data) {
+		luaL_error(L,"malloc failed");
+		return NULL;
+	}
+	lbuf_create(L,data,size,LBUF_FL_FREE);
+	return (uint8_t *)data;
+}
+
+/*
+convert viewport data directly to packed RGB or RGBA, without a pimg
+lbuf,width,height=liveimg.get_viewport_packed(lbuf,frame[,opts])
+lbuf: lbuf to re-use if the size matches, or nil
+frame: from get_live_data
+opts:{
+	skip=bool -- if true, each U Y V Y Y Y is converted to 2 pixels, otherwise 4
+	flip=bool -- if true, rows are bottom to top as used by CD, otherwise top to bottom
+	alpha=bool -- if true, output RGBA with alpha 255, otherwise RGB
+	bitmap_overlay=bool -- if true, blend the bitmap over the viewport, scaled to the full screen
+	x, y, width, height -- convert only this rectangle in viewport pixels, clipped to the visible area
+	                       default whole viewport. with skip, x and width are halved in the output
+	scale=number -- repeat each output pixel scale times in x and y, 1-16, default 1
+}
+returns nil if frame does not contain a viewport
+only the YUV groups covering the rectangle are converted
+*/
+static int liveimg_get_viewport_packed(lua_State *L) {
+	lBuf_t *frame_lb = luaL_checkudata(L,2,LBUF_META);
+	int skip = 0;
+	int flip = 0;
+	int alpha = 0;
+	int overlay = 0;
+	if(lua_istable(L,3)) {
+		skip = lu_table_optboolean(L,3,"skip",0);
+		flip = lu_table_optboolean(L,3,"flip",0);
+		alpha = lu_table_optboolean(L,3,"alpha",0);
+		overlay = lu_table_optboolean(L,3,"bitmap_overlay",0);
+	}
+	// pixel aspect ratio
+	unsigned par = skip?2:1;
+
+	lv_data_header *frame = (lv_data_header *)frame_lb->bytes;
+	const char *err;
+	lv_framebuffer_desc *vp = get_vp_desc(frame,frame_lb->len,&err);
+	if(!vp) {
+		return luaL_error(L,err);
+	}
+	if(!vp->data_start || !(vp->visible_width/par) || !vp->visible_height) {
+		lua_pushnil(L);
 		return 1;
 	}
+	vp_rect_t rect;
+	err = vp_rect_init(L,3,&rect,vp,frame_lb->bytes,skip);
+	if(err) {
+		return luaL_error(L,err);
+	}
+	bitmap_source_t bms;
+	bms.data = NULL;
+	if(overlay) {
+		err = get_bitmap_source(&bms,frame,frame_lb->len);
+		if(err) {
+			return luaL_error(L,err);
+		}
+	}
 
-	convert_palette(pal_rgba,frame);
+	unsigned width = rect.width;
+	unsigned height = rect.height;
+	unsigned scale = rect.scale;
+	unsigned depth = alpha?4:3;
+	unsigned out_width = width*scale;
+	unsigned out_row = out_width*depth;
+
+	uint8_t *dst = packed_lbuf(L,1,out_row*height*scale);
+
+	// if blending, bitmap x for each pixel and one converted bitmap row with scratch
+	// then one planar viewport row
+	unsigned bm_width = bms.data?bms.bm->visible_width:0;
+	unsigned bm_size = bms.data?width*sizeof(unsigned) + bm_width*8:0;
+	unsigned *bm_x = malloc(bm_size + rect.row_pixels*3);
+	if(!bm_x) {
+		return luaL_error(L,"malloc failed");
+	}
+	uint8_t *bm_row = (uint8_t *)bm_x + width*sizeof(unsigned);
+	uint8_t *bm_scratch = bm_row + bm_width*4;
+	uint8_t *r = (uint8_t *)bm_x + bm_size;
+	uint8_t *g = r + rect.row_pixels;
+	uint8_t *b = g + rect.row_pixels;
+	int bm_row_y = -1;
+	unsigned screen_width = vp->margin_left + vp->visible_width + vp->margin_right;
+	unsigned screen_height = vp->margin_top + vp->visible_height + vp->margin_bot;
+	unsigned x,y;
+	if(bms.data) {
+		for(x=0;x<width;x++) {
+			bm_x[x] = (((rect.x + x)*par + vp->margin_left)*bms.bm->visible_width)/screen_width;
+		}
+	}
+	// pixels of the rectangle in the converted row
+	const uint8_t *rr = r + rect.offset;
+	const uint8_t *rg = g + rect.offset;
+	const uint8_t *rb = b + rect.offset;
+
+	const uint8_t *src = rect.data;
+	for(y=0;y<height;y++,src += rect.row_inc) {
+		rect.row_fn(src,rect.groups,skip,r,g,b);
+		uint8_t *row = dst + (flip?(height - 1 - y):y)*scale*out_row;
+		uint8_t *p = row;
+		if(bms.data) {
+			int bm_y = ((rect.y + y + vp->margin_top)*bms.bm->visible_height)/screen_height;
+			// bitmap is usually lower resolution, convert each row once
+			if(bm_y != bm_row_y) {
+				bitmap_source_row_packed(&bms,bm_y,0,bm_row,bm_scratch);
+				bm_row_y = bm_y;
+			}
+			for(x=0;x<width;x++) {
+				const uint8_t *c = bm_row + bm_x[x]*4;
+				unsigned a = c[3];
+				// mostly transparent OSD, fully transparent and opaque are exact without blending
+				if(a == 0) {
+					*p++ = rr[x];
+					*p++ = rg[x];
+					*p++ = rb[x];
+				} else if(a == 255) {
+					*p++ = c[0];
+					*p++ = c[1];
+					*p++ = c[2];
+				} else {
+					*p++ = (c[0]*a + rr[x]*(255 - a) + 127)/255;
+					*p++ = (c[1]*a + rg[x]*(255 - a) + 127)/255;
+					*p++ = (c[2]*a + rb[x]*(255 - a) + 127)/255;
+				}
+				if(alpha) {
+					*p++ = 255;
+				}
+			}
+		} else if(alpha) {
+			for(x=0;x<width;x++) {
+				*p++ = rr[x];
+				*p++ = rg[x];
+				*p++ = rb[x];
+				*p++ = 255;
+			}
+		} else {
+			for(x=0;x<width;x++) {
+				*p++ = rr[x];
+				*p++ = rg[x];
+				*p++ = rb[x];
+			}
+		}
+		if(scale > 1) {
+			scale_row(row,row,width,depth,scale);
+			unsigned i;
+			for(i=1;i<scale;i++) {
+				memcpy(row + i*out_row,row,out_row);
+			}
+		}
+	}
+	free(bm_x);
+	lua_pushnumber(L,out_width);
+	lua_pushnumber(L,height*scale);
+	return 3;
+}
 
-	int y_inc = bm->buffer_width;
-	int x_inc = par;
-	int x,y;
-	int height = bm->visible_height;
+/*
+convert bitmap data directly to packed RGBA, without a pimg
+lbuf,width,height=liveimg.get_bitmap_packed(lbuf,frame[,opts])
+lbuf: lbuf to re-use if the size matches, or nil
+frame: from get_live_data
+opts:{
+	skip=bool -- if true, every other pixel in the x axis is discarded (for viewports with a 1:2 par)
+	flip=bool -- if true, rows are bottom to top as used by CD, otherwise top to bottom
+}
+returns nil if frame does not contain a bitmap
+*/
+static int liveimg_get_bitmap_packed(lua_State *L) {
+	lBuf_t *frame_lb = luaL_checkudata(L,2,LBUF_META);
+	int skip = 0;
+	int flip = 0;
+	if(lua_istable(L,3)) {
+		skip = lu_table_optboolean(L,3,"skip",0);
+		flip = lu_table_optboolean(L,3,"flip",0);
+	}
+	unsigned par = skip?2:1;
 
-	uint8_t *p=((uint8_t *)frame_lb->bytes + bm->data_start) + (height-1)*y_inc;
+	bitmap_source_t bms;
+	const char *err = get_bitmap_source(&bms,(lv_data_header *)frame_lb->bytes,frame_lb->len);
+	if(err) {
+		return luaL_error(L,err);
+	}
+	if(!bms.data) {
+		lua_pushnil(L);
+		return 1;
+	}
+	unsigned width = bms.bm->visible_width/par;
+	unsigned height = bms.bm->visible_height;
+	if(!width) {
+		lua_pushnil(L);
+		return 1;
+	}
+	uint8_t *dst = packed_lbuf(L,1,width*height*4);
+	uint8_t *scratch = NULL;
+	if(bms.bm->fb_type == LV_FB_YUV8B) {
+		scratch = malloc(width*4);
+		if(!scratch) {
+			return luaL_error(L,"malloc failed");
+		}
+	}
+	unsigned y;
+	for(y=0;y<height;y++) {
+		bitmap_source_row_packed(&bms,y,skip,dst + (flip?(height - 1 - y):y)*width*4,scratch);
+	}
+	free(scratch);
+	lua_pushnumber(L,width);
+	lua_pushnumber(L,height);
+	return 3;
+}
 
-	uint8_t *r = im->r;
-	uint8_t *g = im->g;
-	uint8_t *b = im->b;
-	uint8_t *a = im->a;
+/*
+copy luma of a viewport rectangle to dst, w*h bytes. rectangle must be within the visible area
+*/
+static void vp_get_luma(lv_framebuffer_desc *vp,const uint8_t *data,
+						unsigned x0,unsigned y0,unsigned w,unsigned h,uint8_t *dst) {
+	// Y byte of each pixel in a U Y V Y Y Y group
+	static const uint8_t yuv8_y[4] = {1,3,4,5};
+	unsigned bpp = (vp->fb_type == LV_FB_YUV8)?12:16;
+	unsigned row_inc = (vp->buffer_width*bpp)/8;
+	unsigned x,y;
+	for(y=0;y<h;y++) {
+		const uint8_t *row = data + (y0 + y)*row_inc;
+		if(vp->fb_type == LV_FB_YUV8) {
+			for(x=x0;x<x0+w;x++) {
+				*dst++ = row[(x/4)*6 + yuv8_y[x&3]];
+			}
+		} else {
+			for(x=x0;x<x0+w;x++) {
+				*dst++ = row[(x/2)*4 + 1 + (x&1)*2];
+			}
+		}
+	}
+}
 
-	for(y=0;y<height;y++,p-=y_inc) {
-		for(x=0;x<bm->visible_width;x+=x_inc) {
-			palette_entry_rgba_t *c =&pal_rgba[*(p+x)];
-			*r++ = c->r;
-			*g++ = c->g;
-			*b++ = c->b;
-			*a++ = c->a;
+/*
+stats=liveimg.focus_metric(frame[,opts])
+focus measurements on the viewport luma, for manual focusing through live view
+opts:{
+	x, y, width, height -- ROI in viewport pixels from the top left of the visible area,
+	                       clipped to the visible area. default whole viewport
+	radius=number -- radius around the brightest pixel used to measure the star, default 8
+}
+returns nil if frame does not contain a viewport, otherwise
+{
+	x, y, width, height -- ROI used
+	mean -- mean luma
+	background -- median luma
+	lap_var -- variance of the 4 neighbour laplacian over the ROI, larger is sharper
+	peak, peak_x, peak_y -- brightest pixel, the first if there are several
+	saturated -- peak is 255, hfr is not reliable
+	star_x, star_y -- flux weighted centroid of pixels above background within radius of the peak
+	flux -- sum of luma above background within radius of the centroid
+	hfr -- flux weighted mean radius from the centroid, 0 if no pixels are above background
+}
+*/
+static int liveimg_focus_metric(lua_State *L) {
+	lBuf_t *frame_lb = luaL_checkudata(L,1,LBUF_META);
+	lv_data_header *frame = (lv_data_header *)frame_lb->bytes;
+	const char *err;
+	lv_framebuffer_desc *vp = get_vp_desc(frame,frame_lb->len,&err);
+	if(!vp) {
+		return luaL_error(L,err);
+	}
+	if(!vp->data_start || !vp->visible_width || !vp->visible_height) {
+		lua_pushnil(L);
+		return 1;
+	}
+	int rx = 0, ry = 0;
+	int rw = vp->visible_width, rh = vp->visible_height;
+	int radius = 8;
+	if(lua_istable(L,2)) {
+		rx = lu_table_optnumber(L,2,"x",0);
+		ry = lu_table_optnumber(L,2,"y",0);
+		rw = lu_table_optnumber(L,2,"width",rw);
+		rh = lu_table_optnumber(L,2,"height",rh);
+		radius = lu_table_optnumber(L,2,"radius",radius);
+	}
+	if(rx < 0) {
+		rw += rx;
+		rx = 0;
+	}
+	if(ry < 0) {
+		rh += ry;
+		ry = 0;
+	}
+	if(rx + rw > (int)vp->visible_width) {
+		rw = (int)vp->visible_width - rx;
+	}
+	if(ry + rh > (int)vp->visible_height) {
+		rh = (int)vp->visible_height - ry;
+	}
+	if(rw <= 0 || rh <= 0) {
+		return luaL_error(L,"ROI outside viewport");
+	}
+	if(radius < 1) {
+		radius = 1;
+	}
+	unsigned w = rw, h = rh;
+	uint8_t *luma = malloc(w*h);
+	if(!luma) {
+		return luaL_error(L,"malloc failed");
+	}
+	vp_get_luma(vp,(const uint8_t *)frame_lb->bytes + vp->data_start,rx,ry,w,h,luma);
+
+	unsigned hist[256];
+	memset(hist,0,sizeof(hist));
+	unsigned peak = 0, peak_x = 0, peak_y = 0;
+	uint64_t sum = 0;
+	unsigned x,y;
+	const uint8_t *p = luma;
+	for(y=0;y<h;y++) {
+		for(x=0;x<w;x++,p++) {
+			hist[*p]++;
+			sum += *p;
+			if(*p > peak) {
+				peak = *p;
+				peak_x = x;
+				peak_y = y;
+			}
+		}
+	}
+	unsigned half = (w*h + 1)/2;
+	unsigned background = 0, count = 0;
+	while(background < 255 && (count += hist[background]) < half) {
+		background++;
+	}
+
+	// laplacian over the interior, values fit easily in 64 bit sums for any viewport
+	int64_t lsum = 0;
+	uint64_t lsum2 = 0;
+	unsigned lcount = 0;
+	if(w >= 3 && h >= 3) {
+		for(y=1;y<h-1;y++) {
+			const uint8_t *r = luma + y*w;
+			const uint8_t *up = r - w;
+			const uint8_t *down = r + w;
+			for(x=1;x<w-1;x++) {
+				int l = 4*r[x] - r[x-1] - r[x+1] - up[x] - down[x];
+				lsum += l;
+				lsum2 += (int64_t)l*l;
+			}
+		}
+		lcount = (w-2)*(h-2);
+	}
+	double lap_var = 0;
+	if(lcount) {
+		double lmean = (double)lsum/lcount;
+		lap_var = (double)lsum2/lcount - lmean*lmean;
+	}
+
+	// centroid around the peak, then flux and mean radius around the centroid
+	double cx = peak_x, cy = peak_y;
+	double flux = 0, sr = 0;
+	int iter;
+	for(iter=0;iter<2;iter++) {
+		double sx = 0, sy = 0;
+		flux = 0;
+		sr = 0;
+		int x0 = (int)(cx + 0.5) - radius, x1 = (int)(cx + 0.5) + radius;
+		int y0 = (int)(cy + 0.5) - radius, y1 = (int)(cy + 0.5) + radius;
+		int sx_i,sy_i;
+		for(sy_i = (y0 < 0)?0:y0;sy_i <= y1 && sy_i < (int)h;sy_i++) {
+			for(sx_i = (x0 < 0)?0:x0;sx_i <= x1 && sx_i < (int)w;sx_i++) {
+				double dx = sx_i - cx, dy = sy_i - cy;
+				double d2 = dx*dx + dy*dy;
+				int v = (int)luma[sy_i*w + sx_i] - (int)background;
+				if(v <= 0 || d2 > radius*radius) {
+					continue;
+				}
+				flux += v;
+				sx += v*sx_i;
+				sy += v*sy_i;
+				sr += v*sqrt(d2);
+			}
+		}
+		if(flux <= 0) {
+			break;
+		}
+		if(iter == 0) {
+			cx = sx/flux;
+			cy = sy/flux;
 		}
 	}
+	free(luma);
+
+	lua_createtable(L,0,16);
+	lua_pushnumber(L,rx);
+	lua_setfield(L,-2,"x");
+	lua_pushnumber(L,ry);
+	lua_setfield(L,-2,"y");
+	lua_pushnumber(L,w);
+	lua_setfield(L,-2,"width");
+	lua_pushnumber(L,h);
+	lua_setfield(L,-2,"height");
+	lua_pushnumber(L,(double)sum/(w*h));
+	lua_setfield(L,-2,"mean");
+	lua_pushnumber(L,background);
+	lua_setfield(L,-2,"background");
+	lua_pushnumber(L,lap_var);
+	lua_setfield(L,-2,"lap_var");
+	lua_pushnumber(L,peak);
+	lua_setfield(L,-2,"peak");
+	lua_pushnumber(L,rx + peak_x);
+	lua_setfield(L,-2,"peak_x");
+	lua_pushnumber(L,ry + peak_y);
+	lua_setfield(L,-2,"peak_y");
+	lua_pushboolean(L,peak == 255);
+	lua_setfield(L,-2,"saturated");
+	lua_pushnumber(L,rx + cx);
+	lua_setfield(L,-2,"star_x");
+	lua_pushnumber(L,ry + cy);
+	lua_setfield(L,-2,"star_y");
+	lua_pushnumber(L,(flux > 0)?flux:0);
+	lua_setfield(L,-2,"flux");
+	lua_pushnumber(L,(flux > 0)?sr/flux:0);
+	lua_setfield(L,-2,"hfr");
 	return 1;
 }
 
@@ -906,26 +1552,12 @@ static int pimg_blend_to_cd_canvas(lua_State *L) {
 
 /*
 convert pimg to to packed
-in some cases it would be better to do this directly from lv data,
-but code needs to be untangled from pimg
+to convert directly from lv data, see get_viewport_packed and get_bitmap_packed
 */
 static int pimg_to_packed(lua_State *L,int alpha) {
 	liveimg_pimg_t *im = (liveimg_pimg_t *)luaL_checkudata(L,1,LIVEIMG_PIMG_META);
-	lBuf_t *buf = lbuf_getlbuf(L,2);
-	char *data = NULL;
 	unsigned depth=(alpha)?4:3;
-	unsigned data_size = im->width*im->height*depth;
-	if(buf && buf->len == data_size) {
-		// could re-size the data of the same lbuf if size mismatched
-		data = buf->bytes;
-		lua_pushvalue(L,2); // copy it to stack top for return
-	} else {
-		data=malloc(data_size);
-		if(!data) {
-			return luaL_error(L,"malloc failed");
-		}
-		lbuf_create(L,data,data_size,LBUF_FL_FREE);
-	}
+	uint8_t *data = packed_lbuf(L,2,im->width*im->height*depth);
 	uint8_t *r = im->r;
 	uint8_t *g = im->g;
 	uint8_t *b = im->b;
@@ -933,7 +1565,7 @@ static int pimg_to_packed(lua_State *L,int alpha) {
 	int x,y;
 	// start at bottom to flip
 	for(y=im->height;y;y--) {
-		uint8_t *p = (uint8_t *)data + (y-1)*im->width*depth;
+		uint8_t *p = data + (y-1)*im->width*depth;
 		for(x=0;x<im->width;x++) {
 			*p++ = *r++;
 			*p++ = *g++;
@@ -963,9 +1595,162 @@ static int pimg_to_lbuf_packed_rgba(lua_State *L) {
 	return pimg_to_packed(L,1);
 }
 
+/*
+name=liveimg.get_yuv_impl()
+name of the implementation used to convert YUV viewport data
+*/
+static int liveimg_get_yuv_impl(lua_State *L) {
+	lua_pushstring(L,liveimg_yuv_get_impl()->name);
+	return 1;
+}
+
+/*
+name=liveimg.set_yuv_impl(name)
+name: "auto" for the fastest supported by the CPU, or one of liveimg.get_yuv_impls()
+returns the name set, or false, error message if name is not supported
+all implementations produce identical output, this is for testing and benchmarks
+*/
+static int liveimg_set_yuv_impl(lua_State *L) {
+	const char *name = luaL_checkstring(L,1);
+	if(!liveimg_yuv_set_impl(name)) {
+		lua_pushboolean(L,0);
+		lua_pushfstring(L,"yuv implementation not supported: %s",name);
+		return 2;
+	}
+	lua_pushstring(L,liveimg_yuv_get_impl()->name);
+	return 1;
+}
+
+/*
+names=liveimg.get_yuv_impls()
+array of implementation names supported by the CPU, slowest first
+*/
+static int liveimg_get_yuv_impls(lua_State *L) {
+	const char *name;
+	unsigned i;
+	lua_newtable(L);
+	for(i=0;(name = liveimg_yuv_impl_name(i));i++) {
+		lua_pushstring(L,name);
+		lua_rawseti(L,-2,i+1);
+	}
+	return 1;
+}
+
+/*
+payload,codec=liveimg.lvdump_pack(payload,frame[,prev])
+compress a live frame for an lvdump v2 record
+payload: lbuf to re-use, created if nil
+prev: previous frame, if given and the same size, the difference from prev is compressed
+returns the payload lbuf and codec, 0 = raw, 1 = lz, 2 = delta lz
+if compression doesn't reduce the size, frame itself is returned with codec 0
+*/
+static int liveimg_lvdump_pack(lua_State *L) {
+	lBuf_t *frame = luaL_checkudata(L,2,LBUF_META);
+	lBuf_t *prev = lbuf_getlbuf(L,3);
+	unsigned len = frame->len;
+	if(prev && prev->len != len) {
+		prev = NULL;
+	}
+	lBuf_t *payload = lbuf_getlbuf(L,1);
+	if(payload && (payload == frame || payload == prev)) {
+		return luaL_error(L,"payload must not be frame or prev");
+	}
+	unsigned bound = lvcodec_lz_bound(len);
+	// delta is staged after the compressed output
+	payload = lbuf_push_reuse(L,1,bound + (prev?len:0));
+	if(!payload) {
+		return luaL_error(L,"malloc failed");
+	}
+	const uint8_t *src = (uint8_t *)frame->bytes;
+	if(prev) {
+		uint8_t *delta = (uint8_t *)payload->bytes + bound;
+		lvcodec_delta(delta,src,(uint8_t *)prev->bytes,len);
+		src = delta;
+	}
+	unsigned size = lvcodec_lz_compress(src,len,(uint8_t *)payload->bytes,bound);
+	if(!size || size >= len) {
+		lua_pushvalue(L,2);
+		lua_pushnumber(L,LVCODEC_RAW);
+		return 2;
+	}
+	payload->len = size;
+	lua_pushnumber(L,prev?LVCODEC_DELTA_LZ:LVCODEC_LZ);
+	return 2;
+}
+
+/*
+frame=liveimg.lvdump_unpack(frame,payload,offset,size,codec,raw_size[,prev])
+decode size bytes of an lvdump v2 record payload starting at offset
+frame: lbuf to re-use, created if nil
+prev: previous decoded frame, required for codec 2. must not be frame
+returns frame, or false,error if the data is corrupt
+*/
+static int liveimg_lvdump_unpack(lua_State *L) {
+	lBuf_t *payload = luaL_checkudata(L,2,LBUF_META);
+	unsigned offset = luaL_checknumber(L,3);
+	unsigned size = luaL_checknumber(L,4);
+	unsigned codec = luaL_checknumber(L,5);
+	unsigned raw_size = luaL_checknumber(L,6);
+	lBuf_t *prev = lbuf_getlbuf(L,7);
+
+	if(offset > payload->len || size > payload->len - offset) {
+		return luaL_error(L,"offset and size out of range");
+	}
+	if(codec == LVCODEC_DELTA_LZ) {
+		if(!prev) {
+			return luaL_error(L,"delta frame requires prev");
+		}
+		if(prev->len != raw_size) {
+			lua_pushboolean(L,0);
+			lua_pushstring(L,"delta frame size does not match prev");
+			return 2;
+		}
+	} else if(codec != LVCODEC_RAW && codec != LVCODEC_LZ) {
+		lua_pushboolean(L,0);
+		lua_pushfstring(L,"unknown codec %d",codec);
+		return 2;
+	}
+	lBuf_t *frame = lbuf_getlbuf(L,1);
+	if(frame && (frame == payload || frame == prev)) {
+		return luaL_error(L,"frame must not be payload or prev");
+	}
+	frame = lbuf_push_reuse(L,1,raw_size);
+	if(!frame) {
+		return luaL_error(L,"malloc failed");
+	}
+	const uint8_t *src = (uint8_t *)payload->bytes + offset;
+	if(codec == LVCODEC_RAW) {
+		if(size != raw_size) {
+			lua_pushboolean(L,0);
+			lua_pushstring(L,"raw frame size mismatch");
+			return 2;
+		}
+		memcpy(frame->bytes,src,size);
+		return 1;
+	}
+	if(!lvcodec_lz_decompress(src,size,(uint8_t *)frame->bytes,raw_size)) {
+		lua_pushboolean(L,0);
+		lua_pushstring(L,"corrupt compressed frame");
+		return 2;
+	}
+	if(codec == LVCODEC_DELTA_LZ) {
+		lvcodec_undelta((uint8_t *)frame->bytes,(uint8_t *)prev->bytes,raw_size);
+	}
+	return 1;
+}
+
 static const luaL_Reg liveimg_funcs[] = {
   {"get_bitmap_pimg", liveimg_get_bitmap_pimg},
   {"get_viewport_pimg", liveimg_get_viewport_pimg},
+  {"get_viewport_packed", liveimg_get_viewport_packed},
+  {"get_bitmap_packed", liveimg_get_bitmap_packed},
+  {"get_yuv_impl", liveimg_get_yuv_impl},
+  {"set_yuv_impl", liveimg_set_yuv_impl},
+  {"get_yuv_impls", liveimg_get_yuv_impls},
+  {"palette_cache_stats", liveimg_palette_cache_stats},
+  {"focus_metric", liveimg_focus_metric},
+  {"lvdump_pack", liveimg_lvdump_pack},
+  {"lvdump_unpack", liveimg_lvdump_unpack},
   {NULL, NULL}
 };
 
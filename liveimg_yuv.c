@@ -0,0 +1,542 @@
+/*
+ * live view YUV to RGB row conversion, with SIMD implementations selected at runtime
+ * no Lua
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+/*
+SIMD versions compute y + ((chroma + 2048) >> 12) with 32 bit chroma terms and saturating packs,
+which is exactly the scalar calculation, so output does not depend on the implementation.
+Complete blocks of groups are converted with SIMD, remaining groups with the scalar code.
+SSE2 and NEON are used when enabled by the compiler, AVX2 is built with a target attribute
+and only used if the CPU supports it
+*/
+#include <stdint.h>
+#include <string.h>
+#include "liveimg_yuv.h"
+
+#if defined(__SSE2__)
+#define LIVEIMG_YUV_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LIVEIMG_YUV_AVX2 1
+#include <immintrin.h>
+#define AVX2_FN __attribute__((target("avx2")))
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define LIVEIMG_YUV_NEON 1
+#include <arm_neon.h>
+#endif
+
+// pair of 16 bit coefficients for madd, applied to 16 bit U (low) and V (high)
+#define YUV_COEF_PAIR(u,v) ((int)(((uint32_t)(uint16_t)(v) << 16) | (uint16_t)(u)))
+
+static inline void yuv8_row_scalar_x(const uint8_t *p, unsigned groups, int skip,
+									uint8_t *r, uint8_t *g, uint8_t *b) {
+	unsigned i;
+	for(i=0;i<groups;i++,p+=6) {
+		int8_t u = p[0];
+		int8_t v = p[2];
+		*r++ = yuv_to_r(p[1],v);
+		*g++ = yuv_to_g(p[1],u,v);
+		*b++ = yuv_to_b(p[1],u);
+
+		*r++ = yuv_to_r(p[3],v);
+		*g++ = yuv_to_g(p[3],u,v);
+		*b++ = yuv_to_b(p[3],u);
+		if(!skip) {
+			// TODO it might be better to use the next pixels U and V values
+			*r++ = yuv_to_r(p[4],v);
+			*g++ = yuv_to_g(p[4],u,v);
+			*b++ = yuv_to_b(p[4],u);
+
+			*r++ = yuv_to_r(p[5],v);
+			*g++ = yuv_to_g(p[5],u,v);
+			*b++ = yuv_to_b(p[5],u);
+		}
+	}
+}
+
+/*
+uv_xor: value xored with U and V bytes to make them signed, 0x80 for YUV8B, 0 for YUV8C
+*/
+static inline void yuv8bc_row_scalar_x(const uint8_t *p, unsigned groups, int skip, uint8_t uv_xor,
+									uint8_t *r, uint8_t *g, uint8_t *b) {
+	unsigned i;
+	for(i=0;i<groups;i++,p+=4) {
+		int8_t u = p[0] ^ uv_xor;
+		int8_t v = p[2] ^ uv_xor;
+		*r++ = yuv_to_r(p[1],v);
+		*g++ = yuv_to_g(p[1],u,v);
+		*b++ = yuv_to_b(p[1],u);
+
+		if(!skip) {
+			*r++ = yuv_to_r(p[3],v);
+			*g++ = yuv_to_g(p[3],u,v);
+			*b++ = yuv_to_b(p[3],u);
+		}
+	}
+}
+
+static void yuv8_row_scalar(const uint8_t *p, unsigned groups, int skip,
+							uint8_t *r, uint8_t *g, uint8_t *b) {
+	yuv8_row_scalar_x(p,groups,skip,r,g,b);
+}
+
+static void yuv8b_row_scalar(const uint8_t *p, unsigned groups, int skip,
+							uint8_t *r, uint8_t *g, uint8_t *b) {
+	yuv8bc_row_scalar_x(p,groups,skip,0x80,r,g,b);
+}
+
+static void yuv8c_row_scalar(const uint8_t *p, unsigned groups, int skip,
+							uint8_t *r, uint8_t *g, uint8_t *b) {
+	yuv8bc_row_scalar_x(p,groups,skip,0,r,g,b);
+}
+
+#if defined(LIVEIMG_YUV_SSE2)
+/*
+r, g, b chroma terms for 4 groups, from 32 bit lanes with U in byte 0 and V in byte 2
+uv_xor: 16 bit lanes of uv_xor ^ 0x80, which makes the bytes offset by 0x80 for sign extension
+*/
+static inline void sse2_chroma(__m128i a, __m128i uv_xor, __m128i d[3]) {
+	const __m128i round = _mm_set1_epi32(2048);
+	__m128i uv = _mm_and_si128(a,_mm_set1_epi32(0x00FF00FF));
+	uv = _mm_sub_epi16(_mm_xor_si128(uv,uv_xor),_mm_set1_epi16(0x80));
+	d[0] = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(uv,_mm_set1_epi32(YUV_COEF_PAIR(0,5743))),round),12);
+	d[1] = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(uv,_mm_set1_epi32(YUV_COEF_PAIR(-1411,-2925))),round),12);
+	d[2] = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(uv,_mm_set1_epi32(YUV_COEF_PAIR(7258,0))),round),12);
+}
+
+static inline void sse2_store8(uint8_t *dst, __m128i w) {
+	_mm_storel_epi64((__m128i *)dst,_mm_packus_epi16(w,w));
+}
+
+static inline void sse2_store16(uint8_t *dst, __m128i w0, __m128i w1) {
+	_mm_storeu_si128((__m128i *)dst,_mm_packus_epi16(w0,w1));
+}
+
+// 4 groups per block, each gathered as U Y0 V Y1 and Y2 Y3 lanes
+static void yuv8_row_sse2(const uint8_t *p, unsigned groups, int skip,
+							uint8_t *r, uint8_t *g, uint8_t *b) {
+	const __m128i xv = _mm_set1_epi16(0x80);
+	const __m128i mask = _mm_set1_epi32(0xFF);
+	uint8_t *out[3] = {r,g,b};
+	unsigned n = groups & ~3u;
+	unsigned i;
+	int c;
+	for(i=0;i<n;i+=4,p+=24) {
+		// last load is shifted to avoid reading past the block
+		__m128i q01 = _mm_unpacklo_epi32(_mm_loadl_epi64((const __m128i *)p),
+										_mm_loadl_epi64((const __m128i *)(p+6)));
+		__m128i q23 = _mm_unpacklo_epi32(_mm_loadl_epi64((const __m128i *)(p+12)),
+										_mm_srli_si128(_mm_loadl_epi64((const __m128i *)(p+16)),2));
+		__m128i a = _mm_unpacklo_epi64(q01,q23);
+		__m128i e = _mm_unpackhi_epi64(q01,q23);
+		__m128i y0 = _mm_and_si128(_mm_srli_epi32(a,8),mask);
+		__m128i y1 = _mm_srli_epi32(a,24);
+		__m128i d[3];
+		sse2_chroma(a,xv,d);
+		for(c=0;c<3;c++) {
+			__m128i c0 = _mm_add_epi32(y0,d[c]);
+			__m128i c1 = _mm_add_epi32(y1,d[c]);
+			__m128i t0 = _mm_unpacklo_epi32(c0,c1);
+			__m128i t2 = _mm_unpackhi_epi32(c0,c1);
+			if(skip) {
+				sse2_store8(out[c],_mm_packs_epi32(t0,t2));
+				out[c] += 8;
+			} else {
+				__m128i y2 = _mm_and_si128(e,mask);
+				__m128i y3 = _mm_and_si128(_mm_srli_epi32(e,8),mask);
+				__m128i c2 = _mm_add_epi32(y2,d[c]);
+				__m128i c3 = _mm_add_epi32(y3,d[c]);
+				__m128i t1 = _mm_unpacklo_epi32(c2,c3);
+				__m128i t3 = _mm_unpackhi_epi32(c2,c3);
+				sse2_store16(out[c],
+							_mm_packs_epi32(_mm_unpacklo_epi64(t0,t1),_mm_unpackhi_epi64(t0,t1)),
+							_mm_packs_epi32(_mm_unpacklo_epi64(t2,t3),_mm_unpackhi_epi64(t2,t3)));
+				out[c] += 16;
+			}
+		}
+	}
+	yuv8_row_scalar_x(p,groups - n,skip,out[0],out[1],out[2]);
+}
+
+// 8 groups per block, each 32 bit lane is one group
+static inline void yuv8bc_row_sse2(const uint8_t *p, unsigned groups, int skip, uint8_t uv_xor,
+							uint8_t *r, uint8_t *g, uint8_t *b) {
+	const __m128i xv = _mm_set1_epi16(uv_xor ^ 0x80);
+	const __m128i mask = _mm_set1_epi32(0xFF);
+	uint8_t *out[3] = {r,g,b};
+	unsigned n = groups & ~7u;
+	unsigned i;
+	int c,h;
+	for(i=0;i<n;i+=8,p+=32) {
+		__m128i w[2][3];
+		for(h=0;h<2;h++) {
+			__m128i a = _mm_loadu_si128((const __m128i *)(p + h*16));
+			__m128i y0 = _mm_and_si128(_mm_srli_epi32(a,8),mask);
+			__m128i y1 = _mm_srli_epi32(a,24);
+			__m128i d[3];
+			sse2_chroma(a,xv,d);
+			for(c=0;c<3;c++) {
+				__m128i c0 = _mm_add_epi32(y0,d[c]);
+				if(skip) {
+					w[h][c] = c0;
+				} else {
+					__m128i c1 = _mm_add_epi32(y1,d[c]);
+					w[h][c] = _mm_packs_epi32(_mm_unpacklo_epi32(c0,c1),_mm_unpackhi_epi32(c0,c1));
+				}
+			}
+		}
+		for(c=0;c<3;c++) {
+			if(skip) {
+				sse2_store8(out[c],_mm_packs_epi32(w[0][c],w[1][c]));
+				out[c] += 8;
+			} else {
+				sse2_store16(out[c],w[0][c],w[1][c]);
+				out[c] += 16;
+			}
+		}
+	}
+	yuv8bc_row_scalar_x(p,groups - n,skip,uv_xor,out[0],out[1],out[2]);
+}
+
+static void yuv8b_row_sse2(const uint8_t *p, unsigned groups, int skip,
+							uint8_t *r, uint8_t *g, uint8_t *b) {
+	yuv8bc_row_sse2(p,groups,skip,0x80,r,g,b);
+}
+
+static void yuv8c_row_sse2(const uint8_t *p, unsigned groups, int skip,
+							uint8_t *r, uint8_t *g, uint8_t *b) {
+	yuv8bc_row_sse2(p,groups,skip,0,r,g,b);
+}
+#endif
+
+#if defined(LIVEIMG_YUV_AVX2)
+// as sse2_chroma, for 8 lanes
+AVX2_FN static inline void avx2_chroma(__m256i a, __m256i uv_xor, __m256i d[3]) {
+	const __m256i round = _mm256_set1_epi32(2048);
+	__m256i uv = _mm256_and_si256(a,_mm256_set1_epi32(0x00FF00FF));
+	uv = _mm256_sub_epi16(_mm256_xor_si256(uv,uv_xor),_mm256_set1_epi16(0x80));
+	d[0] = _mm256_srai_epi32(_mm256_add_epi32(_mm256_madd_epi16(uv,_mm256_set1_epi32(YUV_COEF_PAIR(0,5743))),round),12);
+	d[1] = _mm256_srai_epi32(_mm256_add_epi32(_mm256_madd_epi16(uv,_mm256_set1_epi32(YUV_COEF_PAIR(-1411,-2925))),round),12);
+	d[2] = _mm256_srai_epi32(_mm256_add_epi32(_mm256_madd_epi16(uv,_mm256_set1_epi32(YUV_COEF_PAIR(7258,0))),round),12);
+}
+
+// 16 bit values in order to 16 bytes
+AVX2_FN static inline void avx2_store16(uint8_t *dst, __m256i w) {
+	__m256i v = _mm256_permute4x64_epi64(_mm256_packus_epi16(w,w),_MM_SHUFFLE(3,1,2,0));
+	_mm_storeu_si128((__m128i *)dst,_mm256_castsi256_si128(v));
+}
+
+// two sets of 16 bit values in order to 32 bytes
+AVX2_FN static inline void avx2_store32(uint8_t *dst, __m256i w0, __m256i w1) {
+	__m256i v = _mm256_permute4x64_epi64(_mm256_packus_epi16(w0,w1),_MM_SHUFFLE(3,1,2,0));
+	_mm256_storeu_si256((__m256i *)dst,v);
+}
+
+// pack two sets of 32 bit values in order to 16 bit values in order
+AVX2_FN static inline __m256i avx2_packs_seq(__m256i a, __m256i b) {
+	return _mm256_permute4x64_epi64(_mm256_packs_epi32(a,b),_MM_SHUFFLE(3,1,2,0));
+}
+
+// zero fill index for shuffles
+#define Z -128
+
+/*
+8 groups per block, as two loads of 4 groups. each 16 byte lane of a load holds two groups,
+the low lane at offsets 0 and 6, the high lane at 4 and 10, and is shuffled into per pixel Y and U V
+*/
+AVX2_FN static void yuv8_row_avx2(const uint8_t *p, unsigned groups, int skip,
+							uint8_t *r, uint8_t *g, uint8_t *b) {
+	const __m256i xv = _mm256_set1_epi16(0x80);
+	// first and second group of each lane, all 4 pixels
+	const __m256i y_a = _mm256_setr_epi8(1,Z,Z,Z, 3,Z,Z,Z, 4,Z,Z,Z, 5,Z,Z,Z,
+										5,Z,Z,Z, 7,Z,Z,Z, 8,Z,Z,Z, 9,Z,Z,Z);
+	const __m256i y_b = _mm256_setr_epi8(7,Z,Z,Z, 9,Z,Z,Z, 10,Z,Z,Z, 11,Z,Z,Z,
+										11,Z,Z,Z, 13,Z,Z,Z, 14,Z,Z,Z, 15,Z,Z,Z);
+	const __m256i uv_a = _mm256_setr_epi8(0,Z,2,Z, 0,Z,2,Z, 0,Z,2,Z, 0,Z,2,Z,
+										4,Z,6,Z, 4,Z,6,Z, 4,Z,6,Z, 4,Z,6,Z);
+	const __m256i uv_b = _mm256_setr_epi8(6,Z,8,Z, 6,Z,8,Z, 6,Z,8,Z, 6,Z,8,Z,
+										10,Z,12,Z, 10,Z,12,Z, 10,Z,12,Z, 10,Z,12,Z);
+	// skip, first 2 pixels of each group in order
+	const __m256i y_s = _mm256_setr_epi8(1,Z,Z,Z, 3,Z,Z,Z, 7,Z,Z,Z, 9,Z,Z,Z,
+										5,Z,Z,Z, 7,Z,Z,Z, 11,Z,Z,Z, 13,Z,Z,Z);
+	const __m256i uv_s = _mm256_setr_epi8(0,Z,2,Z, 0,Z,2,Z, 6,Z,8,Z, 6,Z,8,Z,
+										4,Z,6,Z, 4,Z,6,Z, 10,Z,12,Z, 10,Z,12,Z);
+	uint8_t *out[3] = {r,g,b};
+	unsigned n = groups & ~7u;
+	unsigned i;
+	int c,h;
+	for(i=0;i<n;i+=8,p+=48) {
+		__m256i w[2][3];
+		for(h=0;h<2;h++) {
+			const uint8_t *s = p + h*24;
+			__m256i x = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)s)),
+												_mm_loadu_si128((const __m128i *)(s+8)),1);
+			if(skip) {
+				__m256i y = _mm256_shuffle_epi8(x,y_s);
+				__m256i d[3];
+				avx2_chroma(_mm256_shuffle_epi8(x,uv_s),xv,d);
+				for(c=0;c<3;c++) {
+					w[h][c] = _mm256_add_epi32(y,d[c]);
+				}
+			} else {
+				__m256i ya = _mm256_shuffle_epi8(x,y_a);
+				__m256i yb = _mm256_shuffle_epi8(x,y_b);
+				__m256i da[3],db[3];
+				avx2_chroma(_mm256_shuffle_epi8(x,uv_a),xv,da);
+				avx2_chroma(_mm256_shuffle_epi8(x,uv_b),xv,db);
+				// lanes hold groups 0,2 and 1,3, so the pack is in order
+				for(c=0;c<3;c++) {
+					w[h][c] = _mm256_packs_epi32(_mm256_add_epi32(ya,da[c]),_mm256_add_epi32(yb,db[c]));
+				}
+			}
+		}
+		for(c=0;c<3;c++) {
+			if(skip) {
+				avx2_store16(out[c],avx2_packs_seq(w[0][c],w[1][c]));
+				out[c] += 16;
+			} else {
+				avx2_store32(out[c],w[0][c],w[1][c]);
+				out[c] += 32;
+			}
+		}
+	}
+	yuv8_row_scalar_x(p,groups - n,skip,out[0],out[1],out[2]);
+}
+
+#undef Z
+
+// 16 groups per block, each 32 bit lane is one group
+AVX2_FN static inline void yuv8bc_row_avx2(const uint8_t *p, unsigned groups, int skip, uint8_t uv_xor,
+							uint8_t *r, uint8_t *g, uint8_t *b) {
+	const __m256i xv = _mm256_set1_epi16(uv_xor ^ 0x80);
+	const __m256i mask = _mm256_set1_epi32(0xFF);
+	uint8_t *out[3] = {r,g,b};
+	unsigned n = groups & ~15u;
+	unsigned i;
+	int c,h;
+	for(i=0;i<n;i+=16,p+=64) {
+		__m256i w[2][3];
+		for(h=0;h<2;h++) {
+			__m256i a = _mm256_loadu_si256((const __m256i *)(p + h*32));
+			__m256i y0 = _mm256_and_si256(_mm256_srli_epi32(a,8),mask);
+			__m256i y1 = _mm256_srli_epi32(a,24);
+			__m256i d[3];
+			avx2_chroma(a,xv,d);
+			for(c=0;c<3;c++) {
+				__m256i c0 = _mm256_add_epi32(y0,d[c]);
+				if(skip) {
+					w[h][c] = c0;
+				} else {
+					__m256i c1 = _mm256_add_epi32(y1,d[c]);
+					w[h][c] = _mm256_packs_epi32(_mm256_unpacklo_epi32(c0,c1),_mm256_unpackhi_epi32(c0,c1));
+				}
+			}
+		}
+		for(c=0;c<3;c++) {
+			if(skip) {
+				avx2_store16(out[c],avx2_packs_seq(w[0][c],w[1][c]));
+				out[c] += 16;
+			} else {
+				avx2_store32(out[c],w[0][c],w[1][c]);
+				out[c] += 32;
+			}
+		}
+	}
+	yuv8bc_row_scalar_x(p,groups - n,skip,uv_xor,out[0],out[1],out[2]);
+}
+
+AVX2_FN static void yuv8b_row_avx2(const uint8_t *p, unsigned groups, int skip,
+							uint8_t *r, uint8_t *g, uint8_t *b) {
+	yuv8bc_row_avx2(p,groups,skip,0x80,r,g,b);
+}
+
+AVX2_FN static void yuv8c_row_avx2(const uint8_t *p, unsigned groups, int skip,
+							uint8_t *r, uint8_t *g, uint8_t *b) {
+	yuv8bc_row_avx2(p,groups,skip,0,r,g,b);
+}
+#endif
+
+#if defined(LIVEIMG_YUV_NEON)
+// r, g, b chroma terms for 8 pixels, rounding narrow shift is (t + 2048) >> 12
+static inline void neon_chroma(int16x8_t u, int16x8_t v, int16x8_t d[3]) {
+	int16x4_t ul = vget_low_s16(u);
+	int16x4_t uh = vget_high_s16(u);
+	int16x4_t vl = vget_low_s16(v);
+	int16x4_t vh = vget_high_s16(v);
+	d[0] = vcombine_s16(vrshrn_n_s32(vmull_n_s16(vl,5743),12),
+						vrshrn_n_s32(vmull_n_s16(vh,5743),12));
+	d[1] = vcombine_s16(vrshrn_n_s32(vmlal_n_s16(vmull_n_s16(ul,-1411),vl,-2925),12),
+						vrshrn_n_s32(vmlal_n_s16(vmull_n_s16(uh,-1411),vh,-2925),12));
+	d[2] = vcombine_s16(vrshrn_n_s32(vmull_n_s16(ul,7258),12),
+						vrshrn_n_s32(vmull_n_s16(uh,7258),12));
+}
+
+static inline uint8x8_t neon_pixel(uint8x8_t y, int16x8_t d) {
+	return vqmovun_s16(vaddq_s16(vreinterpretq_s16_u16(vmovl_u8(y)),d));
+}
+
+// 8 groups per block, loaded as 16 bit U Y0, V Y1, Y2 Y3
+static void yuv8_row_neon(const uint8_t *p, unsigned groups, int skip,
+							uint8_t *r, uint8_t *g, uint8_t *b) {
+	uint8_t *out[3] = {r,g,b};
+	unsigned n = groups & ~7u;
+	unsigned i;
+	int c;
+	for(i=0;i<n;i+=8,p+=48) {
+		uint16x8x3_t e = vld3q_u16((const uint16_t *)p);
+		int16x8_t u = vmovl_s8(vreinterpret_s8_u8(vmovn_u16(e.val[0])));
+		int16x8_t v = vmovl_s8(vreinterpret_s8_u8(vmovn_u16(e.val[1])));
+		uint8x8_t y0 = vshrn_n_u16(e.val[0],8);
+		uint8x8_t y1 = vshrn_n_u16(e.val[1],8);
+		int16x8_t d[3];
+		neon_chroma(u,v,d);
+		for(c=0;c<3;c++) {
+			if(skip) {
+				uint8x8x2_t o;
+				o.val[0] = neon_pixel(y0,d[c]);
+				o.val[1] = neon_pixel(y1,d[c]);
+				vst2_u8(out[c],o);
+				out[c] += 16;
+			} else {
+				uint8x8x4_t o;
+				o.val[0] = neon_pixel(y0,d[c]);
+				o.val[1] = neon_pixel(y1,d[c]);
+				o.val[2] = neon_pixel(vmovn_u16(e.val[2]),d[c]);
+				o.val[3] = neon_pixel(vshrn_n_u16(e.val[2],8),d[c]);
+				vst4_u8(out[c],o);
+				out[c] += 32;
+			}
+		}
+	}
+	yuv8_row_scalar_x(p,groups - n,skip,out[0],out[1],out[2]);
+}
+
+// 16 groups per block, deinterleaved to U, Y0, V, Y1
+static inline void yuv8bc_row_neon(const uint8_t *p, unsigned groups, int skip, uint8_t uv_xor,
+							uint8_t *r, uint8_t *g, uint8_t *b) {
+	const uint8x16_t xv = vdupq_n_u8(uv_xor);
+	uint8_t *out[3] = {r,g,b};
+	unsigned n = groups & ~15u;
+	unsigned i;
+	int c;
+	for(i=0;i<n;i+=16,p+=64) {
+		uint8x16x4_t q = vld4q_u8(p);
+		int8x16_t u = vreinterpretq_s8_u8(veorq_u8(q.val[0],xv));
+		int8x16_t v = vreinterpretq_s8_u8(veorq_u8(q.val[2],xv));
+		int16x8_t dl[3],dh[3];
+		neon_chroma(vmovl_s8(vget_low_s8(u)),vmovl_s8(vget_low_s8(v)),dl);
+		neon_chroma(vmovl_s8(vget_high_s8(u)),vmovl_s8(vget_high_s8(v)),dh);
+		for(c=0;c<3;c++) {
+			uint8x16_t c0 = vcombine_u8(neon_pixel(vget_low_u8(q.val[1]),dl[c]),
+										neon_pixel(vget_high_u8(q.val[1]),dh[c]));
+			if(skip) {
+				vst1q_u8(out[c],c0);
+				out[c] += 16;
+			} else {
+				uint8x16x2_t o;
+				o.val[0] = c0;
+				o.val[1] = vcombine_u8(neon_pixel(vget_low_u8(q.val[3]),dl[c]),
+										neon_pixel(vget_high_u8(q.val[3]),dh[c]));
+				vst2q_u8(out[c],o);
+				out[c] += 32;
+			}
+		}
+	}
+	yuv8bc_row_scalar_x(p,groups - n,skip,uv_xor,out[0],out[1],out[2]);
+}
+
+static void yuv8b_row_neon(const uint8_t *p, unsigned groups, int skip,
+							uint8_t *r, uint8_t *g, uint8_t *b) {
+	yuv8bc_row_neon(p,groups,skip,0x80,r,g,b);
+}
+
+static void yuv8c_row_neon(const uint8_t *p, unsigned groups, int skip,
+							uint8_t *r, uint8_t *g, uint8_t *b) {
+	yuv8bc_row_neon(p,groups,skip,0,r,g,b);
+}
+#endif
+
+// slowest first
+static const liveimg_yuv_impl_t yuv_impls[] = {
+	{"scalar",yuv8_row_scalar,yuv8b_row_scalar,yuv8c_row_scalar},
+#if defined(LIVEIMG_YUV_SSE2)
+	{"sse2",yuv8_row_sse2,yuv8b_row_sse2,yuv8c_row_sse2},
+#endif
+#if defined(LIVEIMG_YUV_AVX2)
+	{"avx2",yuv8_row_avx2,yuv8b_row_avx2,yuv8c_row_avx2},
+#endif
+#if defined(LIVEIMG_YUV_NEON)
+	{"neon",yuv8_row_neon,yuv8b_row_neon,yuv8c_row_neon},
+#endif
+};
+
+#define N_YUV_IMPLS (sizeof(yuv_impls)/sizeof(yuv_impls[0]))
+
+static const liveimg_yuv_impl_t *yuv_impl_cur;
+
+static int impl_supported(const liveimg_yuv_impl_t *impl) {
+#if defined(LIVEIMG_YUV_AVX2)
+	if(strcmp(impl->name,"avx2") == 0) {
+		return __builtin_cpu_supports("avx2");
+	}
+#endif
+	return 1;
+}
+
+const liveimg_yuv_impl_t *liveimg_yuv_get_impl(void) {
+	if(!yuv_impl_cur) {
+		liveimg_yuv_set_impl(NULL);
+	}
+	return yuv_impl_cur;
+}
+
+int liveimg_yuv_set_impl(const char *name) {
+	unsigned i;
+	if(!name || strcmp(name,"auto") == 0) {
+		for(i=N_YUV_IMPLS;i>0;i--) {
+			if(impl_supported(&yuv_impls[i-1])) {
+				yuv_impl_cur = &yuv_impls[i-1];
+				return 1;
+			}
+		}
+		return 0; // not reached, scalar is always supported
+	}
+	for(i=0;i<N_YUV_IMPLS;i++) {
+		if(strcmp(name,yuv_impls[i].name) == 0 && impl_supported(&yuv_impls[i])) {
+			yuv_impl_cur = &yuv_impls[i];
+			return 1;
+		}
+	}
+	return 0;
+}
+
+const char *liveimg_yuv_impl_name(unsigned n) {
+	unsigned i;
+	for(i=0;i<N_YUV_IMPLS;i++) {
+		if(impl_supported(&yuv_impls[i])) {
+			if(n == 0) {
+				return yuv_impls[i].name;
+			}
+			n--;
+		}
+	}
+	return NULL;
+}
@@ -0,0 +1,79 @@
+/*
+ * live view YUV to RGB row conversion, with SIMD implementations selected at runtime
+ * no Lua
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef LIVEIMG_YUV_H
+#define LIVEIMG_YUV_H
+
+/*
+scalar pixel conversion, the reference for all implementations
+chroma terms are 12 bit fixed point, rounded
+*/
+static inline uint8_t clip_yuv(int v) {
+	if (v<0) return 0;
+	if (v>255) return 255;
+	return v;
+}
+
+static inline uint8_t yuv_to_r(uint8_t y, int8_t v) {
+	return clip_yuv(((y<<12) +          v*5743 + 2048)>>12);
+}
+
+static inline uint8_t yuv_to_g(uint8_t y, int8_t u, int8_t v) {
+	return clip_yuv(((y<<12) - u*1411 - v*2925 + 2048)>>12);
+}
+
+static inline uint8_t yuv_to_b(uint8_t y, int8_t u) {
+	return clip_yuv(((y<<12) + u*7258          + 2048)>>12);
+}
+
+/*
+convert one row of live view data to planar r, g, b
+groups: number of complete groups in src
+skip: convert only the first half of the pixels in each group, for viewports with a 1:2 par
+YUV8: 6 byte groups U Y V Y Y Y, 4 pixels, 2 with skip
+YUV8B, YUV8C: 4 byte groups U Y V Y, 2 pixels, 1 with skip. U V are offset by 0x80 in B, signed in C
+output is identical for every implementation
+*/
+typedef void (*liveimg_yuv_row_fn)(const uint8_t *src, unsigned groups, int skip,
+									uint8_t *r, uint8_t *g, uint8_t *b);
+
+typedef struct {
+	const char *name;
+	liveimg_yuv_row_fn yuv8;
+	liveimg_yuv_row_fn yuv8b;
+	liveimg_yuv_row_fn yuv8c;
+} liveimg_yuv_impl_t;
+
+/*
+current implementation, the fastest supported by the CPU unless changed by liveimg_yuv_set_impl
+*/
+const liveimg_yuv_impl_t *liveimg_yuv_get_impl(void);
+
+/*
+set the implementation by name, NULL or "auto" for the fastest supported
+returns 0 if the name is unknown or not supported by the CPU
+*/
+int liveimg_yuv_set_impl(const char *name);
+
+/*
+name of the n-th implementation supported by the CPU, slowest first, or NULL if n is out of range
+*/
+const char *liveimg_yuv_impl_name(unsigned n);
+
+#endif
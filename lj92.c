@@ -0,0 +1,658 @@
+/*
+ * lossless JPEG (ITU T.81 process 14, SOF3) encoder and decoder, as used for compressed DNG
+ * no Lua, called from rawimg worker threads
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lj92.h"
+
+#define LJ92_SOI 0xd8
+#define LJ92_EOI 0xd9
+#define LJ92_SOF3 0xc3
+#define LJ92_DHT 0xc4
+#define LJ92_SOS 0xda
+#define LJ92_DRI 0xdd
+#define LJ92_RST0 0xd0
+
+// difference categories 0-16
+#define LJ92_SYMBOLS 17
+
+// codes up to this length are decoded with a single table lookup
+#define LJ92_LOOKUP_BITS 9
+
+// marker segments, with a single huffman table of all 17 symbols
+#define LJ92_HEADER_MAX (2 + 4+1+16+LJ92_SYMBOLS + 4+6+3*LJ92_MAX_COMPONENTS + 4+1+2*LJ92_MAX_COMPONENTS+3 + 2)
+
+#if defined(__GNUC__)
+#define LJ92_NBITS(a) ((a)?32 - __builtin_clz(a):0)
+#else
+static unsigned lj92_nbits(unsigned a) {
+	unsigned n = 0;
+	while(a) {
+		n++;
+		a >>= 1;
+	}
+	return n;
+}
+#define LJ92_NBITS(a) lj92_nbits(a)
+#endif
+
+static inline int lj92_predict(unsigned predictor, int ra, int rb, int rc) {
+	switch(predictor) {
+		case 1: return ra;
+		case 2: return rb;
+		case 3: return rc;
+		case 4: return ra + rb - rc;
+		case 5: return ra + ((rb - rc)>>1);
+		case 6: return rb + ((ra - rc)>>1);
+		default: return (ra + rb)>>1;
+	}
+}
+
+/*
+difference category of a difference modulo 2^16
+*/
+static inline unsigned lj92_category(uint16_t d) {
+	int v = (int16_t)d;
+	if(v == -32768) {
+		return 16;
+	}
+	return LJ92_NBITS((unsigned)((v < 0)?-v:v));
+}
+
+size_t lj92_max_size(unsigned width, unsigned height, unsigned components) {
+	// 16 bit code and 16 extra bits per sample, doubled for 0xff stuffing
+	return (size_t)width*height*components*8 + LJ92_HEADER_MAX;
+}
+
+/*
+huffman code sizes for freq, as in T.81 annex K.2, limited to 16 bits
+bits receives the number of codes of each length 1-16, vals the symbols in code order
+returns the number of symbols
+*/
+static unsigned lj92_make_table(const unsigned *hist, uint8_t *bits, uint8_t *vals) {
+	// one extra symbol reserves the all ones code
+	long freq[LJ92_SYMBOLS + 1];
+	int others[LJ92_SYMBOLS + 1];
+	unsigned codesize[LJ92_SYMBOLS + 1];
+	unsigned count[33];
+	int i,j;
+	for(i=0;i<LJ92_SYMBOLS;i++) {
+		freq[i] = hist[i];
+	}
+	freq[LJ92_SYMBOLS] = 1;
+	for(i=0;i<=LJ92_SYMBOLS;i++) {
+		others[i] = -1;
+		codesize[i] = 0;
+	}
+	while(1) {
+		int v1 = -1, v2 = -1;
+		// least frequency, largest symbol on ties
+		for(i=0;i<=LJ92_SYMBOLS;i++) {
+			if(freq[i] && (v1 < 0 || freq[i] <= freq[v1])) {
+				v1 = i;
+			}
+		}
+		for(i=0;i<=LJ92_SYMBOLS;i++) {
+			if(freq[i] && i != v1 && (v2 < 0 || freq[i] <= freq[v2])) {
+				v2 = i;
+			}
+		}
+		if(v2 < 0) {
+			break;
+		}
+		freq[v1] += freq[v2];
+		freq[v2] = 0;
+		codesize[v1]++;
+		while(others[v1] >= 0) {
+			v1 = others[v1];
+			codesize[v1]++;
+		}
+		others[v1] = v2;
+		codesize[v2]++;
+		while(others[v2] >= 0) {
+			v2 = others[v2];
+			codesize[v2]++;
+		}
+	}
+	memset(count,0,sizeof(count));
+	for(i=0;i<=LJ92_SYMBOLS;i++) {
+		if(codesize[i]) {
+			count[codesize[i]]++;
+		}
+	}
+	// limit to 16 bits, K.3
+	for(i=32;i>16;i--) {
+		while(count[i]) {
+			j = i - 2;
+			while(!count[j]) {
+				j--;
+			}
+			count[i] -= 2;
+			count[i-1]++;
+			count[j+1] += 2;
+			count[j]--;
+		}
+	}
+	// remove the reserved code
+	while(!count[i]) {
+		i--;
+	}
+	count[i]--;
+	for(i=1;i<=16;i++) {
+		bits[i-1] = count[i];
+	}
+	unsigned n = 0;
+	for(i=1;i<=32;i++) {
+		for(j=0;j<LJ92_SYMBOLS;j++) {
+			if(codesize[j] == (unsigned)i) {
+				vals[n++] = j;
+			}
+		}
+	}
+	return n;
+}
+
+/*
+code and length of each symbol from bits and vals, T.81 annex C
+*/
+static void lj92_make_codes(const uint8_t *bits, const uint8_t *vals, unsigned *codes, unsigned *sizes) {
+	unsigned code = 0;
+	unsigned k = 0;
+	unsigned len,i;
+	memset(sizes,0,LJ92_SYMBOLS*sizeof(unsigned));
+	for(len=1;len<=16;len++) {
+		for(i=0;i<bits[len-1];i++) {
+			codes[vals[k]] = code++;
+			sizes[vals[k]] = len;
+			k++;
+		}
+		code <<= 1;
+	}
+}
+
+typedef struct {
+	uint8_t *p;
+	uint64_t acc;
+	unsigned n;
+} lj92_writer_t;
+
+// len up to 32
+static inline void lj92_put_bits(lj92_writer_t *w, unsigned v, unsigned len) {
+	w->acc = (w->acc << len) | v;
+	w->n += len;
+	while(w->n >= 8) {
+		w->n -= 8;
+		uint8_t b = (uint8_t)(w->acc >> w->n);
+		*w->p++ = b;
+		if(b == 0xff) {
+			*w->p++ = 0;
+		}
+	}
+}
+
+static uint8_t *lj92_put_marker(uint8_t *p, unsigned marker, unsigned len) {
+	*p++ = 0xff;
+	*p++ = marker;
+	if(len) {
+		*p++ = len >> 8;
+		*p++ = len & 0xff;
+	}
+	return p;
+}
+
+size_t lj92_encode(const uint16_t *samples, const lj92_frame_t *frame, unsigned predictor,
+					uint16_t *diffs, uint8_t *out) {
+	unsigned nc = frame->components;
+	unsigned rowlen = frame->width*nc;
+	unsigned hist[LJ92_SYMBOLS];
+	unsigned x,y,i;
+
+	memset(hist,0,sizeof(hist));
+	for(y=0;y<frame->height;y++) {
+		const uint16_t *p = samples + y*rowlen;
+		const uint16_t *above = p - rowlen; // only used after the first row
+		uint16_t *d = diffs + y*rowlen;
+		// first column predicted from above, or the midpoint on the first row
+		for(i=0;i<nc;i++) {
+			int pred = (y)?above[i]:1<<(frame->precision - 1);
+			d[i] = (uint16_t)(p[i] - pred);
+			hist[lj92_category(d[i])]++;
+		}
+		if(y == 0 || predictor == 1) {
+			for(i=nc;i<rowlen;i++) {
+				d[i] = (uint16_t)(p[i] - p[i - nc]);
+				hist[lj92_category(d[i])]++;
+			}
+		} else {
+			for(i=nc;i<rowlen;i++) {
+				d[i] = (uint16_t)(p[i] - lj92_predict(predictor,p[i - nc],above[i],above[i - nc]));
+				hist[lj92_category(d[i])]++;
+			}
+		}
+	}
+
+	uint8_t bits[16];
+	uint8_t vals[LJ92_SYMBOLS];
+	unsigned nvals = lj92_make_table(hist,bits,vals);
+	unsigned codes[LJ92_SYMBOLS];
+	unsigned sizes[LJ92_SYMBOLS];
+	lj92_make_codes(bits,vals,codes,sizes);
+
+	uint8_t *p = lj92_put_marker(out,LJ92_SOI,0);
+	p = lj92_put_marker(p,LJ92_DHT,2 + 1 + 16 + nvals);
+	*p++ = 0; // DC table 0
+	memcpy(p,bits,16);
+	p += 16;
+	memcpy(p,vals,nvals);
+	p += nvals;
+
+	p = lj92_put_marker(p,LJ92_SOF3,8 + 3*nc);
+	*p++ = frame->precision;
+	*p++ = frame->height >> 8;
+	*p++ = frame->height & 0xff;
+	*p++ = frame->width >> 8;
+	*p++ = frame->width & 0xff;
+	*p++ = nc;
+	for(i=0;i<nc;i++) {
+		*p++ = i; // component id
+		*p++ = 0x11; // no subsampling
+		*p++ = 0; // quantization table, unused
+	}
+
+	p = lj92_put_marker(p,LJ92_SOS,6 + 2*nc);
+	*p++ = nc;
+	for(i=0;i<nc;i++) {
+		*p++ = i;
+		*p++ = 0; // all components use table 0
+	}
+	*p++ = predictor;
+	*p++ = 0; // Se, unused
+	*p++ = 0; // point transform
+
+	lj92_writer_t w;
+	w.p = p;
+	w.acc = 0;
+	w.n = 0;
+	for(y=0;y<frame->height;y++) {
+		const uint16_t *d = diffs + y*rowlen;
+		for(x=0;x<rowlen;x++) {
+			uint16_t v = d[x];
+			unsigned s = lj92_category(v);
+			if(s == 0 || s == 16) {
+				lj92_put_bits(&w,codes[s],sizes[s]);
+			} else {
+				// negative differences are sent as the low bits of v-1
+				unsigned extra = ((int16_t)v < 0)?(unsigned)(v - 1):v;
+				extra &= (1<<s) - 1;
+				lj92_put_bits(&w,(codes[s] << s) | extra,sizes[s] + s);
+			}
+		}
+	}
+	// pad the last byte with ones
+	if(w.n) {
+		lj92_put_bits(&w,(1<<(8 - w.n)) - 1,8 - w.n);
+	}
+	p = lj92_put_marker(w.p,LJ92_EOI,0);
+	return p - out;
+}
+
+typedef struct {
+	int present;
+	uint16_t lookup[1<<LJ92_LOOKUP_BITS]; // (length << 8) | symbol, 0 for longer codes
+	int32_t maxcode[18]; // by length, -1 if none
+	int32_t valoff[17]; // symbol index - first code of each length
+	uint8_t vals[256];
+} lj92_table_t;
+
+typedef struct {
+	lj92_frame_t frame;
+	lj92_table_t tables[4];
+	unsigned restart; // restart interval in samples per component, 0 for none
+	unsigned scan_table[LJ92_MAX_COMPONENTS];
+	unsigned predictor;
+	unsigned pt; // point transform
+	const uint8_t *scan_data; // entropy coded data
+	const uint8_t *end;
+} lj92_decoder_t;
+
+static unsigned lj92_get16(const uint8_t *p) {
+	return (p[0]<<8) | p[1];
+}
+
+static const char *lj92_read_dht(lj92_decoder_t *dec, const uint8_t *p, unsigned len) {
+	while(len) {
+		if(len < 17) {
+			return "invalid DHT";
+		}
+		unsigned id = p[0];
+		if(id > 3) {
+			return "unsupported huffman table";
+		}
+		lj92_table_t *t = &dec->tables[id];
+		const uint8_t *bits = p + 1;
+		unsigned nvals = 0;
+		unsigned i,l;
+		for(i=0;i<16;i++) {
+			nvals += bits[i];
+		}
+		if(nvals > 256 || len < 17 + nvals) {
+			return "invalid DHT";
+		}
+		memcpy(t->vals,p + 17,nvals);
+		memset(t->lookup,0,sizeof(t->lookup));
+		int code = 0;
+		unsigned k = 0;
+		for(l=1;l<=16;l++) {
+			t->valoff[l] = k - code;
+			// more codes than fit in l bits would fill past the end of lookup
+			if(code + bits[l-1] > (1<<l)) {
+				return "invalid DHT";
+			}
+			if(bits[l-1]) {
+				unsigned n;
+				for(n=0;n<bits[l-1];n++,k++,code++) {
+					if(l <= LJ92_LOOKUP_BITS) {
+						unsigned fill = 1<<(LJ92_LOOKUP_BITS - l);
+						unsigned j;
+						for(j=0;j<fill;j++) {
+							t->lookup[(code<<(LJ92_LOOKUP_BITS - l)) + j] = (l<<8) | t->vals[k];
+						}
+					}
+				}
+				t->maxcode[l] = code - 1;
+			} else {
+				t->maxcode[l] = -1;
+			}
+			code <<= 1;
+		}
+		t->maxcode[17] = 0x7fffffff; // ends the search for invalid codes
+		t->present = 1;
+		p += 17 + nvals;
+		len -= 17 + nvals;
+	}
+	return NULL;
+}
+
+/*
+parse markers up to the start of the entropy coded data
+if scan is not set, stops after the frame header
+*/
+static const char *lj92_parse(lj92_decoder_t *dec, const uint8_t *data, size_t len, int scan) {
+	const char *err;
+	const uint8_t *p = data;
+	const uint8_t *end = data + len;
+	int have_frame = 0;
+	memset(dec,0,sizeof(*dec));
+	if(len < 4 || p[0] != 0xff || p[1] != LJ92_SOI) {
+		return "not a JPEG";
+	}
+	p += 2;
+	while(end - p >= 4) {
+		if(p[0] != 0xff) {
+			return "marker expected";
+		}
+		unsigned marker = p[1];
+		if(marker == 0xff) { // fill byte
+			p++;
+			continue;
+		}
+		if(marker == LJ92_EOI) {
+			break;
+		}
+		unsigned seglen = lj92_get16(p + 2);
+		if(seglen < 2 || seglen > end - p - 2) {
+			return "truncated marker segment";
+		}
+		const uint8_t *seg = p + 4;
+		seglen -= 2;
+		p += 4 + seglen;
+		unsigned i;
+		switch(marker) {
+			case LJ92_DHT:
+				if((err = lj92_read_dht(dec,seg,seglen))) {
+					return err;
+				}
+				break;
+			case LJ92_SOF3:
+				if(seglen < 6) {
+					return "invalid SOF";
+				}
+				dec->frame.precision = seg[0];
+				dec->frame.height = lj92_get16(seg + 1);
+				dec->frame.width = lj92_get16(seg + 3);
+				dec->frame.components = seg[5];
+				if(dec->frame.precision < 2 || dec->frame.precision > 16) {
+					return "invalid precision";
+				}
+				if(!dec->frame.components || dec->frame.components > LJ92_MAX_COMPONENTS
+					|| seglen < 6 + 3*dec->frame.components) {
+					return "unsupported component count";
+				}
+				if(!dec->frame.width || !dec->frame.height) {
+					return "invalid frame size";
+				}
+				for(i=0;i<dec->frame.components;i++) {
+					if(seg[6 + i*3 + 1] != 0x11) {
+						return "unsupported sampling factors";
+					}
+				}
+				if(!scan) {
+					return NULL;
+				}
+				have_frame = 1;
+				break;
+			case LJ92_DRI:
+				if(seglen < 2) {
+					return "invalid DRI";
+				}
+				dec->restart = lj92_get16(seg);
+				break;
+			case LJ92_SOS:
+				if(!have_frame) {
+					return "SOS before SOF3";
+				}
+				if(seglen < 1 || seg[0] != dec->frame.components || seglen < 4 + 2*seg[0]) {
+					return "unsupported scan";
+				}
+				for(i=0;i<dec->frame.components;i++) {
+					unsigned t = seg[2 + i*2] >> 4;
+					if(t > 3 || !dec->tables[t].present) {
+						return "missing huffman table";
+					}
+					dec->scan_table[i] = t;
+				}
+				seg += 1 + 2*dec->frame.components;
+				dec->predictor = seg[0];
+				dec->pt = seg[2] & 0xf;
+				if(dec->predictor < 1 || dec->predictor > 7) {
+					return "invalid predictor";
+				}
+				if(dec->pt >= dec->frame.precision) {
+					return "invalid point transform";
+				}
+				// restarts must fall on row boundaries
+				if(dec->restart && dec->restart % dec->frame.width) {
+					return "unsupported restart interval";
+				}
+				dec->scan_data = p;
+				dec->end = end;
+				return NULL;
+			default:
+				// other SOF types are not lossless
+				if(marker >= 0xc0 && marker <= 0xcf && marker != 0xc8 && marker != 0xcc) {
+					return "unsupported JPEG process";
+				}
+				// APPn, COM etc are ignored
+				break;
+		}
+	}
+	return (have_frame)?"no scan":"no SOF3";
+}
+
+const char *lj92_read_frame(const uint8_t *data, size_t len, lj92_frame_t *frame) {
+	lj92_decoder_t dec;
+	const char *err = lj92_parse(&dec,data,len,0);
+	if(!err) {
+		memcpy(frame,&dec.frame,sizeof(*frame));
+	}
+	return err;
+}
+
+typedef struct {
+	const uint8_t *p;
+	const uint8_t *end;
+	uint64_t acc;
+	unsigned n;
+	int err;
+} lj92_reader_t;
+
+/*
+fill the bit buffer to at least 57 bits
+stops at a marker, supplying zeros, so restart markers can be found
+*/
+static void lj92_fill(lj92_reader_t *r) {
+	while(r->n <= 56) {
+		unsigned b = 0;
+		if(r->p < r->end) {
+			if(r->p[0] != 0xff) {
+				b = *r->p++;
+			} else if(r->end - r->p >= 2 && r->p[1] == 0) {
+				b = 0xff;
+				r->p += 2;
+			}
+		}
+		r->acc = (r->acc << 8) | b;
+		r->n += 8;
+	}
+}
+
+static inline int lj92_read_diff(lj92_reader_t *r, const lj92_table_t *t) {
+	if(r->n < 32) {
+		lj92_fill(r);
+	}
+	unsigned e = t->lookup[(r->acc >> (r->n - LJ92_LOOKUP_BITS)) & ((1<<LJ92_LOOKUP_BITS) - 1)];
+	unsigned s;
+	if(e) {
+		r->n -= e>>8;
+		s = e & 0xff;
+	} else {
+		unsigned l = LJ92_LOOKUP_BITS + 1;
+		int code = (r->acc >> (r->n - l)) & ((1<<l) - 1);
+		while(code > t->maxcode[l]) {
+			l++;
+			code = (r->acc >> (r->n - l)) & ((1<<l) - 1);
+		}
+		if(l > 16) {
+			r->err = 1;
+			return 0;
+		}
+		r->n -= l;
+		s = t->vals[t->valoff[l] + code];
+	}
+	if(s == 0) {
+		return 0;
+	}
+	if(s >= 16) {
+		return 32768;
+	}
+	int v = (r->acc >> (r->n - s)) & ((1<<s) - 1);
+	r->n -= s;
+	if(v < (1<<(s - 1))) {
+		v -= (1<<s) - 1;
+	}
+	return v;
+}
+
+/*
+skip to after the next restart marker and reset the bit buffer
+*/
+static void lj92_restart(lj92_reader_t *r) {
+	while(r->end - r->p >= 2 && !(r->p[0] == 0xff && (r->p[1] & 0xf8) == LJ92_RST0)) {
+		r->p++;
+	}
+	if(r->end - r->p < 2) {
+		r->err = 1;
+		return;
+	}
+	r->p += 2;
+	r->acc = 0;
+	r->n = 0;
+}
+
+const char *lj92_decode(const uint8_t *data, size_t len, uint16_t *out, size_t out_count) {
+	lj92_decoder_t dec;
+	const char *err = lj92_parse(&dec,data,len,1);
+	if(err) {
+		return err;
+	}
+	unsigned nc = dec.frame.components;
+	unsigned rowlen = dec.frame.width*nc;
+	if(out_count < (size_t)rowlen*dec.frame.height) {
+		return "output too small";
+	}
+	unsigned restart_rows = dec.restart/dec.frame.width;
+	const lj92_table_t *tables[LJ92_MAX_COMPONENTS];
+	unsigned x,y,i;
+	for(i=0;i<nc;i++) {
+		tables[i] = &dec.tables[dec.scan_table[i]];
+	}
+	int initial = 1<<(dec.frame.precision - dec.pt - 1);
+
+	lj92_reader_t r;
+	r.p = dec.scan_data;
+	r.end = dec.end;
+	r.acc = 0;
+	r.n = 0;
+	r.err = 0;
+	// first row of the scan or restart interval
+	int first = 1;
+	for(y=0;y<dec.frame.height;y++) {
+		uint16_t *p = out + y*rowlen;
+		const uint16_t *above = p - rowlen; // only used after the first row
+		if(restart_rows && y && y % restart_rows == 0) {
+			lj92_restart(&r);
+			first = 1;
+		}
+		for(i=0;i<nc;i++) {
+			int pred = (first)?initial:above[i];
+			p[i] = (uint16_t)(pred + lj92_read_diff(&r,tables[i]));
+		}
+		if(first || dec.predictor == 1) {
+			for(x=nc;x<rowlen;x++) {
+				p[x] = (uint16_t)(p[x - nc] + lj92_read_diff(&r,tables[x % nc]));
+			}
+		} else {
+			for(x=nc;x<rowlen;x++) {
+				int pred = lj92_predict(dec.predictor,p[x - nc],above[x],above[x - nc]);
+				p[x] = (uint16_t)(pred + lj92_read_diff(&r,tables[x % nc]));
+			}
+		}
+		first = 0;
+		if(r.err) {
+			return "invalid huffman code";
+		}
+	}
+	if(dec.pt) {
+		size_t k;
+		for(k=0;k<(size_t)rowlen*dec.frame.height;k++) {
+			out[k] <<= dec.pt;
+		}
+	}
+	return NULL;
+}
@@ -0,0 +1,59 @@
+/*
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef LJ92_H
+#define LJ92_H
+
+#define LJ92_MAX_COMPONENTS 4
+
+typedef struct {
+	unsigned width; // samples per line, per component
+	unsigned height;
+	unsigned components;
+	unsigned precision;
+} lj92_frame_t;
+
+/*
+upper bound on the size of an encoded frame
+*/
+size_t lj92_max_size(unsigned width, unsigned height, unsigned components);
+
+/*
+encode width x height x components interleaved samples as a lossless JPEG (ITU T.81 SOF3) frame,
+with a single huffman table optimized for the data and the given predictor (1-7)
+out must have room for lj92_max_size bytes. diffs is work space for width*height*components values
+returns the encoded size
+called from worker threads, no Lua
+*/
+size_t lj92_encode(const uint16_t *samples, const lj92_frame_t *frame, unsigned predictor,
+					uint16_t *diffs, uint8_t *out);
+
+/*
+read the frame header of a lossless JPEG
+returns NULL or an error message
+*/
+const char *lj92_read_frame(const uint8_t *data, size_t len, lj92_frame_t *frame);
+
+/*
+decode a lossless JPEG into out, which must hold width*height*components samples of the frame
+returned by lj92_read_frame. samples are interleaved as in lj92_encode
+returns NULL or an error message
+called from worker threads, no Lua
+*/
+const char *lj92_decode(const uint8_t *data, size_t len, uint16_t *out, size_t out_count);
+
+#endif
@@ -0,0 +1,347 @@
+--[[
+host side autofocus, using remotecap sub-image raws around a star
+each focus position is set with the rsint camera script exec command,
+a raw sub-image is captured and the star HFR measured with rawimg find_stars
+a V-curve or parabola is fit to the results and the camera moved to the minimum
+]]
+local m={}
+
+--[[
+hfr,info=autofocus.measure(img,opts)
+img: rawimg of the sub-image
+opts {
+	x=number -- column of the target star. If not set, the median HFR of all unsaturated stars is used
+	y=number -- row of the target star in img, default middle
+	radius=number -- maximum distance of target star from x,y, default 32
+	star_opts=table -- options for find_stars
+}
+returns hfr,info{stars=number,x=number,y=number,flux=number} or false,msg
+]]
+function m.measure(img,opts)
+	opts=util.extend_table({
+		y=img:height()/2,
+		radius=32,
+	},opts)
+	local stars=img:find_stars(opts.star_opts)
+	local count=stars:count()
+	if count == 0 then
+		return false,'no stars'
+	end
+	if not opts.x then
+		local stats=stars:stats()
+		if stats.hfr == 0 then
+			return false,'all stars saturated'
+		end
+		return stats.hfr,{stars=count}
+	end
+	local best,best_d2
+	for i=0,count-1 do
+		local s=stars:get(i)
+		local d2=(s.x - opts.x)^2 + (s.y - opts.y)^2
+		if not s.saturated and d2 <= opts.radius^2 and (not best or d2 < best_d2) then
+			best=s
+			best_d2=d2
+		end
+	end
+	if not best then
+		return false,'no unsaturated star near target'
+	end
+	return best.hfr,{stars=count,x=best.x,y=best.y,flux=best.flux}
+end
+
+--[[
+least squares line fit to points {{pos,val},...}
+returns slope,intercept
+]]
+local function fit_line(points)
+	local n=#points
+	local sx,sy,sxx,sxy=0,0,0,0
+	for _,p in ipairs(points) do
+		sx=sx + p[1]
+		sy=sy + p[2]
+		sxx=sxx + p[1]*p[1]
+		sxy=sxy + p[1]*p[2]
+	end
+	local d=n*sxx - sx*sx
+	if d == 0 then
+		return
+	end
+	local slope=(n*sxy - sx*sy)/d
+	return slope,(sy - slope*sx)/n
+end
+
+--[[
+fit a V curve, a line to each side of the lowest point, excluding it
+pos,fit=autofocus.fit_vcurve(points)
+points: array of {pos,hfr}, in any order
+returns the position where the lines intersect and {left={slope,intercept},right={slope,intercept}}
+or false,msg if there are fewer than 2 points on either side or the lines don't form a V
+]]
+function m.fit_vcurve(points)
+	local sorted=util.extend_table({},points)
+	table.sort(sorted,function(a,b) return a[1] < b[1] end)
+	local imin=1
+	for i,p in ipairs(sorted) do
+		if p[2] < sorted[imin][2] then
+			imin=i
+		end
+	end
+	local left,right={},{}
+	for i,p in ipairs(sorted) do
+		if i < imin then
+			table.insert(left,p)
+		elseif i > imin then
+			table.insert(right,p)
+		end
+	end
+	if #left < 2 or #right < 2 then
+		return false,'minimum too close to end of range'
+	end
+	local ls,li=fit_line(left)
+	local rs,ri=fit_line(right)
+	if not ls or not rs or ls >= 0 or rs <= 0 then
+		return false,'points do not form a V'
+	end
+	return (ri - li)/(ls - rs),{left={ls,li},right={rs,ri}}
+end
+
+--[[
+fit a parabola hfr = a*pos^2 + b*pos + c
+pos,fit=autofocus.fit_parabola(points)
+returns the vertex position and {a,b,c} or false,msg
+]]
+function m.fit_parabola(points)
+	local n=#points
+	if n < 3 then
+		return false,'too few points'
+	end
+	-- center and scale positions, SD values can be large
+	local mean,scale=0,0
+	for _,p in ipairs(points) do
+		mean=mean + p[1]/n
+	end
+	for _,p in ipairs(points) do
+		scale=math.max(scale,math.abs(p[1] - mean))
+	end
+	if scale == 0 then
+		return false,'all positions equal'
+	end
+	-- normal equations
+	local s={0,0,0,0,0} -- sums of x^0..x^4
+	local t={0,0,0} -- sums of y*x^0..x^2
+	for _,p in ipairs(points) do
+		local x=(p[1] - mean)/scale
+		local xp=1
+		for i=1,5 do
+			s[i]=s[i] + xp
+			if i <= 3 then
+				t[i]=t[i] + p[2]*xp
+			end
+			xp=xp*x
+		end
+	end
+	local function det3(a,b,c,d,e,f,g,h,i)
+		return a*(e*i - f*h) - b*(d*i - f*g) + c*(d*h - e*g)
+	end
+	local d=det3(s[5],s[4],s[3], s[4],s[3],s[2], s[3],s[2],s[1])
+	if d == 0 then
+		return false,'singular fit'
+	end
+	local a=det3(t[3],s[4],s[3], t[2],s[3],s[2], t[1],s[2],s[1])/d
+	local b=det3(s[5],t[3],s[3], s[4],t[2],s[2], s[3],t[1],s[1])/d
+	local c=det3(s[5],s[4],t[3], s[4],s[3],t[2], s[3],s[2],t[1])/d
+	if a <= 0 then
+		return false,'curve has no minimum'
+	end
+	-- back to unscaled coordinates
+	local xs=-b/(2*a)
+	a=a/(scale*scale)
+	b=b/scale - 2*a*mean
+	c=c - b*mean - a*mean*mean
+	return mean + xs*scale,{a=a,b=b,c=c}
+end
+
+--[[
+pos,fit=autofocus.fit(points,method)
+method: 'v' or 'parabola', default 'v'
+the result must be inside the measured range
+]]
+function m.fit(points,method)
+	local f
+	if not method or method == 'v' then
+		f=m.fit_vcurve
+	elseif method == 'parabola' then
+		f=m.fit_parabola
+	else
+		return false,'unknown fit method '..tostring(method)
+	end
+	local pos,fit=f(points)
+	if not pos then
+		return false,fit
+	end
+	local lo,hi
+	for _,p in ipairs(points) do
+		lo=math.min(lo or p[1],p[1])
+		hi=math.max(hi or p[1],p[1])
+	end
+	if pos < lo or pos > hi then
+		return false,string.format('minimum %d outside range %d-%d',pos,lo,hi)
+	end
+	return pos,fit
+end
+
+--[[
+return a list of n positions evenly spaced from first to last, rounded to integers
+]]
+function m.positions(first,last,n)
+	local r={}
+	if n < 2 then
+		return {first}
+	end
+	for i=0,n-1 do
+		table.insert(r,util.round(first + (last - first)*i/(n-1)))
+	end
+	return r
+end
+
+--[[
+run an autofocus sweep. Camera must be in rec mode, remotecap must support raw and dng header
+result=autofocus.run(opts)
+opts {
+	positions={...} -- focus positions to sample, SD in mm
+	lstart=number -- first line of sub-image, should be even
+	lcount=number -- number of lines
+	shoot_opts=table -- exposure options as returned by cli:get_shoot_common_opts
+	fit=string -- 'v' or 'parabola', default 'v'
+	settle=number -- ms to wait after setting focus, default 100
+	verify=bool -- shoot and measure again after moving to the best position, default true
+	shotwait=number -- ms to wait for each shot, default 20000
+	x,y,radius,star_opts -- passed to measure, y in full image coordinates
+}
+result {
+	points={{pos,hfr,stars},...} -- measured positions, failed measurements are not included
+	best=number -- final focus position
+	fit=table -- fit parameters, or false if the fit failed and the best sample was used
+	hfr=number -- verify HFR, if verify was set
+}
+throws on error
+]]
+function m.run(opts)
+	opts=util.extend_table({
+		fit='v',
+		settle=100,
+		verify=true,
+		shotwait=20000,
+	},opts)
+	local rsopts=util.extend_table({
+		-- raw + dng header
+		fformat=6,
+		lstart=opts.lstart,
+		lcount=opts.lcount,
+		cap_timeout=30000,
+		shoot_hook_timeout=60000,
+	},opts.shoot_opts)
+	-- enables focus override
+	if not rsopts.sd then
+		rsopts.sd=opts.positions[1]
+	end
+	local mopts=util.extend_table({},opts,{keys={'x','radius','star_opts'}})
+	if opts.y then
+		mopts.y=opts.y - opts.lstart
+	end
+
+	local hdr_lb,frame_lb
+	local rcopts={
+		dng_hdr=chdku.rc_handler_store(function(chunk) hdr_lb=chunk.data end),
+		raw=chdku.rc_handler_store(function(chunk) frame_lb=chunk.data end),
+		timeout=opts.shotwait,
+	}
+	local spec
+	local function shoot_measure(pos)
+		local t0=ticktime.get()
+		con:write_msg(string.format('exec focus:set(%d) sleep(%d)',pos,opts.settle))
+		con:write_msg('s')
+		frame_lb=nil
+		con:capture_get_data(rcopts)
+		if not frame_lb then
+			errlib.throw{etype='protocol',msg='autofocus: no raw data'}
+		end
+		if not spec then
+			if not hdr_lb then
+				errlib.throw{etype='protocol',msg='autofocus: no dng header'}
+			end
+			local hdr,err=dng.bind_header(hdr_lb)
+			if not hdr then
+				errlib.throw{etype='protocol',msg='autofocus: '..tostring(err)}
+			end
+			spec=hdr:get_imgspec()
+		end
+		local img=chdku.rc_bind_raw(util.extend_table({},spec),frame_lb,opts.lstart or 0)
+		local hfr,info=m.measure(img,mopts)
+		if hfr then
+			printf('focus %6d hfr %6.2f stars %3d %.3fs\n',pos,hfr,info.stars,ticktime.elapsed(t0))
+		else
+			util.warnf('focus %6d %s\n',pos,tostring(info))
+		end
+		return hfr,info
+	end
+
+	local opts_s=serialize(rsopts)
+	local rs_init_vals,rerr=con:execwait('return rsint_init('..opts_s..')',{libs={'rsint'}})
+	if not rs_init_vals then
+		errlib.throw{etype='remote',msg='autofocus: '..tostring(rerr)}
+	end
+	con:exec('return rsint_run('..opts_s..')',{libs={'rsint'}})
+
+	local result={points={}}
+	local status,err=pcall(function()
+		for _,pos in ipairs(opts.positions) do
+			local hfr,info=shoot_measure(pos)
+			if hfr then
+				table.insert(result.points,{pos,hfr,info.stars})
+			end
+		end
+		local best,fit=m.fit(result.points,opts.fit)
+		if best then
+			result.best=util.round(best)
+			result.fit=fit
+		else
+			util.warnf('fit failed: %s, using best sample\n',tostring(fit))
+			result.fit=false
+			for _,p in ipairs(result.points) do
+				if not result.best or p[2] < result.best_hfr then
+					result.best=p[1]
+					result.best_hfr=p[2]
+				end
+			end
+			if not result.best then
+				errlib.throw{etype='bad_arg',msg='autofocus: no successful measurements'}
+			end
+		end
+		if opts.verify then
+			result.hfr=shoot_measure(result.best)
+		else
+			con:write_msg(string.format('exec focus:set(%d)',result.best))
+		end
+	end)
+	con:write_msg_pcall('q')
+	local pstatus,wstatus=con:wait_status_pcall{
+		run=false,
+		timeout=30000,
+	}
+	if not pstatus then
+		util.warnf('error waiting for shot script %s\n',tostring(wstatus))
+	elseif wstatus.timeout then
+		util.warnf('timed out waiting for shot script\n')
+	end
+	local ustatus,uerr=con:execwait_pcall('rs_cleanup('..serialize(rs_init_vals)..')',{libs={'rs_shoot_cleanup'}})
+	if not status then
+		error(err,0)
+	end
+	if not ustatus then
+		errlib.throw{etype='remote',msg='autofocus: uninit '..tostring(uerr)}
+	end
+	return result
+end
+
+return m
@@ -20,6 +20,8 @@ lua helper functions for working with the chdk.* c api
 
 local chdku={}
 chdku.rlibs = require('rlibs')
+local pixmap = require('pixmap')
+local fits = require('fits')
 chdku.sleep = sys.sleep -- to allow override
 -- format a script message in a human readable way
 function chdku.format_script_msg(msg)
@@ -1315,8 +1317,21 @@ function chdku.rc_build_path(hdata,opts)
 	return filename
 end
 
-function chdku.rc_process_dng(dng_info,raw)
-	local hdr,err=dng.bind_header(dng_info.hdr)
+--[[
+process a remotecap DNG frame, raw is the raw chunk in CHDK little endian format
+raw data is not byte swapped or padded, dng_info.data_offset and data_size are set
+for rawimg.write_dng
+dng_info.frame_hdr is set to a copy of the header with changes for this frame
+if dng_info.lj92 is set, dng_info.tiles is set to the compressed data, to be written instead of raw
+dng_info.frame_dng and frame_img are set to the bound header and frame rows, for rc_write_fits
+name is used to identify the frame in quality gate messages
+if a quality gate is set, dng_info.gate_status is set to the gate result
+rejected frames are not stacked or converted, quarantined frames are not stacked
+]]
+function chdku.rc_process_dng(dng_info,raw,name)
+	-- the received header is kept unmodified, since raw ifd changes point outside it
+	dng_info.frame_hdr=dng_info.hdr:sub()
+	local hdr,err=dng.bind_header(dng_info.frame_hdr)
 	if not hdr then
 		error(err)
 	end
@@ -1330,58 +1345,188 @@ function chdku.rc_process_dng(dng_info,raw)
 		error('ifd 0 not found')
 	end
 
-	raw.data:reverse_bytes()
-
 	local bpp = ifd.byname.BitsPerSample:getel()
 	local width = ifd.byname.ImageWidth:getel()
 	local height = ifd.byname.ImageLength:getel()
+	local lstart=0
+	local rows=height
+	-- sub-image
+	if dng_info.lstart ~= 0 or dng_info.lcount ~= 0 then
+		lstart=dng_info.lstart
+		rows=math.floor(raw.data:len()*8/(width*bpp))
+	end
+
+	dng_info.gate_status = nil
+	if dng_info.gate then
+		local img=chdku.rc_bind_raw(hdr:get_imgspec(),raw.data,lstart,rows)
+		dng_info.gate_status = dng_info.gate:check(img,name)
+		if dng_info.gate_status == 'reject' then
+			return
+		end
+	end
+	if dng_info.stack and dng_info.gate_status ~= 'quarantine' then
+		dng_info.stack:add_raw(hdr,raw,dng_info)
+	end
+	if dng_info.stack_only then
+		return
+	end
 
 	cli.dbgmsg('dng %dx%dx%d\n',width,height,bpp)
 
+	-- data stays in CHDK byte order, it is swapped and padded as the file is written
 	-- values are assumed to be valid
-	-- sub-image, pad
-	if dng_info.lstart ~= 0 or dng_info.lcount ~= 0 then
-		-- TODO assume a single strip with full data
-		local fullraw = lbuf.new(ifd.byname.StripByteCounts:getel())
-		local offset = (width * dng_info.lstart * bpp)/8;
-		--local blacklevel = ifd.byname.BlackLevel:getel()
-		-- filling with blacklevel would be nicer but max doesn't care about byte order
-		fullraw:fill(string.char(0xff),0,offset) -- fill up to data
-		-- copy
-		fullraw:fill(raw.data,offset,1)
-		fullraw:fill(string.char(0xff),offset+raw.data:len()) -- fill remainder
-		-- replace original data
-		raw.data=fullraw
-	end
-
+	-- TODO assume a single strip with full data
+	dng_info.data_size = ifd.byname.StripByteCounts:getel()
+	dng_info.data_offset = (width * lstart * bpp)/8
+	local aa=hdr:get_imgspec().active_area
 
+	if dng_info.thumb_width then
+		local w=math.min(dng_info.thumb_width,aa.right - aa.left)
+		hdr:set_thumb_size(w,util.round(w*(aa.bottom - aa.top)/(aa.right - aa.left)))
+	end
 	local twidth = ifd0.byname.ImageWidth:getel()
 	local theight = ifd0.byname.ImageLength:getel()
 
-	local status, err = pcall(hdr.set_data,hdr,raw.data)
-	if not status then
-		cli.dbgmsg('not creating thumb: %s\n',tostring(err))
+	-- raw ifd changes, written in a new raw ifd after header, thumb and data
+	local raw_entries={}
+	local raw_remove
+	dng_info.trailer = nil
+	dng_info.tiles = nil
+	if dng_info.pixmap and dng_info.pixmap_opcode then
+		cli.dbgmsg('adding bad pixel opcode: %d\n',dng_info.pixmap:count())
+		table.insert(raw_entries,hdr:opcode1_entry(dng_info.pixmap:fix_bad_pixels_opcode(hdr:bayer_phase())))
+	end
+
+	local status, img = pcall(chdku.rc_bind_raw,hdr:get_imgspec(),raw.data,lstart,rows)
+	dng_info.frame_dng = hdr
+	dng_info.frame_img = nil
+	if status then
+		dng_info.frame_img = img
+		chdku.rc_process_dng_img(dng_info,hdr,img,lstart,rows,height)
+	else
+		cli.dbgmsg('not creating thumb: %s\n',tostring(img))
 		dng_info.thumb = lbuf.new(twidth*theight*3)
-		return -- thumb failure isn't fatal
+		-- thumb failure isn't fatal
+	end
+	if dng_info.tiles then
+		local entries
+		entries,raw_remove=dng.lj92_raw_entries(util.extend_table({sizes=dng_info.tile_sizes},dng_info.lj92),
+			dng_info.frame_hdr:len() + twidth*theight*3)
+		for _,e in ipairs(entries) do
+			table.insert(raw_entries,e)
+		end
+	end
+	if #raw_entries > 0 then
+		dng_info.trailer = lbuf.new(hdr:replace_raw_ifd(raw_entries,
+			dng_info.frame_hdr:len() + twidth*theight*3 + dng_info.data_size,{remove=raw_remove}))
 	end
-	if dng_info.badpix then
+end
+
+--[[
+img=chdku.rc_bind_raw(spec,data,lstart,rows)
+bind the rows of remotecap raw data starting at lstart, with the part of the active area they contain
+spec is the full image spec from the DNG header, modified
+rows defaults to the number of complete rows in data
+top keeps the parity of the full active area, so the CFA phase is unchanged
+]]
+function chdku.rc_bind_raw(spec,data,lstart,rows)
+	local aa=spec.active_area
+	spec.data=data
+	spec.endian='little'
+	spec.height=rows or math.floor(data:len()*8/(spec.width*spec.bpp))
+	spec.active_area={
+		top=math.max(aa.top - lstart,(aa.top - lstart)%2),
+		left=aa.left,
+		bottom=math.min(aa.bottom - lstart,spec.height),
+		right=aa.right,
+	}
+	return rawimg.bind_lbuf(spec)
+end
+
+--[[
+patch pixels of the bound raw rows of a frame, create the thumbnail, and compress if dng_info.lj92 is set
+]]
+function chdku.rc_process_dng_img(dng_info,hdr,img,lstart,rows,height)
+	local aa=hdr:get_imgspec().active_area
+	local ifd0=hdr:get_ifd{0}
+	local twidth = ifd0.byname.ImageWidth:getel()
+	local theight = ifd0.byname.ImageLength:getel()
+	if dng_info.pixmap then
+		if not dng_info.pixmap_opcode then
+			cli.dbgmsg('patching mapped pixels: ')
+			local pixmap=dng_info.pixmap
+			if rows ~= height then
+				pixmap=pixmap:band(lstart,rows)
+			end
+			local bcount=pixmap:patch(img)
+			cli.dbgmsg('%d\n',bcount)
+		end
+	elseif dng_info.badpix then
 		cli.dbgmsg('patching badpixels: ')
-		local bcount=hdr.img:patch_pixels(dng_info.badpix) -- TODO should use values from opcodes
+		local bcount=img:patch_pixels(dng_info.badpix) -- TODO should use values from opcodes
 		cli.dbgmsg('%d\n',bcount)
 	end
 
+	-- thumb and compression are only needed for the DNG
+	if dng_info.fits and not dng_info.fits.dng then
+		return
+	end
 	cli.dbgmsg('creating thumb: %dx%d\n',twidth,theight)
 	-- TODO assumes header is set up for RGB uncompressed
-	-- TODO could make a better / larger thumb than default and adjust entries
-	dng_info.thumb = hdr.img:make_rgb_thumb(twidth,theight)
+	local t0=ticktime.get()
+	-- for sub-images, rows outside the data are read as the max value, as the padding
+	dng_info.thumb = img:make_rgb_thumb(twidth,theight,{
+		wb=hdr:get_wb(),
+		y_offset=lstart,
+		area=aa,
+	})
+	cli.dbgmsg('thumb %.4f\n',ticktime.elapsed(t0))
+	if dng_info.lj92 then
+		t0=ticktime.get()
+		-- sub-image rows outside the data are compressed as the max value, like the padding
+		dng_info.tiles,dng_info.tile_sizes=img:encode_lj92(util.extend_table({
+			y_offset=lstart,
+			height=height,
+		},dng_info.lj92))
+		dng_info.data_offset=0
+		dng_info.data_size=dng_info.tiles:len()
+		cli.dbgmsg('lj92 %d bytes %.4f\n',dng_info.data_size,ticktime.elapsed(t0))
+	end
+end
+--[[
+write the frame rows bound by the last rc_process_dng as FITS
+dng_info.fits is passed to fits.write
+]]
+function chdku.rc_write_fits(dng_info,filename,serial)
+	if not dng_info.frame_img then
+		errlib.throw{etype='bad_arg',msg='rc_write_fits: frame data not available'}
+	end
+	fsutil.mkdir_parent(filename)
+	local fh=fsutil.open_e(filename,'wb')
+	local status,err=pcall(fits.write,fh,dng_info.frame_dng,dng_info.frame_img,util.extend_table({
+		serial=serial,
+		wb=dng_info.frame_dng:get_wb(),
+	},dng_info.fits))
+	fh:close()
+	if not status then
+		errlib.throw{etype='io',msg=tostring(err)}
+	end
 end
+
 --[[
 return a raw handler that will take a previously received dng header and build a DNG file
 dng_info:
 	lstart=<number> sub image start
 	lcount=<number> sub image lines
 	hdr=<lbuf> dng header lbuf
-
+	stack=<livestack> optional live stack to add frames to
+	stack_only=<bool> only add to stack, don't write DNG files
+	pixmap=<pixmap> optional bad pixel map, used instead of badpix
+	pixmap_opcode=<bool> add pixmap as a FixBadPixelsList opcode instead of patching
+	thumb_width=<number> embedded preview width, height follows the active area. default camera size
+	gate=<framegate> optional quality gate, frames are checked before stacking and writing
+	lj92=<table> optional {tile_width,tile_height}, write raw data as lossless JPEG compressed tiles
+	fits=<table> optional fits.write options, write the frame as FITS. the DNG is only written if fits.dng is set
 ]]
 function chdku.rc_handler_raw_dng_file(hopts,dng_info)
 	if not dng_info then
@@ -1400,14 +1545,35 @@ function chdku.rc_handler_raw_dng_file(hopts,dng_info)
 						raw.size,
 						tostring(raw.offset),
 						tostring(raw.last))
-		chdku.rc_process_dng(dng_info,raw)
+		chdku.rc_process_dng(dng_info,raw,filename)
+		if dng_info.stack_only or dng_info.gate_status == 'reject' then
+			return
+		end
+		if dng_info.gate_status == 'quarantine' then
+			filename = dng_info.gate:quarantine_path(filename)
+		end
+		if dng_info.fits then
+			chdku.rc_write_fits(dng_info,fsutil.remove_sfx(filename,'.dng')..'.fits',
+				lcon.ptpdev and lcon.ptpdev.serial_number)
+			if not dng_info.fits.dng then
+				return
+			end
+		end
 		fsutil.mkdir_parent(filename)
 		local fh=fsutil.open_e(filename,'wb')
-		dng_info.hdr:fwrite(fh)
-		--fh:write(string.rep('\0',128*96*3)) -- fake thumb
-		dng_info.thumb:fwrite(fh)
-		raw.data:fwrite(fh)
+		local status,err=pcall(rawimg.write_dng,fh,{
+			header=dng_info.frame_hdr,
+			thumb=dng_info.thumb,
+			data=dng_info.tiles or raw.data,
+			swap=(dng_info.tiles == nil),
+			data_offset=dng_info.data_offset,
+			data_size=dng_info.data_size,
+			trailer=dng_info.trailer,
+		})
 		fh:close()
+		if not status then
+			errlib.throw{etype='io',msg=tostring(err)}
+		end
 	end
 end
 --[[
@@ -1469,6 +1635,17 @@ opts {
 	badpix=bool -- threshold to patch bad pixels in in dng
 	lstart=number -- starting line for sub-image dng (default = 0)
 	lcount=number -- number of lines for sub-image dng (default = 0 = all)
+	stack=livestack -- live stack to add dng frames to, see livestack.lua
+	stack_only=bool -- only stack dng frames, don't save them
+	pixmap=string|pixmap -- bad pixel map file or object, patched instead of badpix
+	pixmap_opcode=bool -- add pixmap as a DNG opcode rather than modifying the data
+	thumb_width=number -- embedded preview width, default camera size
+	gate=framegate -- quality gate to check dng frames with, see framegate.lua
+	lj92=bool|number -- write dng raw data lossless JPEG compressed, optionally the tile size. default 256
+	fits=bool|string -- write dng frames as FITS, string is 'cfa' or 'rgb'. default cfa
+	fits_bits=number -- FITS BITPIX, 16 or 32. default 16
+	fits_black=bool -- subtract the black level from FITS cfa data
+	fits_dng=bool -- write DNG files as well as FITS
 ]]
 function chdku.rc_init_std_handlers(opts)
 	opts=util.extend_table({
@@ -1495,7 +1672,41 @@ function chdku.rc_init_std_handlers(opts)
 			lstart=opts.lstart,
 			lcount=opts.lcount,
 			badpix=opts.badpix,
+			stack=opts.stack,
+			stack_only=opts.stack_only,
+			pixmap_opcode=opts.pixmap_opcode,
+			thumb_width=opts.thumb_width,
+			gate=opts.gate,
 		}
+		if opts.lj92 then
+			local size = 256
+			if opts.lj92 ~= true then
+				size = tonumber(opts.lj92)
+				if not size or size % 16 ~= 0 or size <= 0 then
+					errlib.throw{etype='bad_arg',msg='rc_init_std_handlers: lj92 tile size must be a multiple of 16'}
+				end
+			end
+			dng_info.lj92 = {tile_width=size,tile_height=size}
+		end
+		if opts.fits then
+			dng_info.fits = {
+				planes=(opts.fits == true) and 'cfa' or opts.fits,
+				bitpix=tonumber(opts.fits_bits) or 16,
+				black=opts.fits_black,
+				dng=opts.fits_dng,
+			}
+			if dng_info.fits.planes ~= 'cfa' and dng_info.fits.planes ~= 'rgb' then
+				errlib.throw{etype='bad_arg',msg='rc_init_std_handlers: invalid fits '..tostring(opts.fits)}
+			end
+			if dng_info.fits.bitpix ~= 16 and (dng_info.fits.bitpix ~= 32 or dng_info.fits.planes == 'rgb') then
+				errlib.throw{etype='bad_arg',msg='rc_init_std_handlers: invalid fits_bits '..tostring(opts.fits_bits)}
+			end
+		end
+		if type(opts.pixmap) == 'string' then
+			dng_info.pixmap = pixmap.load(opts.pixmap)
+		else
+			dng_info.pixmap = opts.pixmap
+		end
 		rcopts.dng_hdr = chdku.rc_handler_store(function(chunk) dng_info.hdr=chunk.data end)
 		rcopts.raw = chdku.rc_handler_raw_dng_file(util.extend_table({ext='dng',fmt='DNG'},hopts),dng_info)
 	else
@@ -2020,53 +2231,557 @@ opts:{
 						caller must close opts.filehandle when done
 	filehandle=handle -- already open handle to write to, filename ignored
 	lb=lbuf -- lbuf for image to re-use, created and set if not given
-	pimg=pimg -- pimg to re-use, created if and set if not given
 	skip=bool -- downsample image width 50% in X (faster, rough aspect correction for some cams)
+	overlay=bool -- blend the bitmap over the viewport, if present in frame
 }
 ]]
 function chdku.live_dump_vp_pbm(frame,opts)
-	opts.pimg = liveimg.get_viewport_pimg(opts.pimg,frame,opts.skip)
+	local lb,width,height = liveimg.get_viewport_packed(opts.lb,frame,{
+		skip=opts.skip,
+		bitmap_overlay=opts.overlay,
+	})
 	-- TODO may be null if video selected on startup
-	if not opts.pimg then
+	if not lb then
 		error('no viewport data')
 	end
-	opts.lb = opts.pimg:to_lbuf_packed_rgb(opts.lb)
-	local width = opts.pimg:width()
-	if opts.skip then
-		width = width/2
-	end
+	opts.lb = lb
 
 	local fh = live_dump_img_open(opts)
 	fh:write(string.format('P6\n%d\n%d\n%d\n',
 		width,
-		opts.pimg:height(),255))
+		height,255))
 	opts.lb:fwrite(fh)
 	live_dump_img_close(fh,opts)
 end
 --[[
-write viewport data to an unscaled RGBA pam image
-opts as above
+write bitmap data to an unscaled RGBA pam image
+opts as above, except overlay
 ]]
 function chdku.live_dump_bm_pam(frame,opts)
-	opts.pimg = liveimg.get_bitmap_pimg(opts.pimg,frame,opts.skip)
-	opts.lb = opts.pimg:to_lbuf_packed_rgba(opts.lb)
-
-	local width = opts.pimg:width()
-	if opts.skip then
-		width = width/2
+	local lb,width,height = liveimg.get_bitmap_packed(opts.lb,frame,{skip=opts.skip})
+	if not lb then
+		error('no bitmap data')
 	end
+	opts.lb = lb
 
 	local fh = live_dump_img_open(opts)
 
 	fh:write(string.format(
 		'P7\nWIDTH %d\nHEIGHT %d\nDEPTH %d\nMAXVAL %d\nTUPLTYPE RGB_ALPHA\nENDHDR\n',
 		width,
-		opts.pimg:height(),
+		height,
 		4,255))
 	opts.lb:fwrite(fh)
 	live_dump_img_close(fh,opts)
 end
 
+--[[
+lvdump v2 file format, all values are little endian u32
+'chlv' magic
+header record: size of following data = 12, version major = 2, version minor = 0, flags
+	flags: 1 = may contain compressed frames
+records: size of following data, type, type specific data
+	type 1 frame: codec, raw frame size, capture time low, high, payload
+		time is microseconds since the epoch, 0 if unknown
+		codec: 0 = raw, 1 = LZ4 block, 2 = LZ4 block of the bytewise difference from the previous frame
+	type 2 index, after the last frame: count, then count entries of
+		file offset of the frame record low, high, time low, high, codec, raw frame size
+trailer, the last 16 bytes: file offset of the index record low, high, count, 'lvix'
+files without a trailer, e.g. if recording was interrupted, are read by scanning the records
+
+v1, read only: 'chlv', size = 8, version major = 1, version minor = 0, then records of
+u32 size followed by a raw frame
+]]
+local LVDUMP_REC_FRAME=1
+local LVDUMP_REC_INDEX=2
+local LVDUMP_FRAME_HDR_SIZE=24
+local LVDUMP_INDEX_ENTRY_SIZE=24
+local LVDUMP_TRAILER_SIZE=16
+-- size of the mapping used for sequential reads
+local LVDUMP_WINDOW_SIZE=32*1024*1024
+
+local function lvdump_u64_split(v)
+	local hi=math.floor(v/2^32)
+	return v - hi*2^32, hi
+end
+
+local lvdump_writer_methods={}
+local lvdump_writer_meta={__index=lvdump_writer_methods}
+
+--[[
+writer=chdku.lvdump_create(filename[,opts])
+create an lvdump v2 file
+opts:{
+	compress=bool -- compress frames, default false
+	keyframe_interval=number -- with compress, maximum frames between frames compressed
+	                         -- without reference to the previous, default 30. 1 disables delta
+}
+returns writer, or false,error
+]]
+function chdku.lvdump_create(filename,opts)
+	opts=util.extend_table({
+		compress=false,
+		keyframe_interval=30,
+	},opts)
+	local fh,err=io.open(filename,'wb')
+	if not fh then
+		return false,err
+	end
+	local w=setmetatable({
+		fh=fh,
+		filename=filename,
+		compress=opts.compress,
+		keyframe_interval=opts.keyframe_interval,
+		hdr=lbuf.new(LVDUMP_FRAME_HDR_SIZE),
+		index={},
+		since_key=0,
+	},lvdump_writer_meta)
+	fh:write('chlv')
+	w.hdr:set_u32(0,12,2,0,opts.compress and 1 or 0)
+	w.hdr:fwrite(fh,0,16)
+	w.size=20
+	return w
+end
+
+--[[
+writer:write(frame[,time])
+append a frame. time: capture time in seconds since the epoch, with fractional part
+]]
+function lvdump_writer_methods:write(frame,time)
+	local payload,codec=frame,0
+	if self.compress then
+		local prev
+		if self.since_key < self.keyframe_interval then
+			prev=self.prev
+		end
+		payload,codec=liveimg.lvdump_pack(self.payload,frame,prev)
+		if payload ~= frame then
+			self.payload=payload
+		end
+		if codec == 2 then
+			self.since_key=self.since_key + 1
+		else
+			self.since_key=1
+		end
+		-- frame is normally re-used by the caller, keep a copy for the next delta
+		if self.keyframe_interval > 1 then
+			if not self.prev or self.prev:len() ~= frame:len() then
+				self.prev=lbuf.new(frame:len())
+			end
+			self.prev:fill(frame)
+		end
+	end
+	local time_us=0
+	if time then
+		time_us=math.floor(time*1000000 + 0.5)
+	end
+	local time_lo,time_hi=lvdump_u64_split(time_us)
+	self.hdr:set_u32(0,LVDUMP_FRAME_HDR_SIZE - 4 + payload:len(),LVDUMP_REC_FRAME,codec,frame:len(),time_lo,time_hi)
+	self.hdr:fwrite(self.fh)
+	payload:fwrite(self.fh)
+	table.insert(self.index,{offset=self.size,time=time_us,codec=codec,raw_size=frame:len()})
+	self.size=self.size + LVDUMP_FRAME_HDR_SIZE + payload:len()
+end
+
+--[[
+writer:close()
+write the index and close the file
+]]
+function lvdump_writer_methods:close()
+	if not self.fh then
+		return
+	end
+	local count=#self.index
+	local trailer_pos=12 + count*LVDUMP_INDEX_ENTRY_SIZE
+	local lb=lbuf.new(trailer_pos + LVDUMP_TRAILER_SIZE)
+	lb:set_u32(0,trailer_pos - 4,LVDUMP_REC_INDEX,count)
+	for i,e in ipairs(self.index) do
+		local offset_lo,offset_hi=lvdump_u64_split(e.offset)
+		local time_lo,time_hi=lvdump_u64_split(e.time)
+		lb:set_u32(12 + (i-1)*LVDUMP_INDEX_ENTRY_SIZE,offset_lo,offset_hi,time_lo,time_hi,e.codec,e.raw_size)
+	end
+	local index_lo,index_hi=lvdump_u64_split(self.size)
+	lb:set_u32(trailer_pos,index_lo,index_hi,count)
+	lb:fill('lvix',trailer_pos + 12)
+	lb:fwrite(self.fh)
+	self.size=self.size + lb:len()
+	self.fh:close()
+	self.fh=nil
+	self.prev=nil
+	self.payload=nil
+end
+
+function lvdump_writer_methods:count()
+	return #self.index
+end
+
+local lvdump_reader_methods={}
+local lvdump_reader_meta={__index=lvdump_reader_methods}
+
+--[[
+reader=chdku.lvdump_open(filename)
+open an lvdump file of any version for random access playback
+frame data is read through memory mappings rather than loaded
+returns reader, or false,error
+]]
+function chdku.lvdump_open(filename)
+	local size=lfs.attributes(filename,'size')
+	if not size then
+		return false,filename..': not found'
+	end
+	if size < 16 then
+		return false,filename..': not an lvdump file'
+	end
+	local hdr,err=lbuf.mmap(filename,'r',0,math.min(size,20))
+	if not hdr then
+		return false,err
+	end
+	if hdr:string(1,4) ~= 'chlv' then
+		return false,filename..': not an lvdump file'
+	end
+	local hdr_size,major,minor=hdr:get_u32(4,3)
+	local r=setmetatable({
+		filename=filename,
+		size=size,
+		version_major=major,
+		version_minor=minor,
+		index={},
+	},lvdump_reader_meta)
+	local status
+	if major == 1 then
+		status,err=pcall(r.scan_v1,r,8 + hdr_size)
+	elseif major == 2 and hdr_size >= 12 and hdr:len() >= 20 then
+		r.flags=hdr:get_u32(16)
+		status,err=pcall(r.load_index,r)
+		if status and not r.indexed then
+			status,err=pcall(r.scan_v2,r,8 + hdr_size)
+		end
+	else
+		return false,string.format('%s: unsupported lvdump version %d.%d',filename,major,minor)
+	end
+	if not status then
+		return false,tostring(err)
+	end
+	return r
+end
+
+--[[
+map len bytes of the file at offset, throws on error
+]]
+function lvdump_reader_methods:map(offset,len,mode)
+	local lb,err=lbuf.mmap(self.filename,mode or 'r',offset,len)
+	if not lb then
+		errlib.throw{etype='io',msg=tostring(err)}
+	end
+	return lb
+end
+
+--[[
+lbuf,offset of a mapping containing size bytes of the file at offset
+sequential reads are served from one large mapping rather than mapping each frame
+]]
+function lvdump_reader_methods:window(offset,size)
+	local w=self.win
+	if w and offset >= self.win_offset and offset + size <= self.win_offset + w:len() then
+		return w,offset - self.win_offset
+	end
+	self.win=self:map(offset,math.min(math.max(size,LVDUMP_WINDOW_SIZE),self.size - offset))
+	self.win_offset=offset
+	return self.win,0
+end
+
+function lvdump_reader_methods:scan_v1(pos)
+	while pos + 4 <= self.size do
+		local len=self:map(pos,4):get_u32()
+		-- incomplete last frame
+		if pos + 4 + len > self.size then
+			break
+		end
+		table.insert(self.index,{offset=pos + 4,size=len,codec=0,raw_size=len,time=0})
+		pos=pos + 4 + len
+	end
+end
+
+function lvdump_reader_methods:scan_v2(pos)
+	while pos + 8 <= self.size do
+		local hdr=self:map(pos,math.min(LVDUMP_FRAME_HDR_SIZE,self.size - pos))
+		local len,rtype=hdr:get_u32(0,2)
+		if pos + 4 + len > self.size or rtype == LVDUMP_REC_INDEX then
+			break
+		end
+		if rtype == LVDUMP_REC_FRAME and len >= LVDUMP_FRAME_HDR_SIZE - 4 then
+			local codec,raw_size,time_lo,time_hi=hdr:get_u32(8,4)
+			table.insert(self.index,{
+				offset=pos + LVDUMP_FRAME_HDR_SIZE,
+				size=len + 4 - LVDUMP_FRAME_HDR_SIZE,
+				codec=codec,
+				raw_size=raw_size,
+				time=time_lo + time_hi*2^32,
+			})
+		end
+		pos=pos + 4 + len
+	end
+end
+
+--[[
+load the index from the trailer, leaves self.indexed unset if there is no valid index
+]]
+function lvdump_reader_methods:load_index()
+	if self.size < 20 + LVDUMP_TRAILER_SIZE then
+		return
+	end
+	local trailer=self:map(self.size - LVDUMP_TRAILER_SIZE,LVDUMP_TRAILER_SIZE)
+	if trailer:string(13,16) ~= 'lvix' then
+		return
+	end
+	local index_lo,index_hi,count=trailer:get_u32(0,3)
+	local index_pos=index_lo + index_hi*2^32
+	local index_len=12 + count*LVDUMP_INDEX_ENTRY_SIZE
+	if index_pos + index_len + LVDUMP_TRAILER_SIZE ~= self.size then
+		return
+	end
+	local lb=self:map(index_pos,index_len)
+	local len,rtype,rcount=lb:get_u32(0,3)
+	if len ~= index_len - 4 or rtype ~= LVDUMP_REC_INDEX or rcount ~= count then
+		return
+	end
+	local index={}
+	for i=1,count do
+		local offset_lo,offset_hi,time_lo,time_hi,codec,raw_size=lb:get_u32(12 + (i-1)*LVDUMP_INDEX_ENTRY_SIZE,6)
+		index[i]={
+			offset=offset_lo + offset_hi*2^32 + LVDUMP_FRAME_HDR_SIZE,
+			codec=codec,
+			raw_size=raw_size,
+			time=time_lo + time_hi*2^32,
+		}
+	end
+	-- frame records are contiguous, so each ends where the next starts
+	for i,e in ipairs(index) do
+		local next_pos=index_pos
+		if index[i+1] then
+			next_pos=index[i+1].offset - LVDUMP_FRAME_HDR_SIZE
+		end
+		e.size=next_pos - e.offset
+		if e.size < 0 then
+			return
+		end
+	end
+	self.index=index
+	self.indexed=true
+end
+
+--[[
+count=reader:count()
+]]
+function lvdump_reader_methods:count()
+	return #self.index
+end
+
+--[[
+time=reader:time(i)
+capture time of frame i in seconds since the epoch, or nil if not recorded
+]]
+function lvdump_reader_methods:time(i)
+	local e=self.index[i]
+	if e and e.time > 0 then
+		return e.time/1000000
+	end
+end
+
+--[[
+decode frame i and everything it depends on into the internal buffers
+]]
+function lvdump_reader_methods:decode(i)
+	if self.dec_index == i then
+		return self.dec
+	end
+	-- walk back to a frame that doesn't need its predecessor, or follows the last decoded
+	local first=i
+	while self.index[first].codec == 2 and first - 1 ~= self.dec_index do
+		first=first - 1
+		if first < 1 then
+			errlib.throw{etype='bad_arg',msg='lvdump: delta frame without key frame'}
+		end
+	end
+	for j=first,i do
+		local e=self.index[j]
+		local payload,offset=self:window(e.offset,e.size)
+		local frame,err=liveimg.lvdump_unpack(self.dec_spare,payload,offset,e.size,e.codec,e.raw_size,self.dec)
+		if not frame then
+			self.dec_index=nil
+			errlib.throw{etype='bad_arg',msg=string.format('lvdump: frame %d: %s',j,tostring(err))}
+		end
+		self.dec_spare=self.dec
+		self.dec=frame
+		self.dec_index=j
+	end
+	return self.dec
+end
+
+--[[
+frame,time=reader:read(i[,lb])
+get frame i, 1 based, and its capture time as reader:time
+lb: lbuf to copy the frame into, re-used if large enough
+if lb is not given, raw frames are returned as a private copy on write mapping of the file,
+and compressed frames are returned in an internal buffer which is only valid until the next
+read, and must not be modified
+]]
+function lvdump_reader_methods:read(i,lb)
+	local e=self.index[i]
+	if not e then
+		errlib.throw{etype='bad_arg',msg='lvdump: invalid frame '..tostring(i)}
+	end
+	local frame
+	if e.codec ~= 0 then
+		frame=self:decode(i)
+		if lb then
+			frame=liveimg.lvdump_unpack(lb,frame,0,frame:len(),0,frame:len())
+		end
+	elseif lb then
+		local payload,offset=self:window(e.offset,e.size)
+		frame=liveimg.lvdump_unpack(lb,payload,offset,e.size,0,e.size)
+	else
+		frame=self:map(e.offset,e.size,'c')
+	end
+	return frame,self:time(i)
+end
+
+--[[
+reader:close()
+release mappings and buffers. the reader may still be used, at the cost of re-creating them
+]]
+function lvdump_reader_methods:close()
+	self.win=nil
+	self.dec=nil
+	self.dec_spare=nil
+	self.dec_index=nil
+end
+
+--[[
+status,err=chdku.lvdump_convert(infile,outfile[,opts])
+re-write an lvdump file of any version as v2, opts as chdku.lvdump_create
+frames from v1 files have no capture time
+]]
+function chdku.lvdump_convert(infile,outfile,opts)
+	if infile == outfile then
+		return false,'input and output must be different files'
+	end
+	local r,err=chdku.lvdump_open(infile)
+	if not r then
+		return false,err
+	end
+	local w
+	w,err=chdku.lvdump_create(outfile,opts)
+	if not w then
+		return false,err
+	end
+	local lb=lbuf.new(0)
+	local status
+	status,err=pcall(function()
+		for i=1,r:count() do
+			local frame,time=r:read(i,lb)
+			w:write(frame,time)
+		end
+	end)
+	w:close()
+	r:close()
+	if not status then
+		return false,tostring(err)
+	end
+	return true
+end
+
+--[[
+live view stream formats for lvserve
+	lvdump: an lvdump v2 file without an index, raw frames which clients convert themselves
+	ppm: concatenated binary PPM images of the viewport
+	multipart: HTTP response with PPM parts, like MJPEG streams from network cameras
+]]
+local LVSTREAM_BOUNDARY='chdkptp-lv'
+chdku.lvstream_formats={
+	lvdump={
+		header=function(self)
+			local lb=lbuf.new(20)
+			lb:fill('chlv',0,1)
+			lb:set_u32(4,12,2,0,0)
+			return lb
+		end,
+		encode=function(self,frame,time)
+			local time_lo,time_hi=lvdump_u64_split(math.floor((time or 0)*1000000 + 0.5))
+			self.hdr:set_u32(0,LVDUMP_FRAME_HDR_SIZE - 4 + frame:len(),LVDUMP_REC_FRAME,0,frame:len(),time_lo,time_hi)
+			return self.hdr,frame
+		end,
+	},
+	ppm={
+		encode=function(self,frame)
+			local w,h
+			self.packed,w,h=liveimg.get_viewport_packed(self.packed,frame,self.packed_opts)
+			if not self.packed then
+				return
+			end
+			return string.format('P6\n%d %d\n255\n',w,h),self.packed
+		end,
+	},
+	multipart={
+		header=function(self)
+			return 'HTTP/1.0 200 OK\r\n'
+				..'Cache-Control: no-cache\r\n'
+				..'Connection: close\r\n'
+				..'Content-Type: multipart/x-mixed-replace; boundary='..LVSTREAM_BOUNDARY..'\r\n\r\n'
+		end,
+		encode=function(self,frame)
+			local w,h
+			self.packed,w,h=liveimg.get_viewport_packed(self.packed,frame,self.packed_opts)
+			if not self.packed then
+				return
+			end
+			local ppm_hdr=string.format('P6\n%d %d\n255\n',w,h)
+			return string.format('--%s\r\nContent-Type: image/x-portable-pixmap\r\nContent-Length: %d\r\n\r\n%s',
+						LVSTREAM_BOUNDARY,ppm_hdr:len() + self.packed:len(),ppm_hdr),
+					self.packed,
+					'\r\n'
+		end,
+	},
+}
+
+local lvstream_methods={}
+local lvstream_meta={__index=lvstream_methods}
+
+--[[
+stream=chdku.lvstream_create(format[,opts])
+format: name from chdku.lvstream_formats
+opts:{
+	skip=bool -- for image formats, convert 2 pixels per U Y V Y Y Y, for cameras with a 2:1 pixel aspect ratio
+	bitmap_overlay=bool -- for image formats, blend the ui overlay over the viewport
+}
+stream.header: string or lbuf to send to each client before frames, or nil
+]]
+function chdku.lvstream_create(format,opts)
+	local fmt=chdku.lvstream_formats[format]
+	if not fmt then
+		return false,'unknown format '..tostring(format)
+	end
+	opts=util.extend_table({},opts)
+	local s=setmetatable({
+		fmt=fmt,
+		hdr=lbuf.new(LVDUMP_FRAME_HDR_SIZE),
+		packed_opts={skip=opts.skip,bitmap_overlay=opts.bitmap_overlay},
+	},lvstream_meta)
+	if fmt.header then
+		s.header=fmt.header(s)
+	end
+	return s
+end
+
+--[[
+... = stream:encode(frame[,time])
+returns strings and lbufs to pass to lvserve server:publish, or nothing if the frame has no image
+returned lbufs are re-used by the next call
+]]
+function lvstream_methods:encode(frame,time)
+	return self.fmt.encode(self,frame,time)
+end
+
 --[[
 NOTE this only tells if the CHDK protocol supports live view
 the live sub-protocol might not be fully compatible
@@ -2077,10 +2792,35 @@ end
 
 function con_methods:live_get_frame(what)
 	self.live:set_frame(self:get_live_data(self.live._frame,what))
+	local sec,usec=sys.gettimeofday()
+	self.live.frame_time=sec + usec/1000000
+	return true
+end
+
+--[[
+set the live frame to the latest from the background fetch started with con:live_pump_start
+timeout: ms to wait for a new frame, default 0
+returns true if a new frame was set, false if there was none
+throws if the pump stopped on error
+]]
+function con_methods:live_pump_frame(timeout)
+	local frame,seq,time = self:live_pump_get_frame(self.live._frame,self.live.pump_seq,timeout)
+	if not frame then
+		return false
+	end
+	self.live.pump_seq = seq
+	self.live.frame_time = time
+	self.live:set_frame(frame)
 	return true
 end
 
-function con_methods:live_dump_start(filename)
+--[[
+status,err=con:live_dump_start(filename,opts)
+start recording live frames to an lvdump v2 file
+filename: optional, defaults to chdk_<pid>_<date>_<time>.lvdump
+opts: optional, as chdku.lvdump_create
+]]
+function con_methods:live_dump_start(filename,opts)
 	if not self:is_connected() then
 		return false,'not connected'
 	end
@@ -2091,50 +2831,35 @@ function con_methods:live_dump_start(filename)
 		filename = string.format('chdk_%x_%s.lvdump',tostring(con.condev.product_id),os.date('%Y%m%d_%H%M%S'))
 	end
 	--printf('recording to %s\n',dumpname)
-	self.live.dump_fh = io.open(filename,"wb")
-	if not self.live.dump_fh then
+	local writer = chdku.lvdump_create(filename,opts)
+	if not writer then
 		return false, 'failed to open dumpfile'
 	end
-
-	-- used to write the size field of each frame
-	self.live.dump_sz_buf = lbuf.new(4)
-
-	-- header (magic, size of following data, version major, version minor)
-	-- TODO this is ugly
-	self.live.dump_fh:write('chlv') -- magic
-	self.live.dump_sz_buf:set_u32(0,8) -- header size (version major, minor)
-	self.live.dump_sz_buf:fwrite(self.live.dump_fh)
-	self.live.dump_sz_buf:set_u32(0,1) -- version major
-	self.live.dump_sz_buf:fwrite(self.live.dump_fh)
-	self.live.dump_sz_buf:set_u32(0,0) -- version minor
-	self.live.dump_sz_buf:fwrite(self.live.dump_fh)
-
-	self.live.dump_size = 16;
-
+	self.live.dump_writer = writer
+	self.live.dump_size = writer.size
 	self.live.dump_fn = filename
 	return true
 end
 
 function con_methods:live_dump_frame()
-	if not self.live.dump_fh then
+	if not self.live.dump_writer then
 		return false,'not initialized'
 	end
 	if not self.live._frame then
 		return false,'no frame'
 	end
 
-	self.live.dump_sz_buf:set_u32(0,self.live._frame:len())
-	self.live.dump_sz_buf:fwrite(self.live.dump_fh)
-	self.live._frame:fwrite(self.live.dump_fh)
-	self.live.dump_size = self.live.dump_size + self.live._frame:len() + 4
+	self.live.dump_writer:write(self.live._frame,self.live.frame_time)
+	self.live.dump_size = self.live.dump_writer.size
 	return true
 end
 
 -- TODO should ensure this is automatically called when connection is closed, or re-connected
 function con_methods:live_dump_end()
-	if self.live.dump_fh then
-		self.live.dump_fh:close()
-		self.live.dump_fh=nil
+	if self.live.dump_writer then
+		self.live.dump_writer:close()
+		self.live.dump_size = self.live.dump_writer.size
+		self.live.dump_writer=nil
 	end
 end
 
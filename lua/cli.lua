@@ -424,6 +424,32 @@ end
 --[[
 process options common to shoot and remoteshoot
 ]]
+--[[
+convert a subject distance string like 2m, 500mm to mm
+returns mm or false,error
+]]
+function cli.parse_sd(val)
+	local sd,units=string.match(val,'(%d+)(%a*)')
+
+	local convert={
+		mm=1,
+		cm=100,
+		m=1000,
+		ft=304.8,
+		['in']=25.4,
+	}
+	if not sd then
+		return false,string.format('invalid sd %s',tostring(val))
+	end
+	if units == '' then
+		units = 'm'
+	end
+	if not convert[units] then
+		return false,string.format('invalid sd units %s',tostring(units))
+	end
+	return util.round(sd*convert[units])
+end
+
 function cli:get_shoot_common_opts(args)
 	if not con:is_connected() then
 		return false, 'not connected'
@@ -503,22 +529,11 @@ function cli:get_shoot_common_opts(args)
 		opts.nd = val
 	end
 	if args.sd then
-		local sd,units=string.match(args.sd,'(%d+)(%a*)')
-
-		local convert={
-			mm=1,
-			cm=100,
-			m=1000,
-			ft=304.8,
-			['in']=25.4,
-		}
-		if units == '' then
-			units = 'm'
+		local sd,err=cli.parse_sd(args.sd)
+		if not sd then
+			return false,err
 		end
-		if not convert[units] then
-			return false,string.format('invalid sd units %s',tostring(units))
-		end
-		opts.sd = util.round(sd*convert[units])
+		opts.sd = sd
 	end
 	if args.sdmode then
 		if not args.sd then
@@ -685,9 +700,103 @@ function cli.get_download_overwrite_opt(val)
 		errlib.throw{etype='bad_arg',msg='unrecognized overwrite option '..tostring(val)}
 	end
 end
+local livestack=require'livestack'
+--[[
+create a live stack from remoteshoot / rsint stacking options, or nil if not requested
+]]
+function cli.get_rs_stack(args)
+	if not args.stack then
+		if args.stackprev or args.stackdark or args.stackonly or args.stackfloat or args.stackn or args.stackreg then
+			util.warnf('stack options without -stack ignored\n')
+		end
+		return
+	end
+	if not args.dng then
+		util.warnf('stack without dng ignored\n')
+		return
+	end
+	local dst
+	if type(args.stack) == 'string' then
+		dst = args.stack
+	end
+	if args.stackreg and args.stackreg ~= true and args.stackreg ~= 'similarity' and args.stackreg ~= 'affine' then
+		errlib.throw{etype='bad_arg',msg='invalid stackreg '..tostring(args.stackreg)}
+	end
+	local preview_every
+	if args.stackn then
+		preview_every = tonumber(args.stackn)
+		if not preview_every or preview_every < 1 then
+			errlib.throw{etype='bad_arg',msg='invalid stackn '..tostring(args.stackn)}
+		end
+	end
+	return livestack.new{
+		dst=dst,
+		float=args.stackfloat,
+		dark=args.stackdark or nil,
+		preview=args.stackprev or nil,
+		preview_every=preview_every,
+		register=args.stackreg,
+	}
+end
+
+local framegate=require'framegate'
+--[[
+create a frame quality gate from remoteshoot / rsint gate options, or nil if not requested
+]]
+function cli.get_rs_gate(args)
+	if not args.gate then
+		if args.gatelog or args.gatebg or args.gatestars or args.gatefwhm or args.gateecc or args.gaten then
+			util.warnf('gate options without -gate ignored\n')
+		end
+		return
+	end
+	if not args.dng then
+		util.warnf('gate without dng ignored\n')
+		return
+	end
+	local action
+	if type(args.gate) == 'string' then
+		action = args.gate
+	end
+	local opts={
+		action=action,
+		log=args.gatelog or nil,
+	}
+	for _,v in ipairs{{'gatebg','max_bg'},{'gatestars','min_stars'},{'gatefwhm','max_fwhm'},{'gateecc','max_ecc'},{'gaten','window'}} do
+		local arg,opt=v[1],v[2]
+		if args[arg] then
+			opts[opt] = tonumber(args[arg])
+			if not opts[opt] or opts[opt] < 0 then
+				errlib.throw{etype='bad_arg',msg='invalid '..arg..' '..tostring(args[arg])}
+			end
+		end
+	end
+	return framegate.new(opts)
+end
+
+--[[
+return the DNG thumbnail width from remoteshoot / rsint -thumbw, or nil if not requested
+the upper limit is the active area width, which is only known once the DNG header is received
+]]
+function cli.get_rs_thumb_width(args)
+	if not args.thumbw then
+		return
+	end
+	if not args.dng then
+		util.warnf('thumbw without dng ignored\n')
+		return
+	end
+	local w=tonumber(args.thumbw)
+	if not w or w < 2 or w ~= math.floor(w) then
+		errlib.throw{etype='bad_arg',msg='invalid thumbw '..tostring(args.thumbw)}
+	end
+	return w
+end
+
 -- TODO should have a system to split up command code
 local rsint=require'rsint'
 rsint.register_rlib()
+local autofocus=require'autofocus'
 
 cli:add_commands{
 	{
@@ -1874,6 +1983,9 @@ Standard string substitutions
 			nopal=false,
 			quiet=false,
 			pbm=false,
+			pump=false,
+			compress=false,
+			keyframes=30,
 		}),
 		help_detail=[[
  file:
@@ -1886,6 +1998,11 @@ Standard string substitutions
    -nobmo     don't get D6 ui overlay opacity data
    -nopal     don't get palette for ui overlay
    -quiet     don't print progress
+   -pump      fetch frames in a background thread, so writing overlaps the transfer
+              frames are fetched at most every -wait ms, and the latest is written
+   -compress  compress frames
+   -keyframes=<N> with -compress, maximum frames between frames compressed independently
+              of the previous frame, default 30
 ]],
 		func=function(self,args)
 			local dumpfile=args[1]
@@ -1915,15 +2032,33 @@ Standard string substitutions
 			if not con:live_is_api_compatible() then
 				return false,'incompatible api'
 			end
-			status, err = con:live_dump_start(dumpfile)
+			status, err = con:live_dump_start(dumpfile,{
+				compress=args.compress,
+				keyframe_interval=tonumber(args.keyframes),
+			})
 			if not status then
 				return false,err
 			end
+			if args.pump then
+				status, err = con:live_pump_start(what,{interval=args.wait})
+				if not status then
+					con:live_dump_end()
+					return false,err
+				end
+			end
 			for i=1,args.count do
 				if not args.quiet then
 					printf('grabbing frame %d\n',i)
 				end
-				status, err = con:live_get_frame(what)
+				if args.pump then
+					-- wait for the next frame, generous to allow for slow connections
+					status, err = pcall(con.live_pump_frame,con,5000+(args.wait or 0))
+					if status and not err then
+						status, err = false, 'timeout waiting for frame'
+					end
+				else
+					status, err = con:live_get_frame(what)
+				end
 				if not status then
 					break
 				end
@@ -1931,10 +2066,13 @@ Standard string substitutions
 				if not status then
 					break
 				end
-				if args.wait and i < args.count then
+				if not args.pump and args.wait and i < args.count then
 					sys.sleep(args.wait)
 				end
 			end
+			if args.pump then
+				con:live_pump_stop()
+			end
 			con:live_dump_end()
 			if status then
 				err = string.format('%d bytes recorded to %s\n',tonumber(con.live.dump_size),tostring(con.live.dump_fn))
@@ -1942,6 +2080,399 @@ Standard string substitutions
 			return status,err
 		end,
 	},
+	{
+		names={'lvdumpconv'},
+		help='convert lvdump files to the current format',
+		arghelp="[options] <infile> <outfile>",
+		args=argparser.create({
+			compress=false,
+			keyframes=30,
+		}),
+		help_detail=[[
+ infile:
+   lvdump file of any version
+ outfile:
+   output lvdump file, with a seek index. Frames converted from version 1 files have no timestamps
+ options:
+   -compress  compress frames
+   -keyframes=<N> with -compress, maximum frames between frames compressed independently
+              of the previous frame, default 30
+]],
+		func=function(self,args)
+			if not args[1] or not args[2] then
+				return false,'expected infile and outfile'
+			end
+			local status,err = chdku.lvdump_convert(args[1],args[2],{
+				compress=args.compress,
+				keyframe_interval=tonumber(args.keyframes),
+			})
+			if not status then
+				return false,err
+			end
+			return true,string.format('%d bytes written to %s\n',lfs.attributes(args[2],'size'),args[2])
+		end,
+	},
+	{
+		names={'lvfocus'},
+		help='print live view focus measurements',
+		arghelp="[options]",
+		args=argparser.create({
+			count=false,
+			wait=100,
+			roi=false,
+			radius=8,
+			pump=false,
+			infile=false,
+			csv=false,
+			quiet=false,
+		}),
+		help_detail=[[
+ options:
+   -count=<N> number of frames to measure, default 10, or all frames with -infile
+   -wait=<N>  wait N ms between frames
+   -roi=<x>,<y>,<w>,<h> region to measure in viewport pixels from the top left, default whole viewport
+   -radius=<N> radius around the brightest pixel used to measure the star, default 8
+   -pump      fetch frames in a background thread
+   -infile=<file> measure frames from an lvdump file instead of the camera
+   -csv=<file> write frame,time,lap_var,peak,hfr,flux,star_x,star_y for each frame to <file>
+   -quiet     only print the summary
+
+ Measures the viewport luma of each live view frame without transferring raws
+   lap_var: variance of the laplacian, larger is sharper
+   peak: brightest pixel value, 255 is saturated
+   hfr: half flux radius of the brightest star in viewport pixels, smaller is sharper
+ The frames with the best lap_var and hfr are reported at the end
+]],
+		func=function(self,args)
+			local mopts={radius=tonumber(args.radius)}
+			if args.roi then
+				local x,y,w,h=string.match(args.roi,'^(%d+),(%d+),(%d+),(%d+)$')
+				if not x then
+					return false,'invalid roi '..tostring(args.roi)
+				end
+				mopts.x,mopts.y,mopts.width,mopts.height=tonumber(x),tonumber(y),tonumber(w),tonumber(h)
+			end
+			local wait=tonumber(args.wait)
+			local count=tonumber(args.count)
+			-- frame source, returns frame,time or nil when done
+			local get_frame,done
+			if args.infile then
+				local reader,err=chdku.lvdump_open(args.infile)
+				if not reader then
+					return false,err
+				end
+				count=math.min(count or reader:count(),reader:count())
+				local i=0
+				get_frame=function()
+					i=i+1
+					return reader:read(i)
+				end
+				done=function()
+					reader:close()
+				end
+			else
+				if not con:live_is_api_compatible() then
+					return false,'incompatible api'
+				end
+				count=count or 10
+				-- viewport only
+				local what=1
+				if args.pump then
+					local status,err=con:live_pump_start(what,{interval=wait})
+					if not status then
+						return false,err
+					end
+				end
+				local first=true
+				get_frame=function()
+					if args.pump then
+						if not con:live_pump_frame(5000+(wait or 0)) then
+							errlib.throw{etype='timeout',msg='timeout waiting for frame'}
+						end
+					else
+						if not first and wait then
+							sys.sleep(wait)
+						end
+						con:live_get_frame(what)
+					end
+					first=false
+					return con.live._frame,con.live.frame_time
+				end
+				done=function()
+					if args.pump then
+						con:live_pump_stop()
+					end
+				end
+			end
+			local fh
+			if args.csv then
+				fh=fsutil.open_e(args.csv,'wb')
+				fh:write('frame,time,lap_var,peak,hfr,flux,star_x,star_y\n')
+			end
+			local best_lap,best_hfr
+			local status,err=pcall(function()
+				for i=1,count do
+					local frame,time=get_frame()
+					local r=liveimg.focus_metric(frame,mopts)
+					if r then
+						if not args.quiet then
+							printf('%4d lap_var %9.2f peak %3d hfr %5.2f flux %8.0f star %6.1f,%6.1f%s\n',
+								i,r.lap_var,r.peak,r.hfr,r.flux,r.star_x,r.star_y,r.saturated and ' saturated' or '')
+						end
+						if fh then
+							fh:write(string.format('%d,%.6f,%.3f,%d,%.3f,%.0f,%.2f,%.2f\n',
+								i,time or 0,r.lap_var,r.peak,r.hfr,r.flux,r.star_x,r.star_y))
+						end
+						if not best_lap or r.lap_var > best_lap.lap_var then
+							best_lap=r
+							best_lap.frame=i
+						end
+						if r.hfr > 0 and (not best_hfr or r.hfr < best_hfr.hfr) then
+							best_hfr=r
+							best_hfr.frame=i
+						end
+					elseif not args.quiet then
+						printf('%4d no viewport\n',i)
+					end
+				end
+			end)
+			done()
+			if fh then
+				fh:close()
+			end
+			if not status then
+				return false,err
+			end
+			if not best_lap then
+				return false,'no viewport frames'
+			end
+			local msg=string.format('best lap_var %.2f frame %d',best_lap.lap_var,best_lap.frame)
+			if best_hfr then
+				msg=msg..string.format(', best hfr %.2f frame %d',best_hfr.hfr,best_hfr.frame)
+			end
+			return true,msg
+		end,
+	},
+	{
+		names={'lvbench'},
+		help='benchmark live view host processing',
+		arghelp="[options] [file]",
+		args=argparser.create({
+			ref=false,
+			count=false,
+			reps=5,
+			skip=false,
+			focus=false,
+			mkref=false,
+		}),
+		help_detail=[[
+ file:
+   lvdump file to replay. If not given, generated reference frames are used
+ options:
+   -ref=<name> reference frames to use, yuv8, yuv8b, yuv8c or all. default all
+   -count=<N>  use at most N frames
+   -reps=<N>   passes over all frames, after an untimed warm up pass. default 5
+   -skip       convert with 1:2 pixel aspect ratio, as the gui does for most cameras
+   -focus      include the focus metric
+   -mkref=<dir> write the reference frames to lvdump files in <dir> and exit
+
+ Replays frames through the host live view pipeline as fast as possible, without a camera
+ Reports ns per frame and frames per second for each stage
+   read:   read from the file, decompressing if needed. Files only
+   parse:  live wrapper and frame buffer descriptions
+   vp:     viewport to image, as the gui
+   bm:     bitmap to image, as the gui
+   packed: viewport with bitmap overlay, as lvdumpimg -overlay
+   focus:  focus metric of the whole viewport, with -focus
+ Reference frames are generated by a fixed procedure for each viewport type, so results
+ from different versions and machines are comparable
+]],
+		func=function(self,args)
+			local lvbench=require'lvbench'
+			local names=lvbench.ref_names
+			if args.ref and args.ref ~= 'all' then
+				if not lvbench.refs[args.ref] then
+					return false,'unknown reference '..tostring(args.ref)
+				end
+				names={args.ref}
+			end
+			if args.mkref then
+				local files=lvbench.write_refs(args.mkref,names)
+				return true,'wrote '..table.concat(files,', ')
+			end
+			local opts={
+				count=tonumber(args.count),
+				reps=tonumber(args.reps),
+				skip=args.skip,
+				focus=args.focus,
+			}
+			if args[1] then
+				opts.file=args[1]
+				lvbench.run(opts)
+				return true
+			end
+			for _,name in ipairs(names) do
+				opts.ref=name
+				lvbench.run(opts)
+			end
+			return true
+		end,
+	},
+	{
+		names={'lvserve'},
+		help='serve live view frames to local clients',
+		arghelp="[options]",
+		args=argparser.create({
+			port=8240,
+			host='127.0.0.1',
+			unix=false,
+			format='lvdump',
+			skip=false,
+			overlay=false,
+			count=false,
+			wait=false,
+			fps=10,
+			pump=false,
+			infile=false,
+			quiet=false,
+		}),
+		help_detail=[[
+ options:
+   -port=<N>    TCP port to listen on, default 8240
+   -host=<addr> address to listen on, default 127.0.0.1 so only this machine can connect
+   -unix=<path> listen on a unix socket at <path> instead of TCP
+   -format=<fmt> stream format, default lvdump
+     lvdump:    lvdump v2 stream of raw frames, readable as an lvdump file
+     ppm:       binary PPM image of the viewport per frame
+     multipart: HTTP multipart/x-mixed-replace stream of PPM images
+   -skip        with ppm or multipart, 2 pixels per U Y V Y Y Y, for cameras with 2:1 pixel aspect ratio
+   -overlay     with ppm or multipart, blend the ui overlay over the viewport
+   -count=<N>   stop after N frames, default run until chdkptp exits
+   -wait=<N>    wait N ms between frames
+   -fps=<N>     specify wait as a frame rate, default 10
+   -pump        fetch frames in a background thread
+   -infile=<file> replay frames from an lvdump file instead of the camera, repeating until -count
+   -quiet       don't print status
+
+ Each frame is fetched and encoded once and shared by all clients, up to 16
+ Clients that can't keep up skip to the latest frame, without slowing the camera or other clients
+ Frames are not encoded while no clients are connected
+]],
+		func=function(self,args)
+			local wait
+			if args.wait then
+				wait = tonumber(args.wait)
+			elseif args.fps then
+				wait = 1000/tonumber(args.fps)
+			end
+			local count = tonumber(args.count)
+			local stream,err = chdku.lvstream_create(args.format,{skip=args.skip,bitmap_overlay=args.overlay})
+			if not stream then
+				return false,err
+			end
+			-- frame source, returns frame,time
+			local get_frame,done
+			if args.infile then
+				local reader
+				reader,err = chdku.lvdump_open(args.infile)
+				if not reader then
+					return false,err
+				end
+				if reader:count() == 0 then
+					reader:close()
+					return false,'no frames in '..args.infile
+				end
+				local lb=lbuf.new(0)
+				local i=0
+				get_frame=function()
+					i=(i % reader:count()) + 1
+					-- replayed frames are served as current, like a live camera
+					return reader:read(i,lb),ustime.new():float()
+				end
+				done=function()
+					reader:close()
+				end
+			else
+				if not con:live_is_api_compatible() then
+					return false,'incompatible api'
+				end
+				local what = 1
+				if args.format == 'lvdump' or args.overlay then
+					-- viewport, bitmap, palette and opacity
+					what = 29
+				end
+				if args.pump then
+					local status
+					status,err = con:live_pump_start(what,{interval=wait})
+					if not status then
+						return false,err
+					end
+				end
+				get_frame=function()
+					if args.pump then
+						if not con:live_pump_frame(5000+(wait or 0)) then
+							errlib.throw{etype='timeout',msg='timeout waiting for frame'}
+						end
+					else
+						con:live_get_frame(what)
+					end
+					return con.live._frame,con.live.frame_time
+				end
+				done=function()
+					if args.pump then
+						con:live_pump_stop()
+					end
+				end
+			end
+			local server
+			server,err = lvserve.new{
+				port=tonumber(args.port),
+				host=args.host,
+				path=args.unix or nil,
+				header=stream.header,
+			}
+			if not server then
+				done()
+				return false,err
+			end
+			if not args.quiet then
+				if args.unix then
+					printf('serving %s on %s\n',args.format,args.unix)
+				else
+					printf('serving %s on %s:%d\n',args.format,args.host,server:stats().port)
+				end
+			end
+			local t_status=ticktime.get()
+			local status
+			status,err=pcall(function()
+				local i=0
+				while not count or i < count do
+					i=i+1
+					local t_frame_start=ticktime.get()
+					local frame,time=get_frame()
+					if server:clients() > 0 then
+						server:publish(stream:encode(frame,time))
+					end
+					if not args.quiet and ticktime.elapsed(t_status) >= 10 then
+						local s=server:stats()
+						printf('frames:%d clients:%d sent:%d dropped:%d bytes:%d\n',i,s.clients,s.sent,s.dropped,s.bytes)
+						t_status=ticktime.get()
+					end
+					local etms=ticktime.elapsedms(t_frame_start)
+					if wait and (not count or i < count) and etms < wait then
+						sys.sleep(wait - etms)
+					end
+				end
+			end)
+			done()
+			local s=server:stats()
+			server:close()
+			if not status then
+				return false,err
+			end
+			return true,string.format('published:%d sent:%d dropped:%d connections:%d',s.published,s.sent,s.dropped,s.connections)
+		end,
+	},
 	{
 		names={'lvdumpimg'},
 		help='dump camera display frames to netpbm images',
@@ -1955,6 +2486,7 @@ Standard string substitutions
 			bm=false,
 			pipevp=false,
 			pipebm=false,
+			overlay=false,
 			nopal=false,
 			nobmo=false,
 			quiet=false,
@@ -1973,6 +2505,7 @@ Standard string substitutions
    -pipebm[=oneproc]
       treat vp or bm 'dest' as a command to pipe to. With =oneproc a single process
       receives all frames. Otherwise, a new process is spawned for each frame
+   -overlay   blend the ui overlay onto the viewfinder image
    -nopal     don't get palette for ui overlay
    -nobmo     don't get D6 ui overlay opacity data
    -quiet     don't print progress
@@ -1992,7 +2525,10 @@ Standard string substitutions
 			if args.vp then
 				what = 1
 			end
-			if args.bm then
+			if args.overlay and not args.vp then
+				return false,'overlay requires vp'
+			end
+			if args.bm or args.overlay then
 				what = what + 4
 				if not args.nopal then
 					what = what + 8
@@ -2038,6 +2574,7 @@ Standard string substitutions
 			con:set_subst_con_state(subst.state)
 
 			local vp_opts = cli.init_lvdumpimg_file_opts('vp',args,subst)
+			vp_opts.overlay = args.overlay
 			local bm_opts = cli.init_lvdumpimg_file_opts('bm',args,subst)
 
 			local t0=ticktime.get()
@@ -2361,6 +2898,28 @@ Standard string substitutions
 			nosubst=false,
 			seq=false,
 			script=false,
+			stack=false,
+			stackprev=false,
+			stackn=false,
+			stackdark=false,
+			stackfloat=false,
+			stackreg=false,
+			stackonly=false,
+			gate=false,
+			gatelog=false,
+			gatebg=false,
+			gatestars=false,
+			gatefwhm=false,
+			gateecc=false,
+			gaten=false,
+			pixmap=false,
+			pixmapop=false,
+			thumbw=false,
+			lj92=false,
+			fits=false,
+			fitsbits=false,
+			fitsblack=false,
+			fitsdng=false,
 		},
 		help_detail=[[
  [dest] path/name specification for saved files
@@ -2397,12 +2956,42 @@ Standard string substitutions
    -shots=<n>   shoot n shots
    -int=<n.m>   interval for multiple shots, in seconds
    -badpix[=n]  interpolate over pixels with value <= n, default 0, (dng only)
+   -pixmap=<file> interpolate over pixels listed in pixel map <file> instead of -badpix
+                see dngpixmap (dng only)
+   -pixmapop    add -pixmap pixels as a DNG FixBadPixelsList opcode instead of modifying data
+   -thumbw=<n>  width of DNG embedded preview, height follows the active area aspect ratio
+                rounded down to even, at most the active area width
+                default is the camera setting, usually 128 (dng only)
+   -lj92[=n]    write DNG raw data lossless JPEG compressed, in n x n tiles, default 256
+                (dng only)
+   -fits[=cfa|rgb] write FITS files instead of DNG, with raw CFA data or demosaiced RGB planes
+                default cfa (dng only)
+   -fitsbits=<n> FITS BITPIX, 16 or 32, default 16. 32 is cfa only
+   -fitsblack   subtract the black level from FITS cfa data
+   -fitsdng     write DNG files as well as FITS
    -shotwait=<n> wait n ms for shot to complete, default 20000 or 2*tv+10000 if -tv given
    -filedummy   write dummy IMG_nnnn.JPG (or .CR2) to avoid play / shutdown crash on some
                 cams. -jpgdummy also accepted for backward compatibility
    -nosubst     don't do string substitution on file names
    -seq=<n>     initial value for shotseq subst string, default cli_shotseq
    -script=<filename> use local file <filename> for shooting script
+   -stack[=file] add DNG frames to a live stack, saved as a 16 bit DNG when done
+                default stack.dng (dng only)
+   -stackprev=<file> write a PPM preview of the stack to <file>
+   -stackn=<n>  update stack preview every n frames, default 1
+   -stackdark=<file> subtract dark frame DNG <file> from each stacked frame
+   -stackfloat  use floating point sums for the stack
+   -stackreg[=affine] align frames to the first using stars before stacking
+                frames where stars can't be matched are not stacked
+   -stackonly   only stack frames, don't save individual DNGs
+   -gate[=reject] check DNG frames against the recent frames before saving or stacking
+                failed frames are saved in a quarantine subdirectory, or not saved with reject
+   -gatelog=<file> append frame metrics and gate results to CSV <file>
+   -gatebg=<r>  maximum background, relative to recent frames, default 1.5
+   -gatestars=<r> minimum star count, relative to recent frames, default 0.5
+   -gatefwhm=<r> maximum median star FWHM, relative to recent frames, default 1.5
+   -gateecc=<n> maximum increase in median star eccentricity, default 0.15
+   -gaten=<n>   number of recent accepted frames used for comparison, default 10
 
 Substitutions
 ${serial}         camera serial number, or empty if not available
@@ -2478,6 +3067,18 @@ Standard string substitutions
 			if args.badpix and not args.dng then
 				util.warnf('badpix without dng ignored\n')
 			end
+			if args.pixmap and not args.dng then
+				util.warnf('pixmap without dng ignored\n')
+			end
+			if args.lj92 and not args.dng then
+				util.warnf('lj92 without dng ignored\n')
+			end
+			if args.fits and not args.dng then
+				util.warnf('fits without dng ignored\n')
+			end
+			if args.pixmapop and not args.pixmap then
+				return false,'pixmapop requires pixmap'
+			end
 
 			if args.s or args.c then
 				if args.dng or args.raw then
@@ -2512,6 +3113,9 @@ Standard string substitutions
 					opts.shots = 1
 				end
 			end
+			local stack=cli.get_rs_stack(args)
+			local gate=cli.get_rs_gate(args)
+			local thumb_width=cli.get_rs_thumb_width(args)
 			local shootscript
 			if args.script then
 				shootscript=fsutil.readfile_e(args.script,'b')
@@ -2550,6 +3154,17 @@ Standard string substitutions
 				badpix=args.badpix,
 				lstart=opts.lstart,
 				lcount=opts.lcount,
+				stack=stack,
+				stack_only=args.stackonly,
+				pixmap=args.pixmap or nil,
+				pixmap_opcode=args.pixmapop,
+				thumb_width=thumb_width,
+				lj92=args.lj92,
+				fits=args.fits,
+				fits_bits=args.fitsbits,
+				fits_black=args.fitsblack,
+				fits_dng=args.fitsdng,
+				gate=gate,
 			}
 			rcopts.do_subst=do_subst
 
@@ -2619,6 +3234,18 @@ Standard string substitutions
 			end
 			cli.dbgmsg("script wait time %.4f\n",ticktime.elapsed(t0))
 
+			if stack and stack:frames() > 0 then
+				local sstatus,serr = stack:save()
+				if sstatus then
+					printf('saved stack of %d frames %s\n',stack:frames(),stack.opts.dst)
+				else
+					warnf('failed to save stack %s\n',tostring(serr))
+				end
+			end
+			if gate then
+				printf('%d of %d frames failed quality gate\n',gate.rejected,gate.frames)
+			end
+
 			local ustatus, uerr = con:execwait_pcall('rs_cleanup('..serialize(rs_init_vals)..')',{libs={'rs_shoot_cleanup'}}) -- try to uninit
 			-- if uninit failed, combine with previous status
 			if not ustatus then
@@ -2666,6 +3293,28 @@ Standard string substitutions
 			jpgdummy=false,
 			nosubst=false,
 			seq=false,
+			stack=false,
+			stackprev=false,
+			stackn=false,
+			stackdark=false,
+			stackfloat=false,
+			stackreg=false,
+			stackonly=false,
+			gate=false,
+			gatelog=false,
+			gatebg=false,
+			gatestars=false,
+			gatefwhm=false,
+			gateecc=false,
+			gaten=false,
+			pixmap=false,
+			pixmapop=false,
+			thumbw=false,
+			lj92=false,
+			fits=false,
+			fitsbits=false,
+			fitsblack=false,
+			fitsdng=false,
 		},
 		help_detail=[[
  [dest] path/name specification for saved files
@@ -2698,6 +3347,19 @@ Standard string substitutions
    -s=<start>   first line of for subimage raw
    -c=<count>   number of lines for subimage
    -badpix[=n]  interpolate over pixels with value <= n, default 0, (dng only)
+   -pixmap=<file> interpolate over pixels listed in pixel map <file> instead of -badpix
+                see dngpixmap (dng only)
+   -pixmapop    add -pixmap pixels as a DNG FixBadPixelsList opcode instead of modifying data
+   -thumbw=<n>  width of DNG embedded preview, height follows the active area aspect ratio
+                rounded down to even, at most the active area width
+                default is the camera setting, usually 128 (dng only)
+   -lj92[=n]    write DNG raw data lossless JPEG compressed, in n x n tiles, default 256
+                (dng only)
+   -fits[=cfa|rgb] write FITS files instead of DNG, with raw CFA data or demosaiced RGB planes
+                default cfa (dng only)
+   -fitsbits=<n> FITS BITPIX, 16 or 32, default 16. 32 is cfa only
+   -fitsblack   subtract the black level from FITS cfa data
+   -fitsdng     write DNG files as well as FITS
    -cmdwait=n   wait n seconds for command, default 60
    -cont        use continuous mode
    -shotwait=<n> wait n ms for shot to complete, default 20000 or 2*tv+10000 if -tv given
@@ -2706,6 +3368,23 @@ Standard string substitutions
                 cams. -jpgdummy also accepted for backward compatibility
    -nosubst     don't do string substitution on file names
    -seq=<n>     initial value for shotseq subst string, default cli_shotseq
+   -stack[=file] add DNG frames to a live stack, saved as a 16 bit DNG when done
+                default stack.dng (dng only)
+   -stackprev=<file> write a PPM preview of the stack to <file>
+   -stackn=<n>  update stack preview every n frames, default 1
+   -stackdark=<file> subtract dark frame DNG <file> from each stacked frame
+   -stackfloat  use floating point sums for the stack
+   -stackreg[=affine] align frames to the first using stars before stacking
+                frames where stars can't be matched are not stacked
+   -stackonly   only stack frames, don't save individual DNGs
+   -gate[=reject] check DNG frames against the recent frames before saving or stacking
+                failed frames are saved in a quarantine subdirectory, or not saved with reject
+   -gatelog=<file> append frame metrics and gate results to CSV <file>
+   -gatebg=<r>  maximum background, relative to recent frames, default 1.5
+   -gatestars=<r> minimum star count, relative to recent frames, default 0.5
+   -gatefwhm=<r> maximum median star FWHM, relative to recent frames, default 1.5
+   -gateecc=<n> maximum increase in median star eccentricity, default 0.15
+   -gaten=<n>   number of recent accepted frames used for comparison, default 10
 
  The following commands are available at the rsint> prompt
   s    shoot
@@ -2714,6 +3393,8 @@ Standard string substitutions
   exec <lua code>   execute code on the camera
   pcall <lua code>  execute code on the camera in pcall
   path[=path] change download destination, equivalent to [local] in the initial command
+  reject      remove the most recent frame from the live stack
+  stacksave   save the live stack now, it is also saved when rsint ends
 
  In -cont mode, the following restrictions apply:
  The camera must be set to continuous mode in the Canon UI
@@ -2738,6 +3419,139 @@ Standard string substitutions
 			return rsint.run(args)
 		end,
 	},
+	{
+		names={'rsfocus'},
+		help='focus on stars using remote capture sub-images',
+		arghelp="[options]",
+		args=cli.argparser.create{
+			u='s',
+			tv=false,
+			sv=false,
+			svm=false,
+			av=false,
+			isomode=false,
+			nd=false,
+			sdmode=false,
+			from=false,
+			to=false,
+			n=9,
+			star=false,
+			s=false,
+			c=64,
+			radius=32,
+			sigma=false,
+			fit='v',
+			settle=100,
+			shotwait=false,
+			noverify=false,
+			csv=false,
+		},
+		help_detail=[[
+ options:
+   -u, -tv, -sv, -svm, -av, -isomode, -nd, -sdmode  exposure, as for remoteshoot
+   -from=<v>[units] first focus position, units as for remoteshoot -sd, default m
+   -to=<v>[units]   last focus position
+   -n=<n>       number of positions to measure, default 9
+   -star=<x>,<y> raw coordinates of the star to measure, the sub-image is centered on y
+   -s=<start>   first line of sub-image, when -star is not given the median HFR of all stars is used
+   -c=<count>   number of lines for sub-image, default 64
+   -radius=<n>  maximum distance of the star from -star, default 32
+   -sigma=<n>   star detection threshold, default 5
+   -fit=<v|parabola> curve to fit to the measurements, default v
+   -settle=<ms> wait after setting focus before shooting, default 100
+   -shotwait=<n> wait n ms for each shot, default 20000 or 2*tv+10000 if -tv given
+   -noverify    don't shoot again at the final position
+   -csv=<file>  write position,hfr,stars for each measurement to <file>
+
+ Shoots a raw sub-image at each focus position, measures the star half flux radius,
+ fits a V curve (lines either side of the minimum) or parabola and sets focus to the minimum.
+ If the fit fails, the best measured position is used.
+ The camera must be in rec mode and support remote capture of raw and DNG header.
+ Focus is set with set_focus while half press is held, the port must support focus override
+]],
+		func=function(self,args)
+			if not args.from or not args.to then
+				return false,'from and to required'
+			end
+			local from,err=cli.parse_sd(args.from)
+			if not from then
+				return false,err
+			end
+			local to
+			to,err=cli.parse_sd(args.to)
+			if not to then
+				return false,err
+			end
+			-- initial focus, also validates sdmode
+			args.sd=args.from
+			local shoot_opts
+			shoot_opts,err = cli:get_shoot_common_opts(args)
+			if not shoot_opts then
+				return false,err
+			end
+			local n=tonumber(args.n)
+			if not n or n < 1 then
+				return false,'invalid n'
+			end
+			local lcount=tonumber(args.c)
+			if not lcount or lcount < 16 then
+				return false,'invalid c'
+			end
+			lcount=lcount + lcount%2
+			local opts={
+				positions=autofocus.positions(from,to,n),
+				lcount=lcount,
+				shoot_opts=shoot_opts,
+				fit=args.fit,
+				settle=tonumber(args.settle),
+				verify=not args.noverify,
+				radius=tonumber(args.radius),
+			}
+			if args.star then
+				local x,y=string.match(args.star,'^(%d+),(%d+)$')
+				if not x then
+					return false,'invalid star '..tostring(args.star)
+				end
+				opts.x=tonumber(x)
+				opts.y=tonumber(y)
+				opts.lstart=math.max(0,opts.y - lcount/2)
+			elseif args.s then
+				opts.lstart=tonumber(args.s)
+				if not opts.lstart then
+					return false,'invalid s'
+				end
+			else
+				return false,'star or s required'
+			end
+			-- even start, so the CFA pattern is unchanged
+			opts.lstart=opts.lstart - opts.lstart%2
+			if args.fit ~= 'v' and args.fit ~= 'parabola' then
+				return false,'invalid fit '..tostring(args.fit)
+			end
+			if args.sigma then
+				opts.star_opts={sigma=tonumber(args.sigma)}
+			end
+			if args.shotwait then
+				opts.shotwait=tonumber(args.shotwait)
+			elseif shoot_opts.tv then
+				opts.shotwait=10000 + 2*exp.tv96_to_shutter(shoot_opts.tv)*1000
+			end
+
+			local r=autofocus.run(opts)
+			if args.csv then
+				local fh=fsutil.open_e(args.csv,'wb')
+				fh:write('position,hfr,stars\n')
+				for _,p in ipairs(r.points) do
+					fh:write(string.format('%d,%.3f,%d\n',p[1],p[2],p[3]))
+				end
+				fh:close()
+			end
+			if r.hfr then
+				return true,string.format('focus %d hfr %.2f',r.best,r.hfr)
+			end
+			return true,string.format('focus %d',r.best)
+		end,
+	},
 	{
 		names={'rec'},
 		help='switch camera to shooting mode',
@@ -20,6 +20,7 @@ this is not a fully featured TIFF/TIFF-EP/DNG reader
 ]]
 local m={}
 local lbu=require'lbufutil'
+local fits=require'fits'
 --[[
 bind the tiff header
 --]]
@@ -55,6 +56,10 @@ m.tags_map = {
 	DateTime					=0x132,
 	Artist						=0x13b,
 
+	TileWidth					=0x142,
+	TileLength					=0x143,
+	TileOffsets					=0x144,
+	TileByteCounts				=0x145,
 	SubIFDs						=0x14a,
 
 	CFARepeatPatternDim			=0x828d,
@@ -103,6 +108,7 @@ m.tags_map = {
 	BaselineNoise				=0xc62b,
 	BaselineSharpness			=0xc62c,
 	LinearResponseLimit			=0xc62e,
+	CameraSerialNumber			=0xc62f,
 	LenseInfo					=0xc630,
 	CalibrationIlluminant1		=0xc65a,
 	CalibrationIlluminant2		=0xc65b,
@@ -362,17 +368,29 @@ local ifd_entry_methods = {
 		return util.hexdump(self:get_byte_str())
 	end
 }
+local ifd_entry_meta = {__index=ifd_entry_methods}
+
+--[[
+make an entry object from values returned by tiffifd find or entry
+]]
+local function make_ifd_entry(lb,tag,type_id,count,valoff,off)
+	return setmetatable({
+		_lb=lb,
+		tag=tag,
+		type_id=type_id,
+		count=count,
+		valoff=valoff,
+		off=off,
+	},ifd_entry_meta)
+end
+
+--[[
+bind entry i of ifd, reading the entry directly from the lbuf
+]]
 function m.bind_ifd_entry(d,ifd,i)
 	local off = ifd.off + 2 + i*12 -- offset + entry count + index*sizeof(entry)
-	local e=lbu.wrap(d._lb)
-	util.extend_table(e,ifd_entry_methods)
-	e.off = off
-	e:bind_seek(off)
-	e:bind_u16('tag')
-	e:bind_u16('type_id')
-	e:bind_u32('count')
-	e:bind_u32('valoff')
-	return e
+	local lb = d._lb
+	return make_ifd_entry(lb,lb:get_u16(off),lb:get_u16(off+2),lb:get_u32(off+4),lb:get_u32(off+8),off)
 end
 
 local ifd_methods = {}
@@ -409,58 +427,185 @@ function ifd_methods.write_image_data(self,dst)
 	end
 end
 
--- ifds
-function m.bind_ifds(d,ifd_off,ifd_list,parent)
-	-- for sub, we may be appending
-	if not ifd_list then
-		ifd_list={}
+--[[
+entries are only created when used, through byname, bytag or entries
+entries of the same ifd are shared between the three tables
+]]
+local function ifd_get_entry(ifd,i,tag,type_id,count,valoff,off)
+	local e = ifd._ecache[i]
+	if not e then
+		if not tag then
+			tag,type_id,count,valoff,off = ifd.dng._tiff:entry(ifd._tiff_index,i)
+		end
+		e = make_ifd_entry(ifd.dng._lb,tag,type_id,count,valoff,off)
+		ifd._ecache[i] = e
+	end
+	return e
+end
+
+local function ifd_find_entry(ifd,tag)
+	local i,tag,type_id,count,valoff,off = ifd.dng._tiff:find(ifd._tiff_index,tag)
+	if i then
+		return ifd_get_entry(ifd,i,tag,type_id,count,valoff,off)
+	end
+end
+
+local byname_meta = {
+	__index=function(t,name)
+		local tag = m.tags_map[name]
+		if not tag then
+			return nil
+		end
+		local e = ifd_find_entry(t._ifd,tag)
+		rawset(t,name,e)
+		return e
+	end,
+}
+
+local bytag_meta = {
+	__index=function(t,tag)
+		if type(tag) ~= 'number' then
+			return nil
+		end
+		local e = ifd_find_entry(t._ifd,tag)
+		rawset(t,tag,e)
+		return e
+	end,
+}
+
+local ifd_meta = {
+	__index=function(ifd,k)
+		if k ~= 'entries' then
+			return nil
+		end
+		local entries = {}
+		for i=0,ifd.n_entries-1 do
+			entries[i+1] = ifd_get_entry(ifd,i)
+		end
+		rawset(ifd,'entries',entries)
+		return entries
+	end,
+}
+
+--[[
+parse the ifd tree of d._lb with tiffifd and create ifd tables
+returns the list of main ifds, sub and exif ifds are in .sub and .exif of their parent
+or false,error if the data is not a valid TIFF
+]]
+function m.bind_ifds(d)
+	local tiff,err=tiffifd.parse(d._lb)
+	if not tiff then
+		return false,err
 	end
-	repeat
-		if ifd_off >= d._lb:len() then
-			error('ifd outside of data')
+	d._tiff = tiff
+	local ifd_list = {}
+	local all = {}
+	for i=0,tiff:ifd_count()-1 do
+		local off,n_entries,kind,parent_index = tiff:ifd(i)
+		local parent = all[parent_index]
+		local list
+		if kind == 'main' then
+			list = ifd_list
+		elseif kind == 'sub' then
+			parent.sub = parent.sub or {}
+			list = parent.sub
+		else
+			parent.exif = parent.exif or {}
+			list = parent.exif
 		end
-		local n_entries = d._lb:get_u16(ifd_off)
 		local ifd = {
 			dng=d, -- DNG object this ifd belongs to
-			index=#ifd_list,
-			off=ifd_off,
+			index=#list,
+			off=off,
 			n_entries=n_entries,
-			entries={},
-			bytag={},
-			byname={},
+			size=n_entries * 12 + 2,
 			parent=parent, -- parent ifd, if any
+			is_exif=(kind == 'exif') or nil,
+			_tiff_index=i,
+			_ecache={},
 		}
-		for i=0, n_entries-1 do
-			local e = m.bind_ifd_entry(d,ifd,i)
-			table.insert(ifd.entries,e)
-			if e.tag == m.tags_map.SubIFDs then
-				ifd.sub={}
-				-- sub ifds could point to a list of offsets, which could in turn each be chained (???)
-				for i=1,e.count do
-					m.bind_ifds(d,e.valoff+(i-1)*e:type().elsize,ifd.sub,ifd)
-				end
-			elseif e.tag == m.tags_map.ExifIFD then
-				ifd.exif={ }
-				-- assume there is only one
-				if e.count == 1 then
-					m.bind_ifds(d,e.valoff,ifd.exif,ifd)
-					ifd.exif[1].is_exif=true
-				else
-					util.warnf('multiple exif IFDs per IFD not supported')
-				end
+		ifd.byname=setmetatable({_ifd=ifd},byname_meta)
+		ifd.bytag=setmetatable({_ifd=ifd},bytag_meta)
+		util.extend_table(ifd,ifd_methods)
+		setmetatable(ifd,ifd_meta)
+		table.insert(list,ifd)
+		all[i] = ifd
+	end
+	return ifd_list
+end
+
+--[[
+return a string containing a copy of ifd with entries added or replaced, followed by
+any values that don't fit inline, suitable for writing at offset in the file
+entries: array of {tag=number, type_id=number, count=number, data=string}
+opts {
+	remove=array -- tags to leave out
+	copy=bool -- copy unchanged out of line values, for when the data they are in is not kept
+}
+unless copy is set, unchanged out of line values are left in place and referenced by their original offset
+]]
+function m.build_ifd(ifd,entries,offset,opts)
+	opts=opts or {}
+	local lb=ifd.dng._lb
+	local list={}
+	local replaced={}
+	for _,tag in ipairs(opts.remove or {}) do
+		replaced[tag]=true
+	end
+	for _,e in ipairs(entries) do
+		replaced[e.tag]=true
+		table.insert(list,e)
+	end
+	for _,e in ipairs(ifd.entries) do
+		if not replaced[e.tag] then
+			if opts.copy and not e:is_inline() then
+				table.insert(list,{tag=e.tag,type_id=e.type_id,count=e.count,data=e:get_byte_str()})
+			else
+				-- keep original value or offset bytes
+				table.insert(list,{tag=e.tag,type_id=e.type_id,count=e.count,valoff=lb:string(e.off+9,e.off+12)})
 			end
-			ifd.bytag[e.tag] = e
-			-- avoid including unk_xxx names
-			if m.tags[e.tag] then
-				ifd.byname[e:tagname()] = e
+		end
+	end
+	table.sort(list,function(a,b) return a.tag < b.tag end)
+	local ifd_size = 2 + #list*12 + 4
+	local b=lbuf.new(ifd_size)
+	b:set_u16(0,#list)
+	local values={}
+	local voff=offset + ifd_size
+	for i,e in ipairs(list) do
+		local o = 2 + (i-1)*12
+		b:set_u16(o,e.tag,e.type_id)
+		b:set_u32(o+4,e.count)
+		if e.valoff then
+			b:fill(e.valoff,o+8,1)
+		elseif #e.data <= 4 then
+			b:fill(e.data..string.rep('\0',4-#e.data),o+8,1)
+		else
+			b:set_u32(o+8,voff)
+			local v=e.data
+			-- values must start on a word boundary
+			if #v % 2 == 1 then
+				v=v..'\0'
 			end
+			table.insert(values,v)
+			voff=voff + #v
 		end
-		ifd.size = n_entries * 12 + 2
-		util.extend_table(ifd,ifd_methods)
-		table.insert(ifd_list,ifd)
-		ifd_off = d._lb:get_u32(ifd_off + ifd.size)
-	until ifd_off == 0
-	return ifd_list
+	end
+	-- next ifd
+	b:set_u32(ifd_size-4,lb:get_u32(ifd.off + ifd.size))
+	return b:string()..table.concat(values)
+end
+
+--[[
+big endian 32 bit values, as used in DNG opcodes
+]]
+function m.be32_str(v)
+	return string.char(math.floor(v/0x1000000)%256,math.floor(v/0x10000)%256,math.floor(v/0x100)%256,v%256)
+end
+
+function m.be32_get(s,i)
+	local b1,b2,b3,b4=string.byte(s,i,i+3)
+	return ((b1*256 + b2)*256 + b3)*256 + b4
 end
 
 local dng_methods={}
@@ -694,6 +839,141 @@ function dng_methods.dump_thumb(self,dst,opts)
 	return true
 end
 
+--[[
+header for an uncompressed, little endian 16 bit RGB TIFF, with the image data in a single strip
+immediately following the header
+]]
+function m.rgb16_tiff_header(width,height)
+	local entries={
+		{256,4,1,width}, -- ImageWidth
+		{257,4,1,height}, -- ImageLength
+		{258,3,3,0}, -- BitsPerSample, offset filled in below
+		{259,3,1,1}, -- Compression: none
+		{262,3,1,2}, -- PhotometricInterpretation: RGB
+		{273,4,1,0}, -- StripOffsets, filled in below
+		{277,3,1,3}, -- SamplesPerPixel
+		{278,4,1,height}, -- RowsPerStrip
+		{279,4,1,width*height*6}, -- StripByteCounts
+		{284,3,1,1}, -- PlanarConfiguration: chunky
+	}
+	local ifd_size=2 + #entries*12 + 4
+	local bps_off=8 + ifd_size
+	local data_off=bps_off + 6
+	entries[3][4]=bps_off
+	entries[6][4]=data_off
+	local b=lbuf.new(data_off)
+	b:fill('II*\0',0,1)
+	b:set_u32(4,8)
+	b:set_u16(8,#entries)
+	for i,e in ipairs(entries) do
+		local o=10 + (i-1)*12
+		b:set_u16(o,e[1],e[2])
+		b:set_u32(o+4,e[3])
+		if e[2] == 3 and e[3] == 1 then
+			b:set_u16(o+8,e[4])
+		else
+			b:set_u32(o+8,e[4])
+		end
+	end
+	-- next ifd offset is already 0
+	b:set_u16(bps_off,16,16,16)
+	return b
+end
+
+--[[
+demosaic the raw data and write it as 16 bit RGB TIFF or PPM
+the image is converted and written in bands of rows, so only one band is held in memory
+opts:{
+	fmt='tiff'|'ppm' -- default tiff
+	method='edge'|'bilinear' -- default edge
+	region='active'|'all' -- default active
+	band=number -- rows per band, default 64
+	wb={r,g,b} -- white balance multipliers, default from AsShotNeutral if present
+	black, white, gamma -- see rawimg make_rgb_thumb, default linear output
+}
+]]
+function dng_methods.dump_demosaic(self,dst,opts)
+	local img = self.img
+	if not img then
+		return false, 'image data not set'
+	end
+	opts=util.extend_table({
+		fmt='tiff',
+		method='edge',
+		region='active',
+		band=64,
+		wb=self:get_wb(),
+	},opts)
+	local width,height
+	if opts.region == 'active' then
+		local aa=self.raw_ifd.byname.ActiveArea
+		width=aa:getel(3) - aa:getel(1)
+		height=aa:getel(2) - aa:getel(0)
+	else
+		width=img:width()
+		height=img:height()
+	end
+	local hdr,endian
+	if opts.fmt == 'tiff' then
+		hdr=m.rgb16_tiff_header(width,height):string()
+		endian='little'
+	elseif opts.fmt == 'ppm' then
+		hdr=string.format('P6\n%d\n%d\n%d\n',width,height,65535)
+		endian='big'
+	else
+		return false, 'invalid format '..tostring(opts.fmt)
+	end
+	local fh,err = io.open(dst,'wb')
+	if not fh then
+		return false, 'open failed '..tostring(err)
+	end
+	fh:write(hdr)
+	local dopts={
+		method=opts.method,
+		region=opts.region,
+		rows=opts.band,
+		wb=opts.wb,
+		black=opts.black,
+		white=opts.white,
+		gamma=opts.gamma,
+		endian=endian,
+		top=0,
+	}
+	local ok,err=pcall(function()
+		local w,rows
+		repeat
+			dopts.lbuf,w,rows=img:demosaic(dopts)
+			dopts.lbuf:fwrite(fh,0,w*rows*6)
+			dopts.top=dopts.top + rows
+		until dopts.top >= height
+	end)
+	fh:close()
+	if not ok then
+		return false, tostring(err)
+	end
+	return true
+end
+
+--[[
+write the raw data as FITS, see fits.write for opts
+]]
+function dng_methods.dump_fits(self,dst,opts)
+	local img = self.img
+	if not img then
+		return false, 'image data not set'
+	end
+	local fh,err = io.open(dst,'wb')
+	if not fh then
+		return false, 'open failed '..tostring(err)
+	end
+	local ok,err=pcall(fits.write,fh,self,img,util.extend_table({wb=self:get_wb()},opts))
+	fh:close()
+	if not ok then
+		return false, tostring(err)
+	end
+	return true
+end
+
 local function do_set_pixel_test(img)
 	local bad = 0
 	local bad_b = 0
@@ -754,32 +1034,14 @@ function dng_methods.test_set_pixel(self)
 end
 
 --[[
-set image data, either to internal data or an external lbuf
-initializes dng.img
-order is only for testing external data in little endian format
+return a rawimg imgspec table describing the raw image, without data
 ]]
-function dng_methods.set_data(self,data,offset,order)
+function dng_methods.get_imgspec(self)
 	-- TODO makes assumptions about header layout
 	local ifd=self.raw_ifd
 	if not ifd then 
 		error('ifd 0.0 not found')
 	end
-
-	if not order then
-		order = 'big'
-	end
-
-	if not offset then
-		offset = 0
-	end
-
-	-- no data, use internal
-	if not data then
-		data = self._lb
-		offset = ifd.byname.StripOffsets:getel() -- TODO in theory could be more than one
-		-- order should always be big for embedded data
-	end
-
 	local active_area = {
 		top=ifd.byname.ActiveArea:getel(0),
 		left=ifd.byname.ActiveArea:getel(1),
@@ -795,21 +1057,385 @@ function dng_methods.set_data(self,data,offset,order)
 		util.warnf("warning invalid active area left %d > %d\n",active_area.left,ifd.byname.ImageWidth:getel())
 		active_area.left = ifd.byname.ImageWidth:getel()
 	end
-	local img = rawimg.bind_lbuf{
-		data=data,
-		data_offset=offset,
+	return {
 		width=ifd.byname.ImageWidth:getel(),
 		height=ifd.byname.ImageLength:getel(),
 		bpp=ifd.byname.BitsPerSample:getel(),
-		endian=order,
 		black_level=ifd.byname.BlackLevel:getel(),
 		cfa_pattern=ifd.byname.CFAPattern:get_byte_str(),
 		active_area=active_area,
 	}
-	self.img = img
+end
+
+--[[
+set image data, either to internal data or an external lbuf
+initializes dng.img
+order is only for testing external data in little endian format
+]]
+function dng_methods.set_data(self,data,offset,order)
+	local spec=self:get_imgspec()
+
+	if not order then
+		order = 'big'
+	end
+
+	if not offset then
+		offset = 0
+	end
+
+	-- no data, use internal
+	if not data then
+		if self:is_lj92() then
+			self:decompress()
+		end
+		data = self._lb
+		offset = self.raw_ifd.byname.StripOffsets:getel() -- TODO in theory could be more than one
+		-- order should always be big for embedded data
+	end
+
+	spec.data=data
+	spec.data_offset=offset
+	spec.endian=order
+	self.img = rawimg.bind_lbuf(spec)
 	return true
 end
 
+--[[
+white balance multipliers {r,g,b} from AsShotNeutral, normalized to green, or nil
+]]
+function dng_methods.get_wb(self)
+	local e=self.main_ifd.byname.AsShotNeutral
+	if not e or e.count ~= 3 then
+		return
+	end
+	local n={}
+	for i=0,2 do
+		local v=e:getel(i)
+		if v[2] == 0 or v[1] == 0 then
+			return
+		end
+		n[i+1]=v[1]/v[2]
+	end
+	return {n[2]/n[1],1,n[2]/n[3]}
+end
+
+--[[
+change the size of the RGB8 thumbnail in ifd 0
+assumes the layout written by CHDK: header, thumbnail, raw data
+the raw data offset is adjusted for the new thumbnail size
+width and height are rounded down to even, so the raw data stays on an even offset
+]]
+function dng_methods.set_thumb_size(self,width,height)
+	width=math.max(2,width - width%2)
+	height=math.max(2,height - height%2)
+	local ifd=self.main_ifd
+	local old_size=ifd.byname.StripByteCounts:getel()
+	local size=width*height*3
+	ifd.byname.ImageWidth:setel(width)
+	ifd.byname.ImageLength:setel(height)
+	if ifd.byname.RowsPerStrip then
+		ifd.byname.RowsPerStrip:setel(height)
+	end
+	ifd.byname.StripByteCounts:setel(size)
+	local offsets=self.raw_ifd.byname.StripOffsets
+	offsets:setel(offsets:getel() + size - old_size)
+end
+
+--[[
+DNG BayerPhase of the top left pixel of the image, for opcodes like FixBadPixelsList
+0 = red, 1 = green in a red row, 2 = green in a blue row, 3 = blue
+CFAPattern is relative to the active area
+]]
+function dng_methods.bayer_phase(self)
+	local ifd=self.raw_ifd
+	local cfa=ifd.byname.CFAPattern:get_byte_str()
+	local top=ifd.byname.ActiveArea:getel(0)
+	local left=ifd.byname.ActiveArea:getel(1)
+	local i=(left%2) + (top%2)*2
+	local c=cfa:byte(i+1)
+	if c == 0 then
+		return 0
+	elseif c == 2 then
+		return 3
+	end
+	-- green, check the other color in the same row
+	local other = i - i%2 + (1 - i%2)
+	if cfa:byte(other+1) == 0 then
+		return 1
+	end
+	return 2
+end
+
+--[[
+return a raw ifd entry for OpcodeList1 with opcode appended to any existing opcodes, for replace_raw_ifd
+opcode: string, a single opcode in DNG (big endian) format
+DNGBackwardVersion in the header is set to 1.3, as required for opcodes
+]]
+function dng_methods.opcode1_entry(self,opcode)
+	local count=1
+	local ops=opcode
+	local e=self.raw_ifd.byname.OpcodeList1
+	if e then
+		local old=e:get_byte_str()
+		count=m.be32_get(old,1) + 1
+		ops=string.sub(old,5)..opcode
+	end
+	local oplist=m.be32_str(count)..ops
+	self.main_ifd.byname.DNGBackwardVersion:setel_array{1,3,0,0}
+	return {tag=m.tags_map.OpcodeList1,type_id=7,count=#oplist,data=oplist} -- UNDEFINED
+end
+
+--[[
+build a new raw ifd with entries added or replaced, see build_ifd
+offset: file offset where the returned data will be written, normally the end of the file
+returns a string to be written at offset, containing the new ifd and its values
+the header is modified to refer to the new ifd, so data written at offset must be retained
+assumes the raw ifd is the only sub ifd
+]]
+function dng_methods.replace_raw_ifd(self,entries,offset,opts)
+	local pad=''
+	-- ifd must start on a word boundary
+	if offset % 2 == 1 then
+		pad='\0'
+		offset = offset + 1
+	end
+	local r=m.build_ifd(self.raw_ifd,entries,offset,opts)
+	self.main_ifd.byname.SubIFDs:setel(offset)
+	return pad..r
+end
+
+--[[
+append an opcode to OpcodeList1 of the raw ifd
+opcode: string, a single opcode in DNG (big endian) format
+offset: file offset where the returned data will be written, normally the end of the file
+returns a string to be written at offset, containing a new raw ifd and opcode list, as replace_raw_ifd
+]]
+function dng_methods.add_opcode1(self,opcode,offset)
+	return self:replace_raw_ifd({self:opcode1_entry(opcode)},offset)
+end
+
+local function u32_str(v)
+	local lb=lbuf.new(4)
+	lb:set_u32(0,v)
+	return lb:string()
+end
+
+local function u16_str(v)
+	local lb=lbuf.new(2)
+	lb:set_u16(0,v)
+	return lb:string()
+end
+
+--[[
+raw ifd entries for lossless JPEG (LJ92) compressed tiles, and the tags they replace, for replace_raw_ifd
+tiles {
+	tile_width=number
+	tile_height=number
+	sizes=array -- size of each tile, as returned by rawimg encode_lj92
+}
+offset: file offset of the first tile, the others follow in order
+returns entries,remove
+]]
+function m.lj92_raw_entries(tiles,offset)
+	local n=#tiles.sizes
+	local offsets=lbuf.new(n*4)
+	local counts=lbuf.new(n*4)
+	for i,size in ipairs(tiles.sizes) do
+		offsets:set_u32((i-1)*4,offset)
+		counts:set_u32((i-1)*4,size)
+		offset = offset + size
+	end
+	return {
+		{tag=m.tags_map.Compression,type_id=3,count=1,data=u16_str(7)}, -- SHORT
+		{tag=m.tags_map.TileWidth,type_id=4,count=1,data=u32_str(tiles.tile_width)}, -- LONG
+		{tag=m.tags_map.TileLength,type_id=4,count=1,data=u32_str(tiles.tile_height)},
+		{tag=m.tags_map.TileOffsets,type_id=4,count=n,data=offsets:string()},
+		{tag=m.tags_map.TileByteCounts,type_id=4,count=n,data=counts:string()},
+	},{
+		m.tags_map.StripOffsets,
+		m.tags_map.StripByteCounts,
+		m.tags_map.RowsPerStrip,
+	}
+end
+
+--[[
+return true if the raw data is lossless JPEG compressed
+]]
+function dng_methods.is_lj92(self)
+	local e=self.raw_ifd.byname.Compression
+	return (e ~= nil and e:getel() == 7)
+end
+
+--[[
+return the size of the start of the file that must be kept when the raw data is replaced
+this is the offset of the raw data, if nothing but the raw ifd refers to data after it, as in
+files written by CHDK or write_lj92. Otherwise, it is the whole file
+]]
+function dng_methods.raw_prefix_size(self)
+	local e=self.raw_ifd.byname.TileOffsets or self.raw_ifd.byname.StripOffsets
+	local start=self._lb:len()
+	for i=0,e.count-1 do
+		start=math.min(start,e:getel(i))
+	end
+	local function check(list)
+		for _,ifd in ipairs(list) do
+			if ifd ~= self.raw_ifd then
+				if ifd.off + ifd.size + 4 > start then
+					return false
+				end
+				for _,e in ipairs(ifd.entries) do
+					if not e:is_inline() and e.valoff + e.count*e:type().size > start then
+						return false
+					end
+				end
+				if ifd:has_image() then
+					for i=0,ifd.byname.StripOffsets.count-1 do
+						if ifd.byname.StripOffsets:getel(i) + ifd.byname.StripByteCounts:getel(i) > start then
+							return false
+						end
+					end
+				end
+				if (ifd.sub and not check(ifd.sub)) or (ifd.exif and not check(ifd.exif)) then
+					return false
+				end
+			end
+		end
+		return true
+	end
+	if check(self.ifds) then
+		return start
+	end
+	return self._lb:len()
+end
+
+--[[
+replace lossless JPEG compressed raw data with uncompressed big endian data, as written by CHDK
+the start of the file (see raw_prefix_size) is kept, followed by the data and a new raw ifd
+d.lj92 is set to the tile size of the original, so dngsave can compress it again
+]]
+function dng_methods.decompress(self)
+	local ifd=self.raw_ifd
+	local spec=self:get_imgspec()
+	local tiles={data=self._lb,offsets={},sizes={}}
+	local offsets,counts
+	if ifd.byname.TileOffsets then
+		offsets=ifd.byname.TileOffsets
+		counts=ifd.byname.TileByteCounts
+		tiles.tile_width=ifd.byname.TileWidth:getel()
+		tiles.tile_height=ifd.byname.TileLength:getel()
+	else
+		-- strips are decoded as full width tiles
+		offsets=ifd.byname.StripOffsets
+		counts=ifd.byname.StripByteCounts
+		tiles.tile_width=spec.width
+		tiles.tile_height=spec.height
+		if ifd.byname.RowsPerStrip then
+			tiles.tile_height=math.min(ifd.byname.RowsPerStrip:getel(),spec.height)
+		end
+	end
+	for i=0,offsets.count-1 do
+		tiles.offsets[i+1]=offsets:getel(i)
+		tiles.sizes[i+1]=counts:getel(i)
+	end
+	-- decode before modifying anything, so d is unchanged on error
+	spec.endian='big'
+	local _,data=rawimg.decode_lj92(spec,tiles)
+	local prefix=self:raw_prefix_size()
+	local size=data:len()
+	local offset=prefix + prefix%2
+	local trailer=self:replace_raw_ifd({
+		{tag=m.tags_map.Compression,type_id=3,count=1,data=u16_str(1)},
+		{tag=m.tags_map.StripOffsets,type_id=4,count=1,data=u32_str(offset)},
+		{tag=m.tags_map.RowsPerStrip,type_id=4,count=1,data=u32_str(spec.height)},
+		{tag=m.tags_map.StripByteCounts,type_id=4,count=1,data=u32_str(size)},
+	},offset + size,{
+		remove={
+			m.tags_map.TileWidth,
+			m.tags_map.TileLength,
+			m.tags_map.TileOffsets,
+			m.tags_map.TileByteCounts,
+		},
+		copy=true,
+	})
+	local lb=lbuf.new(offset + size + #trailer)
+	lb:fill(self._lb:sub(1,prefix),0,1)
+	lb:fill(data,offset,1)
+	lb:fill(trailer,offset + size,1)
+	if tiles.tile_width % 16 == 0 and tiles.tile_height % 16 == 0 then
+		self.lj92={tile_width=tiles.tile_width,tile_height=tiles.tile_height}
+	else
+		self.lj92={}
+	end
+	self:rebind(lb)
+end
+
+--[[
+write the DNG to file handle fh with the raw data lossless JPEG compressed
+opts {
+	tile_width=number -- default 256
+	tile_height=number -- default 256
+	predictor=number -- default 1
+}
+the start of the file (see raw_prefix_size) is written unchanged, followed by the tiles and a new raw ifd
+d is not modified
+returns the size of the compressed data
+]]
+function dng_methods.write_lj92(self,fh,opts)
+	opts=util.extend_table({tile_width=256,tile_height=256},opts)
+	local data,sizes=self.img:encode_lj92(opts)
+	local prefix=self:raw_prefix_size()
+	local entries,remove=m.lj92_raw_entries({
+		tile_width=opts.tile_width,
+		tile_height=opts.tile_height,
+		sizes=sizes,
+	},prefix)
+	local subifds=self.main_ifd.byname.SubIFDs
+	local old_subifds=subifds:getel()
+	local trailer=self:replace_raw_ifd(entries,prefix + data:len(),{remove=remove,copy=true})
+	local hdr=self._lb:sub(1,prefix)
+	subifds:setel(old_subifds)
+	rawimg.write_dng(fh,{
+		header=hdr,
+		data=data,
+		swap=false,
+		trailer=lbuf.new(trailer),
+	})
+	return data:len()
+end
+
+--[[
+replace the underlying lbuf and re-parse ifds, e.g. after appending data with add_opcode1
+]]
+function dng_methods.rebind(self,lb)
+	local had_img = (self.img ~= nil)
+	self._lb = lb
+	local ifds,err = m.bind_ifds(self)
+	if not ifds then
+		error(err)
+	end
+	self.ifds = ifds
+	self.main_ifd = self:get_ifd{0}
+	self.raw_ifd = self:get_ifd{0,0}
+	self.exif_ifd = self:get_ifd{0,'exif'}
+	self.img = nil
+	if had_img then
+		self:set_data()
+	end
+end
+
+--[[
+copy a mapped file into memory, so the file can be safely overwritten
+modifications made since load are kept
+]]
+function dng_methods.unmap(self)
+	if not self._lb:mapped() then
+		return
+	end
+	self:rebind(self._lb:sub())
+	-- windows does not allow writing to a file with a mapped view, release it now
+	collectgarbage('collect')
+end
+
 --[[
 return ifd specified by "path", or nil
 path: table of 0 based ifd numbers
@@ -855,7 +1481,11 @@ function m.bind_header(lb)
 	if d.id ~= 42 then
 		return false, string.format('invalid id %d, expected 42',d.id)
 	end
-	d.ifds = m.bind_ifds(d,d.ifd0_off)
+	local ifds,err = m.bind_ifds(d)
+	if not ifds then
+		return false, err
+	end
+	d.ifds = ifds
 	-- shortcuts to main IFDs of interest, could be smarter about finding them
 	d.main_ifd = d:get_ifd{0} -- thumb an overall information
 	d.raw_ifd = d:get_ifd{0,0} -- raw data
@@ -863,9 +1493,24 @@ function m.bind_header(lb)
 	return d
 end
 
+--[[
+d=dng.load(filename,opts)
+opts {
+	nodata=bool -- don't bind image data
+	nomap=bool -- read the whole file into memory instead of mapping it
+}
+by default, the file is mapped copy on write with lbuf.mmap, so only the parts accessed are read.
+modifications are not written to the file. Use d:unmap() before overwriting the file
+returns dng object or false,error
+]]
 function m.load(filename, opts)
 	opts = util.extend_table({},opts)
-	local lb,err=lbu.loadfile(filename)
+	local lb,err
+	if opts.nomap then
+		lb,err=lbu.loadfile(filename)
+	else
+		lb,err=lbuf.mmap(filename,'c')
+	end
 	if not lb then
 		return false, err
 	end
@@ -884,4 +1529,50 @@ function m.load(filename, opts)
 	end
 	return d
 end
+
+--[[
+load only the header of a DNG file, for fast access to tags without reading image data
+d=dng.load_header(filename,opts)
+opts {
+	size=number -- initial number of bytes to read, default 64k
+}
+if the ifds or tag values extend past the initial read, the required size is read
+image data functions will not work, d.header_only is set
+returns dng object or false,error
+]]
+function m.load_header(filename, opts)
+	opts = util.extend_table({size=65536},opts)
+	local fh,err=io.open(filename,'rb')
+	if not fh then
+		return false, err
+	end
+	local flen = fh:seek('end')
+	local size = math.min(opts.size,flen)
+	local d
+	while true do
+		fh:seek('set',0)
+		local lb=lbuf.new(size)
+		lb:fread(fh,0,size)
+		d,err = m.bind_header(lb)
+		if d and d._tiff:data_end() <= size then
+			break
+		end
+		if size == flen then
+			break
+		end
+		-- ifds may be anywhere, e.g. after image data when rewritten with add_opcode1
+		if d then
+			size = math.min(d._tiff:data_end(),flen)
+		else
+			size = flen
+		end
+	end
+	fh:close()
+	if not d then
+		return false, err
+	end
+	d.filename = filename
+	d.header_only = true
+	return d
+end
 return m
@@ -17,6 +17,7 @@
 --[[
 CLI commands for manipulating DNG images
 ]]
+local pixmap=require'pixmap'
 -- store info for DNG cli commands, global for easy script access
 local m = {
 	--selected = current selected dng, or nil
@@ -58,6 +59,25 @@ m.get_sel_nobatch = function(index_arg)
 	return m.selected
 end
 
+--[[
+check whether two paths refer to the same existing file
+]]
+local function same_file(a,b)
+	if a == b then
+		return true
+	end
+	local at=lfs.attributes(a)
+	local bt=lfs.attributes(b)
+	if not at or not bt then
+		return false
+	end
+	-- ino is not set on windows
+	if at.ino == 0 then
+		return fsutil.normalize_dir_sep(a):lower() == fsutil.normalize_dir_sep(b):lower()
+	end
+	return at.dev == bt.dev and at.ino == bt.ino
+end
+
 --[[
 prepare output path for a file write
 opts: {
@@ -92,6 +112,10 @@ local function prepare_dst_path(d,name,opts)
 		if not opts.over then
 			return false, 'file exists, use -over to overwrite '..tostring(name)
 		end
+		-- loaded files are mapped, overwriting in place would corrupt the loaded data
+		if not opts.pretend and same_file(name,d.filename) then
+			d:unmap()
+		end
 	elseif m then -- TODO might want to allow
 		return false, "can't overwrite non-file "..tostring(filename)
 	else
@@ -166,12 +190,130 @@ local function do_dump_raw(d,args)
 	end
 end
 
+local function do_demosaic(d,args)
+	local fmt = args.fmt
+	if fmt ~= 'tiff' and fmt ~= 'ppm' then
+		return false, 'invalid format: '..tostring(fmt)
+	end
+	local opts={
+		fmt=fmt,
+		method=args.method,
+		region=args.reg,
+		band=tonumber(args.band),
+		white=tonumber(args.white),
+		gamma=tonumber(args.gamma),
+	}
+	if args.wb == 'none' then
+		opts.wb={1,1,1}
+	elseif args.wb ~= 'asshot' then
+		local r,g,b=string.match(args.wb,'^([%d.]+),([%d.]+),([%d.]+)$')
+		if not r then
+			return false, 'invalid wb: '..tostring(args.wb)
+		end
+		opts.wb={tonumber(r),tonumber(g),tonumber(b)}
+	end
+	local sfx = (fmt == 'tiff') and '.tif' or '.ppm'
+	local filename,err = prepare_dst_path(d,args.out,{sfx=sfx,over=args.over,pretend=args.pretend})
+	if not filename then
+		return false, err
+	end
+	if args.pretend then
+		printf("demosaic: %s\n",tostring(filename))
+		return true
+	end
+	local t0=ticktime.get()
+	local status,err = d:dump_demosaic(filename,opts)
+	if status then
+		cli.dbgmsg('demosaic %s %.3f sec\n',filename,ticktime.elapsed(t0))
+	end
+	return status,err
+end
+
+local function do_fits(d,args)
+	local opts={
+		planes=args.planes,
+		bitpix=tonumber(args.bits),
+		region=args.reg,
+		black=args.black,
+		method=args.method,
+	}
+	if opts.planes ~= 'cfa' and opts.planes ~= 'rgb' then
+		return false, 'invalid planes: '..tostring(opts.planes)
+	end
+	if opts.bitpix ~= 16 and opts.bitpix ~= 32 then
+		return false, 'invalid bits: '..tostring(args.bits)
+	end
+	if opts.bitpix == 32 and opts.planes == 'rgb' then
+		return false, 'rgb requires bits=16'
+	end
+	local filename,err = prepare_dst_path(d,args.out,{sfx='.fits',over=args.over,pretend=args.pretend})
+	if not filename then
+		return false, err
+	end
+	if args.pretend then
+		printf("fits: %s\n",tostring(filename))
+		return true
+	end
+	local t0=ticktime.get()
+	local status,err = d:dump_fits(filename,opts)
+	if status then
+		cli.dbgmsg('fits %s %.3f sec\n',filename,ticktime.elapsed(t0))
+	end
+	return status,err
+end
+
+-- star list of the most recent alignment reference, so batches only measure it once
+local align_ref={}
+
+local function do_align(d,args)
+	if not args.ref then
+		return false, 'missing -ref'
+	end
+	local star_opts={sigma=tonumber(args.sigma)}
+	if align_ref.key ~= args.ref or align_ref.sigma ~= star_opts.sigma then
+		local rd = m.list[tonumber(args.ref)]
+		if not rd then
+			local err
+			rd,err = dng.load(args.ref)
+			if not rd then
+				return false, 'failed to load reference '..tostring(err)
+			end
+		end
+		align_ref={
+			key=args.ref,
+			sigma=star_opts.sigma,
+			stars=rd.img:find_stars(star_opts),
+		}
+	end
+	local xform,err=rawimg.match_stars(align_ref.stars,d.img:find_stars(star_opts),{
+		model=args.model,
+		tol=tonumber(args.tol),
+	})
+	if not xform then
+		return false, err
+	end
+	printf('%s: matches %d rms %.2f dx %.2f dy %.2f rot %.3f scale %.5f\n',
+		d.filename,xform.matches,xform.rms,xform.tx,xform.ty,xform.rotation,xform.scale)
+	if args.nowarp then
+		return true
+	end
+	-- warp from a copy into the dng data, so it can be saved
+	local src=d.img:convert{bpp=d.img:bpp(),endian=d.img:endian()}
+	src:warp(xform,{dst=d.img,fill=d:get_imgspec().black_level})
+	return true
+end
+
 
 local dngbatch_cmds=util.flag_table{
 	'info',
 	'mod',
 	'dump',
 	'save',
+	'pixmap',
+	'demosaic',
+	'fits',
+	'stars',
+	'align',
 }
 
 local function dngbatch_docmd(cmd,dargs)
@@ -179,7 +321,8 @@ local function dngbatch_docmd(cmd,dargs)
 		printf('%s %s\n',cmd.name,cmd.argstr)
 		if dargs.pretend then
 			-- these commands pretend at a lower level to output path names etc
-			if cmd.name == 'dngsave' or cmd.name == 'dngdump' then
+			if cmd.name == 'dngsave' or cmd.name == 'dngdump' or cmd.name == 'dngdemosaic'
+					or cmd.name == 'dngfits' then
 				cmd.args.pretend = true
 			else
 				return true
@@ -203,22 +346,9 @@ local function dngbatch_docmd(cmd,dargs)
 end
 
 --[[
-findfiles callback
+load a file and run the batch commands on it, throws on error
 ]]
-local function dngbatch_callback(self,opts)
-	local dargs = opts.dngbatch_args
-	local cmds = opts.dngbatch_cmds
-	local relpath
-	local src=self.cur.full
-	if #self.cur.path == 1 then
-		relpath = self.cur.name
-	else
-		if #self.cur.path == 2 then
-			relpath = self.cur.path[2]
-		else
-			relpath = fsutil.joinpath(unpack(self.cur.path,2))
-		end
-	end
+local function dngbatch_file(src,relpath,dargs,cmds)
 	printf("load: %s\n",src)
 	local d,err
 	if dargs.pretend then
@@ -241,6 +371,7 @@ local function dngbatch_callback(self,opts)
 	for i,cmd in ipairs(cmds) do
 		status,err = dngbatch_docmd(cmd,dargs)
 		if not status then
+			batch = {}
 			errlib.throw{etype='dngcmd',msg=tostring(err)}
 		end
 	end
@@ -248,37 +379,34 @@ local function dngbatch_callback(self,opts)
 	batch = {}
 end
 
-local dngbatch_ap=cli.argparser.create{
-	patch=false,
-	fmatch=false,
-	rmatch=false,
-	maxdepth=1,
-	pretend=false,
-	verbose=false,
-	odir=false,
-	ext='dng'
-}
 --[[
-TODO there should be a generic framework for this in cli
+findfiles callback
 ]]
-local function dngbatch_cmd(self,args)
-	local err
-	-- split of dngbatch args from rest, delimited by {}
-	-- TODO input additional lines until }
-	local args,rest = string.match(args,'^([^{]*){%s*([^}]*)}$')
-	if not args then
-		return false, 'parse error, missing {}?'
-	end
-
-	args,err = dngbatch_ap:parse(args)
-	if not args then
-		return false,err
+local function dngbatch_callback(self,opts)
+	local relpath
+	local src=self.cur.full
+	if #self.cur.path == 1 then
+		relpath = self.cur.name
+	else
+		if #self.cur.path == 2 then
+			relpath = self.cur.path[2]
+		else
+			relpath = fsutil.joinpath(unpack(self.cur.path,2))
+		end
 	end
-
-	if #args == 0  then
-		return false,'no files specified'
+	-- parallel, files are processed after all are found
+	if opts.dngbatch_files then
+		table.insert(opts.dngbatch_files,{src=src,relpath=relpath})
+		return
 	end
+	dngbatch_file(src,relpath,opts.dngbatch_args,opts.dngbatch_cmds)
+end
 
+--[[
+parse the commands between {}
+returns array of {name,args,argstr} or false,error
+]]
+function m.dngbatch_parse_cmds(rest)
 	local cmds={}
 	local errors={}
 
@@ -308,6 +436,190 @@ local function dngbatch_cmd(self,args)
 	if #errors > 0 then
 		return false,'\n'..table.concat(errors,'\n')
 	end
+	return cmds
+end
+
+-- marks the end of the output for a file in parallel worker output
+local dngbatch_result_mark='@dngbatch_result@'
+
+--[[
+job=dngbatch_job(files,n,dargs,cmds)
+job for n parallel workers, as serialized to the job file
+workers don't have the loaded file list, so numeric align references are replaced by
+the name of the loaded file
+returns job or false,error
+]]
+function m.dngbatch_job(files,n,dargs,cmds)
+	local job_cmds={}
+	for i,cmd in ipairs(cmds) do
+		local args=util.extend_table({},cmd.args)
+		if cmd.name == 'dngalign' and tonumber(args.ref) then
+			local rd=m.list[tonumber(args.ref)]
+			if not rd then
+				return false,string.format('%d: align reference %s not loaded',i,tostring(args.ref))
+			end
+			args.ref=rd.filename
+		end
+		job_cmds[i]={name=cmd.name,args=args,argstr=cmd.argstr}
+	end
+	return {
+		files=files,
+		n=n,
+		args=util.extend_table({},dargs,{keys={'odir','verbose'}}),
+		cmds=job_cmds,
+		-- split the image processing threads between workers
+		threads=math.max(1,math.floor(rawimg.get_threads()/n)),
+	}
+end
+
+--[[
+entry point for parallel dngbatch worker processes
+processes every nth file of the job starting at k, writing the output for each file followed by a result line
+]]
+function m.dngbatch_worker(jobfile,k)
+	local job=util.unserialize(fsutil.readfile_e(jobfile,'b'))
+	if not job then
+		errlib.throw{etype='bad_arg',msg='dngbatch: invalid job file '..tostring(jobfile)}
+	end
+	rawimg.set_threads(job.threads)
+	local cmds=job.cmds
+	for i=k,#job.files,job.n do
+		local f=job.files[i]
+		local status,err=pcall(dngbatch_file,f.src,f.relpath,job.args,cmds)
+		if status then
+			printf('%s %d ok\n',dngbatch_result_mark,i)
+		else
+			printf('%s %d %s\n',dngbatch_result_mark,i,(string.gsub(tostring(err),'\n','\\n')))
+		end
+		util.util_stdout:flush()
+	end
+end
+
+--[[
+errors=dngbatch_relay(files,workers)
+read the output of each file from the worker handling it, in file order
+workers are handles of worker output, file i is handled by worker (i-1)%#workers + 1
+returns an array of error messages for failed files
+]]
+function m.dngbatch_relay(files,workers)
+	local errors={}
+	for i,f in ipairs(files) do
+		local fh=workers[(i-1)%#workers + 1]
+		local result
+		while true do
+			local line=fh:read('*l')
+			if not line then
+				result='worker exited'
+				break
+			end
+			local ri,r=string.match(line,'^'..dngbatch_result_mark..' (%d+) (.*)$')
+			if ri then
+				if tonumber(ri) ~= i then
+					r=string.format('unexpected worker result %s',ri)
+				end
+				result=string.gsub(r,'\\n','\n')
+				break
+			end
+			printf('%s\n',line)
+		end
+		if result ~= 'ok' then
+			util.warnf('%s: %s\n',f.src,result)
+			table.insert(errors,f.src..': '..string.match(result,'[^\n]*'))
+		end
+	end
+	return errors
+end
+
+--[[
+run the batch in n worker processes
+each worker handles every nth file, output is relayed in file order
+returns true or false,error if any files failed
+]]
+local function dngbatch_parallel(files,n,dargs,cmds)
+	n=math.min(n,#files)
+	local job,err=m.dngbatch_job(files,n,dargs,cmds)
+	if not job then
+		return false,err
+	end
+	local bytes=0
+	for _,f in ipairs(files) do
+		bytes=bytes + (lfs.attributes(f.src,'size') or 0)
+	end
+	local jobfile=os.tmpname()
+	fsutil.writefile_e(serialize(job,{pretty=false}),jobfile,'wb')
+	local t0=ticktime.get()
+	local workers={}
+	for k=1,n do
+		-- -r skips startup files, which might connect to a camera or run other commands
+		local cmd=string.format('"%s" -r -e"exec require\'dngcli\'.dngbatch_worker([=[%s]=],%d)"',sys.getcmd(),jobfile,k)
+		if sys.ostype() == 'Windows' then
+			cmd = '"'..cmd..'"' -- cmd.exe strips the outer quotes
+		end
+		local fh,err=fsutil.popen(cmd,'r')
+		if not fh then
+			for i=1,k-1 do
+				workers[i]:close()
+			end
+			os.remove(jobfile)
+			return false,'dngbatch: failed to start worker '..tostring(err)
+		end
+		workers[k]=fh
+	end
+	local errors=m.dngbatch_relay(files,workers)
+	for _,fh in ipairs(workers) do
+		fh:close()
+	end
+	os.remove(jobfile)
+	local t=ticktime.elapsed(t0)
+	printf('%d files %d failed %d workers %.3f sec %.2f files/s %.2f MB/s\n',
+		#files,#errors,n,t,#files/t,bytes/(1024*1024*t))
+	if #errors > 0 then
+		return false,string.format('%d files failed\n%s',#errors,table.concat(errors,'\n'))
+	end
+	return true
+end
+
+local dngbatch_ap=cli.argparser.create{
+	patch=false,
+	fmatch=false,
+	rmatch=false,
+	maxdepth=1,
+	pretend=false,
+	verbose=false,
+	odir=false,
+	ext='dng',
+	j=1,
+}
+--[[
+TODO there should be a generic framework for this in cli
+]]
+local function dngbatch_cmd(self,args)
+	local err
+	-- split of dngbatch args from rest, delimited by {}
+	-- TODO input additional lines until }
+	local args,rest = string.match(args,'^([^{]*){%s*([^}]*)}$')
+	if not args then
+		return false, 'parse error, missing {}?'
+	end
+
+	args,err = dngbatch_ap:parse(args)
+	if not args then
+		return false,err
+	end
+
+	if #args == 0  then
+		return false,'no files specified'
+	end
+
+	local cmds,err = m.dngbatch_parse_cmds(rest)
+	if not cmds then
+		return false,err
+	end
+	local jobs=tonumber(args.j)
+	if not jobs or jobs < 1 then
+		return false,'invalid -j '..tostring(args.j)
+	end
+	jobs=math.floor(jobs)
 	local sfx
 	if args.ext ~= '*' and args.ext ~= true then
 		sfx = '.'..args.ext
@@ -322,7 +634,17 @@ local function dngbatch_cmd(self,args)
 		dngbatch_cmds=cmds,
 		fsfx=sfx,
 	}
+	-- pretend just prints names, no point in workers
+	if jobs > 1 and not args.pretend then
+		opts.dngbatch_files={}
+	end
 	fsutil.find_files({unpack(args)},opts,dngbatch_callback)
+	if opts.dngbatch_files then
+		if #opts.dngbatch_files == 0 then
+			return true
+		end
+		return dngbatch_parallel(opts.dngbatch_files,jobs,args,cmds)
+	end
 	return true
 end
 
@@ -365,6 +687,8 @@ m.init_cli = function()
 		args=cli.argparser.create({
 			over=false,
 			keepmtime=false,
+			lj92=false,
+			nolj92=false,
 		}),
 		help_detail=[[
  file:       file or directory to write to
@@ -372,6 +696,9 @@ m.init_cli = function()
  options:
    -over     overwrite existing files
    -keepmtime preserve existing modification time
+   -lj92[=n] compress raw data as lossless JPEG, in n x n tiles, default 256
+             files loaded compressed are saved compressed with their original tile size
+   -nolj92   save files loaded compressed uncompressed
 ]],
 		func=function(self,args)
 			local filename
@@ -385,12 +712,26 @@ m.init_cli = function()
 				return false, 'no file selected'
 			end
 
+			local lj92
+			if args.lj92 then
+				lj92 = {}
+				if args.lj92 ~= true then
+					local size = tonumber(args.lj92)
+					if not size then
+						return false, 'invalid lj92 tile size'
+					end
+					lj92 = {tile_width=size,tile_height=size}
+				end
+			elseif d.lj92 and not args.nolj92 then
+				lj92 = d.lj92
+			end
+
 			local filename,err = prepare_dst_path(d,args[1],{over=args.over,pretend=args.pretend})
 			if not filename then
 				return false, err
 			end
 			if args.pretend then
-				printf("save: %s\n",filename)
+				printf("save: %s%s\n",filename,(lj92 and ' lj92') or '')
 				return true
 			end
 
@@ -403,7 +744,12 @@ m.init_cli = function()
 
 			local fh = fsutil.open_e(filename,'wb')
 
-			local status, err = d._lb:fwrite(fh)
+			local status, err
+			if lj92 then
+				status, err = pcall(d.write_lj92,d,fh,lj92)
+			else
+				status, err = d._lb:fwrite(fh)
+			end
 			fh:close()
 			if status then
 				printf('wrote %s\n',filename)
@@ -701,6 +1047,146 @@ m.init_cli = function()
 			return true
 		end,
 	},
+	{
+		names={'dngpixmap'},
+		help='build a bad pixel map from dark or flat frames',
+		arghelp="[options] [image num]",
+		args=cli.argparser.create({
+			min=false,
+			max=false,
+			sigma=false,
+			reg='active',
+			out=false,
+			add=false,
+		}),
+		help_detail=[[
+ options:
+  -min=N     pixels with value <= N are bad
+  -max=N     pixels with value >= N are bad
+  -sigma=S   pixels more than S standard deviations from the mean of their color are bad
+  -reg=<active|all>
+    region of image to search, either active area (default) or all
+  -out=<file> pixel map file to write
+  -add       merge with pixels already in <file>, e.g. to combine darks and flats
+ pixel maps are used with dngmod -pixmap and remoteshoot or rsint -pixmap
+]],
+		func=function(self,args)
+			local d = m.get_sel_batch(args[1])
+			if not d then
+				return false, 'no file selected'
+			end
+			local opts={
+				min=tonumber(args.min),
+				max=tonumber(args.max),
+				sigma=tonumber(args.sigma),
+				region=args.reg,
+			}
+			if not (opts.min or opts.max or opts.sigma) then
+				return false, 'must specify min, max or sigma'
+			end
+			if not args.out then
+				return false, 'missing -out'
+			end
+			local pm=pixmap.detect(d.img,opts)
+			local count=pm:count()
+			if args.add and lfs.attributes(args.out,'mode') == 'file' then
+				pm=pixmap.load(args.out):union(pm)
+			end
+			pm:save(args.out)
+			return true, string.format('%d bad pixels, %d in %s',count,pm:count(),args.out)
+		end,
+	},
+	{
+		names={'dngstars'},
+		help='find stars and measure HFR and FWHM',
+		arghelp="[options] [image num]",
+		args=cli.argparser.create({
+			sigma=false,
+			plane='bin',
+			grid=false,
+			max=false,
+			list=false,
+			out=false,
+		}),
+		help_detail=[[
+ options:
+  -sigma=S     detection threshold in background standard deviations, default 5
+  -plane=<bin|green>
+    bin    detect on the mean of each 2x2 CFA quad, default
+    green  detect on the mean of the greens of each quad
+  -grid=N      background grid cell size in pixels, default 64
+  -max=N       keep only the N brightest stars, default 1000
+  -list[=N]    list the N brightest stars, default 20
+  -out=<file>  write all stars to a CSV file
+ sizes are in raw pixels, hfr and fwhm are medians of unsaturated stars
+]],
+		func=function(self,args)
+			local d = m.get_sel_batch(args[1])
+			if not d then
+				return false, 'no file selected'
+			end
+			local stars=d.img:find_stars{
+				sigma=tonumber(args.sigma),
+				plane=args.plane,
+				grid=tonumber(args.grid),
+				max_stars=tonumber(args.max),
+			}
+			local s=stars:stats()
+			printf('%s: stars %d hfr %.2f fwhm %.2f ecc %.2f background %.1f noise %.1f\n',
+				d.filename,s.count,s.hfr,s.fwhm,s.ecc,s.background,s.noise)
+			if args.list then
+				local n=tonumber(args.list) or 20
+				for i=0,math.min(n,s.count)-1 do
+					local st=stars:get(i)
+					printf('%4d %8.2f %8.2f flux %9.0f hfr %5.2f fwhm %5.2f ecc %4.2f%s\n',
+						i,st.x,st.y,st.flux,st.hfr,st.fwhm,st.ecc,st.saturated and ' sat' or '')
+				end
+			end
+			if args.out then
+				fsutil.mkdir_parent(args.out)
+				local fh=fsutil.open_e(args.out,'wb')
+				fh:write('x,y,flux,peak,hfr,fwhm,ecc,npix,saturated\n')
+				for i=0,s.count-1 do
+					local st=stars:get(i)
+					fh:write(string.format('%.3f,%.3f,%.1f,%.1f,%.3f,%.3f,%.3f,%d,%d\n',
+						st.x,st.y,st.flux,st.peak,st.hfr,st.fwhm,st.ecc,st.npix,st.saturated and 1 or 0))
+				end
+				fh:close()
+			end
+			return true
+		end,
+	},
+	{
+		names={'dngalign'},
+		help='align image to a reference using stars',
+		arghelp="[options] [image num]",
+		args=cli.argparser.create({
+			ref=false,
+			model='similarity',
+			tol=false,
+			sigma=false,
+			nowarp=false,
+		}),
+		help_detail=[[
+ options:
+  -ref=<n|file>  reference image, number of a loaded dng or a DNG file name
+  -model=<similarity|affine>
+    similarity  shift, rotation and scale, default
+    affine      also allows shear and different x and y scale
+  -tol=N       star match tolerance in pixels, default 3
+  -sigma=S     star detection threshold, see dngstars
+  -nowarp      only report the transform, don't change the image
+ the image data is resampled in place, use dngsave to write it
+ pixels that fall outside the original frame are set to the black level
+]],
+		func=function(self,args)
+			local d = m.get_sel_batch(args[1])
+			if not d then
+				return false, 'no file selected'
+			end
+			return do_align(d,args)
+		end,
+	},
 	{
 		names={'dnglist'},
 		help='list loaded dng files',
@@ -744,11 +1230,15 @@ m.init_cli = function()
 		args=cli.argparser.create({
 			patch=false,
 			over=false,
+			pixmap=false,
+			pixmapop=false,
 		}),
-		--TODO opcode based patch, other rawops
+		--TODO other rawops
 		help_detail=[[
  options:
    -patch[=n]   interpolate over pixels with value less than n (default 0)
+   -pixmap=<file> interpolate over pixels listed in pixel map <file>, see dngpixmap
+   -pixmapop    add -pixmap pixels as a FixBadPixelsList opcode instead of modifying data
 ]],
 		func=function(self,args)
 			local d = m.get_sel_batch(args[1])
@@ -764,6 +1254,23 @@ m.init_cli = function()
 				local count = d.img:patch_pixels(args.patch)
 				printf('patched %d pixels\n',count)
 			end
+			if args.pixmapop and not args.pixmap then
+				return false, 'pixmapop requires pixmap'
+			end
+			if args.pixmap then
+				local pm = pixmap.load(args.pixmap)
+				if args.pixmapop then
+					local len = d._lb:len()
+					local trailer = d:add_opcode1(pm:fix_bad_pixels_opcode(d:bayer_phase()),len)
+					local lb = lbuf.new(len + #trailer)
+					lb:fill(d._lb,0,1)
+					lb:fill(trailer,len,1)
+					d:rebind(lb)
+					printf('added opcode for %d pixels\n',pm:count())
+				else
+					printf('patched %d pixels\n',pm:patch(d.img))
+				end
+			end
 			return true
 		end,
 	},
@@ -811,6 +1318,77 @@ m.init_cli = function()
 			return true
 		end,
 	},
+	{
+		names={'dngdemosaic'},
+		help='convert raw data to full size 16 bit RGB',
+		arghelp="[options] [image num]",
+		args=cli.argparser.create({
+			out=false,
+			fmt='tiff',
+			method='edge',
+			reg='active',
+			wb='asshot',
+			white=false,
+			gamma=false,
+			band=false,
+			over=false,
+		}),
+		help_detail=[[
+ options:
+  -out[=name]  output file or directory, default dngname.(tif|ppm)
+  -over        overwrite existing file
+  -fmt=<tiff|ppm>  output format, default tiff
+  -method=<edge|bilinear>
+    edge      interpolate along edges to reduce color fringing, default
+    bilinear  average of nearest neighbors, faster
+  -reg=<active|all> region of image to convert, either active area (default) or all
+  -wb=<asshot|none|r,g,b> white balance multipliers, default as shot if present in the DNG
+  -white=N     raw value mapped to full scale, default max value for bpp
+  -gamma=G     output gamma, default 1 (linear)
+  -band=N      rows converted at a time, default 64
+]],
+		func=function(self,args)
+			local d = m.get_sel_batch(args[1])
+			if not d then
+				return false, 'no file selected'
+			end
+			return do_demosaic(d,args)
+		end,
+	},
+	{
+		names={'dngfits'},
+		help='write raw data as FITS',
+		arghelp="[options] [image num]",
+		args=cli.argparser.create({
+			out=false,
+			planes='cfa',
+			bits='16',
+			reg='active',
+			black=false,
+			method='edge',
+			over=false,
+		}),
+		help_detail=[[
+ options:
+  -out[=name]  output file or directory, default dngname.fits
+  -over        overwrite existing file
+  -planes=<cfa|rgb>
+    cfa       raw CFA data with BAYERPAT, default
+    rgb       demosaiced RGB planes, white balanced as shot
+  -bits=<16|32> BITPIX, default 16. 32 is cfa only
+  -reg=<active|all> region of image to write, either active area (default) or all
+  -black       subtract the black level from cfa data. With -bits=16, negative values are 0
+  -method=<edge|bilinear> demosaic method for rgb, default edge
+ exposure, ISO, date, camera model and black level are written as header cards
+]],
+		func=function(self,args)
+			local d = m.get_sel_batch(args[1])
+			if not d then
+				return false, 'no file selected'
+			end
+			return do_fits(d,args)
+		end,
+	},
 	{
 		names={'dngbatch'},
 		help='manipulate multiple files',
@@ -822,13 +1400,16 @@ m.init_cli = function()
    -odir             output directory, if no name specified in file commands
    -pretend          print actions instead of doing them
    -verbose[=n]      print detail about actions
+   -j=n              process files in n parallel chdkptp processes, default 1
+                     output is shown in file order. Files that fail are reported at the end
+                     instead of stopping the batch
  file selection
    -fmatch=<pattern> only file with path/name matching <pattern>
    -rmatch=<pattern> only recurse into directories with path/name matching <pattern>
    -maxdepth=n       only recurse into N levels of directory (default 1, only those specified in command)
    -ext=string       only files with specified extension, default dng, * for all. Not a pattern
  commands:
-   mod dump save info listpixels
+   mod dump save info listpixels pixmap demosaic fits stars align
   take the same options as the corresponding standalone commands
   load and unload are implicitly called for each file
 ]],
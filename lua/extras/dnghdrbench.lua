@@ -0,0 +1,76 @@
+--[[
+benchmark DNG header loading
+
+usage:
+!m=require'extras/dnghdrbench'
+!m.run(options)
+options:{
+	file=string   -- DNG file to take the header from, required
+	n=number      -- number of header files to write and load, default 10000
+	dir=string    -- directory for header files, default dnghdrbench in the current directory
+	keep=bool     -- don't remove the header files when done
+	reps=number   -- repetitions of the in memory parse, default n
+}
+the header (ifds and tag values) of file is written to n files, which are then loaded
+with dng.load_header, and a few tags read from each as a catalog scan would.
+the in memory time is bind_header on an lbuf, without file access
+]]
+local m={}
+
+local function read_tags(d)
+	local ifd=d.raw_ifd
+	return ifd.byname.ImageWidth:getel(),
+		ifd.byname.ImageLength:getel(),
+		ifd.byname.BitsPerSample:getel(),
+		d.main_ifd.byname.Model:get_ascii(),
+		d.exif_ifd and d.exif_ifd.byname.ExposureTime and d.exif_ifd.byname.ExposureTime:getel()
+end
+
+function m.run(opts)
+	opts=util.extend_table({
+		n=10000,
+		dir='dnghdrbench',
+	},opts)
+	if not opts.file then
+		errlib.throw{etype='bad_arg',msg='dnghdrbench: file required'}
+	end
+	local src,err=dng.load_header(opts.file)
+	if not src then
+		errlib.throw{etype='io',msg='dnghdrbench: '..tostring(err)}
+	end
+	-- ifds and tag values, without image data
+	local size=src._tiff:data_end()
+	local hdr=src._lb:string(1,size)
+	printf('header %d bytes, %d files\n',#hdr,opts.n)
+
+	local reps=opts.reps or opts.n
+	local lb=lbuf.new(hdr)
+	local t0=ticktime.get()
+	for i=1,reps do
+		read_tags(assert(dng.bind_header(lb)))
+	end
+	local t=ticktime.elapsed(t0)
+	printf('in memory  %8.4f %8.1f us/header\n',t,t*1e6/reps)
+
+	fsutil.mkdir_m(opts.dir)
+	local names={}
+	for i=1,opts.n do
+		names[i]=fsutil.joinpath(opts.dir,string.format('HDR_%05d.DNG',i))
+		fsutil.writefile_e(hdr,names[i],'wb')
+	end
+	collectgarbage('collect')
+	t0=ticktime.get()
+	for _,name in ipairs(names) do
+		read_tags(assert(dng.load_header(name)))
+	end
+	t=ticktime.elapsed(t0)
+	printf('load_header %8.4f %8.1f files/s\n',t,opts.n/t)
+	if not opts.keep then
+		for _,name in ipairs(names) do
+			os.remove(name)
+		end
+		lfs.rmdir(opts.dir)
+	end
+end
+
+return m
@@ -0,0 +1,126 @@
+--[[
+benchmark lossless JPEG (LJ92) DNG raw compression
+
+usage:
+!m=require'extras/lj92bench'
+!m.run(options)
+options:{
+	file=string      -- DNG file to compress, default a synthetic sky background image
+	width=number     -- synthetic image width, default 4000
+	height=number    -- synthetic image height, default 3000
+	bpp=number       -- synthetic image bpp, default 12
+	noise=number     -- synthetic image noise range, default 32
+	tiles={...}      -- tile sizes to test, default 128,256,512
+	predictors={...} -- predictors to test, default 1,6
+	threads={...}    -- thread counts to test, default 1 and the number of CPUs
+	reps=number      -- repetitions of each test, best time is reported. default 3
+}
+prints the compression ratio, encode and decode MB/s, and encode MB/s per thread
+MB are of the uncompressed packed data, as written by CHDK
+]]
+local m={}
+
+local function make_img(opts)
+	if opts.file then
+		local d,err=dng.load(opts.file)
+		if not d then
+			errlib.throw{etype='io',msg='lj92bench: '..tostring(err)}
+		end
+		return d.img,d:get_imgspec()
+	end
+	local spec={
+		width=opts.width,
+		height=opts.height,
+		bpp=opts.bpp,
+		endian='little',
+		black_level=128,
+		cfa_pattern='\0\1\1\2',
+		data=lbuf.new(opts.width*opts.height*opts.bpp/8),
+	}
+	-- a band of noisy background with a few stars, repeated to fill the image
+	local rows=64
+	local bspec=util.extend_table({},spec)
+	bspec.height=rows
+	bspec.data=lbuf.new(opts.width*rows*opts.bpp/8)
+	local band=rawimg.bind_lbuf(bspec)
+	local max=2^opts.bpp - 1
+	math.randomseed(1)
+	for y=0,rows-1 do
+		for x=0,opts.width-1 do
+			local v=spec.black_level + 64 + (x%2)*16 + math.random(0,opts.noise)
+			if x%397 < 3 and y%31 < 3 then
+				v=max - math.random(0,opts.noise)
+			end
+			band:set_pixel(x,y,math.min(v,max))
+		end
+	end
+	spec.data:fill(bspec.data)
+	return rawimg.bind_lbuf(spec),spec
+end
+
+local function best_time(reps,f)
+	local best
+	for i=1,reps do
+		local t0=ticktime.get()
+		f()
+		local t=ticktime.elapsed(t0)
+		if not best or t < best then
+			best=t
+		end
+	end
+	return best
+end
+
+function m.run(opts)
+	opts=util.extend_table({
+		width=4000,
+		height=3000,
+		bpp=12,
+		noise=32,
+		tiles={128,256,512},
+		predictors={1,6},
+		reps=3,
+	},opts)
+	local prev_threads=rawimg.get_threads()
+	local max_threads=rawimg.set_threads(0)
+	if not opts.threads then
+		opts.threads={1}
+		if max_threads > 1 then
+			table.insert(opts.threads,max_threads)
+		end
+	end
+	local img,spec=make_img(opts)
+	local size=spec.width*spec.height*spec.bpp/8
+	local mb=size/(1024*1024)
+	printf('%dx%d %d bpp %.2f MB\n',spec.width,spec.height,spec.bpp,mb)
+	printf('%5s %4s %7s %6s %9s %9s %9s\n','tile','pred','threads','ratio','enc MB/s','per core','dec MB/s')
+	for _,tile in ipairs(opts.tiles) do
+		for _,pred in ipairs(opts.predictors) do
+			for _,threads in ipairs(opts.threads) do
+				rawimg.set_threads(threads)
+				local eopts={tile_width=tile,tile_height=tile,predictor=pred}
+				local data,sizes
+				local t=best_time(opts.reps,function()
+					data,sizes=img:encode_lj92(eopts)
+				end)
+				local offsets={}
+				local off=0
+				for i,s in ipairs(sizes) do
+					offsets[i]=off
+					off=off + s
+				end
+				local dspec=util.extend_table({},spec,{keys={'width','height','bpp','endian'}})
+				dspec.data=lbuf.new(size)
+				local tiles={data=data,offsets=offsets,sizes=sizes,tile_width=tile,tile_height=tile}
+				local td=best_time(opts.reps,function()
+					rawimg.decode_lj92(dspec,tiles)
+				end)
+				printf('%5d %4d %7d %6.3f %9.1f %9.1f %9.1f\n',
+					tile,pred,threads,size/data:len(),mb/t,mb/(t*threads),mb/td)
+			end
+		end
+	end
+	rawimg.set_threads(prev_threads)
+end
+
+return m
@@ -0,0 +1,150 @@
+--[[
+benchmark live view YUV viewport to RGB conversion for each supported implementation
+
+usage:
+!m=require'extras/lvconvbench'
+!m.run(options)
+options:{
+	file=string     -- lvdump file to read frames from, default synthetic frames
+	frames=number   -- maximum number of frames to use, default 30
+	fb_type=string  -- synthetic frame type, yuv8, yuv8b or yuv8c. default yuv8
+	width=number    -- synthetic frame width, default 720
+	height=number   -- synthetic frame height, default 480
+	impls={...}     -- implementations to test, default all supported, see liveimg.get_yuv_impls
+	skip={...}      -- skip values to test, default false,true
+	output=string   -- pimg for planar pimgs, packed for packed RGB lbufs. default pimg
+	reps=number     -- repetitions over all frames, best time is reported. default 5
+	roi={x,y,w,h}   -- convert only this viewport rectangle, default whole viewport
+	scale=number    -- integer upscaling of the output, default 1
+}
+prints frames per second and megapixels of output per second
+]]
+local m={}
+
+local fb_types={yuv8=0,yuv8b=2,yuv8c=3}
+
+local function read_frames(opts)
+	local reader,err=chdku.lvdump_open(opts.file)
+	if not reader then
+		errlib.throw{etype='bad_arg',msg='lvconvbench: '..tostring(err)}
+	end
+	local frames={}
+	for i=1,reader:count() do
+		if #frames >= opts.frames then
+			break
+		end
+		-- frames are kept, so copy rather than use the reader's buffers
+		local frame=reader:read(i,lbuf.new(0))
+		-- frames without viewport data, e.g. from lvdump with only the bitmap selected, are ignored
+		local vp_desc=frame:get_i32(20)
+		if vp_desc > 0 and frame:get_i32(vp_desc + 4) > 0 then
+			table.insert(frames,frame)
+		end
+	end
+	reader:close()
+	if #frames == 0 then
+		errlib.throw{etype='bad_arg',msg='lvconvbench: no viewport frames in file'}
+	end
+	return frames
+end
+
+-- protocol 2.2 header with only a viewport, filled with a gradient and noise
+local function make_frames(opts)
+	local fb_type=fb_types[opts.fb_type]
+	if not fb_type then
+		errlib.throw{etype='bad_arg',msg='lvconvbench: invalid fb_type '..tostring(opts.fb_type)}
+	end
+	local bpp=(fb_type == 0) and 12 or 16
+	local data_start=32 + 36
+	local row_bytes=opts.width*bpp/8
+	local frame=lbuf.new(data_start + row_bytes*opts.height)
+	frame:set_i32(0,2,2,0,0,0,32,0,0)
+	frame:set_i32(32,fb_type,data_start,opts.width,opts.width,opts.height,0,0,0,0)
+	local row=lbuf.new(row_bytes)
+	math.randomseed(1)
+	for i=0,row_bytes-1 do
+		row:set_u8(i,(math.floor(i*256/row_bytes) + math.random(0,15))%256)
+	end
+	frame:fill(row,data_start)
+	local frames={}
+	for i=1,opts.frames do
+		frames[i]=frame
+	end
+	return frames
+end
+
+function m.run(opts)
+	opts=util.extend_table({
+		frames=30,
+		fb_type='yuv8',
+		width=720,
+		height=480,
+		impls=liveimg.get_yuv_impls(),
+		skip={false,true},
+		output='pimg',
+		reps=5,
+	},opts)
+	if opts.output ~= 'pimg' and opts.output ~= 'packed' then
+		errlib.throw{etype='bad_arg',msg='lvconvbench: invalid output '..tostring(opts.output)}
+	end
+	local frames
+	if opts.file then
+		frames=read_frames(opts)
+	else
+		frames=make_frames(opts)
+	end
+	local fb_type,_,_,width,height=frames[1]:get_i32(frames[1]:get_i32(20),5)
+	printf('%d frames type %d %dx%d to %s\n',#frames,fb_type,width,height,opts.output)
+	-- only pass a rectangle if requested, so the default measures the whole viewport path
+	local rect
+	if opts.roi or opts.scale then
+		rect={scale=opts.scale}
+		if opts.roi then
+			rect.x,rect.y,rect.width,rect.height=unpack(opts.roi)
+			printf('roi %d,%d %dx%d',rect.x,rect.y,rect.width,rect.height)
+		end
+		printf(' scale %d\n',opts.scale or 1)
+	end
+	printf('%8s %5s %9s %9s %7s\n','impl','skip','frames/s','MP/s','speedup')
+	local prev_impl=liveimg.get_yuv_impl()
+	for _,skip in ipairs(opts.skip) do
+		local base
+		local packed_opts={skip=skip}
+		if rect then
+			util.extend_table(packed_opts,rect)
+		end
+		for _,name in ipairs(opts.impls) do
+			local status,err=liveimg.set_yuv_impl(name)
+			if not status then
+				liveimg.set_yuv_impl(prev_impl)
+				errlib.throw{etype='bad_arg',msg='lvconvbench: '..tostring(err)}
+			end
+			local pimg,lb
+			local pixels=0
+			local best
+			for i=1,opts.reps do
+				local t0=ticktime.get()
+				pixels=0
+				for _,frame in ipairs(frames) do
+					if opts.output == 'packed' then
+						local w,h
+						lb,w,h=liveimg.get_viewport_packed(lb,frame,packed_opts)
+						pixels=pixels + w*h
+					else
+						pimg=liveimg.get_viewport_pimg(pimg,frame,skip,rect)
+						pixels=pixels + pimg:width()*pimg:height()
+					end
+				end
+				local t=ticktime.elapsed(t0)
+				if not best or t < best then
+					best=t
+				end
+			end
+			base=base or best
+			printf('%8s %5s %9.1f %9.1f %7.2f\n',name,tostring(skip),#frames/best,pixels/(best*1000000),base/best)
+		end
+	end
+	liveimg.set_yuv_impl(prev_impl)
+end
+
+return m
@@ -0,0 +1,121 @@
+--[[
+benchmark rawimg bulk operations with different thread counts
+
+usage:
+!m=require'extras/rawbench'
+!m.run(options)
+options:{
+	width=number   -- image width, default 4000
+	height=number  -- image height, default 3000
+	bpp=number     -- default 12
+	threads={...}  -- thread counts to test, default 1,2,4... up to number of CPUs
+	reps=number    -- repetitions of each operation, best time is reported. default 3
+	ops={...}      -- operation names to run, default all
+	file=string    -- DNG file to use instead of a synthetic image
+}
+prints the time for each operation and thread count, and the speedup relative to the first thread count
+]]
+local m={}
+
+m.ops={
+	{'convert16',function(b) b.img:convert{bpp=16,endian='little',lbuf=b.conv_lb} end},
+	{'rgb_thumb',function(b) b.img:make_rgb_thumb(640,480) end},
+	{'patch',function(b) b.img:patch_pixels() end},
+	{'find_bad',function(b) b.img:find_bad_pixels{sigma=6} end},
+	{'stack_add',function(b) b.stack:add(b.img) end},
+	{'stack_mean',function(b) b.stack:get_mean{lbuf=b.mean_lb} end},
+	{'stack_thumb',function(b) b.stack:make_rgb_thumb(640,480) end},
+	{'demosaic',function(b) b.img:demosaic{rows=256,lbuf=b.band_lb} end},
+	{'find_stars',function(b) b.img:find_stars() end},
+	{'warp',function(b) b.img:warp({xx=1,xy=0,tx=0.5,yx=0,yy=1,ty=0.5},{lbuf=b.warp_lb}) end},
+}
+
+local function make_img(opts)
+	if opts.file then
+		local d,err=dng.load(opts.file)
+		if not d then
+			errlib.throw{etype='io',msg='rawbench: '..tostring(err)}
+		end
+		return d.img,d:get_imgspec()
+	end
+	local spec={
+		width=opts.width,
+		height=opts.height,
+		bpp=opts.bpp,
+		endian='little',
+		black_level=128,
+		cfa_pattern='\0\1\1\2',
+		data=lbuf.new(opts.width*opts.height*opts.bpp/8),
+	}
+	-- pseudo random fill, without a per pixel Lua call
+	local seed=''
+	for i=1,4096 do
+		seed=seed..string.char((i*7919)%251)
+	end
+	spec.data:fill(seed)
+	return rawimg.bind_lbuf(spec),spec
+end
+
+function m.run(opts)
+	opts=util.extend_table({
+		width=4000,
+		height=3000,
+		bpp=12,
+		reps=3,
+	},opts)
+	local max_threads=rawimg.set_threads(0)
+	if not opts.threads then
+		opts.threads={}
+		local n=1
+		while n < max_threads do
+			table.insert(opts.threads,n)
+			n=n*2
+		end
+		table.insert(opts.threads,max_threads)
+	end
+	local ops=m.ops
+	if opts.ops then
+		local want=util.flag_table(opts.ops)
+		ops={}
+		for _,op in ipairs(m.ops) do
+			if want[op[1]] then
+				table.insert(ops,op)
+			end
+		end
+	end
+
+	local b={}
+	local spec
+	b.img,spec=make_img(opts)
+	spec.data=nil
+	b.stack=rawimg.stack_new(spec)
+	b.conv_lb=lbuf.new(b.img:width()*b.img:height()*2)
+	b.mean_lb=lbuf.new(b.img:width()*b.img:height()*2)
+	b.band_lb=lbuf.new(b.img:width()*256*6)
+	b.warp_lb=lbuf.new(b.img:width()*b.img:height()*b.img:bpp()/8)
+	printf('%dx%d %d bpp, %d CPUs\n',b.img:width(),b.img:height(),b.img:bpp(),max_threads)
+
+	local base={}
+	for _,n in ipairs(opts.threads) do
+		printf('threads %d\n',rawimg.set_threads(n))
+		for _,op in ipairs(ops) do
+			local name,f=op[1],op[2]
+			local best
+			for i=1,opts.reps do
+				local t0=ticktime.get()
+				f(b)
+				local t=ticktime.elapsed(t0)
+				if not best or t < best then
+					best=t
+				end
+			end
+			if not base[name] then
+				base[name]=best
+			end
+			printf(' %-12s %8.4f %5.2fx\n',name,best,base[name]/best)
+		end
+	end
+	rawimg.set_threads(0)
+end
+
+return m
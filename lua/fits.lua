@@ -0,0 +1,245 @@
+--[[
+FITS output for raw images
+writes the raw CFA data or demosaiced RGB planes of a rawimg, with header cards from the DNG metadata
+data is converted and written a row or band at a time, without a full size copy, so frames can be
+written directly from remotecap raw data without an intermediate DNG
+]]
+local m={}
+
+m.BLOCK_SIZE=2880
+
+--[[
+format an 80 character header card
+value may be a string, number or boolean. nil for cards like COMMENT, where comment is the text
+]]
+function m.card(key,value,comment)
+	local s
+	if value == nil then
+		s=string.format('%-8s%s',key,comment or '')
+	else
+		local v
+		if type(value) == 'boolean' then
+			v=string.format('%20s',value and 'T' or 'F')
+		elseif type(value) == 'number' then
+			if value == math.floor(value) and math.abs(value) < 2^53 then
+				v=string.format('%20d',value)
+			else
+				v=string.format('%20.10G',value)
+			end
+		else
+			-- quotes are doubled, and strings padded to at least 8 characters
+			v=string.format("'%-8s'",(string.gsub(tostring(value),"'","''")))
+		end
+		s=string.format('%-8s= %s',key,v)
+		if comment then
+			s=s..' / '..comment
+		end
+	end
+	return string.sub(s..string.rep(' ',80),1,80)
+end
+
+--[[
+build a header from an array of {key,value,comment}, ending with END and padded to the block size
+]]
+function m.header(cards)
+	local t={}
+	for i,c in ipairs(cards) do
+		t[i]=m.card(c[1],c[2],c[3])
+	end
+	table.insert(t,m.card('END'))
+	local s=table.concat(t)
+	return s..string.rep(' ',(m.BLOCK_SIZE - #s%m.BLOCK_SIZE)%m.BLOCK_SIZE)
+end
+
+local cfa_names={[0]='R','G','B'}
+
+--[[
+CFA pattern as a BAYERPAT string like RGGB, for the pixel at x,y of the 4 byte pattern
+]]
+function m.bayer_pattern(cfa_pattern,x,y)
+	local t={}
+	for i=0,3 do
+		local b=cfa_pattern:byte(((x + i)%2) + ((y + math.floor(i/2))%2)*2 + 1)
+		t[i+1]=cfa_names[b] or '?'
+	end
+	return table.concat(t)
+end
+
+-- EXIF date like 2020:01:02 03:04:05 to FITS, and the same time converted from local to UTC
+local function exif_date(s,subsec)
+	local year,month,day,hour,min,sec=string.match(s or '','^(%d+):(%d+):(%d+) (%d+):(%d+):(%d+)')
+	if not year then
+		return
+	end
+	local frac=''
+	if subsec and string.match(subsec,'^%d+$') then
+		frac='.'..subsec
+	end
+	local t=os.time{year=tonumber(year),month=tonumber(month),day=tonumber(day),
+					hour=tonumber(hour),min=tonumber(min),sec=tonumber(sec)}
+	return string.format('%s-%s-%sT%s:%s:%s%s',year,month,day,hour,min,sec,frac),
+		t and os.date('!%Y-%m-%dT%H:%M:%S',t)..frac
+end
+
+--[[
+header cards from the metadata of dng object d, which may be a bound header
+opts {
+	serial=string -- camera serial number, default the DNG CameraSerialNumber if present
+	black=number -- black level of the written data, default DNG black level
+}
+]]
+function m.dng_cards(d,opts)
+	opts=opts or {}
+	local cards={}
+	local function add(key,value,comment)
+		if value ~= nil then
+			table.insert(cards,{key,value,comment})
+		end
+	end
+	local main=d.main_ifd.byname
+	add('INSTRUME',main.Model and main.Model:get_ascii(),'camera model')
+	add('SERIALNO',opts.serial or (main.CameraSerialNumber and main.CameraSerialNumber:get_ascii()),'camera serial number')
+	add('SWCREATE',main.Software and main.Software:get_ascii())
+	local exif=d.exif_ifd and d.exif_ifd.byname or {}
+	if exif.ExposureTime then
+		local v=exif.ExposureTime:getel()
+		if v[2] ~= 0 then
+			add('EXPTIME',v[1]/v[2],'[s] exposure time')
+		end
+	end
+	if exif.ISOSpeedRatings then
+		add('ISOSPEED',exif.ISOSpeedRatings:getel(),'ISO')
+	end
+	if exif.FocalLength then
+		local v=exif.FocalLength:getel()
+		if v[2] ~= 0 then
+			add('FOCALLEN',v[1]/v[2],'[mm] focal length')
+		end
+	end
+	if exif.FNumber then
+		local v=exif.FNumber:getel()
+		if v[2] ~= 0 then
+			add('FOCRATIO',v[1]/v[2],'f number')
+		end
+	end
+	if exif.DateTimeOriginal then
+		local dloc,dutc=exif_date(exif.DateTimeOriginal:get_ascii(),
+								exif.SubsecTimeOriginal and exif.SubsecTimeOriginal:get_ascii())
+		add('DATE-OBS',dutc,'UTC, from camera clock in PC time zone')
+		add('DATE-LOC',dloc,'camera clock')
+	end
+	add('BLKLEVEL',opts.black or d.raw_ifd.byname.BlackLevel:getel(),'black level of data')
+	return cards
+end
+
+--[[
+write raw image data as FITS
+fits.write(fh,d,img,opts)
+fh: file handle open for binary writing
+d: dng object or bound header for metadata
+img: rawimg with the data, e.g. d.img or a bound remotecap frame
+opts {
+	planes=string -- 'cfa' for raw CFA data, 'rgb' for demosaiced RGB planes. default cfa
+	bitpix=number -- 16 or 32, default 16. rgb only supports 16
+	region=string -- 'active' or 'all', default active
+	black=bool -- subtract the black level from cfa data, for calibration. with bitpix 16, values are clipped at 0
+	serial=string -- camera serial number
+	cards=table -- additional {key,value,comment} header cards
+	method, wb, white, gamma, band -- rgb options, see dng dump_demosaic
+}
+errors are thrown
+]]
+function m.write(fh,d,img,opts)
+	opts=util.extend_table({
+		planes='cfa',
+		bitpix=16,
+		region='active',
+		band=64,
+	},opts)
+	if opts.planes ~= 'cfa' and opts.planes ~= 'rgb' then
+		errlib.throw{etype='bad_arg',msg='fits: invalid planes '..tostring(opts.planes)}
+	end
+	if opts.bitpix ~= 16 and (opts.bitpix ~= 32 or opts.planes == 'rgb') then
+		errlib.throw{etype='bad_arg',msg='fits: invalid bitpix '..tostring(opts.bitpix)}
+	end
+	local top,left,bottom,right
+	if opts.region == 'active' then
+		top,left,bottom,right=img:active_area()
+	elseif opts.region == 'all' then
+		top,left,bottom,right=0,0,img:height(),img:width()
+	else
+		errlib.throw{etype='bad_arg',msg='fits: invalid region '..tostring(opts.region)}
+	end
+	local width=right - left
+	local height=bottom - top
+	-- black level subtracted from cfa data, and the black level of the written data
+	local sub_black=0
+	local data_black
+	if opts.planes == 'rgb' or opts.black then
+		data_black=0
+		if opts.planes == 'cfa' then
+			sub_black=d.raw_ifd.byname.BlackLevel:getel()
+		end
+	end
+	local cards={
+		{'SIMPLE',true},
+		{'BITPIX',opts.bitpix},
+		{'NAXIS',(opts.planes == 'rgb') and 3 or 2},
+		{'NAXIS1',width},
+		{'NAXIS2',height},
+	}
+	if opts.planes == 'rgb' then
+		table.insert(cards,{'NAXIS3',3})
+	end
+	if opts.bitpix == 16 then
+		table.insert(cards,{'BZERO',32768})
+		table.insert(cards,{'BSCALE',1})
+	end
+	table.insert(cards,{'ROWORDER','TOP-DOWN'})
+	if opts.planes == 'cfa' then
+		table.insert(cards,{'BAYERPAT',m.bayer_pattern(img:cfa_pattern(),left,top)})
+		table.insert(cards,{'XBAYROFF',0})
+		table.insert(cards,{'YBAYROFF',0})
+	end
+	for _,c in ipairs(m.dng_cards(d,{serial=opts.serial,black=data_black})) do
+		table.insert(cards,c)
+	end
+	if opts.cards then
+		for _,c in ipairs(opts.cards) do
+			table.insert(cards,c)
+		end
+	end
+	fh:write(m.header(cards))
+
+	if opts.planes == 'cfa' then
+		img:write_fits(fh,{region=opts.region,bitpix=opts.bitpix,black=sub_black})
+		return
+	end
+	-- each band is written to its rows in the three planes
+	local start=fh:seek()
+	local plane_size=width*height*2
+	local dopts={
+		method=opts.method,
+		region=opts.region,
+		rows=opts.band,
+		wb=opts.wb,
+		white=opts.white,
+		gamma=opts.gamma,
+		planar=true,
+		signed=true,
+		top=0,
+	}
+	local w,rows
+	repeat
+		dopts.lbuf,w,rows=img:demosaic(dopts)
+		for c=0,2 do
+			fh:seek('set',start + c*plane_size + dopts.top*w*2)
+			dopts.lbuf:fwrite(fh,c*w*rows*2,w*rows*2)
+		end
+		dopts.top=dopts.top + rows
+	until dopts.top >= height
+	fh:seek('set',start + 3*plane_size)
+	fh:write(string.rep('\0',(m.BLOCK_SIZE - (3*plane_size)%m.BLOCK_SIZE)%m.BLOCK_SIZE))
+end
+
+return m
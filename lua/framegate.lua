@@ -0,0 +1,165 @@
+--[[
+frame quality gate for remotecap DNG frames
+background, star count, median FWHM and eccentricity are measured with rawimg find_stars
+and compared to the medians of the most recent accepted frames.
+frames outside the limits are rejected (not written) or quarantined (written to a separate directory)
+frames are measured from the little endian raw chunk, before the DNG byte swap
+]]
+local m={}
+
+local gate_methods={}
+
+--[[
+gate=framegate.new(opts)
+opts {
+	action=string -- 'reject' or 'quarantine', default 'quarantine'
+	quarantine_dir=string -- directory for quarantined frames, relative to the frame directory. default 'quarantine'
+	window=number -- number of accepted frames used for the baseline, default 10
+	warmup=number -- frames accepted unconditionally to build the baseline, default 3
+	max_bg=number -- maximum background, relative to baseline, default 1.5
+	min_stars=number -- minimum star count, relative to baseline, default 0.5
+	max_fwhm=number -- maximum median FWHM, relative to baseline, default 1.5
+	max_ecc=number -- maximum increase in median eccentricity, default 0.15
+	star_opts=table -- options for rawimg find_stars
+	log=string -- CSV file to append per frame metrics to
+}
+]]
+function m.new(opts)
+	opts=util.extend_table({
+		action='quarantine',
+		quarantine_dir='quarantine',
+		window=10,
+		warmup=3,
+		max_bg=1.5,
+		min_stars=0.5,
+		max_fwhm=1.5,
+		max_ecc=0.15,
+	},opts)
+	if opts.action ~= 'reject' and opts.action ~= 'quarantine' then
+		errlib.throw{etype='bad_arg',msg='framegate: invalid action '..tostring(opts.action)}
+	end
+	return util.extend_table({
+		opts=opts,
+		history={}, -- metrics of recent accepted frames
+		frames=0,
+		rejected=0,
+	},gate_methods)
+end
+
+local function median(vals)
+	local t=util.extend_table({},vals)
+	table.sort(t)
+	local n=#t
+	if n%2 == 1 then
+		return t[(n+1)/2]
+	end
+	return (t[n/2] + t[n/2+1])/2
+end
+
+--[[
+return the baseline metrics, medians of the accepted frame history
+]]
+function gate_methods:baseline()
+	local r={}
+	for _,k in ipairs{'background','stars','fwhm','ecc'} do
+		local vals={}
+		for i,h in ipairs(self.history) do
+			vals[i]=h[k]
+		end
+		r[k]=median(vals)
+	end
+	return r
+end
+
+--[[
+measure frame metrics
+metrics=gate:measure(img)
+returns {background,stars,fwhm,ecc,time}
+]]
+function gate_methods:measure(img)
+	local t0=ticktime.get()
+	local stats=img:find_stars(self.opts.star_opts):stats()
+	return {
+		background=stats.background,
+		stars=stats.count,
+		fwhm=stats.fwhm,
+		ecc=stats.ecc,
+		time=ticktime.elapsed(t0),
+	}
+end
+
+--[[
+compare metrics to the baseline
+returns true or false,reason
+]]
+function gate_methods:evaluate(metrics)
+	if #self.history < self.opts.warmup then
+		return true
+	end
+	local opts=self.opts
+	local base=self:baseline()
+	if metrics.background > base.background*opts.max_bg then
+		return false,string.format('background %.1f > %.1f',metrics.background,base.background*opts.max_bg)
+	end
+	if metrics.stars < base.stars*opts.min_stars then
+		return false,string.format('stars %d < %.1f',metrics.stars,base.stars*opts.min_stars)
+	end
+	if metrics.fwhm == 0 or metrics.fwhm > base.fwhm*opts.max_fwhm then
+		return false,string.format('fwhm %.2f > %.2f',metrics.fwhm,base.fwhm*opts.max_fwhm)
+	end
+	if metrics.ecc > base.ecc + opts.max_ecc then
+		return false,string.format('ecc %.2f > %.2f',metrics.ecc,base.ecc + opts.max_ecc)
+	end
+	return true
+end
+
+--[[
+check a frame, add it to the baseline if accepted
+status,metrics,reason=gate:check(img,name)
+status is 'ok' or the configured action
+name is used for the log
+]]
+function gate_methods:check(img,name)
+	local metrics=self:measure(img)
+	local ok,reason=self:evaluate(metrics)
+	local status='ok'
+	self.frames=self.frames + 1
+	if ok then
+		table.insert(self.history,metrics)
+		if #self.history > self.opts.window then
+			table.remove(self.history,1)
+		end
+	else
+		status=self.opts.action
+		self.rejected=self.rejected + 1
+		util.warnf('frame %s %s: %s\n',tostring(name),status,reason)
+	end
+	cli.dbgmsg('gate bg %.1f stars %d fwhm %.2f ecc %.2f %s %.4f\n',
+		metrics.background,metrics.stars,metrics.fwhm,metrics.ecc,status,metrics.time)
+	if self.opts.log then
+		self:write_log(name,metrics,status,reason)
+	end
+	return status,metrics,reason
+end
+
+function gate_methods:write_log(name,metrics,status,reason)
+	local new=(lfs.attributes(self.opts.log,'mode') ~= 'file')
+	fsutil.mkdir_parent(self.opts.log)
+	local fh=fsutil.open_e(self.opts.log,'ab')
+	if new then
+		fh:write('time,name,background,stars,fwhm,ecc,status,reason\n')
+	end
+	fh:write(string.format('%s,%s,%.2f,%d,%.3f,%.3f,%s,%s\n',
+		os.date('%Y-%m-%d %H:%M:%S'),tostring(name),
+		metrics.background,metrics.stars,metrics.fwhm,metrics.ecc,status,reason or ''))
+	fh:close()
+end
+
+--[[
+return the path a quarantined frame should be written to
+]]
+function gate_methods:quarantine_path(filename)
+	return fsutil.joinpath(fsutil.dirname(filename),self.opts.quarantine_dir,fsutil.basename(filename))
+end
+
+return m
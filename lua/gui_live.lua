@@ -17,6 +17,7 @@
 module for live view gui
 ]]
 local stats=require'gui_live_stats'
+local focus=require'gui_live_focus'
 
 local m={
 	vp_par = 2, -- pixel aspect ratio for viewport 1:n, n=1,2
@@ -41,6 +42,7 @@ statslabel -- text for stats
 	resize_canvas_count = 0, -- how many times canvas needed resizing
 	frame_timer_count = 0, -- timer_action calls
 	stats=stats, -- debug access
+	focus=focus,
 }
 
 local screen_aspects = {
@@ -274,55 +276,22 @@ local function update_frame_data(frame)
 	end
 end
 
--- TODO this is just to allow us to read/write a binary integer record size
-local dump_recsize = lbuf.new(4)
-
---[[
-lbuf - optional lbuf to re-use, if possible
-fh - file handle
-returns (possibly new) lbuf or nil on eof
-]]
-local function read_dump_rec(lb,fh)
-	if not dump_recsize:fread(fh) then
-		return
-	end
-	local len = dump_recsize:get_u32()
-	if not lb or lb:len() ~= len then
-		lb = lbuf.new(len)
-	end
-	if lb:fread(fh) then -- on EOF, return nil
-		return lb
-	end
-end
-
 local function init_dump_replay()
 	m.dump_replay = false
-	m.dump_replay_file = io.open(m.dump_replay_filename,"rb")
-	if not m.dump_replay_file then
-		printf("failed to open dumpfile\n")
+	local reader,err = chdku.lvdump_open(m.dump_replay_filename)
+	if not reader then
+		printf("failed to open dumpfile: %s\n",tostring(err))
 		return
 	end
-	local magic = m.dump_replay_file:read(4)
-	if magic ~= 'chlv' then
-		printf("unrecognized file\n")
+	if reader:count() == 0 then
+		printf("no frames in dumpfile\n")
 		return
 	end
 
 	reset_last_frame_vals()
---	m.dump_replay_file:seek('set',4)
-	local header = read_dump_rec(nil,m.dump_replay_file)
-
-	if not header then
-		printf("failed to read header\n")
-		return
-	end
-
-	-- TODO should be defined somewhere
-	if header:get_u32() ~= 1 then
-		printf("incompatible version %s\n",tostring(header:get_u32()))
-		return
-	end
-	gui.infomsg("loading dump ver %s.%s\n",tostring(header:get_u32()),tostring(header:get_u32(4)))
+	gui.infomsg("loading dump ver %s.%s, %d frames\n",tostring(reader.version_major),tostring(reader.version_minor),reader:count())
+	m.dump_replay_reader = reader
+	m.dump_replay_index = 0
 	m.dump_replay = true
 	if not m.dump_replay_frame then
 		m.dump_replay_frame = chdku.live_wrapper()
@@ -331,8 +300,10 @@ end
 
 local function end_dump_replay()
 	m.dump_replay = false
-	m.dump_replay_file:close()
-	m.dump_replay_file=nil
+	if m.dump_replay_reader then
+		m.dump_replay_reader:close()
+		m.dump_replay_reader=nil
+	end
 	m.dump_replay_frame=nil
 	stats:stop()
 end
@@ -341,26 +312,24 @@ local function read_dump_frame()
 	stats:start()
 	stats:start_xfer()
 
-	local data = read_dump_rec(m.dump_replay_frame._frame,m.dump_replay_file)
-	-- EOF, loop
-	if not data then
-		end_dump_replay()
-		init_dump_replay()
-		data = read_dump_rec(m.dump_replay_frame._frame,m.dump_replay_file)
-	end
+	-- loop at the end
+	m.dump_replay_index = m.dump_replay_index % m.dump_replay_reader:count() + 1
+	-- copy so the palette can be overridden without affecting following delta frames
+	local data = m.dump_replay_reader:read(m.dump_replay_index,m.dump_replay_frame._frame or lbuf.new(0))
 	m.dump_replay_frame:set_frame(data)
 	if prefs.gui_force_replay_palette ~= -1 then
 		m.dump_replay_frame._frame:set_u32(chdku.live_frame_map.palette_type,prefs.gui_force_replay_palette)
 	end
 
 	update_frame_data(m.dump_replay_frame)
+	focus.update(m.dump_replay_frame,m.vp_par)
 	stats:end_xfer(m.dump_replay_frame._frame:len())
 	-- TODO
 	update_canvas_size()
 end
 
 local function end_dump()
-	if con.live and con.live.dump_fh then
+	if con.live and con.live.dump_writer then
 		gui.infomsg('%d bytes recorded to %s\n',tonumber(con.live.dump_size),tostring(con.live.dump_fn))
 		con:live_dump_end()
 	end
@@ -370,7 +339,7 @@ local function record_dump()
 	if not m.dump_active then
 		return
 	end
-	if not con.live.dump_fh then
+	if not con.live.dump_writer then
 		local status,err = con:live_dump_start()
 		if not status then
 			printf('error starting dump:%s\n',tostring(err))
@@ -421,6 +390,50 @@ local function toggle_play_dump(self,state)
 end
 
 
+local function stop_pump()
+	if m.pump_active then
+		m.pump_active = false
+		if con:is_connected() then
+			con:live_pump_stop()
+		end
+	end
+end
+
+--[[
+start or update the background fetch for what, at most at the target frame rate
+returns false if the pump is disabled or not available
+]]
+local function start_pump(what)
+	if not prefs.gui_live_pump or m.pump_unavailable then
+		stop_pump()
+		return false
+	end
+	local status,err = con:live_pump_start(what,{interval=m.frame_time})
+	if not status then
+		printf('live pump not available, fetching in gui: %s\n',tostring(err))
+		m.pump_unavailable = true
+		return false
+	end
+	m.pump_active = true
+	return true
+end
+
+local function get_frame_error(err)
+	stop_pump()
+	end_dump()
+	printf('error getting frame: %s\n',tostring(err))
+	gui.update_connection_status() -- update connection status on error, to prevent spamming
+	stats:stop()
+end
+
+local function new_frame(lv)
+	m.lv_frame_num = m.lv_frame_num + 1
+	update_frame_data(lv)
+	focus.update(lv,m.vp_par)
+	record_dump()
+	update_canvas_size()
+end
+
 local function timer_action(self)
 	m.frame_timer_count = m.frame_timer_count + 1
 	if m.update_should_run() then
@@ -435,34 +448,45 @@ local function timer_action(self)
 			-- gui run for a short time would probably do it too
 			m.skip_frames = 1
 		end
-		m.lv_frame_num = m.lv_frame_num + 1
 		if m.dump_replay then
+			m.lv_frame_num = m.lv_frame_num + 1
 			read_dump_frame()
 		else
 			stats:start()
 			local what=get_fb_selection()
 			if what == 0 then
+				stop_pump()
 				return
 			end
-			stats:start_xfer()
-			local status,err = con:live_get_frame(what)
-			if not status then
-				end_dump()
-				printf('error getting frame: %s\n',tostring(err))
-				gui.update_connection_status() -- update connection status on error, to prevent spamming
-				stats:stop()
+			if start_pump(what) then
+				-- only a frame already fetched in the background is used, so USB latency doesn't block the UI
+				local status,r = pcall(con.live_pump_frame,con)
+				if not status then
+					get_frame_error(r)
+				elseif r then
+					stats:pump_frame(con:live_pump_stats(),con.live._frame:len(),con:get_counters().live_alloc)
+					new_frame(con.live)
+				end
 			else
-				stats:end_xfer(con.live._frame:len())
-				update_frame_data(con.live)
-				record_dump()
-				update_canvas_size()
+				stats:start_xfer(con:get_counters().live_alloc)
+				local status,err = con:live_get_frame(what)
+				if not status then
+					get_frame_error(err)
+				else
+					stats:end_xfer(con.live._frame:len(),con:get_counters().live_alloc)
+					new_frame(con.live)
+				end
 			end
 		end
 		-- IUP docs say action shouldn't be called directly, use iup.Update(m.icnv)
 		-- or iup.Redraw(m.icnv,0) instead but those appear to trigger
 		-- multiple redraws, action seems to work
-		m.icnv:action()
+		-- with the pump, ticks without a new frame don't redraw, so draw FPS reflects real frames
+		if m.lv_frame_num ~= m.lv_frame_drawn then
+			m.icnv:action()
+		end
 	else
+		stop_pump()
 		stats:stop()
 	end
 	-- updating label appears to trigger a refresh on some gtk versions, only do if changed
@@ -539,6 +563,21 @@ local function update_fps(val)
 	end
 end
 
+--[[
+canvas position of viewport pixel x,y, from the top left of the visible area
+]]
+local function vp_to_canvas(x,y)
+	local lv = m.get_current_frame_data()
+	return (lv.vp.margin_left + x)/m.vp_par,
+		(lv.vp.margin_bot + lv.vp.visible_height - y)*m.vp_aspect_factor
+end
+
+local function canvas_to_vp(x,y)
+	local lv = m.get_current_frame_data()
+	return x*m.vp_par - lv.vp.margin_left,
+		lv.vp.margin_bot + lv.vp.visible_height - y/m.vp_aspect_factor
+end
+
 local redraw_canvas = errutil.wrap(function(self)
 	if m.tabs.value ~= m.container then
 		return;
@@ -569,6 +608,7 @@ local redraw_canvas = errutil.wrap(function(self)
 						lv.vp.margin_left/m.vp_par,
 						lv.vp.margin_bot)
 				end
+				focus.draw_roi(ccnv,lv,m.vp_par,vp_to_canvas)
 			end
 		end
 		if m.bm_active then
@@ -682,6 +722,10 @@ function m.init()
 					m.statslabel,
 					tabtitle="Statistics",
 				},
+				iup.vbox{
+					focus.init(),
+					tabtitle="Focus",
+				},
 				iup.vbox{
 					tabtitle="Debug",
 					iup.toggle{title="Dump to file",action=toggle_dump},
@@ -724,6 +768,20 @@ function m.init()
 		self.ccnv:Kill()
 	end
 
+	-- place the focus ROI
+	function icnv:button_cb(button,pressed,x,y,status)
+		if button ~= iup.BUTTON1 or pressed ~= 1 or not focus.enabled then
+			return
+		end
+		local lv = m.get_current_frame_data()
+		if not lv or not lv.vp then
+			return
+		end
+		local _,h = gui.parsesize(self.rastersize)
+		focus.set_center(canvas_to_vp(x,h - 1 - y))
+		self:action()
+	end
+
 	function icnv:resize_cb(w,h)
 		gui.dbgmsg("Resize: Width="..w.."   Height="..h..'\n')
 	end
@@ -742,6 +800,8 @@ function m.get_container_title()
 end
 function m.on_connect_change(lcon)
 	m.live_con_valid = false
+	-- disconnecting stops the pump
+	m.pump_active = false
 	if con:is_connected() then
 		reset_last_frame_vals()
 		if con:live_is_api_compatible() then
@@ -766,6 +826,7 @@ function m.update_run_state(state)
 		if m.timer then
 			m.timer.run = "NO"
 		end
+		stop_pump()
 		stats:stop()
 	end
 end
@@ -795,6 +856,7 @@ prefs._add('gui_live_sched','boolean','use scheduler for live updates',false,
 )
 -- windows degrades gracefully if req rate is too high
 prefs._add('gui_live_dropframes','boolean','drop frames if target fps too high',(sys.ostype() ~= 'Windows'))
+prefs._add('gui_live_pump','boolean','fetch live frames in a background thread if available',true)
 prefs._add('gui_dump_palette','boolean','dump live palette data on state change')
 prefs._add('gui_context_plus','boolean','use IUP context plus if available')
 prefs._add('gui_force_replay_palette','number','override palette type dump replay, -1 disable',-1)
@@ -0,0 +1,255 @@
+--[[
+live view focus metric display for gui_live, see liveimg.focus_metric
+measures a square ROI of each new frame, centered where the live view was last clicked
+and shows it magnified, converting only the ROI
+]]
+local m={
+	enabled=false,
+	hist_size=200, -- frames of history graphed
+	roi_size=128, -- ROI height in viewport pixels, width is scaled by the viewport pixel aspect ratio
+	radius=8,
+	zoom_size=256, -- zoom view size, the ROI is upscaled by the largest integer factor that fits
+	hist={},
+}
+
+local graph_colors={
+	lap_var={64,220,64},
+	hfr={255,160,32},
+}
+
+function m.reset()
+	m.hist={}
+	m.zoom_img=nil
+	m.best_lap=nil
+	m.best_hfr=nil
+	m.update_labels()
+	m.redraw_graph()
+	m.redraw_zoom()
+end
+
+--[[
+x,y,width,height of the ROI in viewport pixels for fb desc vp
+par: viewport pixel aspect ratio, 1 or 2
+]]
+function m.get_roi(vp,par)
+	local vw,vh = vp.visible_width,vp.visible_height
+	local h = math.min(m.roi_size,vh)
+	local w = math.min(m.roi_size*par,vw)
+	local cx = m.center_x or vw/2
+	local cy = m.center_y or vh/2
+	local x = math.max(0,math.min(vw - w,math.floor(cx - w/2)))
+	local y = math.max(0,math.min(vh - h,math.floor(cy - h/2)))
+	return x,y,w,h
+end
+
+function m.set_center(x,y)
+	m.center_x = x
+	m.center_y = y
+	-- values from a different star aren't comparable
+	m.reset()
+end
+
+--[[
+measure the current frame of live wrapper lv, if enabled
+]]
+function m.update(lv,par)
+	if not m.enabled or not lv._frame or not lv.vp then
+		return
+	end
+	local x,y,w,h = m.get_roi(lv.vp,par)
+	if w <= 0 or h <= 0 then
+		return
+	end
+	local r = liveimg.focus_metric(lv._frame,{x=x,y=y,width=w,height=h,radius=m.radius})
+	if not r then
+		return
+	end
+	local scale = math.max(1,math.min(16,math.floor(m.zoom_size/m.roi_size)))
+	m.zoom_img = liveimg.get_viewport_pimg(m.zoom_img,lv._frame,par == 2,{x=x,y=y,width=w,height=h,scale=scale})
+	m.redraw_zoom()
+	table.insert(m.hist,r)
+	if #m.hist > m.hist_size then
+		table.remove(m.hist,1)
+	end
+	if not m.best_lap or r.lap_var > m.best_lap then
+		m.best_lap = r.lap_var
+	end
+	if r.hfr > 0 and (not m.best_hfr or r.hfr < m.best_hfr) then
+		m.best_hfr = r.hfr
+	end
+	m.update_labels()
+	m.redraw_graph()
+end
+
+--[[
+draw the ROI outline on the live canvas
+to_canvas: function(vx,vy) returning canvas coordinates of a viewport position
+]]
+function m.draw_roi(ccnv,lv,par,to_canvas)
+	if not m.enabled or not lv.vp then
+		return
+	end
+	local x,y,w,h = m.get_roi(lv.vp,par)
+	local x0,y0 = to_canvas(x,y + h)
+	local x1,y1 = to_canvas(x + w,y)
+	ccnv:Foreground(cd.EncodeColor(255,255,0))
+	ccnv:Rect(x0,x1,y0,y1)
+	local r = m.hist[#m.hist]
+	if r and r.hfr > 0 then
+		-- circle of twice the hfr, roughly the visible extent of the star
+		local sx,sy = to_canvas(r.star_x,r.star_y)
+		local ex,ey = to_canvas(r.star_x + 2*r.hfr,r.star_y + 2*r.hfr)
+		ccnv:Arc(sx,sy,math.max(4,2*math.abs(ex - sx)),math.max(4,2*math.abs(ey - sy)),0,360)
+	end
+end
+
+function m.update_labels()
+	if not m.label then
+		return
+	end
+	local r = m.hist[#m.hist]
+	local s
+	if r then
+		s = string.format('Lap var: %.1f\nBest: %.1f\nHFR: %.2f\nBest: %s\nPeak: %d%s',
+			r.lap_var,m.best_lap,r.hfr,m.best_hfr and string.format('%.2f',m.best_hfr) or '-',
+			r.peak,r.saturated and ' sat' or '')
+	else
+		s = 'Lap var: -\nBest: -\nHFR: -\nBest: -\nPeak: -'
+	end
+	if m.label.title ~= s then
+		m.label.title = s
+	end
+end
+
+local function draw_series(ccnv,w,h,key,invert)
+	local vmax = 0
+	for _,r in ipairs(m.hist) do
+		if r[key] > vmax then
+			vmax = r[key]
+		end
+	end
+	if vmax == 0 then
+		return
+	end
+	local c = graph_colors[key]
+	ccnv:Foreground(cd.EncodeColor(c[1],c[2],c[3]))
+	ccnv:Begin(cd.OPEN_LINES)
+	for i,r in ipairs(m.hist) do
+		local x = (i - 1)*(w - 1)/(m.hist_size - 1)
+		local v = r[key]/vmax
+		if invert and r[key] > 0 then
+			v = 1 - v
+		end
+		ccnv:Vertex(x,v*(h - 1))
+	end
+	ccnv:End()
+end
+
+--[[
+lap_var history, higher is better, and hfr, inverted so higher is also better
+each scaled to its maximum in the history
+]]
+local function draw_graph(self)
+	local ccnv = self.dccnv
+	if not ccnv then
+		return
+	end
+	ccnv:Activate()
+	ccnv:Clear()
+	local w,h = ccnv:GetSize()
+	draw_series(ccnv,w,h,'lap_var')
+	draw_series(ccnv,w,h,'hfr',true)
+	ccnv:Flush()
+end
+
+function m.redraw_graph()
+	if m.graph and m.graph.dccnv then
+		m.graph:action()
+	end
+end
+
+-- ROI magnified by integer scaling during conversion, centered in the zoom canvas
+local function draw_zoom(self)
+	local ccnv = self.dccnv
+	if not ccnv then
+		return
+	end
+	ccnv:Activate()
+	ccnv:Clear()
+	if m.enabled and m.zoom_img then
+		local w,h = ccnv:GetSize()
+		local iw,ih = m.zoom_img:width(),m.zoom_img:height()
+		m.zoom_img:put_to_cd_canvas(ccnv,math.floor((w - iw)/2),math.floor((h - ih)/2))
+	end
+	ccnv:Flush()
+end
+
+function m.redraw_zoom()
+	if m.zoom and m.zoom.dccnv then
+		m.zoom:action()
+	end
+end
+
+--[[
+create the controls, returns a vbox for a tab
+]]
+local function map_cb(self)
+	self.ccnv = cd.CreateCanvas(cd.IUP,self)
+	self.dccnv = cd.CreateCanvas(cd.DBUFFER,self.ccnv)
+	self.dccnv:SetBackground(cd.EncodeColor(32,32,32))
+end
+
+local function unmap_cb(self)
+	self.dccnv:Kill()
+	self.ccnv:Kill()
+	self.dccnv = nil
+	self.ccnv = nil
+end
+
+function m.init()
+	m.graph = iup.canvas{rastersize="200x80",border="NO",expand="NO",map_cb=map_cb,unmap_cb=unmap_cb}
+	m.graph.action = errutil.wrap(draw_graph)
+	m.zoom = iup.canvas{rastersize=m.zoom_size.."x"..m.zoom_size,border="NO",expand="NO",map_cb=map_cb,unmap_cb=unmap_cb}
+	m.zoom.action = errutil.wrap(draw_zoom)
+	if iup.flatlabel then
+		m.label = iup.flatlabel{size="90x40",alignment="ALEFT:ATOP"}
+	else
+		m.label = iup.label{size="90x40",alignment="ALEFT:ATOP"}
+	end
+	m.update_labels()
+	return iup.vbox{
+		iup.toggle{
+			title="Measure focus",
+			action=function(self,state)
+				m.enabled = (state == 1)
+				m.reset()
+			end,
+		},
+		iup.hbox{
+			iup.label{title="ROI size"},
+			iup.text{
+				spin="YES",
+				spinmax="1024",
+				spinmin="16",
+				spininc="16",
+				value=tostring(m.roi_size),
+				spin_cb=function(self,newval)
+					m.roi_size = tonumber(newval)
+					m.reset()
+				end,
+			},
+		},
+		iup.label{title="Click live view to place ROI"},
+		m.label,
+		m.graph,
+		m.zoom,
+		iup.button{
+			title="Reset",
+			action=function(self)
+				m.reset()
+			end,
+		},
+	}
+end
+
+return m
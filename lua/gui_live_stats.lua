@@ -95,6 +95,8 @@ local stats={
 function stats:init_counters()
 	self.frames:reset()
 	self.xfer:reset()
+	self.allocs = 0 -- live data buffer allocations since start, should stay at most 1 for steady frame sizes
+	self.pump = nil -- live pump stats, when frames are fetched in the background
 end
 
 stats:init_counters()
@@ -120,11 +122,31 @@ end
 function stats:end_frame()
 	self.frames:finish()
 end
-function stats:start_xfer()
+-- alloc_count: optional, connection live_alloc counter, from con:get_counters
+function stats:start_xfer(alloc_count)
 	self.xfer:start()
+	self.alloc_start = alloc_count
 end
-function stats:end_xfer(bytes)
+function stats:end_xfer(bytes,alloc_count)
 	self.xfer:finish(bytes)
+	if alloc_count and self.alloc_start then
+		self.allocs = self.allocs + alloc_count - self.alloc_start
+	end
+end
+
+--[[
+frame from the background live pump, replaces xfer timing
+pump: from con:live_pump_stats
+bytes: size of the frame
+alloc_count: connection live_alloc counter, from con:get_counters
+]]
+function stats:pump_frame(pump,bytes,alloc_count)
+	if not self.pump then
+		self.pump_alloc_start = alloc_count
+	end
+	self.pump = pump
+	self.pump_bytes = bytes
+	self.allocs = pump.allocs + alloc_count - self.pump_alloc_start
 end
 
 function stats:get_last_total_ms()
@@ -144,6 +166,8 @@ function stats:get()
 	end
 	
 	local fps_avg = 0
+	local fetch_fps_avg = 0
+	local fetch_dropped = 0
 	local frame_time = 0
 	local tp_bps_avg = 0
 	local bps_avg = 0
@@ -155,7 +179,19 @@ function stats:get()
 		frame_time = self.frames:last_time()
 	end
 
-	if self.xfer.count > 1 then
+	if self.pump then
+		if self.pump.elapsed_ms > 0 then
+			fetch_fps_avg = 1000*self.pump.fetched/self.pump.elapsed_ms
+		end
+		fetch_dropped = self.pump.dropped
+		xfer_time = self.pump.last_fetch_ms
+		xfer_bytes = self.pump_bytes
+		tp_bps_avg = xfer_bytes*fetch_fps_avg
+		if self.pump.fetch_ms > 0 then
+			bps_avg = 1000*xfer_bytes*self.pump.fetched/self.pump.fetch_ms
+		end
+	elseif self.xfer.count > 1 then
+		fetch_fps_avg = 1000/self.xfer:avg_r_time()
 		local avg_bytes = self.xfer:avg_bytes()
 		-- total throughput (against wall time)
 		tp_bps_avg = 1000*avg_bytes/self.xfer:avg_r_time()
@@ -168,19 +204,25 @@ function stats:get()
 	-- TODO this rapidly spams lua with lots of unique strings
 	return string.format(
 [[Running: %s
-FPS: %0.2f
+Draw FPS: %0.2f
+Fetch FPS: %0.2f
+Fetch dropped: %d
 Frame last ms: %.1f
 T/P kb/s: %.1f
 Xfer last ms: %.1f
 Xfer kb: %.1f
-Xfer kb/s: %.1f]],
+Xfer kb/s: %.1f
+Xfer allocs: %d]],
 		run,
 		fps_avg,
+		fetch_fps_avg,
+		fetch_dropped,
 		frame_time,
 		tp_bps_avg/1024,
 		xfer_time,
 		xfer_bytes/1024,
-		bps_avg/1024)
+		bps_avg/1024,
+		self.allocs)
 end
 
 return stats
@@ -0,0 +1,233 @@
+--[[
+live stacking of remotecap DNG frames, using the rawimg stack accumulator
+frames are added from the little endian raw chunk, before the DNG byte swap
+]]
+local m={}
+
+local stack_methods={}
+
+--[[
+stack=livestack.new(opts)
+opts {
+	dst=string -- file name for stacked DNG, default stack.dng
+	float=bool -- use floating point sums
+	min=number -- pixel values outside min-max are not accumulated
+	max=number
+	dark=string -- DNG file to subtract from each frame
+	preview=string -- file name to write PPM preview to
+	preview_every=number -- update preview every N frames, default 1
+	preview_width=number -- preview width, default 640
+	preview_auto=number -- percentile of preview values mapped to white, default 99.5
+	register=bool|string -- align frames to the first using stars, true or 'similarity' or 'affine'
+	star_opts=table -- options for rawimg find_stars when registering
+	match_opts=table -- options for rawimg.match_stars when registering
+}
+the underlying accumulator is created when the first frame arrives
+]]
+function m.new(opts)
+	opts=util.extend_table({
+		dst='stack.dng',
+		preview_every=1,
+		preview_width=640,
+		preview_auto=99.5,
+	},opts)
+	local t=util.extend_table({
+		opts=opts,
+		since_preview=0,
+	},stack_methods)
+	if opts.dark then
+		-- kept for the whole session, don't keep the file mapped
+		local d,err=dng.load(opts.dark,{nomap=true})
+		if not d then
+			errlib.throw{etype='bad_arg',msg='livestack: failed to load dark '..tostring(err)}
+		end
+		t.dark=d
+	end
+	return t
+end
+
+--[[
+create the accumulator from the dng header of the first frame
+]]
+function stack_methods:init(hdr,hdr_lb)
+	local spec=hdr:get_imgspec()
+	spec.float=self.opts.float
+	spec.min=self.opts.min
+	-- pixels warped from outside the frame are 0, don't accumulate them
+	if self.opts.register and not spec.min then
+		spec.min=1
+	end
+	spec.max=self.opts.max
+	self.spec=spec
+	self.wb=hdr:get_wb()
+	self.stack=rawimg.stack_new(spec)
+	if self.dark then
+		self.stack:set_dark(self.dark.img)
+		-- only needed to initialize
+		self.dark = nil
+	end
+	-- copy, used as a template to write the stacked DNG
+	self.hdr_lb=lbuf.new(hdr_lb:string())
+end
+
+--[[
+add a frame from raw, a remotecap chunk in CHDK little endian format
+dng_info is as used by chdku.rc_process_dng
+]]
+function stack_methods:add_raw(hdr,raw,dng_info)
+	if not self.stack then
+		self:init(hdr,dng_info.hdr)
+	end
+	local t0=ticktime.get()
+	local spec=self.spec
+	-- raw may be a sub-image
+	local last={
+		data=raw.data,
+		height=math.floor(raw.data:len()*8/(spec.width*spec.bpp)),
+		y_offset=dng_info.lstart,
+		endian='little',
+	}
+	if self.opts.register then
+		local status,err=self:register(last)
+		if not status then
+			util.warnf('stack: frame not added, %s\n',tostring(err))
+			self.skipped=(self.skipped or 0) + 1
+			self.last=nil
+			return
+		end
+	end
+	local n=self.stack:add(self:bind_frame(last),{y_offset=last.y_offset})
+	self.last=last
+	cli.dbgmsg('stack add %d %.4f\n',n,ticktime.elapsed(t0))
+	self.since_preview = self.since_preview + 1
+	if self.opts.preview and self.since_preview >= self.opts.preview_every then
+		self:write_preview(self.opts.preview)
+	end
+end
+
+--[[
+align a full frame to the reference stars, replacing frame data with the warped copy
+the first frame becomes the reference
+]]
+function stack_methods:register(frame)
+	if frame.y_offset ~= 0 or frame.height ~= self.spec.height then
+		return false,'sub-images cannot be registered'
+	end
+	local t0=ticktime.get()
+	local img=self:bind_frame(frame)
+	local stars=img:find_stars(self.opts.star_opts)
+	if not self.ref_stars then
+		self.ref_stars=stars
+		cli.dbgmsg('stack reference %d stars\n',stars:count())
+		return true
+	end
+	local mopts=util.extend_table({},self.opts.match_opts)
+	if type(self.opts.register) == 'string' then
+		mopts.model=self.opts.register
+	end
+	local xform,err=rawimg.match_stars(self.ref_stars,stars,mopts)
+	if not xform then
+		return false,err
+	end
+	if not self.warp_lb then
+		self.warp_lb=lbuf.new(frame.data:len())
+	end
+	img:warp(xform,{lbuf=self.warp_lb})
+	frame.data=self.warp_lb
+	cli.dbgmsg('stack register %d matches rms %.2f dx %.1f dy %.1f rot %.3f %.4f\n',
+		xform.matches,xform.rms,xform.tx,xform.ty,xform.rotation,ticktime.elapsed(t0))
+	return true
+end
+
+function stack_methods:bind_frame(frame)
+	return rawimg.bind_lbuf{
+		data=frame.data,
+		width=self.spec.width,
+		height=frame.height,
+		bpp=self.spec.bpp,
+		endian=frame.endian,
+	}
+end
+
+--[[
+remove the most recently added frame from the stack
+]]
+function stack_methods:reject()
+	if not self.last then
+		return false,'no frame to reject'
+	end
+	local n=self.stack:reject(self:bind_frame(self.last),{y_offset=self.last.y_offset})
+	self.last=nil
+	return true,n
+end
+
+function stack_methods:frames()
+	if not self.stack then
+		return 0
+	end
+	return self.stack:info().frames
+end
+
+--[[
+write a PPM preview of the current stack
+]]
+function stack_methods:write_preview(filename)
+	if not self.stack then
+		return false,'no frames'
+	end
+	local aa=self.spec.active_area
+	local aw=aa.right - aa.left
+	local ah=aa.bottom - aa.top
+	local w=math.min(self.opts.preview_width,math.floor(aw/2))
+	local h=math.floor(w*ah/aw)
+	local t0=ticktime.get()
+	local thumb=self.stack:make_rgb_thumb(w,h,{auto=self.opts.preview_auto,wb=self.wb})
+	fsutil.mkdir_parent(filename)
+	local fh=fsutil.open_e(filename,'wb')
+	fh:write(string.format('P6\n%d\n%d\n%d\n',w,h,255))
+	thumb:fwrite(fh)
+	fh:close()
+	self.since_preview=0
+	cli.dbgmsg('stack preview %dx%d %.4f\n',w,h,ticktime.elapsed(t0))
+	return true
+end
+
+--[[
+save the stack mean as a 16 bit DNG, using the header of the first frame
+values are scaled to use the full 16 bits
+]]
+function stack_methods:save(filename)
+	if self:frames() == 0 then
+		return false,'no frames'
+	end
+	if not filename then
+		filename=self.opts.dst
+	end
+	local hdr_lb=lbuf.new(self.hdr_lb:string())
+	local hdr,err=dng.bind_header(hdr_lb)
+	if not hdr then
+		return false,err
+	end
+	local ifd=hdr.raw_ifd
+	local scale=2^(16 - self.spec.bpp)
+	ifd.byname.BitsPerSample:setel(16)
+	ifd.byname.StripByteCounts:setel(self.spec.width*self.spec.height*2)
+	ifd.byname.BlackLevel:setel(util.round(self.spec.black_level*scale))
+	if ifd.byname.WhiteLevel then
+		ifd.byname.WhiteLevel:setel(util.round(ifd.byname.WhiteLevel:getel()*scale))
+	end
+	local _,data=self.stack:get_mean{bpp=16,endian='big',scale=scale}
+	local tw=hdr.main_ifd.byname.ImageWidth:getel()
+	local th=hdr.main_ifd.byname.ImageLength:getel()
+	local thumb=self.stack:make_rgb_thumb(tw,th,{auto=self.opts.preview_auto,wb=self.wb})
+
+	fsutil.mkdir_parent(filename)
+	local fh=fsutil.open_e(filename,'wb')
+	hdr_lb:fwrite(fh)
+	thumb:fwrite(fh)
+	data:fwrite(fh)
+	fh:close()
+	return true
+end
+
+return m
@@ -0,0 +1,402 @@
+--[[
+headless live view host pipeline benchmark
+replays lvdump frames through the same steps as the gui and lvdumpimg, timing each stage
+reference frames for each viewport type are generated by a fixed integer procedure,
+so results are comparable across releases and machines without a camera
+]]
+local m={}
+
+--[[
+reference cameras
+yuv8: older cameras, 720x240 YUV8 viewport with a 360x240 palette bitmap
+yuv8b: digic 6, 640x480 YUV8B viewport with a YUV8B bitmap and opacity
+yuv8c: digic 7, 720x480 YUV8C viewport in a 736 wide buffer with a YUV8B bitmap and opacity
+]]
+m.refs={
+	yuv8={vp_type=0,vp_buf_width=720,vp_width=720,vp_height=240,
+		bm_type=1,bm_width=360,bm_height=240,palette_type=3},
+	yuv8b={vp_type=2,vp_buf_width=640,vp_width=640,vp_height=480,
+		bm_type=2,bm_width=640,bm_height=480},
+	yuv8c={vp_type=3,vp_buf_width=736,vp_width=720,vp_height=480,
+		bm_type=2,bm_width=640,bm_height=480},
+}
+m.ref_names={'yuv8','yuv8b','yuv8c'}
+-- frames in each reference dump
+m.ref_frames=8
+
+m.stages={'read','parse','vp','bm','packed','focus'}
+
+-- park-miller minimal standard generator, exact in doubles and integers
+local function rand_next(s)
+	return (s*16807)%2147483647
+end
+
+--[[
+star field, fixed for all frames, drifting one pixel right and half a pixel down per frame
+]]
+local function make_stars(width,height)
+	local stars={}
+	local s=12345
+	for i=1,40 do
+		local star={}
+		s=rand_next(s)
+		star.x=s%width
+		s=rand_next(s)
+		star.y=s%height
+		s=rand_next(s)
+		star.amp=40 + s%200
+		table.insert(stars,star)
+	end
+	return stars
+end
+
+-- star profile at squared distance d2, integer approximation of a moffat function
+local function star_value(amp,d2)
+	return math.floor(amp*16/(16 + d2*d2))
+end
+
+-- luma of row y of frame f, as an array of width values
+local function scene_row(ref,stars,f,y)
+	local width=ref.vp_width
+	local height=ref.vp_height
+	local row={}
+	-- sky gradient with noise
+	local base=16 + math.floor(y*24/height)
+	local s=1 + y + f*7919
+	for x=1,width do
+		s=rand_next(s)
+		row[x]=base + s%8
+	end
+	local dx=f
+	local dy=math.floor(f/2)
+	for _,star in ipairs(stars) do
+		local sy=(star.y + dy)%height
+		local ry=y - sy
+		if ry >= -4 and ry <= 4 then
+			local sx=(star.x + dx)%width
+			for rx=-4,4 do
+				local x=sx + rx
+				if x >= 0 and x < width then
+					row[x+1]=math.min(255,row[x+1] + star_value(star.amp,rx*rx + ry*ry))
+				end
+			end
+		end
+	end
+	return row
+end
+
+--[[
+OSD value at bitmap x,y: 0 transparent, 1 opaque white, 2 translucent gray
+status bars at top and bottom with text-like blocks, and a centered focus frame
+]]
+local function osd_value(x,y,width,height)
+	local bar=math.floor(height/16)
+	if y < bar or y >= height - bar then
+		local ty=y%bar
+		local tx=x%(bar*2)
+		if ty >= 2 and ty < bar - 2 and tx < bar + (math.floor(x/(bar*2))%3)*2 then
+			return 1
+		end
+		return 2
+	end
+	local fx0,fx1=math.floor(width*3/8),math.floor(width*5/8)
+	local fy0,fy1=math.floor(height*3/8),math.floor(height*5/8)
+	if ((x == fx0 or x == fx1) and y >= fy0 and y <= fy1)
+		or ((y == fy0 or y == fy1) and x >= fx0 and x <= fx1) then
+		return 1
+	end
+	return 0
+end
+
+-- write an array of byte values at offset, in chunks to stay within the Lua stack limit
+local function put_bytes(lb,offset,t)
+	local n=#t
+	for i=1,n,4096 do
+		local j=math.min(i + 4095,n)
+		lb:fill(string.char(unpack(t,i,j)),offset + i - 1,1)
+	end
+end
+
+local function write_viewport(lb,ref,data_start,f)
+	local stars=make_stars(ref.vp_width,ref.vp_height)
+	local row_bytes=ref.vp_buf_width*((ref.vp_type == 0) and 12 or 16)/8
+	-- neutral chroma, offset by 0x80 in YUV8B, signed otherwise. slight tint so U V are exercised
+	local c0=(ref.vp_type == 2) and 0x80 or 0
+	local u,v=(c0 + 3)%256,(c0 + 253)%256
+	for y=0,ref.vp_height-1 do
+		local luma=scene_row(ref,stars,f,y)
+		local t={}
+		if ref.vp_type == 0 then
+			-- U Y V Y Y Y
+			for x=1,ref.vp_width,4 do
+				t[#t+1]=u
+				t[#t+1]=luma[x]
+				t[#t+1]=v
+				t[#t+1]=luma[x+1]
+				t[#t+1]=luma[x+2]
+				t[#t+1]=luma[x+3]
+			end
+		else
+			-- U Y V Y
+			for x=1,ref.vp_width,2 do
+				t[#t+1]=u
+				t[#t+1]=luma[x]
+				t[#t+1]=v
+				t[#t+1]=luma[x+1]
+			end
+		end
+		put_bytes(lb,data_start + y*row_bytes,t)
+	end
+end
+
+-- bitmap and opacity row strings for each reference, the OSD is the same in every frame
+local bitmap_rows={}
+
+local function write_bitmap(lb,ref,data_start,opacity_start)
+	local rows=bitmap_rows[ref]
+	if not rows then
+		rows={}
+		for y=0,ref.bm_height-1 do
+			local t={}
+			local o={}
+			for x=0,ref.bm_width-1 do
+				local val=osd_value(x,y,ref.bm_width,ref.bm_height)
+				if ref.bm_type == 1 then
+					t[#t+1]=val
+				else
+					-- U or V, then Y. neutral, black where transparent
+					t[#t+1]=0x80
+					t[#t+1]=(val == 1 and 235) or (val == 2 and 128) or 0
+					o[#o+1]=(val == 1 and 255) or (val == 2 and 128) or 0
+				end
+			end
+			local row=lbuf.new(#t + #o)
+			put_bytes(row,0,t)
+			put_bytes(row,#t,o)
+			rows[y+1]={row:string(1,#t),row:string(#t+1,#t+#o)}
+		end
+		bitmap_rows[ref]=rows
+	end
+	local row_bytes=ref.bm_width*((ref.bm_type == 1) and 1 or 2)
+	for y=0,ref.bm_height-1 do
+		lb:fill(rows[y+1][1],data_start + y*row_bytes,1)
+		if ref.bm_type == 2 then
+			lb:fill(rows[y+1][2],opacity_start + y*ref.bm_width,1)
+		end
+	end
+end
+
+--[[
+frame=lvbench.make_ref_frame(name,f)
+generate frame f, starting at 0, of reference name as a protocol 2.2 live view frame
+]]
+function m.make_ref_frame(name,f)
+	local ref=m.refs[name]
+	if not ref then
+		errlib.throw{etype='bad_arg',msg='lvbench: unknown reference '..tostring(name)}
+	end
+	local desc_start=32
+	local pal_start=desc_start + 3*36
+	local pal_size=(ref.bm_type == 1) and 1024 or 0
+	local vp_start=pal_start + pal_size
+	local vp_size=ref.vp_buf_width*ref.vp_height*((ref.vp_type == 0) and 12 or 16)/8
+	local bm_start=vp_start + vp_size
+	local bm_size=ref.bm_width*ref.bm_height*((ref.bm_type == 1) and 1 or 2)
+	local bmo_start=0
+	local bmo_size=0
+	if ref.bm_type == 2 then
+		bmo_start=bm_start + bm_size
+		bmo_size=ref.bm_width*ref.bm_height
+	end
+	local lb=lbuf.new(bm_start + bm_size + bmo_size)
+	lb:set_i32(0,2,2,0,ref.palette_type or 0,(pal_size > 0) and pal_start or 0,
+				desc_start,desc_start + 36,desc_start + 2*36)
+	lb:set_i32(desc_start,ref.vp_type,vp_start,ref.vp_buf_width,ref.vp_width,ref.vp_height,0,0,0,0)
+	lb:set_i32(desc_start + 36,ref.bm_type,bm_start,ref.bm_width,ref.bm_width,ref.bm_height,0,0,0,0)
+	lb:set_i32(desc_start + 2*36,4,bmo_start,ref.bm_width,ref.bm_width,ref.bm_height,0,0,0,0)
+	if pal_size > 0 then
+		-- V U Y A, 1 opaque white, 2 translucent gray, others unused
+		lb:set_u32(pal_start + 4,0x03EB0000,0x01800000)
+	end
+	write_viewport(lb,ref,vp_start,f)
+	write_bitmap(lb,ref,bm_start,bmo_start)
+	return lb
+end
+
+--[[
+files=lvbench.write_refs(dir[,names])
+write compressed lvdump files of m.ref_frames frames for each reference to dir/lvbench_<name>.lvdump
+]]
+function m.write_refs(dir,names)
+	names=names or m.ref_names
+	fsutil.mkdir_m(dir)
+	local files={}
+	for _,name in ipairs(names) do
+		local fn=fsutil.joinpath(dir,'lvbench_'..name..'.lvdump')
+		local writer=chdku.lvdump_create(fn,{compress=true})
+		for f=0,m.ref_frames-1 do
+			-- fixed times at 10 fps, so the files are identical on every run
+			writer:write(m.make_ref_frame(name,f),f/10)
+		end
+		writer:close()
+		table.insert(files,fn)
+	end
+	return files
+end
+
+local function stage_enabled(opts,stage)
+	if stage == 'read' then
+		return opts.file ~= nil
+	end
+	if stage == 'focus' then
+		return opts.focus
+	end
+	return true
+end
+
+--[[
+r=lvbench.run(opts)
+opts:{
+	file=string -- lvdump file to replay
+	ref=string -- reference name to generate in memory, if file is not given. default yuv8b
+	count=number -- maximum number of frames to use, default all
+	reps=number -- passes over all frames, after one untimed warm up pass. default 5
+	skip=bool -- convert with 1:2 pixel aspect ratio, as the gui does for most cameras
+	focus=bool -- include the focus metric
+	quiet=bool -- don't print results
+}
+stages:
+	read: reading the frame from the file, decompressing if needed. file only
+	parse: live_wrapper set_frame and reading the frame buffer descriptions
+	vp: viewport to pimg, as the gui live view
+	bm: bitmap to pimg, as the gui live view
+	packed: viewport with bitmap overlay to packed RGB, as lvdumpimg -overlay
+	focus: liveimg.focus_metric on the whole viewport, if enabled
+returns table with frames, reps, desc, and ns and fps for each enabled stage and total
+]]
+function m.run(opts)
+	opts=util.extend_table({
+		ref='yuv8b',
+		reps=5,
+	},opts)
+	local reader
+	local frames={}
+	local count
+	if opts.file then
+		local err
+		reader,err=chdku.lvdump_open(opts.file)
+		if not reader then
+			errlib.throw{etype='bad_arg',msg='lvbench: '..tostring(err)}
+		end
+		count=reader:count()
+	else
+		count=m.ref_frames
+		for f=0,count-1 do
+			frames[f+1]=m.make_ref_frame(opts.ref,f)
+		end
+	end
+	if opts.count then
+		count=math.min(count,opts.count)
+	end
+	if count < 1 then
+		if reader then
+			reader:close()
+		end
+		errlib.throw{etype='bad_arg',msg='lvbench: no frames'}
+	end
+
+	local lv=chdku.live_wrapper()
+	local times={}
+	for _,stage in ipairs(m.stages) do
+		times[stage]=0
+	end
+	local vp_img,bm_img,packed
+	local packed_opts={skip=opts.skip,bitmap_overlay=true}
+	local desc
+	local status,err=pcall(function()
+		for rep=0,opts.reps do
+			for i=1,count do
+				local t0=ticktime.get()
+				local frame
+				if reader then
+					frame=reader:read(i)
+				else
+					frame=frames[i]
+				end
+				local t1=ticktime.get()
+				lv:set_frame(frame)
+				local vp_w,vp_h,bm_w,bm_h
+				if lv.vp then
+					vp_w,vp_h=lv.vp:get_screen_width(),lv.vp:get_screen_height()
+				end
+				if lv.bm then
+					bm_w,bm_h=lv.bm:get_screen_width(),lv.bm:get_screen_height()
+				end
+				local t2=ticktime.get()
+				vp_img=liveimg.get_viewport_pimg(vp_img,frame,opts.skip)
+				local t3=ticktime.get()
+				bm_img=liveimg.get_bitmap_pimg(bm_img,frame,opts.skip)
+				local t4=ticktime.get()
+				packed=liveimg.get_viewport_packed(packed,frame,packed_opts)
+				local t5=ticktime.get()
+				if opts.focus then
+					liveimg.focus_metric(frame)
+				end
+				local t6=ticktime.get()
+				-- first pass warms caches and allocates buffers
+				if rep > 0 then
+					times.read=times.read + t1 - t0
+					times.parse=times.parse + t2 - t1
+					times.vp=times.vp + t3 - t2
+					times.bm=times.bm + t4 - t3
+					times.packed=times.packed + t5 - t4
+					times.focus=times.focus + t6 - t5
+				end
+				if not desc then
+					desc=string.format('vp type %s %sx%s bm type %s %sx%s',
+						tostring(lv.vp and lv.vp.fb_type),tostring(vp_w),tostring(vp_h),
+						tostring(lv.bm and lv.bm.fb_type),tostring(bm_w),tostring(bm_h))
+				end
+			end
+		end
+	end)
+	if reader then
+		reader:close()
+	end
+	if not status then
+		error(err,0)
+	end
+
+	local n=count*opts.reps
+	local r={
+		frames=count,
+		reps=opts.reps,
+		desc=desc,
+		ns={},
+		fps={},
+	}
+	local total=0
+	for _,stage in ipairs(m.stages) do
+		if stage_enabled(opts,stage) then
+			local ns=times[stage]*1e9/n
+			r.ns[stage]=ns
+			r.fps[stage]=(ns > 0) and 1e9/ns or 0
+			total=total + ns
+		end
+	end
+	r.ns.total=total
+	r.fps.total=(total > 0) and 1e9/total or 0
+	if not opts.quiet then
+		printf('%s: %d frames x %d reps, %s\n',opts.file or 'ref '..opts.ref,count,opts.reps,desc)
+		printf('%-8s %12s %10s\n','stage','ns/frame','fps')
+		for _,stage in ipairs(m.stages) do
+			if r.ns[stage] then
+				printf('%-8s %12.0f %10.1f\n',stage,r.ns[stage],r.fps[stage])
+			end
+		end
+		printf('%-8s %12.0f %10.1f\n','total',r.ns.total,r.fps.total)
+	end
+	return r
+end
+
+return m
@@ -0,0 +1,182 @@
+--[[
+bad pixel maps
+sorted lists of defective pixel coordinates, detected once from dark or flat frames
+and applied to each frame, either by patching the data or as a DNG FixBadPixelsList opcode
+
+file format, all values little endian uint32
+	magic 'PXM1'
+	width
+	height
+	count
+	count * coordinate, y in the upper 16 bits, x in the lower, sorted ascending
+coordinates are absolute raw buffer coordinates, not relative to the active area
+]]
+local m={}
+local lbu=require'lbufutil'
+
+m.magic='PXM1'
+m.header_size=16
+
+local pm_methods={}
+
+--[[
+pm=pixmap.new(width,height[,list])
+list: lbuf of coordinates as returned by rawimg find_bad_pixels, default empty
+]]
+function m.new(width,height,list)
+	if not list then
+		list=lbuf.new(0)
+	end
+	return util.extend_table({
+		width=width,
+		height=height,
+		list=list,
+	},pm_methods)
+end
+
+--[[
+pm=pixmap.detect(img,opts)
+opts are passed to img:find_bad_pixels
+]]
+function m.detect(img,opts)
+	return m.new(img:width(),img:height(),img:find_bad_pixels(opts))
+end
+
+--[[
+pm=pixmap.load(filename)
+throws on error
+]]
+function m.load(filename)
+	local lb,err=lbu.loadfile(filename)
+	if not lb then
+		errlib.throw{etype='io',msg='pixmap: '..tostring(err)}
+	end
+	if lb:len() < m.header_size or lb:string(1,4) ~= m.magic then
+		errlib.throw{etype='bad_arg',msg='pixmap: invalid file '..tostring(filename)}
+	end
+	local width,height,count=lb:get_u32(4,3)
+	if lb:len() ~= m.header_size + count*4 then
+		errlib.throw{etype='bad_arg',msg='pixmap: size mismatch '..tostring(filename)}
+	end
+	return m.new(width,height,lb:sub(m.header_size+1))
+end
+
+function pm_methods:count()
+	return self.list:len()/4
+end
+
+--[[
+x,y=pm:get(i)
+i is 0 based
+]]
+function pm_methods:get(i)
+	local v=self.list:get_u32(i*4)
+	return v%0x10000,math.floor(v/0x10000)
+end
+
+function pm_methods:save(filename)
+	local hdr=lbuf.new(m.header_size)
+	hdr:fill(m.magic,0,1)
+	hdr:set_u32(4,self.width,self.height,self:count())
+	fsutil.mkdir_parent(filename)
+	local fh=fsutil.open_e(filename,'wb')
+	hdr:fwrite(fh)
+	self.list:fwrite(fh)
+	fh:close()
+end
+
+--[[
+return a pixmap of rows top to top+rows-1, with coordinates relative to top
+used to patch sub-images
+]]
+function pm_methods:band(top,rows)
+	local n=self:count()
+	local lo,hi=top*0x10000,(top+rows)*0x10000
+	local r=lbuf.new(n*4)
+	local j=0
+	for i=0,n-1 do
+		local v=self.list:get_u32(i*4)
+		if v >= hi then
+			break
+		end
+		if v >= lo then
+			r:set_u32(j*4,v-lo)
+			j=j+1
+		end
+	end
+	return m.new(self.width,rows,r:sub(1,j*4))
+end
+
+--[[
+return a new pixmap containing the pixels of both
+]]
+function pm_methods:union(other)
+	if self.width ~= other.width or self.height ~= other.height then
+		errlib.throw{etype='bad_arg',msg='pixmap: size mismatch'}
+	end
+	local a,b=self.list,other.list
+	local na,nb=self:count(),other:count()
+	local r=lbuf.new((na+nb)*4)
+	local i,j,n=0,0,0
+	while i < na or j < nb do
+		local va,vb
+		if i < na then
+			va=a:get_u32(i*4)
+		end
+		if j < nb then
+			vb=b:get_u32(j*4)
+		end
+		if vb == nil or (va ~= nil and va <= vb) then
+			r:set_u32(n*4,va)
+			i=i+1
+			if va == vb then
+				j=j+1
+			end
+		else
+			r:set_u32(n*4,vb)
+			j=j+1
+		end
+		n=n+1
+	end
+	return m.new(self.width,self.height,r:sub(1,n*4))
+end
+
+--[[
+interpolate over the mapped pixels in img
+returns number of pixels patched
+]]
+function pm_methods:patch(img)
+	if img:width() ~= self.width or img:height() ~= self.height then
+		errlib.throw{etype='bad_arg',msg='pixmap: image size mismatch'}
+	end
+	return img:patch_pixel_list(self.list)
+end
+
+--[[
+return a DNG FixBadPixelsList opcode string for the mapped pixels
+bayer_phase: as returned by dng bayer_phase()
+]]
+function pm_methods:fix_bad_pixels_opcode(bayer_phase)
+	local be32=dng.be32_str
+	local n=self:count()
+	local params={
+		be32(bayer_phase),
+		be32(n), -- bad points
+		be32(0), -- bad rects
+	}
+	for i=0,n-1 do
+		local x,y=self:get(i)
+		table.insert(params,be32(y))
+		table.insert(params,be32(x))
+	end
+	params=table.concat(params)
+	return table.concat{
+		be32(5), -- FixBadPixelsList
+		be32(0x01030000), -- DNG version 1.3
+		be32(1), -- flags: optional
+		be32(#params),
+		params,
+	}
+end
+
+return m
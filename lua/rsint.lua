@@ -17,6 +17,7 @@
 interactive remote shoot
 --]]
 local m={}
+local pixmap=require'pixmap'
 m.prompt='rsint> '
 
 --[[
@@ -54,6 +55,17 @@ function init_handlers(args,opts)
 		badpix=args.badpix,
 		lstart=opts.lstart,
 		lcount=opts.lcount,
+		stack=m.stack,
+		stack_only=args.stackonly,
+		pixmap=m.pixmap,
+		pixmap_opcode=args.pixmapop,
+		thumb_width=m.thumb_width,
+		lj92=args.lj92,
+		fits=args.fits,
+		fits_bits=args.fitsbits,
+		fits_black=args.fitsblack,
+		fits_dng=args.fitsdng,
+		gate=m.gate,
 	}
 	m.rcopts.do_subst=do_subst
 
@@ -119,6 +131,29 @@ m.rsint_once = function(cmd,args,opts)
 		args[1] = rest
 		-- TODO could catch errors, send l to script
 		init_handlers(args,opts)
+	elseif cmdname == 'reject' then
+		if not m.stack then
+			warnf('no stack\n')
+			return false
+		end
+		local status,r = m.stack:reject()
+		if status then
+			printf('rejected, %d frames in stack\n',r)
+		else
+			warnf('%s\n',tostring(r))
+		end
+	elseif cmdname == 'stacksave' then
+		if not m.stack then
+			warnf('no stack\n')
+			return false
+		end
+		if rest == '' then
+			rest = nil
+		end
+		local status,err = m.stack:save(rest)
+		if not status then
+			warnf('%s\n',tostring(err))
+		end
 	else
 		-- remaining commands assumed to be cam side
 		-- TODO could check if remotecap has timed out here
@@ -210,6 +245,24 @@ m.run = function(args)
 	if args.badpix and not args.dng then
 		util.warnf('badpix without dng ignored\n')
 	end
+	if args.pixmap and not args.dng then
+		util.warnf('pixmap without dng ignored\n')
+	end
+	if args.lj92 and not args.dng then
+		util.warnf('lj92 without dng ignored\n')
+	end
+	if args.fits and not args.dng then
+		util.warnf('fits without dng ignored\n')
+	end
+	if args.pixmapop and not args.pixmap then
+		return false,'pixmapop requires pixmap'
+	end
+	-- loaded once, not on every path change
+	if args.pixmap then
+		m.pixmap=pixmap.load(args.pixmap)
+	else
+		m.pixmap=nil
+	end
 
 	if args.s or args.c then
 		if args.dng or args.raw then
@@ -224,6 +277,12 @@ m.run = function(args)
 		end
 	end
 
+	-- stack persists across path changes
+	m.stack=cli.get_rs_stack(args)
+	-- gate baseline too
+	m.gate=cli.get_rs_gate(args)
+	m.thumb_width=cli.get_rs_thumb_width(args)
+
 	init_handlers(args,opts)
 
 	-- wait time for remotecap
@@ -281,6 +340,20 @@ m.run = function(args)
 	cli.dbgmsg("script wait time %.4f\n",ticktime.elapsed(t0))
 	-- TODO check messages
 
+	if m.stack and m.stack:frames() > 0 then
+		local sstatus,serr = m.stack:save()
+		if sstatus then
+			printf('saved stack of %d frames %s\n',m.stack:frames(),m.stack.opts.dst)
+		else
+			warnf('failed to save stack %s\n',tostring(serr))
+		end
+	end
+	m.stack=nil
+	if m.gate then
+		printf('%d of %d frames failed quality gate\n',m.gate.rejected,m.gate.frames)
+	end
+	m.gate=nil
+
 	-- TODO remote script should try to uninit when done
 	local ustatus, uerr = con:execwait_pcall('rs_cleanup('..serialize(rs_init_vals)..')',{libs={'rs_shoot_cleanup'}}) -- try to uninit
 	-- if uninit failed, combine with previous status
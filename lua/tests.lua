@@ -473,6 +473,633 @@ t.lbuff = function()
 	fsutil.rm_r('chdkptp-test-data')
 end
 
+t.lbufmmap = function()
+	local testfile='chdkptp-test-data/lbuftest.dat'
+	fsutil.mkdir_parent(testfile)
+	fsutil.writefile_e('hello world',testfile,'wb')
+	local b=lbuf.mmap(testfile)
+	assert(b:string() == 'hello world' and b:mapped() == 'r')
+	assert(not lbuf.new(1):mapped())
+	assert(not pcall(b.set_u8,b,0,1))
+	assert(not pcall(b.fill,b,'x'))
+	assert(not pcall(b.reverse_bytes,b))
+	-- offsets need not be page aligned
+	b=lbuf.mmap(testfile,'r',6)
+	assert(b:string() == 'world')
+	b=lbuf.mmap(testfile,'r',6,2)
+	assert(b:string() == 'wo')
+	b=lbuf.mmap(testfile,'c',6)
+	assert(b:mapped() == 'c')
+	b:fill('W',0,1)
+	assert(b:string() == 'World')
+	assert(fsutil.readfile_e(testfile,'b') == 'hello world')
+	local err
+	b,err=lbuf.mmap(testfile,'r',11)
+	assert((b==false) and (err=='offset >= file size'))
+	b,err=lbuf.mmap(testfile,'r',10,3)
+	assert((b==false) and (err=='offset + len > file size'))
+	assert(not lbuf.mmap('chdkptp-test-data/nonexistent.dat'))
+	assert(not pcall(lbuf.mmap,testfile,'w'))
+	collectgarbage('collect')
+	fsutil.rm_r('chdkptp-test-data')
+end
+
+--[[
+synthetic protocol 2.2 live view frame with random data
+opts:{
+	vp_type, vp_width, vp_height -- viewport, no viewport data if vp_type is nil
+	bm_type, bm_width, bm_height -- bitmap, 1 = palette, 2 = YUV with opacity. no bitmap data if nil
+}
+]]
+local function make_live_frame(opts)
+	local pal_start=32 + 3*36
+	local vp_start=pal_start + 1024
+	local vp_buf_width=0
+	local vp_size=0
+	if opts.vp_type then
+		vp_buf_width=opts.vp_width + 16
+		vp_size=vp_buf_width*opts.vp_height*((opts.vp_type == 0) and 12 or 16)/8
+	end
+	local bm_start=vp_start + vp_size
+	local bm_size=0
+	local bmo_size=0
+	if opts.bm_type then
+		bm_size=opts.bm_width*opts.bm_height*((opts.bm_type == 1) and 1 or 2)
+		if opts.bm_type == 2 then
+			bmo_size=opts.bm_width*opts.bm_height
+		end
+	end
+	local lb=lbuf.new(bm_start + bm_size + bmo_size)
+	lb:set_i32(0,2,2,0,(opts.bm_type == 1) and 3 or 0,pal_start,32,32+36,32+2*36)
+	if opts.vp_type then
+		lb:set_i32(32,opts.vp_type,vp_start,vp_buf_width,opts.vp_width,opts.vp_height,0,0,0,0)
+	else
+		lb:set_i32(32,0,0,0,0,0,0,0,0,0)
+	end
+	if opts.bm_type then
+		lb:set_i32(32+36,opts.bm_type,bm_start,opts.bm_width,opts.bm_width,opts.bm_height,0,0,0,0)
+		lb:set_i32(32+2*36,4,(bmo_size > 0) and bm_start + bm_size or 0,
+					opts.bm_width,opts.bm_width,opts.bm_height,0,0,0,0)
+	else
+		lb:set_i32(32+36,1,0,0,0,0,0,0,0,0)
+		lb:set_i32(32+2*36,4,0,0,0,0,0,0,0,0)
+	end
+	for i=pal_start,lb:len()-1 do
+		lb:set_u8(i,math.random(0,255))
+	end
+	return lb
+end
+
+t.liveimg_yuv = function()
+	local function mkframe(fb_type,width,height)
+		return make_live_frame{vp_type=fb_type,vp_width=width,vp_height=height}
+	end
+	local function clip(v)
+		return math.max(0,math.min(255,v))
+	end
+	-- packed rgb from the fixed point formulas
+	local function reference(lb,skip)
+		local fb_type,data_start,buf_width,width,height=lb:get_i32(32,5)
+		local row_bytes=buf_width*((fb_type == 0) and 12 or 16)/8
+		local group_bytes=(fb_type == 0) and 6 or 4
+		local y_offsets=(fb_type == 0) and {1,3,4,5} or {1,3}
+		local npix=skip and #y_offsets/2 or #y_offsets
+		local t={}
+		for row=0,height-1 do
+			local p=data_start + row*row_bytes
+			for x=0,width-1,#y_offsets do
+				local u,v
+				if fb_type == 2 then
+					u,v=lb:get_u8(p)-128,lb:get_u8(p+2)-128
+				else
+					u,v=lb:get_i8(p),lb:get_i8(p+2)
+				end
+				for i=1,npix do
+					local y=lb:get_u8(p+y_offsets[i])*4096 + 2048
+					table.insert(t,string.char(clip(math.floor((y + v*5743)/4096)),
+												clip(math.floor((y - u*1411 - v*2925)/4096)),
+												clip(math.floor((y + u*7258)/4096))))
+				end
+				p=p+group_bytes
+			end
+		end
+		return table.concat(t)
+	end
+	local impl=liveimg.get_yuv_impl()
+	local impls=liveimg.get_yuv_impls()
+	assert(impls[1] == 'scalar' and impls[#impls] == impl)
+	assert(liveimg.set_yuv_impl('auto') == impl)
+	local status,err=liveimg.set_yuv_impl('bogus')
+	assert(status == false and err == 'yuv implementation not supported: bogus')
+	math.randomseed(1)
+	-- widths cover whole SIMD blocks and scalar remainders
+	for _,fb_type in ipairs{0,2,3} do
+		for _,width in ipairs{8,200,392} do
+			local frame=mkframe(fb_type,width,5)
+			for _,skip in ipairs{false,true} do
+				local ref=reference(frame,skip)
+				for _,name in ipairs(impls) do
+					assert(liveimg.set_yuv_impl(name) == name)
+					local pimg=liveimg.get_viewport_pimg(nil,frame,skip)
+					assert(pimg:to_lbuf_packed_rgb():string() == ref,
+						string.format('%s type %d width %d skip %s',name,fb_type,width,tostring(skip)))
+				end
+			end
+		end
+	end
+	liveimg.set_yuv_impl(impl)
+end
+
+t.liveimg_packed = function()
+	local function rows_reversed(s,width,height,depth)
+		local t={}
+		for y=height-1,0,-1 do
+			table.insert(t,s:sub(y*width*depth + 1,(y+1)*width*depth))
+		end
+		return table.concat(t)
+	end
+	math.randomseed(2)
+	-- viewport matches the pimg route, for each type and option
+	for _,fb_type in ipairs{0,2,3} do
+		local frame=make_live_frame{vp_type=fb_type,vp_width=72,vp_height=6}
+		for _,skip in ipairs{false,true} do
+			local ref=liveimg.get_viewport_pimg(nil,frame,skip):to_lbuf_packed_rgb():string()
+			local lb,width,height=liveimg.get_viewport_packed(nil,frame,{skip=skip})
+			assert(width == (skip and 36 or 72) and height == 6)
+			assert(lb:string() == ref)
+			-- re-used if the size matches
+			assert(liveimg.get_viewport_packed(lb,frame,{skip=skip}) == lb)
+			local lb2=liveimg.get_viewport_packed(lb,frame,{skip=skip,alpha=true})
+			assert(lb2 ~= lb and lb2:len() == width*height*4)
+			assert(lb2:string():gsub('(...)\255','%1') == ref)
+			lb2=liveimg.get_viewport_packed(nil,frame,{skip=skip,flip=true})
+			assert(lb2:string() == rows_reversed(ref,width,height,3))
+		end
+	end
+	assert(liveimg.get_viewport_packed(nil,make_live_frame{bm_type=1,bm_width=8,bm_height=4}) == nil)
+	-- bitmaps match the pimg route
+	for _,bm_type in ipairs{1,2} do
+		local frame=make_live_frame{vp_type=0,vp_width=64,vp_height=8,bm_type=bm_type,bm_width=64,bm_height=8}
+		for _,skip in ipairs{false,true} do
+			local ref=liveimg.get_bitmap_pimg(nil,frame,skip):to_lbuf_packed_rgba():string()
+			local lb,width,height=liveimg.get_bitmap_packed(nil,frame,{skip=skip})
+			assert(width == (skip and 32 or 64) and height == 8)
+			assert(lb:string() == ref)
+			lb=liveimg.get_bitmap_packed(nil,frame,{skip=skip,flip=true})
+			assert(lb:string() == rows_reversed(ref,width,height,4))
+		end
+		-- overlay blends bitmap over viewport by bitmap alpha
+		local vp=liveimg.get_viewport_packed(nil,frame):string()
+		local bm=liveimg.get_bitmap_packed(nil,frame):string()
+		local lb=liveimg.get_viewport_packed(nil,frame,{bitmap_overlay=true,alpha=true})
+		local blended=lb:string()
+		local opaque,clear=0,0
+		for i=0,64*8-1 do
+			local a=bm:byte(i*4 + 4)
+			for c=1,3 do
+				local expect=math.floor((bm:byte(i*4 + c)*a + vp:byte(i*3 + c)*(255 - a) + 127)/255)
+				assert(blended:byte(i*4 + c) == expect)
+			end
+			assert(blended:byte(i*4 + 4) == 255)
+			if a == 0 then
+				clear=clear+1
+			elseif a == 255 then
+				opaque=opaque+1
+			end
+		end
+		assert(opaque > 0 and (clear > 0 or bm_type == 2))
+	end
+	-- bitmap scaled to the viewport screen
+	local frame=make_live_frame{vp_type=2,vp_width=64,vp_height=8,bm_type=1,bm_width=32,bm_height=4}
+	local plain=liveimg.get_viewport_packed(nil,frame,{skip=true}):string()
+	local blended=liveimg.get_viewport_packed(nil,frame,{skip=true,bitmap_overlay=true}):string()
+	local bm=liveimg.get_bitmap_packed(nil,frame):string()
+	for y=0,7 do
+		for x=0,31 do
+			local i=y*32 + x
+			local b=(math.floor(y/2)*32 + x)*4
+			local a=bm:byte(b + 4)
+			local expect=math.floor((bm:byte(b + 1)*a + plain:byte(i*3 + 1)*(255 - a) + 127)/255)
+			assert(blended:byte(i*3 + 1) == expect)
+		end
+	end
+end
+
+t.liveimg_roi = function()
+	-- rectangle of packed pixels s of the given row width, upscaled by scale
+	local function crop(s,width,depth,x,y,w,h,scale)
+		local t={}
+		for row=y,y+h-1 do
+			local r={}
+			for col=x,x+w-1 do
+				local px=s:sub((row*width + col)*depth + 1,(row*width + col + 1)*depth)
+				table.insert(r,px:rep(scale))
+			end
+			r=table.concat(r)
+			for i=1,scale do
+				table.insert(t,r)
+			end
+		end
+		return table.concat(t)
+	end
+	local function rows_reversed(s,row_len)
+		local t={}
+		for i=#s-row_len+1,1,-row_len do
+			table.insert(t,s:sub(i,i+row_len-1))
+		end
+		return table.concat(t)
+	end
+	math.randomseed(3)
+	for _,fb_type in ipairs{0,2,3} do
+		local frame=make_live_frame{vp_type=fb_type,vp_width=72,vp_height=10}
+		for _,skip in ipairs{false,true} do
+			local par=skip and 2 or 1
+			local full,fw=liveimg.get_viewport_packed(nil,frame,{skip=skip})
+			full=full:string()
+			-- unaligned starts and widths, partial groups at both edges
+			for _,r in ipairs{{0,0,72,10},{5,3,22,4},{7,1,1,1},{60,8,30,5},{-4,-2,10,5}} do
+				for _,scale in ipairs{1,3} do
+					local x,y,w,h=unpack(r)
+					local opts={skip=skip,x=x,y=y,width=w,height=h,scale=scale}
+					-- expected clipped rectangle in output pixels
+					local cx,cy=math.max(x,0),math.max(y,0)
+					local cw,ch=math.min(x + w,72) - cx,math.min(y + h,10) - cy
+					local ox,ow=math.floor(cx/par),math.floor(cw/par)
+					local desc=string.format('type %d skip %s roi %d,%d,%d,%d scale %d',
+									fb_type,tostring(skip),x,y,w,h,scale)
+					if ow == 0 then
+						assert(not pcall(liveimg.get_viewport_packed,nil,frame,opts),desc)
+					else
+						local ref=crop(full,fw,3,ox,cy,ow,ch,scale)
+						local lb,width,height=liveimg.get_viewport_packed(nil,frame,opts)
+						assert(width == ow*scale and height == ch*scale,desc)
+						assert(lb:string() == ref,desc)
+						opts.flip=true
+						assert(liveimg.get_viewport_packed(nil,frame,opts):string() == rows_reversed(ref,width*3),desc)
+						opts.flip=nil
+						opts.alpha=true
+						assert(liveimg.get_viewport_packed(nil,frame,opts):string():gsub('(...)\255','%1') == ref,desc)
+						-- pimg rows are bottom to top, to_lbuf_packed_rgb flips back
+						local pimg=liveimg.get_viewport_pimg(nil,frame,skip,opts)
+						assert(pimg:width() == width and pimg:height() == height,desc)
+						assert(pimg:to_lbuf_packed_rgb():string() == ref,desc)
+					end
+				end
+			end
+		end
+		assert(not pcall(liveimg.get_viewport_packed,nil,frame,{x=72}))
+		assert(not pcall(liveimg.get_viewport_packed,nil,frame,{y=10}))
+		assert(not pcall(liveimg.get_viewport_packed,nil,frame,{scale=0}))
+		assert(not pcall(liveimg.get_viewport_pimg,nil,frame,false,{scale=17}))
+		-- re-used pimg takes the new size
+		local pimg=liveimg.get_viewport_pimg(nil,frame,false,{width=8,height=2})
+		assert(liveimg.get_viewport_pimg(pimg,frame,false,{width=4,height=4}) == pimg)
+		assert(pimg:width() == 4 and pimg:height() == 4)
+	end
+end
+
+t.liveimg_palette_cache = function()
+	math.randomseed(4)
+	local frame=make_live_frame{bm_type=1,bm_width=16,bm_height=4}
+	local pal_start=frame:get_i32(16)
+	liveimg.palette_cache_stats(true)
+	local ref=liveimg.get_bitmap_packed(nil,frame):string()
+	local hits,misses=liveimg.palette_cache_stats()
+	assert(hits == 0 and misses == 1)
+	-- unchanged palette is not converted again, by any route
+	assert(liveimg.get_bitmap_packed(nil,frame):string() == ref)
+	assert(liveimg.get_bitmap_pimg(nil,frame):to_lbuf_packed_rgba():string() == ref)
+	liveimg.get_viewport_packed(nil,frame,{bitmap_overlay=true})
+	hits,misses=liveimg.palette_cache_stats(true)
+	assert(hits == 2 and misses == 0)
+	-- changed palette data or type is a new entry
+	-- entry of the first pixel, V U Y A, made a different opaque gray
+	local entry=pal_start + frame:get_u8(frame:get_i32(32+36+4))*4
+	frame:set_u32(entry,(frame:get_u8(entry + 2) < 128) and 0xFFF00000 or 0xFF100000)
+	local changed=liveimg.get_bitmap_packed(nil,frame):string()
+	assert(changed ~= ref)
+	hits,misses=liveimg.palette_cache_stats(true)
+	assert(hits == 0 and misses == 1)
+	frame:set_i32(12,5)
+	liveimg.get_bitmap_packed(nil,frame)
+	hits,misses=liveimg.palette_cache_stats(true)
+	assert(hits == 0 and misses == 1)
+	-- more palettes than entries, the least recently used is replaced
+	local saved=frame:get_u32(pal_start)
+	for i=1,6 do
+		frame:set_u32(pal_start,i)
+		liveimg.get_bitmap_packed(nil,frame)
+	end
+	frame:set_u32(pal_start,6)
+	liveimg.get_bitmap_packed(nil,frame)
+	frame:set_u32(pal_start,1)
+	liveimg.get_bitmap_packed(nil,frame)
+	hits,misses=liveimg.palette_cache_stats(true)
+	assert(hits == 1 and misses == 7)
+	-- type without a conversion uses the default palette
+	frame:set_u32(pal_start,saved)
+	frame:set_i32(12,0)
+	local default=liveimg.get_bitmap_packed(nil,frame):string()
+	frame:set_i32(16,0)
+	assert(liveimg.get_bitmap_packed(nil,frame):string() == default)
+end
+
+t.liveimg_focus = function()
+	-- frame with a uniform background and a gaussian star of the given sigma, centered at cx,cy
+	local function star_frame(fb_type,sigma,cx,cy)
+		local width,height=64,48
+		local frame=make_live_frame{vp_type=fb_type,vp_width=width,vp_height=height}
+		local vp_start,buf_width=frame:get_i32(32 + 4,2)
+		local row_inc=buf_width*((fb_type == 0) and 12 or 16)/8
+		for y=0,height-1 do
+			for x=0,width-1 do
+				local v=20 + 200*math.exp(-((x - cx)^2 + (y - cy)^2)/(2*sigma^2))
+				local off
+				if fb_type == 0 then
+					off=math.floor(x/4)*6 + ({1,3,4,5})[x%4 + 1]
+				else
+					off=math.floor(x/2)*4 + 1 + (x%2)*2
+				end
+				frame:set_u8(vp_start + y*row_inc + off,math.floor(v + 0.5))
+			end
+		end
+		return frame
+	end
+	for _,fb_type in ipairs{0,2,3} do
+		local sharp=liveimg.focus_metric(star_frame(fb_type,1,30.3,20.6))
+		assert(sharp.width == 64 and sharp.height == 48 and sharp.x == 0 and sharp.y == 0)
+		assert(sharp.background == 20)
+		assert(sharp.peak_x == 30 and sharp.peak_y == 21 and not sharp.saturated)
+		assert(math.abs(sharp.star_x - 30.3) < 0.1 and math.abs(sharp.star_y - 20.6) < 0.1)
+		-- continuous gaussian hfr is sigma*sqrt(pi/2)
+		assert(math.abs(sharp.hfr - 1.25) < 0.25)
+		local soft=liveimg.focus_metric(star_frame(fb_type,3,30.3,20.6))
+		assert(soft.hfr > 2*sharp.hfr)
+		assert(soft.lap_var < sharp.lap_var/4)
+		assert(soft.flux > sharp.flux)
+		-- ROI clipped to the viewport, coordinates stay in viewport pixels
+		local roi=liveimg.focus_metric(star_frame(fb_type,1,30.3,20.6),{x=20,y=10,width=100,height=20})
+		assert(roi.x == 20 and roi.y == 10 and roi.width == 44 and roi.height == 20)
+		assert(roi.peak_x == 30 and roi.peak_y == 21)
+		assert(math.abs(roi.hfr - sharp.hfr) < 0.01)
+		-- ROI without the star
+		local empty=liveimg.focus_metric(star_frame(fb_type,1,30.3,20.6),{x=50,y=40})
+		assert(empty.peak == 20 and empty.hfr == 0 and empty.lap_var == 0)
+		assert(not pcall(liveimg.focus_metric,star_frame(fb_type,1,30.3,20.6),{x=64}))
+	end
+	assert(liveimg.focus_metric(make_live_frame{bm_type=1,bm_width=8,bm_height=4}) == nil)
+end
+
+t.lvdump = function()
+	local dir='chdkptp-test-data'
+	fsutil.mkdir_m(dir)
+	local base=make_live_frame{vp_type=2,vp_width=64,vp_height=16}
+	local frames={base}
+	-- small changes, so delta frames are much smaller
+	for i=2,4 do
+		local frame=frames[i-1]:sub()
+		frame:set_u32(200 + i*16,i,i*3,i*7)
+		frames[i]=frame
+	end
+	-- size change forces a key frame
+	table.insert(frames,make_live_frame{vp_type=0,vp_width=32,vp_height=8})
+	local flat=lbuf.new(base:len())
+	flat:fill(base:sub(1,64))
+	table.insert(frames,flat)
+	local times={}
+	for i=1,#frames do
+		times[i]=1500000000 + i*0.033334
+	end
+
+	local function check_reader(r,with_times)
+		assert(r:count() == #frames)
+		-- out of order to exercise delta chains
+		for _,i in ipairs{3,1,4,2,6,5,3,4} do
+			local frame,time=r:read(i)
+			assert(frame:string() == frames[i]:string())
+			if with_times then
+				assert(math.abs(time - times[i]) < 0.000002)
+			else
+				assert(time == nil)
+			end
+			assert(r:read(i,lbuf.new(0)):string() == frames[i]:string())
+		end
+		assert(not pcall(r.read,r,#frames + 1))
+		r:close()
+	end
+
+	local sizes={}
+	for _,compress in ipairs{false,true} do
+		local fn=dir..'/test'..tostring(compress)..'.lvdump'
+		local w=chdku.lvdump_create(fn,{compress=compress,keyframe_interval=3})
+		for i,frame in ipairs(frames) do
+			w:write(frame,times[i])
+		end
+		w:close()
+		assert(w.size == lfs.attributes(fn,'size'))
+		sizes[compress]=w.size
+		local r=chdku.lvdump_open(fn)
+		assert(r.version_major == 2 and r.indexed)
+		check_reader(r,true)
+	end
+	assert(sizes[true] < sizes[false]/2)
+
+	-- interrupted recording without index
+	local fn=dir..'/noindex.lvdump'
+	local w=chdku.lvdump_create(fn,{compress=true})
+	for i,frame in ipairs(frames) do
+		w:write(frame,times[i])
+	end
+	w.fh:close()
+	local r=chdku.lvdump_open(fn)
+	assert(not r.indexed)
+	check_reader(r,true)
+
+	-- v1, with an incomplete last frame
+	fn=dir..'/v1.lvdump'
+	local fh=io.open(fn,'wb')
+	fh:write('chlv')
+	local lb=lbuf.new(12)
+	lb:set_u32(0,8,1,0)
+	lb:fwrite(fh)
+	for _,frame in ipairs(frames) do
+		lb:set_u32(0,frame:len())
+		lb:fwrite(fh,0,4)
+		frame:fwrite(fh)
+	end
+	lb:set_u32(0,100)
+	lb:fwrite(fh)
+	fh:close()
+	r=chdku.lvdump_open(fn)
+	assert(r.version_major == 1)
+	check_reader(r,false)
+	assert(chdku.lvdump_convert(fn,dir..'/v1conv.lvdump',{compress=true}))
+	r=chdku.lvdump_open(dir..'/v1conv.lvdump')
+	assert(r.version_major == 2 and r.indexed)
+	check_reader(r,false)
+	assert(not chdku.lvdump_convert(fn,fn))
+
+	assert(not chdku.lvdump_open(dir..'/nonexistent.lvdump'))
+	-- truncated and corrupt compressed data
+	local payload,codec=liveimg.lvdump_pack(nil,flat)
+	assert(codec == 1)
+	assert(liveimg.lvdump_unpack(nil,payload,0,payload:len(),codec,flat:len()):string() == flat:string())
+	assert(liveimg.lvdump_unpack(nil,payload,0,payload:len() - 1,codec,flat:len()) == false)
+	-- no literals, so the first match offset is out of range
+	payload:set_u8(0,0)
+	assert(liveimg.lvdump_unpack(nil,payload,0,payload:len(),codec,flat:len()) == false)
+	assert(liveimg.lvdump_unpack(nil,payload,0,payload:len(),7,flat:len()) == false)
+	collectgarbage('collect')
+	fsutil.rm_r(dir)
+end
+
+t.lvbench = function()
+	local lvbench=require'lvbench'
+	-- reference frames must not change between releases, or results aren't comparable
+	local expect={
+		yuv8={346764,170129},
+		yuv8b={1536140,1058120},
+		yuv8c={1628300,1122037},
+	}
+	for _,name in ipairs(lvbench.ref_names) do
+		local frame=lvbench.make_ref_frame(name,1)
+		local sum=0
+		for i=0,frame:len()-1,97 do
+			sum=sum+frame:get_u8(i)
+		end
+		assert(frame:len() == expect[name][1] and sum == expect[name][2],name)
+		-- valid frame with a viewport and bitmap
+		assert(liveimg.get_viewport_packed(nil,frame,{bitmap_overlay=true}))
+		assert(liveimg.focus_metric(frame).peak > 200)
+	end
+	assert(lvbench.make_ref_frame('yuv8',2):string() ~= lvbench.make_ref_frame('yuv8',1):string())
+	assert(not pcall(lvbench.make_ref_frame,'bogus',0))
+
+	local r=lvbench.run{ref='yuv8',count=2,reps=1,focus=true,quiet=true}
+	assert(r.frames == 2 and r.reps == 1)
+	assert(r.ns.read == nil and r.ns.vp > 0 and r.ns.focus > 0)
+	assert(r.ns.total >= r.ns.packed and r.fps.total > 0)
+
+	local dir='chdkptp-test-data'
+	local files=lvbench.write_refs(dir,{'yuv8'})
+	assert(#files == 1)
+	local reader=chdku.lvdump_open(files[1])
+	assert(reader:count() == lvbench.ref_frames)
+	assert(reader:read(3):string() == lvbench.make_ref_frame('yuv8',2):string())
+	reader:close()
+	r=lvbench.run{file=files[1],count=2,reps=1,quiet=true}
+	assert(r.ns.read > 0 and r.ns.focus == nil)
+	collectgarbage('collect')
+	fsutil.rm_r(dir)
+end
+
+t.lvserve = function()
+	local stream=chdku.lvstream_create('lvdump')
+	local server,err=lvserve.new{header=stream.header}
+	if not server and err == 'lvserve requires thread support' then
+		printf('skipped, %s\n',err)
+		return
+	end
+	assert(server,err)
+	local port=server:stats().port
+	assert(port > 0)
+	local function wait_clients(n)
+		for i=1,200 do
+			if server:clients() == n then
+				return
+			end
+			sys.sleep(10)
+		end
+		error('expected '..n..' clients')
+	end
+	local c1=assert(lvserve.connect{port=port})
+	local c2=assert(lvserve.connect{port=port})
+	wait_clients(2)
+	local frames={}
+	for i=1,3 do
+		frames[i]=make_live_frame{vp_type=2,vp_width=64,vp_height=16,bm_type=1,bm_width=32,bm_height=8}
+	end
+	-- both clients get the same complete stream, which is a valid lvdump file
+	local dir='chdkptp-test-data'
+	fsutil.mkdir_m(dir)
+	local data={}
+	for i,frame in ipairs(frames) do
+		assert(server:publish(stream:encode(frame,1500000000 + i)) == i)
+		for j,c in ipairs{c1,c2} do
+			if i == 1 then
+				data[j]={c:recv(20)}
+			end
+			table.insert(data[j],c:recv(24 + frame:len()))
+		end
+	end
+	assert(table.concat(data[1]) == table.concat(data[2]))
+	local fn=dir..'/stream.lvdump'
+	local fh=io.open(fn,'wb')
+	fh:write(table.concat(data[1]))
+	fh:close()
+	local reader=chdku.lvdump_open(fn)
+	assert(reader:count() == #frames)
+	for i,frame in ipairs(frames) do
+		local frame2,time=reader:read(i)
+		assert(frame2:string() == frame:string() and time == 1500000000 + i)
+	end
+	reader:close()
+
+	-- a client that doesn't read skips frames without blocking publish or other clients
+	local big=lbuf.new(1024*1024)
+	for i=1,40 do
+		big:set_u32(0,i)
+		server:publish(stream:encode(big))
+		assert(c1:recv(24 + big:len()):sub(25,28) == big:string(1,4))
+	end
+	local stats=server:stats()
+	assert(stats.published == 43 and stats.dropped > 0 and stats.clients == 2)
+	-- the slow client gets a whole frame, not a mix
+	local rec=c2:recv(24 + big:len())
+	assert(rec:len() == 24 + big:len() and rec:sub(25):byte(5) == 0)
+	c2:close()
+	wait_clients(1)
+
+	-- image formats
+	for _,format in ipairs{'ppm','multipart'} do
+		local s=chdku.lvstream_create(format,{skip=true,bitmap_overlay=true})
+		local parts={s:encode(frames[1])}
+		local img=table.concat(parts,'',1,1)
+		if format == 'multipart' then
+			assert(s.header:match('^HTTP/1.0 200 OK\r\n') and s.header:match('boundary=chdkptp%-lv'))
+			local len=tonumber(img:match('Content%-Length: (%d+)\r\n'))
+			assert(len == parts[2]:len() + img:len() - img:find('P6') + 1 and parts[3] == '\r\n')
+			img=img:sub((img:find('P6')))
+		end
+		assert(img == 'P6\n32 16\n255\n' and parts[2]:len() == 32*16*3)
+		assert(s:encode(make_live_frame{bm_type=1,bm_width=8,bm_height=4}) == nil)
+	end
+	assert(not chdku.lvstream_create('bogus'))
+
+	-- unix socket, removed on close
+	if sys.ostype() ~= 'Windows' then
+		local path=dir..'/lv.sock'
+		local userver=assert(lvserve.new{path=path,header='hdr'})
+		assert(userver:stats().path == path)
+		local c=assert(lvserve.connect{path=path})
+		assert(c:recv(3) == 'hdr')
+		userver:publish('abc')
+		assert(c:recv(3) == 'abc')
+		c:close()
+		userver:close()
+		assert(not lfs.attributes(path))
+	end
+
+	-- port in use
+	assert(not lvserve.new{port=port})
+	c1:close()
+	server:close()
+	assert(not pcall(server.publish,server,'x'))
+	assert(not lvserve.connect{port=port})
+	collectgarbage('collect')
+	fsutil.rm_r(dir)
+end
+
 t.compare = function()
 	assert(util.compare_values_subset({1,2,3},{1}))
 	assert(util.compare_values_subset({1},{1,2,3})==false)
@@ -709,6 +1336,1043 @@ t.dng = function()
 	assert(status)
 end
 
+t.tiffifd = function()
+	-- main ifd with a sub ifd, an exif ifd and a second main ifd
+	local b=lbuf.new(240)
+	b:fill('II*\0',0,1)
+	b:set_u32(4,8)
+	local function ifd(off,entries,next_off)
+		b:set_u16(off,#entries)
+		for i,e in ipairs(entries) do
+			local o=off + 2 + (i-1)*12
+			b:set_u16(o,e[1],e[2])
+			b:set_u32(o+4,e[3],e[4])
+		end
+		b:set_u32(off + 2 + #entries*12,next_off)
+	end
+	ifd(8,{{0x100,4,1,100},{0x110,2,6,200},{0x14a,4,1,100},{0x8769,4,1,140}},160)
+	ifd(100,{{0x100,4,1,50}},0)
+	ifd(140,{{0x829a,5,1,220}},0)
+	ifd(160,{{0x100,3,1,7}},0)
+	b:fill('Model\0',200,1)
+	b:set_u32(220,1,100)
+	local tiff=assert(tiffifd.parse(b))
+	assert(tiff:ifd_count() == 4)
+	assert(tiff:data_end() == 228)
+	assert(util.compare_values({tiff:ifd(1)},{100,1,'sub',0}))
+	assert(util.compare_values({tiff:ifd(2)},{140,1,'exif',0}))
+	assert(util.compare_values({tiff:ifd(3)},{160,1,'main',-1}))
+	assert(util.compare_values({tiff:find(0,0x110)},{1,0x110,2,6,200,22}))
+	assert(tiff:find(0,0x101) == nil)
+	assert(util.compare_values({tiff:entry(3,0)},{0x100,3,1,7,162}))
+
+	local d=assert(dng.bind_header(b))
+	assert(#d.ifds == 2 and d.ifds[2].byname.ImageWidth:getel() == 7)
+	assert(d.main_ifd.byname.Model:get_ascii() == 'Model')
+	assert(d.main_ifd.bytag[0x110] == d.main_ifd.byname.Model)
+	assert(d.main_ifd.entries[2] == d.main_ifd.byname.Model)
+	assert(#d.main_ifd.entries == 4 and d.main_ifd.byname.ImageLength == nil)
+	assert(d.raw_ifd.byname.ImageWidth:getel() == 50 and d.raw_ifd.parent == d.main_ifd)
+	assert(d.exif_ifd.is_exif and util.compare_values(d.exif_ifd.byname.ExposureTime:getel(),{1,100}))
+	local e=dng.bind_ifd_entry(d,d.main_ifd,0)
+	assert(e.tag == 0x100 and e:getel() == 100)
+
+	-- header only load, with the exif value past the initial read
+	local tmpfile=os.tmpname()
+	fsutil.writefile_e(b:string(),tmpfile,'wb')
+	d=assert(dng.load_header(tmpfile,{size=180}))
+	assert(d.header_only and d._lb:len() == 228)
+	assert(util.compare_values(d.exif_ifd.byname.ExposureTime:getel(),{1,100}))
+	d=assert(dng.load(tmpfile,{nodata=true}))
+	assert(d._lb:mapped() == 'c')
+	d.main_ifd.byname.ImageWidth:setel(101)
+	d:unmap()
+	assert(not d._lb:mapped() and d.main_ifd.byname.ImageWidth:getel() == 101)
+	d=nil
+	collectgarbage('collect')
+	os.remove(tmpfile)
+
+	-- invalid
+	b:set_u32(160 + 14,8) -- loop back to ifd 0
+	assert(select(2,tiffifd.parse(b)) == 'ifd loop')
+	b:set_u32(160 + 14,0)
+	b:set_u32(42,1000) -- sub ifd outside data
+	assert(not dng.bind_header(b))
+	assert(not tiffifd.parse(lbuf.new('MM\0*\0\0\0\8')))
+end
+
+t.rawstack = function()
+	local spec={
+		width=16,
+		height=8,
+		bpp=12,
+		endian='little',
+		black_level=128,
+		cfa_pattern='\0\1\1\2',
+	}
+	local function mkimg(v)
+		spec.data=lbuf.new(spec.width*spec.height*spec.bpp/8)
+		local img=rawimg.bind_lbuf(spec)
+		for y=0,spec.height-1 do
+			for x=0,spec.width-1 do
+				img:set_pixel(x,y,v+x)
+			end
+		end
+		return img
+	end
+	for _,float in ipairs{false,true} do
+		spec.float=float
+		local stack=rawimg.stack_new(spec)
+		assert(stack:add(mkimg(1000)) == 1)
+		assert(stack:add(mkimg(2000)) == 2)
+		assert(stack:add(mkimg(4000)) == 3)
+		assert(stack:reject(mkimg(4000)) == 2)
+		local info=stack:info()
+		assert(info.frames == 2 and info.rejected == 1 and info.float == float)
+		local img=stack:get_mean{bpp=16}
+		assert(img:get_pixel(0,0) == 1500)
+		assert(img:get_pixel(15,7) == 1515)
+		stack:reset()
+		stack:set_dark(mkimg(200))
+		-- pixels above x=2 get dark 200+x
+		stack:add(mkimg(300))
+		img=stack:get_mean{bpp=12,endian='big'}
+		assert(img:get_pixel(5,5) == 228)
+		local thumb=stack:make_rgb_thumb(4,2,{black=128,white=228})
+		assert(thumb:len() == 4*2*3 and thumb:byte(1) == 255)
+		-- sub image, only rows 2-3 accumulated
+		stack:reset()
+		stack:set_dark()
+		local height=spec.height
+		spec.height=2
+		stack:add(mkimg(100),{y_offset=2})
+		spec.height=height
+		img=stack:get_mean{bpp=16}
+		assert(img:get_pixel(0,2) == 100 and img:get_pixel(0,0) == 128)
+	end
+	spec.float=nil
+	spec.max=2000
+	local stack=rawimg.stack_new(spec)
+	stack:add(mkimg(1000))
+	stack:add(mkimg(3000))
+	assert(stack:get_mean():get_pixel(0,0) == 1000)
+end
+
+t.pixmap = function()
+	local pixmap=require'pixmap'
+	local spec={
+		width=16,
+		height=8,
+		bpp=12,
+		endian='little',
+		black_level=128,
+		cfa_pattern='\0\1\1\2',
+		data=lbuf.new(16*8*12/8),
+	}
+	local img=rawimg.bind_lbuf(spec)
+	for y=0,spec.height-1 do
+		for x=0,spec.width-1 do
+			img:set_pixel(x,y,1000 + (x+y)%3)
+		end
+	end
+	img:set_pixel(5,2,4000)
+	img:set_pixel(3,6,4095)
+	img:set_pixel(9,1,0)
+	local pm=pixmap.detect(img,{max=3000})
+	assert(pm:count() == 2)
+	local x,y=pm:get(0)
+	assert(x == 5 and y == 2)
+	assert(pixmap.detect(img,{sigma=5}):count() == 3)
+	pm=pm:union(pixmap.detect(img,{min=100}))
+	assert(pm:count() == 3)
+	x,y=pm:get(0)
+	assert(x == 9 and y == 1)
+	local tmpfile=os.tmpname()
+	pm:save(tmpfile)
+	local pm2=pixmap.load(tmpfile)
+	os.remove(tmpfile)
+	assert(pm2:count() == 3 and pm2.width == 16 and pm2.height == 8)
+	assert(pm2.list:string() == pm.list:string())
+	assert(pm2:patch(img) == 3)
+	assert(img:get_pixel(5,2) < 1003 and img:get_pixel(9,1) > 999)
+	assert(pixmap.detect(img,{max=3000}):count() == 0)
+	-- id, version, flags, size + phase, counts + points
+	assert(#pm:fix_bad_pixels_opcode(0) == 16 + 12 + 3*8)
+	local band=pm:band(2,5)
+	assert(band:count() == 2 and band.height == 5)
+	x,y=band:get(0)
+	assert(x == 5 and y == 0)
+	assert(pm:band(7,1):count() == 0)
+
+	-- adjacent hot pixels of the same color are patched from good neighbors only, in any list order
+	local results={}
+	for _,order in ipairs{{0,1},{1,0}} do
+		img:set_pixel(10,4,4000)
+		img:set_pixel(12,4,3900)
+		local hot=pixmap.detect(img,{max=3000})
+		assert(hot:count() == 2)
+		local list=lbuf.new(8)
+		list:set_u32(0,hot.list:get_u32(order[1]*4),hot.list:get_u32(order[2]*4))
+		assert(img:patch_pixel_list(list) == 2)
+		local v1,v2=img:get_pixel(10,4),img:get_pixel(12,4)
+		assert(v1 >= 1000 and v1 <= 1002 and v2 >= 1000 and v2 <= 1002)
+		table.insert(results,{v1,v2})
+	end
+	assert(results[1][1] == results[2][1] and results[1][2] == results[2][2])
+end
+
+t.rawimg_threads = function()
+	local spec={
+		width=64,
+		height=256,
+		bpp=12,
+		endian='little',
+		black_level=128,
+		cfa_pattern='\0\1\1\2',
+		active_area={top=4,left=8,bottom=252,right=60},
+	}
+	local function mkimg()
+		spec.data=lbuf.new(spec.width*spec.height*spec.bpp/8)
+		local img=rawimg.bind_lbuf(spec)
+		for y=0,spec.height-1 do
+			for x=0,spec.width-1 do
+				img:set_pixel(x,y,1000 + (x*7+y*13)%50)
+			end
+		end
+		for i=1,40 do
+			img:set_pixel((i*37)%64,(i*53)%256,(i%2 == 0) and 0 or 4095)
+		end
+		return img
+	end
+	local function run()
+		local r={}
+		local img=mkimg()
+		local cimg,clb=img:convert{bpp=16,endian='big'}
+		r.convert=clb:string()
+		r.bad=img:find_bad_pixels{sigma=4}:string()
+		r.patched=img:patch_pixels()
+		r.patch=spec.data:string()
+		local stack=rawimg.stack_new(spec)
+		stack:set_dark(mkimg())
+		stack:add(cimg:convert{bpp=12,endian='little'})
+		stack:add(img)
+		local _,mlb=stack:get_mean()
+		r.mean=mlb:string()
+		r.thumb=stack:make_rgb_thumb(26,62):string()..img:make_rgb_thumb(26,62):string()
+		return r
+	end
+	local threads=rawimg.get_threads()
+	rawimg.set_threads(1)
+	local r1=run()
+	assert(rawimg.get_threads() == 1)
+	rawimg.set_threads(4)
+	local r4=run()
+	rawimg.set_threads(threads)
+	assert(r1.patched > 0)
+	for k,v in pairs(r1) do
+		assert(r4[k] == v,k)
+	end
+	-- converted image must keep its own lbuf alive
+	local img=mkimg():convert{bpp=16,endian='little'}
+	collectgarbage('collect')
+	assert(img:get_pixel(1,0) == 1007)
+end
+
+t.rgb_thumb = function()
+	local spec={
+		width=16,
+		height=8,
+		black_level=0,
+		cfa_pattern='\0\1\1\2',
+	}
+	local ref
+	for _,bpp in ipairs{10,12,14,16} do
+		for _,endian in ipairs{'little','big'} do
+			spec.bpp=bpp
+			spec.endian=endian
+			spec.data=lbuf.new(spec.width*spec.height*bpp/8)
+			local img=rawimg.bind_lbuf(spec)
+			for y=0,spec.height-1 do
+				for x=0,spec.width-1 do
+					local c=spec.cfa_pattern:byte((x%2) + (y%2)*2 + 1)
+					img:set_pixel(x,y,({800,400,200})[c+1])
+				end
+			end
+			img:set_pixel(0,0,960)
+			-- all pixels of each color in the cell are averaged
+			local thumb=img:make_rgb_thumb(2,2,{white=1023,gamma=1}):string()
+			if ref then
+				assert(thumb == ref,bpp..endian)
+			else
+				ref=thumb
+			end
+		end
+	end
+	-- 8 quads per cell, (7*800+960)/8 = 820
+	assert(ref:byte(1) == util.round(820*255/1023))
+	assert(ref:byte(2) == util.round(400*255/1023))
+	assert(ref:byte(3) == util.round(200*255/1023))
+	assert(ref:byte(4) == util.round(800*255/1023))
+	-- wb and gamma
+	local img=rawimg.bind_lbuf(spec)
+	local thumb=img:make_rgb_thumb(1,1,{black=200,white=1023,wb={1,1,2},gamma=2}):string()
+	assert(thumb:byte(3) == 0)
+	assert(thumb:byte(2) == util.round(255*math.sqrt(200/823)))
+	-- larger than half the active area repeats cells
+	assert(img:make_rgb_thumb(16,8):len() == 16*8*3)
+end
+
+t.write_dng = function()
+	local spec={
+		width=16,
+		height=12,
+		bpp=12,
+		endian='little',
+		cfa_pattern='\0\1\1\2',
+		active_area={top=1,left=2,bottom=12,right=16},
+	}
+	spec.data=lbuf.new(spec.width*spec.height*spec.bpp/8)
+	local img=rawimg.bind_lbuf(spec)
+	for y=0,spec.height-1 do
+		for x=0,spec.width-1 do
+			img:set_pixel(x,y,100 + x*50 + y*20)
+		end
+	end
+	-- sub-image rows 3-8, written swapped and padded with 0xff
+	local rb=spec.width*spec.bpp/8
+	local sub=spec.data:sub(3*rb+1,9*rb)
+	local hdr=lbuf.new('header')
+	local tmpfile=os.tmpname()
+	local fh=io.open(tmpfile,'wb')
+	rawimg.write_dng(fh,{header=hdr,data=sub,data_offset=3*rb,data_size=spec.data:len(),trailer=lbuf.new('end')})
+	fh:close()
+	local out=fsutil.readfile_e(tmpfile,'b')
+	os.remove(tmpfile)
+	local padded=lbuf.new(spec.data:len())
+	padded:fill('\255')
+	padded:fill(sub,3*rb,1)
+	local big=padded:sub()
+	big:reverse_bytes()
+	assert(out == 'header'..big:string()..'end')
+	assert(sub:string() == spec.data:string(3*rb+1,9*rb)) -- source unchanged
+	-- thumb of the sub-image in full image coordinates matches the padded image
+	local pspec=util.extend_table({},spec)
+	pspec.data=padded
+	local ref=rawimg.bind_lbuf(pspec):make_rgb_thumb(7,5):string()
+	local sspec=util.extend_table({},spec)
+	sspec.data=sub
+	sspec.height=6
+	sspec.active_area={top=0,left=2,bottom=6,right=16}
+	local simg=rawimg.bind_lbuf(sspec)
+	assert(simg:make_rgb_thumb(7,5,{y_offset=3,area=spec.active_area}):string() == ref)
+
+	-- odd header and thumb lengths, data larger than the write buffer with an odd final byte
+	local pattern={}
+	for i=0,250 do
+		pattern[i+1]=string.char(i)
+	end
+	local data=lbuf.new(600001)
+	data:fill(table.concat(pattern))
+	fh=io.open(tmpfile,'wb')
+	rawimg.write_dng(fh,{header=lbuf.new('abc'),thumb=lbuf.new('th'),data=data})
+	fh:close()
+	out=fsutil.readfile_e(tmpfile,'b')
+	os.remove(tmpfile)
+	local swapped=data:sub()
+	swapped:reverse_bytes()
+	assert(out == 'abcth'..swapped:string())
+end
+
+t.lj92 = function()
+	local spec={
+		width=48,
+		height=40,
+		bpp=12,
+		endian='big',
+		cfa_pattern='\0\1\1\2',
+	}
+	spec.data=lbuf.new(spec.width*spec.height*spec.bpp/8)
+	local img=rawimg.bind_lbuf(spec)
+	for y=0,spec.height-1 do
+		for x=0,spec.width-1 do
+			img:set_pixel(x,y,(100 + x*30 + (x%2)*500 + y*y + ((x*y)%7)*40)%4096)
+		end
+	end
+	img:set_pixel(5,5,4095)
+	img:set_pixel(6,5,0)
+	local function decode(data,sizes,tw,th,dspec)
+		local offsets={}
+		local off=0
+		for i,size in ipairs(sizes) do
+			offsets[i]=off
+			off=off + size
+		end
+		assert(off == data:len())
+		return rawimg.decode_lj92(util.extend_table({},dspec or spec,{keys={'width','height','bpp','endian','data','data_offset'}}),
+			{data=data,offsets=offsets,sizes=sizes,tile_width=tw,tile_height=th})
+	end
+	local threads=rawimg.get_threads()
+	for _,p in ipairs{1,6,7} do
+		-- edge tiles are partial in both directions
+		rawimg.set_threads(1)
+		local data,sizes=img:encode_lj92{tile_width=32,tile_height=16,predictor=p}
+		rawimg.set_threads(3)
+		local data2=img:encode_lj92{tile_width=32,tile_height=16,predictor=p}
+		assert(data:string() == data2:string())
+		assert(#sizes == 2*3)
+		local dimg,dlb=decode(data,sizes,32,16)
+		assert(dlb:string() == spec.data:string())
+		assert(dimg:bpp() == 12 and dimg:width() == spec.width)
+	end
+	rawimg.set_threads(threads)
+	-- single strip, decoded into part of an existing lbuf
+	local data,sizes=img:encode_lj92{tile_width=48,tile_height=48}
+	local lb=lbuf.new(spec.data:len() + 10)
+	decode(data,sizes,48,48,util.extend_table({data=lb,data_offset=10},spec,{keys={'width','height','bpp','endian'}}))
+	assert(lb:string(11) == spec.data:string())
+	-- sub-image rows 8-23 of 64, other rows are fill
+	local sub=rawimg.bind_lbuf(util.extend_table({height=16,data_offset=8*spec.width*spec.bpp/8},spec,{keys={'width','bpp','endian','data'}}))
+	data,sizes=sub:encode_lj92{tile_width=16,tile_height=16,y_offset=8,height=64,fill=4095}
+	assert(#sizes == 3*4)
+	local full=decode(data,sizes,16,16,util.extend_table({height=64},spec,{keys={'width','bpp','endian'}}))
+	assert(full:get_pixel(1,7) == 4095 and full:get_pixel(1,24) == 4095)
+	assert(full:get_pixel(1,8) == img:get_pixel(1,8) and full:get_pixel(47,23) == img:get_pixel(47,23))
+	-- invalid
+	assert(not pcall(img.encode_lj92,img,{tile_width=20}))
+	assert(not pcall(decode,lbuf.new('junk'),{4},48,48))
+	-- all huffman codes moved to length 1, more than 1 bit can represent
+	data,sizes=img:encode_lj92{tile_width=48,tile_height=48}
+	local bits_off=data:string():find('\255\196',1,true) + 4
+	local nvals=0
+	for i=0,15 do
+		nvals=nvals + data:get_u8(bits_off + i)
+		data:set_u8(bits_off + i,0)
+	end
+	assert(nvals > 2)
+	data:set_u8(bits_off,nvals)
+	local status,err=pcall(decode,data,sizes,48,48)
+	assert(not status and tostring(err):match('invalid DHT'))
+
+	-- minimal DNG: main ifd with raw sub ifd, 32x32 12 bit data at 256
+	local b=lbuf.new(256 + 32*32*12/8)
+	b:fill('II*\0',0,1)
+	b:set_u32(4,8)
+	local function ifd(off,entries)
+		b:set_u16(off,#entries)
+		for i,e in ipairs(entries) do
+			local o=off + 2 + (i-1)*12
+			b:set_u16(o,e[1],e[2])
+			b:set_u32(o+4,e[3],e[4])
+		end
+	end
+	ifd(8,{{0x14a,4,1,100}})
+	ifd(100,{
+		{0x100,4,1,32},{0x101,4,1,32},{0x102,3,1,12},{0x103,3,1,1},
+		{0x111,4,1,256},{0x116,4,1,32},{0x117,4,1,32*32*12/8},
+		{0x828e,1,4,0x02010100},{0xc61a,4,1,128},{0xc68d,4,4,230},
+	})
+	b:set_u32(230,2,0,32,32)
+	local tmpfile=os.tmpname()
+	fsutil.writefile_e(b:string(),tmpfile,'wb')
+	local d=assert(dng.load(tmpfile,{nomap=true}))
+	assert(d:raw_prefix_size() == 256 and not d:is_lj92())
+	for y=0,31 do
+		for x=0,31 do
+			d.img:set_pixel(x,y,(128 + x*x + y*50)%4096)
+		end
+	end
+	local fh=io.open(tmpfile,'wb')
+	assert(d:write_lj92(fh,{tile_width=16,tile_height=16}) > 0)
+	fh:close()
+	assert(d.raw_ifd.off == 100) -- not modified
+	local d2=assert(dng.bind_header(require'lbufutil'.loadfile(tmpfile)))
+	assert(d2:is_lj92() and d2.raw_ifd.byname.TileOffsets.count == 4 and not d2.raw_ifd.byname.StripOffsets)
+	assert(d2.raw_ifd.byname.TileOffsets:getel() == 256)
+	-- decompressed on load
+	d2=assert(dng.load(tmpfile))
+	assert(not d2:is_lj92() and d2.lj92.tile_width == 16)
+	assert(d2.raw_ifd.byname.StripOffsets:getel() == 256)
+	assert(d2:get_imgspec().active_area.top == 2)
+	assert(d2.img:endian() == 'big')
+	local n=0
+	for y=0,31 do
+		for x=0,31 do
+			if d2.img:get_pixel(x,y) ~= d.img:get_pixel(x,y) then
+				n=n+1
+			end
+		end
+	end
+	assert(n == 0)
+	d2=nil
+	collectgarbage('collect')
+	os.remove(tmpfile)
+
+	-- 4x2 RGB thumb in ifd 0, odd sizes rounded down to even so the raw data offset stays even
+	ifd(8,{
+		{0x100,4,1,4},{0x101,4,1,2},{0x111,4,1,232},{0x116,4,1,2},{0x117,4,1,24},{0x14a,4,1,100},
+	})
+	d=assert(dng.bind_header(b))
+	d:set_thumb_size(7,5)
+	assert(d.main_ifd.byname.ImageWidth:getel() == 6 and d.main_ifd.byname.ImageLength:getel() == 4)
+	assert(d.main_ifd.byname.RowsPerStrip:getel() == 4 and d.main_ifd.byname.StripByteCounts:getel() == 72)
+	assert(d.raw_ifd.byname.StripOffsets:getel() == 256 + 72 - 24)
+	d:set_thumb_size(1,1)
+	assert(d.main_ifd.byname.StripByteCounts:getel() == 12)
+end
+
+t.demosaic = function()
+	-- odd active area origin, cfa is relative to it
+	local spec={
+		width=32,
+		height=40,
+		bpp=16,
+		endian='little',
+		black_level=0,
+		cfa_pattern='\0\1\1\2',
+		active_area={top=1,left=1,bottom=39,right=31},
+	}
+	spec.data=lbuf.new(spec.width*spec.height*2)
+	local img=rawimg.bind_lbuf(spec)
+	assert(img:cfa_pattern() == '\2\1\1\0')
+	for y=0,spec.height-1 do
+		for x=0,spec.width-1 do
+			local c=spec.cfa_pattern:byte(((x-1)%2) + ((y-1)%2)*2 + 1)
+			img:set_pixel(x,y,({800,400,200})[c+1])
+		end
+	end
+	-- flat colors are reproduced exactly
+	for _,method in ipairs{'bilinear','edge'} do
+		local lb,w,rows=img:demosaic{method=method,white=65535,endian='little'}
+		assert(w == 30 and rows == 38 and lb:len() == 30*38*6)
+		for i=0,w*rows-1,37 do
+			assert(lb:get_u16(i*6) == 800,method)
+			assert(lb:get_u16(i*6+2) == 400,method)
+			assert(lb:get_u16(i*6+4) == 200,method)
+		end
+	end
+	local lb=img:demosaic{white=65535,endian='little',wb={2,1,0.5}}
+	assert(lb:get_u16(0) == 1600 and lb:get_u16(4) == 100)
+	-- results don't depend on band size or threads
+	local seed=''
+	for i=1,251 do
+		seed=seed..string.char((i*7919)%251)
+	end
+	spec.data:fill(seed)
+	local ref=img:demosaic():string()
+	local band=lbuf.new(30*7*6)
+	for _,threads in ipairs{1,4} do
+		rawimg.set_threads(threads)
+		assert(img:demosaic():string() == ref)
+		local parts={}
+		local top=0
+		repeat
+			local _,w,rows=img:demosaic{top=top,rows=7,lbuf=band}
+			table.insert(parts,band:string(1,w*rows*6))
+			top=top+rows
+		until top >= 38
+		assert(table.concat(parts) == ref)
+	end
+	rawimg.set_threads(0)
+	local hdr=dng.rgb16_tiff_header(30,38)
+	assert(hdr:string(1,4) == 'II*\0')
+	assert(hdr:get_u32(10 + 5*12 + 8) == hdr:len()) -- StripOffsets
+end
+
+t.fits = function()
+	local fits=require'fits'
+	assert(fits.card('SIMPLE',true) == string.format('%-80s','SIMPLE  =                    T'))
+	assert(fits.card('OBJECT',"M 31's",'x') == string.format('%-80s',"OBJECT  = 'M 31''s ' / x"))
+	assert(fits.card('EXPTIME',0.25) == string.format('%-80s','EXPTIME =                 0.25'))
+	assert(fits.bayer_pattern('\0\1\1\2',0,0) == 'RGGB' and fits.bayer_pattern('\0\1\1\2',1,1) == 'BGGR')
+	local hdr=fits.header({{'SIMPLE',true}})
+	assert(#hdr == 2880 and hdr:sub(81,83) == 'END')
+
+	-- metadata from a minimal stand in for a DNG header
+	local function entry(v)
+		return {getel=function() return v end,get_ascii=function() return v end}
+	end
+	local d={
+		main_ifd={byname={Model=entry('Test Cam')}},
+		raw_ifd={byname={BlackLevel=entry(100)}},
+		exif_ifd={byname={
+			ExposureTime=entry({1,4}),
+			ISOSpeedRatings=entry(800),
+			DateTimeOriginal=entry('2021:03:04 05:06:07'),
+		}},
+	}
+	local spec={
+		width=12,
+		height=10,
+		bpp=12,
+		endian='little',
+		black_level=100,
+		cfa_pattern='\0\1\1\2',
+		active_area={top=1,left=2,bottom=9,right=10},
+	}
+	spec.data=lbuf.new(spec.width*spec.height*spec.bpp/8)
+	local img=rawimg.bind_lbuf(spec)
+	for y=0,spec.height-1 do
+		for x=0,spec.width-1 do
+			img:set_pixel(x,y,50 + x*10 + y*100)
+		end
+	end
+	local tmpfile=os.tmpname()
+	local function write(opts)
+		local fh=io.open(tmpfile,'wb')
+		fits.write(fh,d,img,opts)
+		fh:close()
+		local s=fsutil.readfile_e(tmpfile,'b')
+		local cards={}
+		local pos=1
+		repeat
+			local card=s:sub(pos,pos+79)
+			if card:sub(9,10) == '= ' then
+				local v=string.match(card:sub(11),'^%s*([^/]-)%s*/') or string.match(card:sub(11),'^%s*(.-)%s*$')
+				cards[string.match(card:sub(1,8),'%S+')]=string.match(v,"^'(.-)%s*'$") or v
+			end
+			pos=pos+80
+		until card:match('^END ')
+		local data_start=math.ceil((pos-1)/2880)*2880
+		assert(#s%2880 == 0)
+		return cards,s,data_start
+	end
+	local function s16(s,i)
+		local v=s:byte(i)*256 + s:byte(i+1)
+		return ((v >= 32768) and (v - 65536) or v) + 32768
+	end
+	local function s32(s,i)
+		local v=((s:byte(i)*256 + s:byte(i+1))*256 + s:byte(i+2))*256 + s:byte(i+3)
+		return (v >= 2^31) and (v - 2^32) or v
+	end
+	local cards,s,off=write()
+	assert(cards.BITPIX == '16' and cards.NAXIS1 == '8' and cards.NAXIS2 == '8' and cards.BZERO == '32768')
+	-- cfa_pattern is relative to the active area
+	assert(cards.BAYERPAT == 'RGGB' and cards.INSTRUME == 'Test Cam' and cards.ISOSPEED == '800')
+	assert(cards.EXPTIME == '0.25' and cards['DATE-LOC'] == '2021-03-04T05:06:07' and cards.BLKLEVEL == '100')
+	assert(s16(s,off + 1) == img:get_pixel(2,1) and s16(s,off + 8*8*2 - 1) == img:get_pixel(9,8))
+	-- calibrated, signed 32 bit
+	cards,s,off=write{bitpix=32,black=true,region='all'}
+	assert(cards.BITPIX == '32' and cards.NAXIS1 == '12' and not cards.BZERO and cards.BLKLEVEL == '0')
+	assert(cards.BAYERPAT == 'GBRG')
+	assert(s32(s,off + 1) == -50 and s32(s,off + 4*13 + 1) == img:get_pixel(1,1) - 100)
+	assert(#s == off + 2880)
+
+	-- rgb planes, written in bands
+	spec.bpp=16
+	spec.black_level=0
+	spec.data=lbuf.new(spec.width*spec.height*2)
+	img=rawimg.bind_lbuf(spec)
+	for y=0,spec.height-1 do
+		for x=0,spec.width-1 do
+			img:set_pixel(x,y,({800,400,200})[img:cfa_pattern():byte((x%2) + (y%2)*2 + 1)+1])
+		end
+	end
+	cards,s,off=write{planes='rgb',band=3,white=65535,wb={1,1,1}}
+	assert(cards.NAXIS == '3' and cards.NAXIS3 == '3' and not cards.BAYERPAT)
+	for c,v in ipairs{800,400,200} do
+		local plane=off + (c-1)*8*8*2
+		assert(s16(s,plane + 1) == v and s16(s,plane + 8*8*2 - 1) == v)
+	end
+	assert(#s == off + 2880)
+	assert(not pcall(write,{planes='rgb',bitpix=32}))
+	os.remove(tmpfile)
+end
+
+t.find_stars = function()
+	local spec={
+		width=160,
+		height=128,
+		bpp=16,
+		endian='little',
+		black_level=100,
+		cfa_pattern='\0\1\1\2',
+	}
+	-- background 200 above black, with a little deterministic noise
+	local noise={}
+	for i=1,97 do
+		local v=300 + (i*37)%7 - 3
+		noise[i]=string.char(v%256,math.floor(v/256))
+	end
+	spec.data=lbuf.new(spec.width*spec.height*2)
+	spec.data:fill(table.concat(noise))
+	local img=rawimg.bind_lbuf(spec)
+	local truth={{x=40.3,y=30.6,amp=2000},{x=110.5,y=80.2,amp=1000},{x=70.8,y=100.4,amp=500}}
+	local sigma=1.5
+	for _,st in ipairs(truth) do
+		for y=math.floor(st.y)-6,math.floor(st.y)+6 do
+			for x=math.floor(st.x)-6,math.floor(st.x)+6 do
+				local d2=(x-st.x)^2+(y-st.y)^2
+				img:set_pixel(x,y,img:get_pixel(x,y) + util.round(st.amp*math.exp(-d2/(2*sigma^2))))
+			end
+		end
+	end
+	local ref
+	for _,threads in ipairs{1,4} do
+		rawimg.set_threads(threads)
+		for _,plane in ipairs{'bin','green'} do
+			local stars=img:find_stars{plane=plane,grid=32}
+			assert(stars:count() == 3,plane)
+			-- brightest first
+			for i,st in ipairs(truth) do
+				local s=stars:get(i-1)
+				assert(math.abs(s.x - st.x) < 0.25 and math.abs(s.y - st.y) < 0.25,plane)
+				assert(s.fwhm > 3 and s.fwhm < 4.5,plane)
+				assert(not s.saturated)
+				-- green samples are diagonal pairs, which elongates stars slightly
+				assert(plane == 'green' or s.ecc < 0.25)
+			end
+			local stats=stars:stats()
+			assert(math.abs(stats.background - 200) < 2)
+			if plane == 'bin' then
+				if ref then
+					assert(util.compare_values(stats,ref))
+				else
+					ref=stats
+				end
+			end
+		end
+	end
+	rawimg.set_threads(0)
+	assert(img:find_stars{sat=1000}:get(0).saturated)
+	assert(img:find_stars{min_pix=1000}:count() == 0)
+	assert(img:find_stars{max_stars=1}:count() == 1)
+end
+
+--[[
+320x240 16 bit raw with a fixed pseudo-random field of 20 stars
+xf(x,y) maps reference star positions to positions in the image
+]]
+local function make_star_field(xf)
+	local spec={
+		width=320,
+		height=240,
+		bpp=16,
+		endian='little',
+		black_level=100,
+		cfa_pattern='\0\1\1\2',
+	}
+	local noise={}
+	for i=1,97 do
+		local v=300 + (i*37)%7 - 3
+		noise[i]=string.char(v%256,math.floor(v/256))
+	end
+	spec.data=lbuf.new(spec.width*spec.height*2)
+	spec.data:fill(table.concat(noise))
+	local img=rawimg.bind_lbuf(spec)
+	local seed=7
+	local function rnd()
+		seed=(seed*1103515245 + 12345)%2147483648
+		return seed/2147483648
+	end
+	for i=1,20 do
+		local x,y=xf(20 + rnd()*280,20 + rnd()*200)
+		local amp=500 + rnd()*2000
+		for py=math.floor(y)-5,math.floor(y)+5 do
+			for px=math.floor(x)-5,math.floor(x)+5 do
+				local d2=(px-x)^2+(py-y)^2
+				img:set_pixel(px,py,img:get_pixel(px,py) + util.round(amp*math.exp(-d2/4.5)))
+			end
+		end
+	end
+	return img
+end
+t.register = function()
+	local make=make_star_field
+	local ref=make(function(x,y) return x,y end)
+	local a=math.rad(1)
+	-- frame is the reference rotated 1 degree and shifted
+	local frame=make(function(x,y)
+		return math.cos(a)*x - math.sin(a)*y + 3.5,math.sin(a)*x + math.cos(a)*y - 2
+	end)
+	local rs=ref:find_stars()
+	local fs=frame:find_stars()
+	for _,model in ipairs{'similarity','affine'} do
+		local xf=assert(rawimg.match_stars(rs,fs,{model=model}))
+		assert(xf.matches >= 15,model)
+		assert(xf.rms < 0.2,model)
+		assert(math.abs(xf.rotation + 1) < 0.02,model)
+		-- frame origin maps to the inverse shift
+		local x0=-(math.cos(a)*3.5 + math.sin(a)*-2)
+		local y0=-(-math.sin(a)*3.5 + math.cos(a)*-2)
+		assert(math.abs(xf.tx - x0) < 0.1 and math.abs(xf.ty - y0) < 0.1,model)
+	end
+	local xf=rawimg.match_stars(rs,fs)
+	local ref_data
+	for _,threads in ipairs{1,4} do
+		rawimg.set_threads(threads)
+		local w,lb=frame:warp(xf)
+		if ref_data then
+			assert(lb:string() == ref_data)
+		else
+			ref_data=lb:string()
+		end
+		-- warped stars line up with the reference
+		local wxf=assert(rawimg.match_stars(rs,w:find_stars()))
+		assert(math.abs(wxf.tx) < 0.1 and math.abs(wxf.ty) < 0.1 and math.abs(wxf.rotation) < 0.01)
+	end
+	rawimg.set_threads(0)
+	-- unrelated star fields don't match
+	local other=make(function(x,y) return 320-x,y*0.7 end)
+	assert(not rawimg.match_stars(rs,other:find_stars()))
+end
+
+t.dngbatch = function()
+	local dngcli=require'dngcli'
+	local dir='chdkptp-test-data'
+	fsutil.mkdir_m(dir..'/src')
+	-- minimal DNG: main ifd with raw sub ifd, 12 bit data at 256
+	local function write_dng(img,filename)
+		local w,h=img:width(),img:height()
+		local b=lbuf.new(256 + w*h*12/8)
+		b:fill('II*\0',0,1)
+		b:set_u32(4,8)
+		local function ifd(off,entries)
+			b:set_u16(off,#entries)
+			for i,e in ipairs(entries) do
+				local o=off + 2 + (i-1)*12
+				b:set_u16(o,e[1],e[2])
+				b:set_u32(o+4,e[3],e[4])
+			end
+		end
+		ifd(8,{{0x14a,4,1,100}})
+		ifd(100,{
+			{0x100,4,1,w},{0x101,4,1,h},{0x102,3,1,12},{0x103,3,1,1},
+			{0x111,4,1,256},{0x116,4,1,h},{0x117,4,1,w*h*12/8},
+			{0x828e,1,4,0x02010100},{0xc61a,4,1,100},{0xc68d,4,4,230},
+		})
+		b:set_u32(230,0,0,h,w)
+		fsutil.writefile_e(b:string(),filename,'wb')
+		local d=assert(dng.load(filename,{nomap=true}))
+		for y=0,h-1 do
+			for x=0,w-1 do
+				d.img:set_pixel(x,y,math.min(4095,img:get_pixel(x,y)))
+			end
+		end
+		fsutil.writefile_e(d._lb:string(),filename,'wb')
+	end
+	local a=math.rad(1)
+	write_dng(make_star_field(function(x,y) return x,y end),dir..'/ref.dng')
+	write_dng(make_star_field(function(x,y)
+		return math.cos(a)*x - math.sin(a)*y + 3.5,math.sin(a)*x + math.cos(a)*y - 2
+	end),dir..'/src/a.dng')
+	write_dng(make_star_field(function(x,y) return x - 4,y + 1.5 end),dir..'/src/b.dng')
+	fsutil.writefile_e('junk',dir..'/bad.dng','wb')
+
+	-- align to a loaded file by number
+	assert(cli:execute('dngload -nosel '..dir..'/ref.dng'))
+	local n=#dngcli.list
+	local cmdstr='align -ref='..n..' ; save'
+	local status,err=cli:execute('dngbatch -odir='..dir..'/serial '..dir..'/src {'..cmdstr..'}')
+	assert(status,err)
+
+	-- as dngbatch -j=2, with the workers run in this process
+	-- the file that fails to load is handled by the second worker, between files of the first
+	local files={
+		{src=dir..'/src/a.dng',relpath='a.dng'},
+		{src=dir..'/bad.dng',relpath='bad.dng'},
+		{src=dir..'/src/b.dng',relpath='b.dng'},
+	}
+	local cmds=assert(dngcli.dngbatch_parse_cmds(cmdstr))
+	local job=assert(dngcli.dngbatch_job(files,2,{odir=dir..'/par'},cmds))
+	assert(job.cmds[1].args.ref == dir..'/ref.dng')
+	local jobfile=os.tmpname()
+	fsutil.writefile_e(serialize(job,{pretty=false}),jobfile,'wb')
+	fsutil.mkdir_m(dir..'/par')
+	local stdout=util.util_stdout
+	local workers={}
+	for k=1,2 do
+		workers[k]=io.tmpfile()
+		util.util_stdout=workers[k]
+		local status,err=pcall(dngcli.dngbatch_worker,jobfile,k)
+		util.util_stdout=stdout
+		assert(status,err)
+		workers[k]:seek('set')
+	end
+	os.remove(jobfile)
+	-- worker output is relayed in file order, the failure reported
+	local stderr=util.util_stderr
+	local out=io.tmpfile()
+	util.util_stdout=out
+	util.util_stderr=out
+	local status,errors=pcall(dngcli.dngbatch_relay,files,workers)
+	util.util_stdout=stdout
+	util.util_stderr=stderr
+	assert(status,errors)
+	out:seek('set')
+	local loads={}
+	for l in out:lines() do
+		local src=string.match(l,'^load: (.*)')
+		if src then
+			table.insert(loads,src)
+		end
+	end
+	out:close()
+	for i,f in ipairs(files) do
+		assert(loads[i] == f.src)
+	end
+	assert(#errors == 1 and errors[1]:find(dir..'/bad.dng: ',1,true) == 1)
+	-- other files processed after the failure, same output as serial
+	for _,f in ipairs{files[1],files[3]} do
+		local s=fsutil.readfile_e(dir..'/serial/'..f.relpath,'b')
+		assert(s == fsutil.readfile_e(dir..'/par/'..f.relpath,'b'),f.relpath)
+		assert(s ~= fsutil.readfile_e(f.src,'b'))
+	end
+	assert(not lfs.attributes(dir..'/par/bad.dng'))
+	-- results that don't match the file are errors
+	for _,fh in ipairs(workers) do
+		fh:seek('set')
+	end
+	workers[1],workers[2]=workers[2],workers[1]
+	out=io.tmpfile()
+	util.util_stdout=out
+	util.util_stderr=out
+	status,errors=pcall(dngcli.dngbatch_relay,files,workers)
+	util.util_stdout=stdout
+	util.util_stderr=stderr
+	out:close()
+	assert(status,errors)
+	assert(#errors == 3 and string.match(errors[1],'unexpected worker result 2$'))
+	for _,fh in ipairs(workers) do
+		fh:close()
+	end
+
+	assert(not dngcli.dngbatch_job(files,2,{},assert(dngcli.dngbatch_parse_cmds('align -ref='..(n + 1)))))
+	table.remove(dngcli.list,n)
+	collectgarbage('collect')
+	fsutil.rm_r(dir)
+end
+
+t.autofocus = function()
+	local autofocus=require'autofocus'
+	local pos=autofocus.positions(40000,48000,9)
+	assert(#pos == 9 and pos[1] == 40000 and pos[9] == 48000 and pos[5] == 44000)
+	-- asymmetric V with the minimum between samples
+	local points={}
+	for _,p in ipairs(pos) do
+		local d=p - 44700
+		table.insert(points,{p,d < 0 and 1.5 - d*0.001 or 1.5 + d*0.0008})
+	end
+	local best=assert(autofocus.fit(points,'v'))
+	assert(math.abs(best - 44700) < 1)
+	for _,p in ipairs(points) do
+		p[2]=2 + ((p[1] - 43210)/1000)^2
+	end
+	best=assert(autofocus.fit(points,'parabola'))
+	assert(math.abs(best - 43210) < 1)
+	local _,fit=autofocus.fit_parabola(points)
+	assert(math.abs(fit.a*43210^2 + fit.b*43210 + fit.c - 2) < 1e-3)
+	-- minimum at the end of the range
+	assert(not autofocus.fit({{1,5},{2,4},{3,3},{4,2}},'v'))
+	assert(not autofocus.fit({{1,5},{2,4},{3,3},{4,2}},'parabola'))
+
+	local spec={
+		width=160,
+		height=64,
+		bpp=16,
+		endian='little',
+		black_level=100,
+	}
+	spec.data=lbuf.new(spec.width*spec.height*2)
+	spec.data:fill(string.char(44,1)) -- 300
+	local img=rawimg.bind_lbuf(spec)
+	local function star(sx,sy,sigma)
+		for y=math.floor(sy)-8,math.floor(sy)+8 do
+			for x=math.floor(sx)-8,math.floor(sx)+8 do
+				local d2=(x-sx)^2+(y-sy)^2
+				img:set_pixel(x,y,img:get_pixel(x,y) + util.round(2000*math.exp(-d2/(2*sigma^2))))
+			end
+		end
+	end
+	star(40.5,30.5,1.2)
+	star(110.5,32.5,2.5)
+	local wide=assert(autofocus.measure(img,{x=112,y=30}))
+	local narrow,info=assert(autofocus.measure(img,{x=40,y=31}))
+	assert(narrow < wide and math.abs(info.x - 40.5) < 0.3)
+	assert(not autofocus.measure(img,{x=75,y=30}))
+	local med=assert(autofocus.measure(img))
+	assert(med >= narrow and med <= wide)
+
+	-- remotecap sub-image rows 20-51 of the 160x64 frame, masked columns 0-23 and rows 0-2
+	-- the stars at rows 30 and 32 are found, a hot column in the masked area isn't
+	local data=spec.data:sub(1 + 20*spec.width*2,52*spec.width*2)
+	for y=0,31 do
+		data:set_u16(y*spec.width*2 + 10*2,4000)
+	end
+	local full={width=160,height=64,bpp=16,black_level=100,cfa_pattern='\0\1\1\2',
+		active_area={top=3,left=24,bottom=40,right=160}}
+	local simg=chdku.rc_bind_raw(util.extend_table({},full),data,20)
+	local top,left,bottom,right=simg:active_area()
+	assert(top == 1 and left == 24 and bottom == 20 and right == 160 and simg:height() == 32)
+	local stars=simg:find_stars()
+	assert(stars:count() == 2)
+	for i=0,1 do
+		assert(stars:get(i).x > 24 and stars:get(i).y < 20)
+	end
+	-- full frame rows, same CFA phase
+	local fimg=chdku.rc_bind_raw(util.extend_table({},full),spec.data,0)
+	top,left,bottom,right=fimg:active_area()
+	assert(top == 3 and bottom == 40 and fimg:height() == 64)
+	assert(simg:cfa_pattern() == fimg:cfa_pattern() and fimg:cfa_pattern() ~= '\0\0\0\0')
+end
+
+t.framegate = function()
+	local framegate=require'framegate'
+	local function make(opts)
+		local spec={
+			width=160,
+			height=128,
+			bpp=16,
+			endian='little',
+			black_level=100,
+		}
+		local v=100 + opts.bg
+		spec.data=lbuf.new(spec.width*spec.height*2)
+		spec.data:fill(string.char(v%256,math.floor(v/256)))
+		local img=rawimg.bind_lbuf(spec)
+		for i=1,opts.stars do
+			local sx,sy=10.5 + (i-1)%4*40,15.5 + math.floor((i-1)/4)*35
+			for y=math.floor(sy)-8,math.floor(sy)+8 do
+				for x=math.floor(sx)-8,math.floor(sx)+8 do
+					local d2=((x-sx)/opts.stretch)^2+(y-sy)^2
+					img:set_pixel(x,y,img:get_pixel(x,y) + util.round(3000*math.exp(-d2/(2*opts.sigma^2))))
+				end
+			end
+		end
+		return img
+	end
+	local good={bg=200,stars=12,sigma=1.5,stretch=1}
+	local logfile=os.tmpname()
+	os.remove(logfile)
+	local gate=framegate.new{log=logfile,warmup=2}
+	for i=1,3 do
+		local status,metrics=gate:check(make(good),'good'..i)
+		assert(status == 'ok')
+		assert(metrics.stars == 12 and math.abs(metrics.background - 200) < 1)
+	end
+	local function check(opts)
+		return gate:check(make(util.extend_table(util.extend_table({},good),opts)),'bad')
+	end
+	assert(check{bg=500} == 'quarantine')
+	assert(check{stars=4} == 'quarantine')
+	assert(check{sigma=3} == 'quarantine')
+	local status,_,reason=check{stretch=1.4}
+	assert(status == 'quarantine' and string.match(reason,'^ecc'))
+	assert(check{bg=250,sigma=1.7} == 'ok')
+	assert(gate.frames == 8 and gate.rejected == 4)
+	local fh=io.open(logfile,'rb')
+	local lines=0
+	for l in fh:lines() do
+		lines=lines+1
+	end
+	fh:close()
+	os.remove(logfile)
+	assert(lines == 9)
+	assert(gate:quarantine_path('out/IMG_0001.dng') == 'out/quarantine/IMG_0001.dng')
+	gate=framegate.new{action='reject',warmup=1}
+	assert(gate:check(make(good)) == 'ok')
+	assert(gate:check(make(util.extend_table(util.extend_table({},good),{bg=1000}))) == 'reject')
+end
+
 t.climisc = function()
 	local status,msg=cli:execute('!return 1')
 	assert(status and msg=='=1')
@@ -719,6 +2383,14 @@ t.climisc = function()
 	status,msg=cli:execute('!<'..tmpfile)
 	assert(status and msg=='=2')
 	os.remove(tmpfile)
+
+	-- remoteshoot / rsint -thumbw
+	assert(cli.get_rs_thumb_width{dng=true,thumbw='160'} == 160)
+	assert(cli.get_rs_thumb_width{dng=true} == nil)
+	for _,v in ipairs{'0','-10','12.5','x',true} do
+		local status,err=pcall(cli.get_rs_thumb_width,{dng=true,thumbw=v})
+		assert(not status and err.etype == 'bad_arg')
+	end
 end
 
 function m:run(name)
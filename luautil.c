@@ -65,6 +65,16 @@ lua_Number lu_table_optnumber(lua_State *L, int narg, const char *fname, lua_Num
 	return r;
 }
 
+/*
+return boolean value of field, or d if field is nil
+*/
+int lu_table_optboolean(lua_State *L, int narg, const char *fname, int d) {
+	lua_getfield(L, narg, fname);
+	int r = lua_isnil(L,-1)?d:lua_toboolean(L,-1);
+	lua_pop(L,1);
+	return r;
+}
+
 const char *lu_table_checkstring(lua_State *L, int narg, const char *fname) {
 	lua_getfield(L, narg, fname);
 	const char *r = luaL_checkstring(L,-1);
@@ -24,6 +24,7 @@ void *lu_table_checkudata(lua_State *L, int narg, const char *fname, const char
 void *lu_table_optudata(lua_State *L, int narg, const char *fname, const char *tname, void *d);
 lua_Number lu_table_checknumber(lua_State *L, int narg, const char *fname);
 lua_Number lu_table_optnumber(lua_State *L, int narg, const char *fname, lua_Number d);
+int lu_table_optboolean(lua_State *L, int narg, const char *fname, int d);
 int lu_table_checkoption(lua_State *L, int narg, const char *fname, const char *def, const char *lst[]);
 const char *lu_table_checkstring(lua_State *L, int narg, const char *fname);
 const char *lu_table_optlstring(lua_State *L, int narg, const char *fname, const char *d, size_t *l);
@@ -34,4 +35,7 @@ void lu_pusharray_raw_u16(lua_State *L, int count, uint16_t *values);
 #if LUA_VERSION_NUM >= 503
 LUALIB_API void (luaL_register) (lua_State *L, const char *libname, const luaL_Reg *l);
 #define luaL_optint(L, narg, d) (int)luaL_optinteger(L, narg, (lua_Integer)(d))
+#ifndef lua_objlen
+#define lua_objlen(L,i) lua_rawlen(L,i)
+#endif
 #endif
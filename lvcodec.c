@@ -0,0 +1,221 @@
+/*
+ * fast compression for live view recordings, LZ4 block format with optional delta against the previous frame
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#include <stdint.h>
+#include <string.h>
+#include "lvcodec.h"
+
+/*
+greedy single hash probe compressor, output is a standard LZ4 block readable by other decoders
+format constraints: matches are at least 4 bytes with 16 bit offsets, the last match starts
+at least 12 bytes before the end, and the last 5 bytes are always literals
+*/
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5
+#define LZ_MFLIMIT 12
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 14
+
+static inline uint32_t lz_read32(const uint8_t *p) {
+	uint32_t v;
+	memcpy(&v,p,4);
+	return v;
+}
+
+static inline uint32_t lz_hash(uint32_t v) {
+	return (v*2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+unsigned lvcodec_lz_bound(unsigned len) {
+	return len + len/255 + 16;
+}
+
+// write an LZ4 length extension, for values over 15 in a token nibble
+static inline uint8_t *lz_put_len(uint8_t *op, unsigned len) {
+	while(len >= 255) {
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = (uint8_t)len;
+	return op;
+}
+
+unsigned lvcodec_lz_compress(const uint8_t *src, unsigned len, uint8_t *dst, unsigned dst_len) {
+	uint32_t table[1<<LZ_HASH_BITS];
+	const uint8_t *ip = src;
+	const uint8_t *anchor = src;
+	const uint8_t *end = src + len;
+	uint8_t *op = dst;
+	uint8_t *op_end = dst + dst_len;
+
+	if(dst_len < lvcodec_lz_bound(len)) {
+		return 0;
+	}
+	if(len >= LZ_MFLIMIT + 1) {
+		const uint8_t *match_limit = end - LZ_LAST_LITERALS;
+		const uint8_t *ip_limit = end - LZ_MFLIMIT;
+		unsigned misses = 0;
+		memset(table,0,sizeof(table));
+		ip++;
+		while(ip < ip_limit) {
+			uint32_t seq = lz_read32(ip);
+			uint32_t h = lz_hash(seq);
+			const uint8_t *ref = src + table[h];
+			table[h] = (uint32_t)(ip - src);
+			if(ref >= ip || ip - ref > LZ_MAX_OFFSET || lz_read32(ref) != seq) {
+				// skip faster through incompressible data
+				ip += 1 + (misses++ >> 6);
+				continue;
+			}
+			misses = 0;
+			while(ip > anchor && ref > src && ip[-1] == ref[-1]) {
+				ip--;
+				ref--;
+			}
+			const uint8_t *mp = ip + LZ_MIN_MATCH;
+			const uint8_t *rp = ref + LZ_MIN_MATCH;
+			while(mp < match_limit && *mp == *rp) {
+				mp++;
+				rp++;
+			}
+			unsigned lit_len = ip - anchor;
+			unsigned match_len = mp - ip - LZ_MIN_MATCH;
+			// can't overflow given the bound check above, but keep the writer self contained
+			if(op + 1 + lit_len + lit_len/255 + 1 + 2 + match_len/255 + 1 > op_end) {
+				return 0;
+			}
+			uint8_t *token = op++;
+			if(lit_len >= 15) {
+				*token = 15 << 4;
+				op = lz_put_len(op,lit_len - 15);
+			} else {
+				*token = lit_len << 4;
+			}
+			memcpy(op,anchor,lit_len);
+			op += lit_len;
+			unsigned offset = ip - ref;
+			*op++ = offset & 0xFF;
+			*op++ = offset >> 8;
+			if(match_len >= 15) {
+				*token |= 15;
+				op = lz_put_len(op,match_len - 15);
+			} else {
+				*token |= match_len;
+			}
+			ip = mp;
+			anchor = ip;
+			// position inside the match, helps runs of repeated data
+			if(ip < ip_limit) {
+				table[lz_hash(lz_read32(ip - 2))] = (uint32_t)(ip - 2 - src);
+			}
+		}
+	}
+	unsigned lit_len = end - anchor;
+	if(op + 1 + lit_len + lit_len/255 + 1 > op_end) {
+		return 0;
+	}
+	uint8_t *token = op++;
+	if(lit_len >= 15) {
+		*token = 15 << 4;
+		op = lz_put_len(op,lit_len - 15);
+	} else {
+		*token = lit_len << 4;
+	}
+	memcpy(op,anchor,lit_len);
+	op += lit_len;
+	return op - dst;
+}
+
+int lvcodec_lz_decompress(const uint8_t *src, unsigned src_len, uint8_t *dst, unsigned dst_len) {
+	const uint8_t *ip = src;
+	const uint8_t *ip_end = src + src_len;
+	uint8_t *op = dst;
+	uint8_t *op_end = dst + dst_len;
+
+	while(ip < ip_end) {
+		unsigned token = *ip++;
+		size_t lit_len = token >> 4;
+		if(lit_len == 15) {
+			unsigned b;
+			do {
+				if(ip >= ip_end) {
+					return 0;
+				}
+				b = *ip++;
+				lit_len += b;
+			} while(b == 255);
+		}
+		if(lit_len > (size_t)(ip_end - ip) || lit_len > (size_t)(op_end - op)) {
+			return 0;
+		}
+		memcpy(op,ip,lit_len);
+		ip += lit_len;
+		op += lit_len;
+		// last sequence has only literals
+		if(ip == ip_end) {
+			break;
+		}
+		if(ip_end - ip < 2) {
+			return 0;
+		}
+		size_t offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if(offset == 0 || offset > (size_t)(op - dst)) {
+			return 0;
+		}
+		size_t match_len = token & 15;
+		if(match_len == 15) {
+			unsigned b;
+			do {
+				if(ip >= ip_end) {
+					return 0;
+				}
+				b = *ip++;
+				match_len += b;
+			} while(b == 255);
+		}
+		match_len += LZ_MIN_MATCH;
+		if(match_len > (size_t)(op_end - op)) {
+			return 0;
+		}
+		const uint8_t *ref = op - offset;
+		if(offset >= match_len) {
+			memcpy(op,ref,match_len);
+			op += match_len;
+		} else {
+			// overlapping, repeats the last offset bytes
+			while(match_len--) {
+				*op++ = *ref++;
+			}
+		}
+	}
+	return op == op_end;
+}
+
+void lvcodec_delta(uint8_t *dst, const uint8_t *a, const uint8_t *b, unsigned len) {
+	unsigned i;
+	for(i=0; i < len; i++) {
+		dst[i] = a[i] - b[i];
+	}
+}
+
+void lvcodec_undelta(uint8_t *dst, const uint8_t *b, unsigned len) {
+	unsigned i;
+	for(i=0; i < len; i++) {
+		dst[i] += b[i];
+	}
+}
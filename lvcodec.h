@@ -0,0 +1,54 @@
+/*
+ * fast compression for live view recordings, LZ4 block format with optional delta against the previous frame
+ * no Lua
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#ifndef LVCODEC_H
+#define LVCODEC_H
+
+// lvdump v2 frame codecs
+#define LVCODEC_RAW 0
+#define LVCODEC_LZ 1 // LZ4 block
+#define LVCODEC_DELTA_LZ 2 // bytewise difference from the previous frame, then LZ4 block
+
+/*
+maximum compressed size of len bytes
+*/
+unsigned lvcodec_lz_bound(unsigned len);
+
+/*
+compress len bytes of src to dst as an LZ4 block
+returns compressed size, or 0 if it would not fit in dst_len
+*/
+unsigned lvcodec_lz_compress(const uint8_t *src, unsigned len, uint8_t *dst, unsigned dst_len);
+
+/*
+decompress an LZ4 block of src_len bytes, which must expand to exactly dst_len bytes
+returns 0 on corrupt or truncated input, never reads or writes out of bounds
+*/
+int lvcodec_lz_decompress(const uint8_t *src, unsigned src_len, uint8_t *dst, unsigned dst_len);
+
+/*
+dst = a - b, bytewise modulo 256. dst may be a
+*/
+void lvcodec_delta(uint8_t *dst, const uint8_t *a, const uint8_t *b, unsigned len);
+
+/*
+dst += b, bytewise modulo 256, inverse of lvcodec_delta
+*/
+void lvcodec_undelta(uint8_t *dst, const uint8_t *b, unsigned len);
+
+#endif
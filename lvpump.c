@@ -0,0 +1,323 @@
+/*
+ * background live view fetch into a ring of frame buffers
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/time.h>
+#ifdef CHDKPTP_THREADS
+#include <pthread.h>
+#endif
+#include <lua.h>
+#include "ptp.h"
+#include "lbuf.h"
+#include "lvpump.h"
+
+#ifdef CHDKPTP_THREADS
+/*
+the pump thread fills the oldest slot that is neither the latest frame nor held by a consumer,
+so consumers always get the newest complete frame without waiting for USB
+*/
+struct lvpump_s {
+	PTPParams *params;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond; // signaled on new frame, release, stop and settings change
+	int thread_started;
+	int stop;
+	unsigned what;
+	unsigned interval_ms;
+	unsigned nframes;
+	lvpump_frame_t frames[LVPUMP_MAX_FRAMES];
+	lvpump_frame_t *latest;
+	int latest_taken; // latest has been acquired at least once
+	lvpump_stats_t stats;
+};
+
+static uint64_t lvpump_time_us(void) {
+	struct timeval tv;
+	gettimeofday(&tv,NULL);
+	return (uint64_t)tv.tv_sec*1000000 + tv.tv_usec;
+}
+
+static void lvpump_abstime(struct timespec *ts, uint64_t time_us) {
+	ts->tv_sec = time_us/1000000;
+	ts->tv_nsec = (time_us%1000000)*1000;
+}
+
+typedef struct {
+	lvpump_frame_t *f;
+	char *old_data; // replaced allocation, freed after the transaction
+	unsigned allocs;
+	uint64_t alloc_bytes;
+} lvpump_fetch_t;
+
+/*
+getdata alloc_func, grows the slot as lbuf_grow_size, like lbufs re-used by get_live_data
+called without the pump lock, the slot is owned by the pump thread until it becomes latest
+*/
+static void *lvpump_alloc(PTPParams *params, PTPGetdataParams *gdparams, uint64_t size) {
+	lvpump_fetch_t *fetch = (lvpump_fetch_t *)gdparams->handler_data;
+	lvpump_frame_t *f = fetch->f;
+	if(size <= f->alloc_len) {
+		return f->data;
+	}
+	if(size > UINT_MAX/2) {
+		return NULL;
+	}
+	unsigned alloc_len = lbuf_grow_size(f->alloc_len,size);
+	char *data = malloc(alloc_len);
+	if(!data) {
+		return NULL;
+	}
+	fetch->old_data = f->data;
+	f->data = data;
+	f->alloc_len = alloc_len;
+	fetch->allocs++;
+	fetch->alloc_bytes += alloc_len;
+	return data;
+}
+
+/*
+oldest slot available for writing, or NULL if all are in use. called with lock held
+*/
+static lvpump_frame_t *lvpump_free_slot(lvpump_t *p) {
+	lvpump_frame_t *r = NULL;
+	unsigned i;
+	for(i=0; i < p->nframes; i++) {
+		lvpump_frame_t *f = &p->frames[i];
+		if(f == p->latest || f->refs) {
+			continue;
+		}
+		if(!r || f->seq < r->seq) {
+			r = f;
+		}
+	}
+	return r;
+}
+
+static void *lvpump_thread(void *arg) {
+	lvpump_t *p = (lvpump_t *)arg;
+	pthread_mutex_lock(&p->lock);
+	while(!p->stop) {
+		lvpump_frame_t *f = lvpump_free_slot(p);
+		if(!f) {
+			pthread_cond_wait(&p->cond,&p->lock);
+			continue;
+		}
+		unsigned what = p->what;
+		lvpump_fetch_t fetch;
+		memset(&fetch,0,sizeof(fetch));
+		fetch.f = f;
+		// keep the slot from being picked again while unlocked
+		f->refs++;
+		pthread_mutex_unlock(&p->lock);
+
+		uint64_t t0 = lvpump_time_us();
+		char *data;
+		unsigned data_size;
+		uint16_t status = ptp_chdk_get_live_data_alloc(p->params,what,lvpump_alloc,&fetch,&data,&data_size);
+		if(status == PTP_RC_OK && (!data || !data_size || data_size > f->alloc_len)) {
+			status = PTP_ERROR_IO;
+		}
+		uint64_t t1 = lvpump_time_us();
+		free(fetch.old_data);
+
+		pthread_mutex_lock(&p->lock);
+		f->refs--;
+		p->stats.status = status;
+		p->stats.allocs += fetch.allocs;
+		p->stats.alloc_bytes += fetch.alloc_bytes;
+		if(status != PTP_RC_OK) {
+			break;
+		}
+		f->len = data_size;
+		f->seq = ++p->stats.seq;
+		f->time_us = t1;
+		if(p->latest && !p->latest_taken) {
+			p->stats.dropped++;
+		}
+		p->latest = f;
+		p->latest_taken = 0;
+		p->stats.fetched++;
+		p->stats.last_fetch_us = (unsigned)(t1 - t0);
+		p->stats.fetch_us += t1 - t0;
+		pthread_cond_broadcast(&p->cond);
+
+		// throttle, measured from the start of the fetch
+		while(!p->stop && p->interval_ms) {
+			uint64_t next = t0 + (uint64_t)p->interval_ms*1000;
+			if(lvpump_time_us() >= next) {
+				break;
+			}
+			struct timespec ts;
+			lvpump_abstime(&ts,next);
+			pthread_cond_timedwait(&p->cond,&p->lock,&ts);
+		}
+	}
+	p->stats.running = 0;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+	return NULL;
+}
+
+lvpump_t *lvpump_create(PTPParams *params) {
+	lvpump_t *p = malloc(sizeof(lvpump_t));
+	if(!p) {
+		return NULL;
+	}
+	memset(p,0,sizeof(lvpump_t));
+	p->params = params;
+	pthread_mutex_init(&p->lock,NULL);
+	pthread_cond_init(&p->cond,NULL);
+	return p;
+}
+
+void lvpump_destroy(lvpump_t *p) {
+	if(!p) {
+		return;
+	}
+	lvpump_stop(p);
+	unsigned i;
+	for(i=0; i < LVPUMP_MAX_FRAMES; i++) {
+		free(p->frames[i].data);
+	}
+	pthread_cond_destroy(&p->cond);
+	pthread_mutex_destroy(&p->lock);
+	free(p);
+}
+
+int lvpump_start(lvpump_t *p, unsigned what, unsigned nframes, unsigned interval_ms) {
+	pthread_mutex_lock(&p->lock);
+	p->what = what;
+	p->interval_ms = interval_ms;
+	if(p->stats.running) {
+		pthread_cond_broadcast(&p->cond);
+		pthread_mutex_unlock(&p->lock);
+		return 1;
+	}
+	pthread_mutex_unlock(&p->lock);
+	// previous thread stopped itself on error, or was stopped
+	lvpump_stop(p);
+
+	if(nframes < LVPUMP_MIN_FRAMES) {
+		nframes = LVPUMP_MIN_FRAMES;
+	} else if(nframes > LVPUMP_MAX_FRAMES) {
+		nframes = LVPUMP_MAX_FRAMES;
+	}
+	pthread_mutex_lock(&p->lock);
+	unsigned i;
+	for(i=0; i < LVPUMP_MAX_FRAMES; i++) {
+		lvpump_frame_t *f = &p->frames[i];
+		// buffers are kept over restarts, but frames from the previous run are not returned
+		f->seq = 0;
+		f->len = 0;
+		if(i >= nframes && !f->refs) {
+			free(f->data);
+			f->data = NULL;
+			f->alloc_len = 0;
+		}
+	}
+	p->nframes = nframes;
+	p->latest = NULL;
+	p->latest_taken = 0;
+	p->stop = 0;
+	// sequence numbers continue over restarts, so consumers can keep using the last one they saw
+	unsigned seq = p->stats.seq;
+	memset(&p->stats,0,sizeof(p->stats));
+	p->stats.seq = seq;
+	p->stats.start_us = lvpump_time_us();
+	p->stats.running = 1;
+	pthread_mutex_unlock(&p->lock);
+	if(pthread_create(&p->thread,NULL,lvpump_thread,p) != 0) {
+		pthread_mutex_lock(&p->lock);
+		p->stats.running = 0;
+		pthread_mutex_unlock(&p->lock);
+		return 0;
+	}
+	p->thread_started = 1;
+	return 1;
+}
+
+void lvpump_stop(lvpump_t *p) {
+	if(!p->thread_started) {
+		return;
+	}
+	pthread_mutex_lock(&p->lock);
+	p->stop = 1;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+	pthread_join(p->thread,NULL);
+	p->thread_started = 0;
+}
+
+lvpump_frame_t *lvpump_acquire(lvpump_t *p, unsigned after_seq, unsigned timeout_ms) {
+	lvpump_frame_t *f = NULL;
+	pthread_mutex_lock(&p->lock);
+	if(timeout_ms && p->stats.running && (!p->latest || p->latest->seq <= after_seq)) {
+		struct timespec ts;
+		lvpump_abstime(&ts,lvpump_time_us() + (uint64_t)timeout_ms*1000);
+		while(p->stats.running && (!p->latest || p->latest->seq <= after_seq)) {
+			if(pthread_cond_timedwait(&p->cond,&p->lock,&ts) != 0) {
+				break;
+			}
+		}
+	}
+	if(p->latest && p->latest->seq > after_seq) {
+		f = p->latest;
+		f->refs++;
+		p->latest_taken = 1;
+	}
+	pthread_mutex_unlock(&p->lock);
+	return f;
+}
+
+void lvpump_release(lvpump_t *p, lvpump_frame_t *f) {
+	pthread_mutex_lock(&p->lock);
+	f->refs--;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+}
+
+void lvpump_get_stats(lvpump_t *p, lvpump_stats_t *stats) {
+	pthread_mutex_lock(&p->lock);
+	*stats = p->stats;
+	pthread_mutex_unlock(&p->lock);
+}
+
+#else
+// without threads, lvpump_create fails so nothing else is reachable
+lvpump_t *lvpump_create(PTPParams *params) {
+	return NULL;
+}
+void lvpump_destroy(lvpump_t *p) {
+}
+int lvpump_start(lvpump_t *p, unsigned what, unsigned nframes, unsigned interval_ms) {
+	return 0;
+}
+void lvpump_stop(lvpump_t *p) {
+}
+lvpump_frame_t *lvpump_acquire(lvpump_t *p, unsigned after_seq, unsigned timeout_ms) {
+	return NULL;
+}
+void lvpump_release(lvpump_t *p, lvpump_frame_t *f) {
+}
+void lvpump_get_stats(lvpump_t *p, lvpump_stats_t *stats) {
+	memset(stats,0,sizeof(*stats));
+}
+#endif
@@ -0,0 +1,91 @@
+/*
+ * background live view fetch into a ring of frame buffers
+ * no Lua
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#ifndef LVPUMP_H
+#define LVPUMP_H
+
+#define LVPUMP_MIN_FRAMES 2
+#define LVPUMP_MAX_FRAMES 16
+#define LVPUMP_DEFAULT_FRAMES 3
+
+/*
+one slot of the ring. data is only valid while the slot is acquired
+*/
+typedef struct {
+	char *data;
+	unsigned len; // size of the frame in data
+	unsigned alloc_len; // allocated size of data
+	unsigned seq; // frame number, starting from 1, 0 = never filled
+	uint64_t time_us; // wall clock time fetch completed, microseconds since the epoch
+	unsigned refs; // number of consumers holding the slot
+} lvpump_frame_t;
+
+typedef struct {
+	int running;
+	uint16_t status; // PTP status of the last fetch, the pump stops on error
+	unsigned seq; // number of the latest frame, continues over restarts
+	unsigned fetched; // frames fetched since start
+	unsigned dropped; // frames replaced before any consumer acquired them
+	unsigned allocs; // frame buffer allocations since start
+	uint64_t alloc_bytes;
+	unsigned last_fetch_us; // duration of the last fetch
+	uint64_t fetch_us; // total time spent fetching since start
+	uint64_t start_us; // wall clock time of start
+} lvpump_stats_t;
+
+typedef struct lvpump_s lvpump_t;
+
+/*
+create a stopped pump for the connection in params
+params must remain valid until lvpump_destroy
+other threads using params must serialize transactions with params->lock_func
+returns NULL if threads are not supported or allocation fails
+*/
+lvpump_t *lvpump_create(PTPParams *params);
+
+/*
+stop the pump if running and free all frames. no frames may be held
+*/
+void lvpump_destroy(lvpump_t *p);
+
+/*
+start fetching live data with flags what into a ring of nframes buffers
+interval_ms: minimum time between fetch starts, 0 to fetch continuously
+if already running, what and interval_ms are updated and nframes is ignored
+returns 0 on failure
+*/
+int lvpump_start(lvpump_t *p, unsigned what, unsigned nframes, unsigned interval_ms);
+
+/*
+stop the pump and wait for the thread to exit
+frames remain available to acquire until the next start
+*/
+void lvpump_stop(lvpump_t *p);
+
+/*
+get the latest frame if it is newer than after_seq, waiting up to timeout_ms
+returns NULL if there is no newer frame or the pump stopped
+the frame must be released with lvpump_release, and is not re-used by the pump until then
+*/
+lvpump_frame_t *lvpump_acquire(lvpump_t *p, unsigned after_seq, unsigned timeout_ms);
+
+void lvpump_release(lvpump_t *p, lvpump_frame_t *f);
+
+void lvpump_get_stats(lvpump_t *p, lvpump_stats_t *stats);
+
+#endif
@@ -0,0 +1,923 @@
+/*
+ * serve live view frames to local clients over TCP or unix sockets
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#ifdef WIN32
+#define WIN32_LEAN_AND_MEAN
+#define WINVER 0x0502
+#include <windows.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <unistd.h>
+#endif
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#ifdef CHDKPTP_THREADS
+#include <pthread.h>
+#endif
+
+#include <lua.h>
+#include <lauxlib.h>
+#include "sockutil.h"
+#include "lbuf.h"
+#include "luautil.h"
+#include "lvserve.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define LVSERVE_MAX_CLIENTS 16
+// maximum time the thread waits without a new frame or socket activity
+#define LVSERVE_POLL_MS 500
+
+#ifdef CHDKPTP_THREADS
+/*
+published frames are written once to a buffer shared by every client sending it
+a client only ever holds one buffer and always moves to the latest frame when done,
+so publishing never waits for clients, and slow clients just see fewer frames
+*/
+typedef struct lvserve_buf_s {
+	char *data;
+	unsigned len;
+	unsigned alloc_len;
+	unsigned seq;
+	unsigned refs; // clients sending this buffer
+	struct lvserve_buf_s *next; // free list
+} lvserve_buf_t;
+
+typedef struct {
+	socket_t sock;
+	lvserve_buf_t *buf; // frame being sent, NULL if waiting for a frame
+	unsigned pos; // bytes of the header or buf sent
+	int header_done;
+	unsigned last_seq; // last frame started, 0 = none
+} lvserve_client_t;
+
+typedef struct {
+	socket_t listen_sock;
+	socket_t wake_sock; // UDP socket connected to itself, a datagram wakes the thread
+	char *unix_path; // removed on close
+	int port;
+	char *header; // sent to each client before any frames
+	unsigned header_len;
+	pthread_t thread;
+	int thread_started;
+	// protects everything below. clients are only modified by the thread
+	pthread_mutex_t lock;
+	int stop;
+	lvserve_buf_t *latest;
+	lvserve_buf_t *free_bufs;
+	lvserve_client_t clients[LVSERVE_MAX_CLIENTS];
+	unsigned nclients;
+	unsigned connections; // clients accepted since start
+	unsigned published;
+	unsigned sent; // frames completely sent, over all clients
+	unsigned dropped; // frames clients skipped while sending an older frame
+	uint64_t bytes;
+} lvserve_t;
+
+static void buf_free(lvserve_buf_t *b) {
+	if(b) {
+		free(b->data);
+		free(b);
+	}
+}
+
+/*
+release a client reference to b, called with lock held
+*/
+static void buf_release(lvserve_t *s, lvserve_buf_t *b) {
+	b->refs--;
+	if(!b->refs && b != s->latest) {
+		b->next = s->free_bufs;
+		s->free_bufs = b;
+	}
+}
+
+static void client_close(lvserve_t *s, unsigned i) {
+	lvserve_client_t *c = &s->clients[i];
+	sockutil_close(c->sock);
+	if(c->buf) {
+		pthread_mutex_lock(&s->lock);
+		buf_release(s,c->buf);
+		pthread_mutex_unlock(&s->lock);
+	}
+	pthread_mutex_lock(&s->lock);
+	s->nclients--;
+	s->clients[i] = s->clients[s->nclients];
+	pthread_mutex_unlock(&s->lock);
+}
+
+static void accept_clients(lvserve_t *s) {
+	while(1) {
+		socket_t sock = accept(s->listen_sock,NULL,NULL);
+		if(sock == INVALID_SOCKET) {
+			return;
+		}
+		if(s->nclients >= LVSERVE_MAX_CLIENTS || !sockutil_set_nonblock(sock)) {
+			sockutil_close(sock);
+			continue;
+		}
+#ifdef SO_NOSIGPIPE
+		int one = 1;
+		setsockopt(sock,SOL_SOCKET,SO_NOSIGPIPE,&one,sizeof(one));
+#endif
+		pthread_mutex_lock(&s->lock);
+		lvserve_client_t *c = &s->clients[s->nclients++];
+		memset(c,0,sizeof(*c));
+		c->sock = sock;
+		// start with the current frame, earlier ones aren't dropped
+		if(s->latest) {
+			c->last_seq = s->latest->seq - 1;
+		}
+		s->connections++;
+		pthread_mutex_unlock(&s->lock);
+	}
+}
+
+/*
+send as much of the header or current frame as the socket takes
+returns 0 if the client should be closed
+*/
+static int client_send(lvserve_t *s, lvserve_client_t *c) {
+	while(1) {
+		const char *data;
+		unsigned len;
+		if(!c->header_done) {
+			data = s->header;
+			len = s->header_len;
+		} else if(c->buf) {
+			data = c->buf->data;
+			len = c->buf->len;
+		} else {
+			return 1;
+		}
+		if(c->pos < len) {
+			int r = send(c->sock,data + c->pos,len - c->pos,MSG_NOSIGNAL);
+			if(r == SOCKET_ERROR) {
+				return sockutil_would_block(sockutil_errno());
+			}
+			c->pos += r;
+			pthread_mutex_lock(&s->lock);
+			s->bytes += r;
+			pthread_mutex_unlock(&s->lock);
+			if(c->pos < len) {
+				return 1;
+			}
+		}
+		c->pos = 0;
+		if(!c->header_done) {
+			c->header_done = 1;
+			continue;
+		}
+		pthread_mutex_lock(&s->lock);
+		s->sent++;
+		buf_release(s,c->buf);
+		c->buf = NULL;
+		pthread_mutex_unlock(&s->lock);
+		return 1;
+	}
+}
+
+/*
+give waiting clients the latest frame, called with lock held
+*/
+static void assign_frames(lvserve_t *s) {
+	unsigned i;
+	if(!s->latest) {
+		return;
+	}
+	for(i=0; i < s->nclients; i++) {
+		lvserve_client_t *c = &s->clients[i];
+		if(!c->header_done || c->buf || c->last_seq >= s->latest->seq) {
+			continue;
+		}
+		c->buf = s->latest;
+		c->buf->refs++;
+		c->last_seq = c->buf->seq;
+		c->pos = 0;
+	}
+}
+
+static void *lvserve_thread(void *arg) {
+	lvserve_t *s = (lvserve_t *)arg;
+	char scratch[1024];
+	while(1) {
+		pthread_mutex_lock(&s->lock);
+		if(s->stop) {
+			pthread_mutex_unlock(&s->lock);
+			break;
+		}
+		assign_frames(s);
+		pthread_mutex_unlock(&s->lock);
+
+		fd_set rfds,wfds;
+		FD_ZERO(&rfds);
+		FD_ZERO(&wfds);
+		FD_SET(s->listen_sock,&rfds);
+		FD_SET(s->wake_sock,&rfds);
+		socket_t max_sock = (s->listen_sock > s->wake_sock)?s->listen_sock:s->wake_sock;
+		unsigned i;
+		for(i=0; i < s->nclients; i++) {
+			lvserve_client_t *c = &s->clients[i];
+			// always read, to notice disconnects and discard requests
+			FD_SET(c->sock,&rfds);
+			if(!c->header_done || c->buf) {
+				FD_SET(c->sock,&wfds);
+			}
+			if(c->sock > max_sock) {
+				max_sock = c->sock;
+			}
+		}
+		struct timeval tv;
+		tv.tv_sec = LVSERVE_POLL_MS/1000;
+		tv.tv_usec = (LVSERVE_POLL_MS%1000)*1000;
+		int r = select((int)max_sock + 1,&rfds,&wfds,NULL,&tv);
+		if(r == SOCKET_ERROR) {
+			if(sockutil_would_block(sockutil_errno())) {
+				continue;
+			}
+			break;
+		}
+		if(FD_ISSET(s->wake_sock,&rfds)) {
+			while(recv(s->wake_sock,scratch,sizeof(scratch),0) > 0);
+		}
+		// clients may be removed, so go backwards
+		for(i=s->nclients; i-- > 0;) {
+			lvserve_client_t *c = &s->clients[i];
+			if(FD_ISSET(c->sock,&rfds)) {
+				int n = recv(c->sock,scratch,sizeof(scratch),0);
+				if(n == 0 || (n == SOCKET_ERROR && !sockutil_would_block(sockutil_errno()))) {
+					client_close(s,i);
+					continue;
+				}
+			}
+			if(FD_ISSET(c->sock,&wfds) && !client_send(s,c)) {
+				client_close(s,i);
+			}
+		}
+		if(FD_ISSET(s->listen_sock,&rfds)) {
+			accept_clients(s);
+		}
+	}
+	return NULL;
+}
+
+static void lvserve_destroy(lvserve_t *s) {
+	if(s->thread_started) {
+		pthread_mutex_lock(&s->lock);
+		s->stop = 1;
+		pthread_mutex_unlock(&s->lock);
+		send(s->wake_sock,"",1,0);
+		pthread_join(s->thread,NULL);
+		s->thread_started = 0;
+	}
+	while(s->nclients) {
+		client_close(s,s->nclients - 1);
+	}
+	if(s->listen_sock != INVALID_SOCKET) {
+		sockutil_close(s->listen_sock);
+		s->listen_sock = INVALID_SOCKET;
+	}
+	if(s->wake_sock != INVALID_SOCKET) {
+		sockutil_close(s->wake_sock);
+		s->wake_sock = INVALID_SOCKET;
+	}
+#ifndef WIN32
+	if(s->unix_path) {
+		unlink(s->unix_path);
+	}
+#endif
+	free(s->unix_path);
+	s->unix_path = NULL;
+	buf_free(s->latest);
+	s->latest = NULL;
+	while(s->free_bufs) {
+		lvserve_buf_t *b = s->free_bufs;
+		s->free_bufs = b->next;
+		buf_free(b);
+	}
+	free(s->header);
+	s->header = NULL;
+	pthread_mutex_destroy(&s->lock);
+}
+
+/*
+listen on host:port, port 0 for any free port
+returns NULL on success, otherwise an error message
+*/
+static const char *listen_tcp(lvserve_t *s, const char *host, int port) {
+	struct addrinfo hints, *result, *ptr;
+	char port_str[16];
+	memset(&hints,0,sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+	hints.ai_flags = AI_PASSIVE;
+	sprintf(port_str,"%d",port);
+	if(getaddrinfo(host,port_str,&hints,&result) != 0) {
+		return "getaddrinfo failed";
+	}
+	const char *err = "no usable address";
+	for(ptr=result; ptr; ptr=ptr->ai_next) {
+		socket_t sock = socket(ptr->ai_family,ptr->ai_socktype,ptr->ai_protocol);
+		if(sock == INVALID_SOCKET) {
+			continue;
+		}
+		int one = 1;
+		setsockopt(sock,SOL_SOCKET,SO_REUSEADDR,(const char *)&one,sizeof(one));
+		if(bind(sock,ptr->ai_addr,ptr->ai_addrlen) == SOCKET_ERROR) {
+			err = sockutil_strerror(sockutil_errno());
+			sockutil_close(sock);
+			continue;
+		}
+		s->listen_sock = sock;
+		break;
+	}
+	freeaddrinfo(result);
+	if(s->listen_sock == INVALID_SOCKET) {
+		return err;
+	}
+	struct sockaddr_storage addr;
+	socklen_t addr_len = sizeof(addr);
+	if(getsockname(s->listen_sock,(struct sockaddr *)&addr,&addr_len) == 0) {
+		if(addr.ss_family == AF_INET) {
+			s->port = ntohs(((struct sockaddr_in *)&addr)->sin_port);
+		} else if(addr.ss_family == AF_INET6) {
+			s->port = ntohs(((struct sockaddr_in6 *)&addr)->sin6_port);
+		}
+	}
+	return NULL;
+}
+
+static const char *listen_unix(lvserve_t *s, const char *path) {
+#ifdef WIN32
+	return "unix sockets not supported";
+#else
+	struct sockaddr_un addr;
+	if(strlen(path) >= sizeof(addr.sun_path)) {
+		return "path too long";
+	}
+	memset(&addr,0,sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path,path);
+	// remove a stale socket from a previous run, but nothing else
+	struct stat st;
+	if(stat(path,&st) == 0 && S_ISSOCK(st.st_mode)) {
+		unlink(path);
+	}
+	socket_t sock = socket(AF_UNIX,SOCK_STREAM,0);
+	if(sock == INVALID_SOCKET) {
+		return sockutil_strerror(sockutil_errno());
+	}
+	if(bind(sock,(struct sockaddr *)&addr,sizeof(addr)) == SOCKET_ERROR) {
+		const char *err = sockutil_strerror(sockutil_errno());
+		sockutil_close(sock);
+		return err;
+	}
+	s->listen_sock = sock;
+	s->unix_path = strdup(path);
+	return NULL;
+#endif
+}
+
+static const char *open_wake(lvserve_t *s) {
+	struct sockaddr_in addr;
+	socklen_t addr_len = sizeof(addr);
+	memset(&addr,0,sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	s->wake_sock = socket(AF_INET,SOCK_DGRAM,0);
+	if(s->wake_sock == INVALID_SOCKET
+		|| bind(s->wake_sock,(struct sockaddr *)&addr,sizeof(addr)) == SOCKET_ERROR
+		|| getsockname(s->wake_sock,(struct sockaddr *)&addr,&addr_len) == SOCKET_ERROR
+		|| connect(s->wake_sock,(struct sockaddr *)&addr,addr_len) == SOCKET_ERROR
+		|| !sockutil_set_nonblock(s->wake_sock)) {
+		return sockutil_strerror(sockutil_errno());
+	}
+	return NULL;
+}
+
+static lvserve_t *server_get(lua_State *L,int i) {
+	lvserve_t *s = (lvserve_t *)luaL_checkudata(L,i,LVSERVE_META);
+	if(s->listen_sock == INVALID_SOCKET) {
+		luaL_error(L,"server closed");
+	}
+	return s;
+}
+
+/*
+server=lvserve.new(opts)
+opts {
+	port=number -- TCP port, default 0 = any free port, see stats
+	host=string -- address to listen on, default 127.0.0.1 so only local clients can connect
+	path=string -- listen on this unix socket instead of TCP
+	header=string|lbuf -- sent to each client when it connects, before any frames
+}
+returns server, or false,msg
+*/
+static int lvserve_new(lua_State *L) {
+	const char *host = "127.0.0.1";
+	const char *path = NULL;
+	int port = 0;
+	const char *header = NULL;
+	size_t header_len = 0;
+	if(lua_istable(L,1)) {
+		port = lu_table_optnumber(L,1,"port",0);
+		lua_getfield(L,1,"host");
+		if(lua_isstring(L,-1)) {
+			host = lua_tostring(L,-1);
+		}
+		lua_getfield(L,1,"path");
+		if(lua_isstring(L,-1)) {
+			path = lua_tostring(L,-1);
+		}
+		lua_getfield(L,1,"header");
+		lBuf_t *lb = lbuf_getlbuf(L,-1);
+		if(lb) {
+			header = lb->bytes;
+			header_len = lb->len;
+		} else if(lua_isstring(L,-1)) {
+			header = lua_tolstring(L,-1,&header_len);
+		}
+		// values stay on the stack until return
+	}
+	sockutil_startup();
+	lvserve_t *s = (lvserve_t *)lua_newuserdata(L,sizeof(lvserve_t));
+	memset(s,0,sizeof(lvserve_t));
+	s->listen_sock = s->wake_sock = INVALID_SOCKET;
+	pthread_mutex_init(&s->lock,NULL);
+	luaL_getmetatable(L,LVSERVE_META);
+	lua_setmetatable(L,-2);
+
+	const char *err;
+	if(path) {
+		err = listen_unix(s,path);
+	} else {
+		err = listen_tcp(s,host,port);
+	}
+	if(!err && (listen(s->listen_sock,LVSERVE_MAX_CLIENTS) == SOCKET_ERROR || !sockutil_set_nonblock(s->listen_sock))) {
+		err = sockutil_strerror(sockutil_errno());
+	}
+	if(!err) {
+		err = open_wake(s);
+	}
+	if(!err && header_len) {
+		s->header = malloc(header_len);
+		if(!s->header) {
+			err = "malloc failed";
+		} else {
+			memcpy(s->header,header,header_len);
+			s->header_len = header_len;
+		}
+	}
+	if(!err) {
+		if(pthread_create(&s->thread,NULL,lvserve_thread,s) != 0) {
+			err = "failed to start server thread";
+		} else {
+			s->thread_started = 1;
+		}
+	}
+	if(err) {
+		// copy before destroy, may be a static buffer from strerror
+		lua_pushstring(L,err);
+		lvserve_destroy(s);
+		lua_pushboolean(L,0);
+		lua_insert(L,-2);
+		return 2;
+	}
+	return 1;
+}
+
+/*
+seq=server:publish(data[,...])
+data: strings or lbufs, concatenated into one frame
+the data is copied once, and the frame replaces any earlier frame not yet started by a client
+returns the sequence number of the frame
+*/
+static int lvserve_publish(lua_State *L) {
+	lvserve_t *s = server_get(L,1);
+	int n = lua_gettop(L);
+	unsigned len = 0;
+	int i;
+	for(i=2; i<=n; i++) {
+		lBuf_t *lb = lbuf_getlbuf(L,i);
+		if(lb) {
+			len += lb->len;
+		} else if(lua_type(L,i) == LUA_TSTRING) {
+			size_t str_len;
+			lua_tolstring(L,i,&str_len);
+			len += str_len;
+		} else {
+			return luaL_error(L,"expected string or lbuf");
+		}
+	}
+	// a free buffer, preferably one that is already large enough
+	pthread_mutex_lock(&s->lock);
+	lvserve_buf_t *b = NULL;
+	lvserve_buf_t **pb;
+	for(pb=&s->free_bufs; *pb; pb=&(*pb)->next) {
+		if((*pb)->alloc_len >= len || !(*pb)->next) {
+			b = *pb;
+			*pb = b->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&s->lock);
+	if(!b) {
+		b = malloc(sizeof(lvserve_buf_t));
+		if(!b) {
+			return luaL_error(L,"malloc failed");
+		}
+		memset(b,0,sizeof(lvserve_buf_t));
+	}
+	// not visible to the thread until it becomes latest
+	if(b->alloc_len < len) {
+		char *data = realloc(b->data,len);
+		if(!data) {
+			buf_free(b);
+			return luaL_error(L,"malloc failed");
+		}
+		b->data = data;
+		b->alloc_len = len;
+	}
+	b->len = 0;
+	for(i=2; i<=n; i++) {
+		const char *data;
+		size_t data_len;
+		lBuf_t *lb = lbuf_getlbuf(L,i);
+		if(lb) {
+			data = lb->bytes;
+			data_len = lb->len;
+		} else {
+			data = lua_tolstring(L,i,&data_len);
+		}
+		memcpy(b->data + b->len,data,data_len);
+		b->len += data_len;
+	}
+	b->refs = 0;
+	pthread_mutex_lock(&s->lock);
+	b->seq = ++s->published;
+	lvserve_buf_t *old = s->latest;
+	s->latest = b;
+	if(old) {
+		// clients that haven't started the replaced frame never will
+		unsigned j;
+		for(j=0; j < s->nclients; j++) {
+			if(s->clients[j].last_seq < old->seq) {
+				s->dropped++;
+			}
+		}
+		if(!old->refs) {
+			old->next = s->free_bufs;
+			s->free_bufs = old;
+		}
+	}
+	pthread_mutex_unlock(&s->lock);
+	send(s->wake_sock,"",1,0);
+	lua_pushnumber(L,b->seq);
+	return 1;
+}
+
+/*
+n=server:clients()
+number of connected clients, to skip encoding frames nobody will see
+*/
+static int lvserve_clients(lua_State *L) {
+	lvserve_t *s = server_get(L,1);
+	pthread_mutex_lock(&s->lock);
+	unsigned n = s->nclients;
+	pthread_mutex_unlock(&s->lock);
+	lua_pushnumber(L,n);
+	return 1;
+}
+
+/*
+stats=server:stats()
+stats {
+	clients=number -- currently connected
+	connections=number -- accepted since start
+	published=number -- frames published
+	sent=number -- frames completely sent, over all clients
+	dropped=number -- frames clients skipped because they were still sending an older frame
+	bytes=number -- bytes sent, including headers
+	port=number -- TCP port, if not a unix socket
+	path=string -- unix socket path
+}
+*/
+static int lvserve_stats(lua_State *L) {
+	lvserve_t *s = server_get(L,1);
+	pthread_mutex_lock(&s->lock);
+	unsigned nclients = s->nclients;
+	unsigned connections = s->connections;
+	unsigned published = s->published;
+	unsigned sent = s->sent;
+	unsigned dropped = s->dropped;
+	uint64_t bytes = s->bytes;
+	pthread_mutex_unlock(&s->lock);
+	lua_createtable(L,0,8);
+	lua_pushnumber(L,nclients);
+	lua_setfield(L,-2,"clients");
+	lua_pushnumber(L,connections);
+	lua_setfield(L,-2,"connections");
+	lua_pushnumber(L,published);
+	lua_setfield(L,-2,"published");
+	lua_pushnumber(L,sent);
+	lua_setfield(L,-2,"sent");
+	lua_pushnumber(L,dropped);
+	lua_setfield(L,-2,"dropped");
+	lua_pushnumber(L,(lua_Number)bytes);
+	lua_setfield(L,-2,"bytes");
+	if(s->unix_path) {
+		lua_pushstring(L,s->unix_path);
+		lua_setfield(L,-2,"path");
+	} else {
+		lua_pushnumber(L,s->port);
+		lua_setfield(L,-2,"port");
+	}
+	return 1;
+}
+
+/*
+server:close()
+disconnect all clients and stop listening. also done by gc
+*/
+static int lvserve_close(lua_State *L) {
+	lvserve_t *s = (lvserve_t *)luaL_checkudata(L,1,LVSERVE_META);
+	if(s->listen_sock != INVALID_SOCKET) {
+		lvserve_destroy(s);
+	}
+	return 0;
+}
+
+/*
+simple blocking client, mainly for testing
+*/
+typedef struct {
+	socket_t sock;
+} lvserve_client_ud_t;
+
+/*
+client=lvserve.connect(opts)
+opts {
+	port=number -- TCP port on host
+	host=string -- default 127.0.0.1
+	path=string -- unix socket instead of TCP
+}
+returns client, or false,msg
+*/
+static int lvserve_connect(lua_State *L) {
+	const char *host = "127.0.0.1";
+	const char *path = NULL;
+	int port = 0;
+	luaL_checktype(L,1,LUA_TTABLE);
+	port = lu_table_optnumber(L,1,"port",0);
+	lua_getfield(L,1,"host");
+	if(lua_isstring(L,-1)) {
+		host = lua_tostring(L,-1);
+	}
+	lua_getfield(L,1,"path");
+	if(lua_isstring(L,-1)) {
+		path = lua_tostring(L,-1);
+	}
+	sockutil_startup();
+	socket_t sock = INVALID_SOCKET;
+	const char *err = NULL;
+	if(path) {
+#ifdef WIN32
+		err = "unix sockets not supported";
+#else
+		struct sockaddr_un addr;
+		memset(&addr,0,sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strncpy(addr.sun_path,path,sizeof(addr.sun_path) - 1);
+		sock = socket(AF_UNIX,SOCK_STREAM,0);
+		if(sock == INVALID_SOCKET || connect(sock,(struct sockaddr *)&addr,sizeof(addr)) == SOCKET_ERROR) {
+			err = sockutil_strerror(sockutil_errno());
+		}
+#endif
+	} else {
+		struct addrinfo hints, *result, *ptr;
+		char port_str[16];
+		memset(&hints,0,sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_protocol = IPPROTO_TCP;
+		sprintf(port_str,"%d",port);
+		if(getaddrinfo(host,port_str,&hints,&result) != 0) {
+			err = "getaddrinfo failed";
+		} else {
+			err = "connect failed";
+			for(ptr=result; ptr; ptr=ptr->ai_next) {
+				sock = socket(ptr->ai_family,ptr->ai_socktype,ptr->ai_protocol);
+				if(sock == INVALID_SOCKET) {
+					continue;
+				}
+				if(connect(sock,ptr->ai_addr,ptr->ai_addrlen) == SOCKET_ERROR) {
+					err = sockutil_strerror(sockutil_errno());
+					sockutil_close(sock);
+					sock = INVALID_SOCKET;
+					continue;
+				}
+				err = NULL;
+				break;
+			}
+			freeaddrinfo(result);
+		}
+	}
+	if(err) {
+		if(sock != INVALID_SOCKET) {
+			sockutil_close(sock);
+		}
+		lua_pushboolean(L,0);
+		lua_pushstring(L,err);
+		return 2;
+	}
+	lvserve_client_ud_t *c = (lvserve_client_ud_t *)lua_newuserdata(L,sizeof(lvserve_client_ud_t));
+	c->sock = sock;
+	luaL_getmetatable(L,LVSERVE_CLIENT_META);
+	lua_setmetatable(L,-2);
+	return 1;
+}
+
+static lvserve_client_ud_t *client_get(lua_State *L,int i) {
+	lvserve_client_ud_t *c = (lvserve_client_ud_t *)luaL_checkudata(L,i,LVSERVE_CLIENT_META);
+	if(c->sock == INVALID_SOCKET) {
+		luaL_error(L,"client closed");
+	}
+	return c;
+}
+
+/*
+str=client:recv(len[,timeout])
+receive exactly len bytes, waiting up to timeout ms for each part, default 5000
+returns nil,msg on timeout, error or disconnect
+*/
+static int lvserve_client_recv(lua_State *L) {
+	lvserve_client_ud_t *c = client_get(L,1);
+	unsigned len = luaL_checknumber(L,2);
+	unsigned timeout = luaL_optnumber(L,3,5000);
+	char *data = malloc(len?len:1);
+	if(!data) {
+		return luaL_error(L,"malloc failed");
+	}
+	unsigned pos = 0;
+	const char *err = NULL;
+	while(pos < len) {
+		fd_set rfds;
+		FD_ZERO(&rfds);
+		FD_SET(c->sock,&rfds);
+		struct timeval tv;
+		tv.tv_sec = timeout/1000;
+		tv.tv_usec = (timeout%1000)*1000;
+		int r = select((int)c->sock + 1,&rfds,NULL,NULL,&tv);
+		if(r == 0) {
+			err = "timeout";
+			break;
+		}
+		if(r == SOCKET_ERROR) {
+			err = sockutil_strerror(sockutil_errno());
+			break;
+		}
+		int n = recv(c->sock,data + pos,len - pos,0);
+		if(n == 0) {
+			err = "closed";
+			break;
+		}
+		if(n == SOCKET_ERROR) {
+			err = sockutil_strerror(sockutil_errno());
+			break;
+		}
+		pos += n;
+	}
+	if(err) {
+		free(data);
+		lua_pushnil(L);
+		lua_pushstring(L,err);
+		return 2;
+	}
+	lua_pushlstring(L,data,len);
+	free(data);
+	return 1;
+}
+
+/*
+client:close()
+*/
+static int lvserve_client_close(lua_State *L) {
+	lvserve_client_ud_t *c = (lvserve_client_ud_t *)luaL_checkudata(L,1,LVSERVE_CLIENT_META);
+	if(c->sock != INVALID_SOCKET) {
+		sockutil_close(c->sock);
+		c->sock = INVALID_SOCKET;
+	}
+	return 0;
+}
+
+#else
+// without threads, the server can't send while the caller waits for frames
+static int lvserve_new(lua_State *L) {
+	lua_pushboolean(L,0);
+	lua_pushstring(L,"lvserve requires thread support");
+	return 2;
+}
+static int lvserve_connect(lua_State *L) {
+	lua_pushboolean(L,0);
+	lua_pushstring(L,"lvserve requires thread support");
+	return 2;
+}
+static int lvserve_publish(lua_State *L) {
+	return 0;
+}
+static int lvserve_clients(lua_State *L) {
+	return 0;
+}
+static int lvserve_stats(lua_State *L) {
+	return 0;
+}
+static int lvserve_close(lua_State *L) {
+	return 0;
+}
+static int lvserve_client_recv(lua_State *L) {
+	return 0;
+}
+static int lvserve_client_close(lua_State *L) {
+	return 0;
+}
+#endif
+
+static const luaL_Reg lvserve_funcs[] = {
+  {"new", lvserve_new},
+  {"connect", lvserve_connect},
+  {NULL, NULL}
+};
+
+static const luaL_Reg lvserve_meta_methods[] = {
+  {"__gc", lvserve_close},
+  {NULL, NULL}
+};
+
+static const luaL_Reg lvserve_methods[] = {
+  {"publish", lvserve_publish},
+  {"clients", lvserve_clients},
+  {"stats", lvserve_stats},
+  {"close", lvserve_close},
+  {NULL, NULL}
+};
+
+static const luaL_Reg lvserve_client_meta_methods[] = {
+  {"__gc", lvserve_client_close},
+  {NULL, NULL}
+};
+
+static const luaL_Reg lvserve_client_methods[] = {
+  {"recv", lvserve_client_recv},
+  {"close", lvserve_client_close},
+  {NULL, NULL}
+};
+
+int luaopen_lvserve(lua_State *L) {
+	luaL_newmetatable(L,LVSERVE_META);
+	luaL_register(L, NULL, lvserve_meta_methods);
+	lua_newtable(L);
+	luaL_register(L, NULL, lvserve_methods);
+	lua_setfield(L,-2,"__index");
+	lua_pop(L,1);
+
+	luaL_newmetatable(L,LVSERVE_CLIENT_META);
+	luaL_register(L, NULL, lvserve_client_meta_methods);
+	lua_newtable(L);
+	luaL_register(L, NULL, lvserve_client_methods);
+	lua_setfield(L,-2,"__index");
+	lua_pop(L,1);
+
+	luaL_register(L, "lvserve", lvserve_funcs);
+	return 1;
+}
@@ -315,6 +315,19 @@ ptp_tcp_getresp (PTPParams* params, PTPContainer* resp)
 	return ret;
 }
 
+/*
+buffer for getdata without a handler, from alloc_func if set, otherwise ret_data or malloc
+*/
+static void *getdata_ret_buffer(PTPParams* params, PTPGetdataParams *gdparams, uint64_t total_len)
+{
+	if(gdparams->alloc_func) {
+		gdparams->ret_data=gdparams->alloc_func(params,gdparams,total_len);
+	} else if(!gdparams->ret_data) {
+		gdparams->ret_data=malloc(total_len);
+	}
+	return gdparams->ret_data;
+}
+
 uint16_t
 ptp_tcp_getdata (PTPParams* params, PTPContainer* ptp, PTPGetdataParams *gdparams)
 {
@@ -352,10 +365,7 @@ ptp_tcp_getdata (PTPParams* params, PTPContainer* ptp, PTPGetdataParams *gdparam
 		buf = malloc(block_size);
 		p = buf;
 	} else {
-		if(!gdparams->ret_data) {
-			gdparams->ret_data=malloc(total_len);
-		}
-		if(!gdparams->ret_data) {
+		if(!getdata_ret_buffer(params,gdparams,total_len)) {
 			return PTP_ERROR_NOMEM;
 		}
 		p = gdparams->ret_data;
@@ -651,10 +661,7 @@ ptp_usb_getdata (PTPParams* params, PTPContainer* ptp, PTPGetdataParams *gdparam
 		free(buf);
 		return ret;
 	} else {
-		if(!gdparams->ret_data) {
-			gdparams->ret_data=malloc(total_len);
-		}
-		if(!gdparams->ret_data) {
+		if(!getdata_ret_buffer(params,gdparams,total_len)) {
 			return PTP_ERROR_NOMEM;
 		}
 		return params->read_data_func(params, total_len, gdparams->ret_data);
@@ -732,7 +739,7 @@ ptp_usb_getresp (PTPParams* params, PTPContainer* resp)
  * all fields filled in.
  **/
 static uint16_t
-ptp_transaction (PTPParams* params, PTPContainer* ptp, 
+ptp_transaction_nolock (PTPParams* params, PTPContainer* ptp, 
 			uint16_t flags, unsigned int sendlen, char** data)
 {
 	if ((params==NULL) || (ptp==NULL)) 
@@ -752,6 +759,7 @@ ptp_transaction (PTPParams* params, PTPContainer* ptp,
 			PTPGetdataParams gdparams;
 			gdparams.handler = NULL;
 			gdparams.ret_data = *data;
+			gdparams.alloc_func = NULL;
 			uint16_t ret = params->getdata_func(params, ptp,&gdparams);
 			// if allocated by getdata, set
 			if(!*data) {
@@ -772,11 +780,24 @@ ptp_transaction (PTPParams* params, PTPContainer* ptp,
 	return PTP_RC_OK;
 }
 
+static uint16_t
+ptp_transaction (PTPParams* params, PTPContainer* ptp, 
+			uint16_t flags, unsigned int sendlen, char** data)
+{
+	if(!params || !params->lock_func) {
+		return ptp_transaction_nolock(params, ptp, flags, sendlen, data);
+	}
+	params->lock_func(params,1);
+	uint16_t r = ptp_transaction_nolock(params, ptp, flags, sendlen, data);
+	params->lock_func(params,0);
+	return r;
+}
+
 /*
  * reyalp - added more flexible data transfer - read chunks and send to callback instead of buffering all
  * TODO this is mostly a copy / paste of ptp_transaction now
  */
-static uint16_t ptp_getdata_transaction(PTPParams* params, PTPContainer* ptp, PTPGetdataParams *gdparams )
+static uint16_t ptp_getdata_transaction_nolock(PTPParams* params, PTPContainer* ptp, PTPGetdataParams *gdparams )
 {
 	if ((params==NULL) || (ptp==NULL) || (gdparams==NULL)) 
 		return PTP_ERROR_BADPARAM;
@@ -792,6 +813,17 @@ static uint16_t ptp_getdata_transaction(PTPParams* params, PTPContainer* ptp, PT
 	CHECK_PTP_RC(params->getresp_func(params, ptp));
 	return PTP_RC_OK;
 }
+
+static uint16_t ptp_getdata_transaction(PTPParams* params, PTPContainer* ptp, PTPGetdataParams *gdparams )
+{
+	if(!params || !params->lock_func) {
+		return ptp_getdata_transaction_nolock(params, ptp, gdparams);
+	}
+	params->lock_func(params,1);
+	uint16_t r = ptp_getdata_transaction_nolock(params, ptp, gdparams);
+	params->lock_func(params,0);
+	return r;
+}
 /* Events handling functions */
 
 /* PTP Events wait for or check mode */
@@ -2311,6 +2343,38 @@ uint16_t ptp_chdk_get_live_data(PTPParams* params, unsigned flags,char **data,un
 
 }
 
+/*
+as ptp_chdk_get_live_data, but data is read into the buffer returned by alloc_func
+alloc_data is passed to alloc_func in gdparams->handler_data
+*data is only valid if alloc_func was called, and belongs to the caller even on error
+*/
+uint16_t ptp_chdk_get_live_data_alloc(PTPParams* params, unsigned flags, PTPGetdataAllocFunc alloc_func, void *alloc_data, char **data, unsigned *data_size) {
+  uint16_t r;
+  PTPContainer ptp;
+  PTPGetdataParams gdparams;
+
+  PTP_CNT_INIT(ptp);
+  ptp.Code=PTP_OC_CHDK;
+  ptp.Nparam=2;
+  ptp.Param1=PTP_CHDK_GetDisplayData;
+  ptp.Param2=flags;
+
+  PTP_CNT_INIT(gdparams);
+  gdparams.alloc_func = alloc_func;
+  gdparams.handler_data = alloc_data;
+  *data = NULL;
+  *data_size = 0;
+
+  r=ptp_getdata_transaction(params, &ptp, &gdparams);
+  *data = gdparams.ret_data;
+  if ( r != PTP_RC_OK )
+  {
+    return r;
+  }
+  *data_size = ptp.Param1;
+  return r;
+}
+
 uint16_t ptp_chdk_call_function(PTPParams* params, int *args, int size, int *ret)
 {
   uint16_t r;
@@ -751,10 +751,12 @@ typedef struct _PTPParams PTPParams;
 
 typedef struct _PTPGetdataParams PTPGetdataParams;
 typedef uint16_t (* PTPGetdataHandlerFunc)(PTPParams* params, PTPGetdataParams *gdparams, unsigned size, unsigned char *data);
+typedef void *(* PTPGetdataAllocFunc)(PTPParams* params, PTPGetdataParams *gdparams, uint64_t size);
 struct _PTPGetdataParams {
 	PTPGetdataHandlerFunc handler; // handler, optional
 	unsigned block_size; // buffer / call handler with chunks up to size
 	void *ret_data; // no handler, data returned in buffer, allocated if needed
+	PTPGetdataAllocFunc alloc_func; // no handler, optional, returns a buffer of at least size to use instead of ret_data / malloc
 	void *handler_data; // parameters for handler
 	uint64_t total_size; // total size of data in this operation, set before handler call
 };
@@ -776,6 +778,8 @@ typedef uint16_t (* PTPIOSendData)	(PTPParams* params, PTPContainer* ptp,
 					unsigned char *data, unsigned int size);
 typedef uint16_t (* PTPIOGetResp)	(PTPParams* params, PTPContainer* resp);
 typedef uint16_t (* PTPIOGetData)	(PTPParams* params, PTPContainer* ptp, PTPGetdataParams *gdparams);
+/* called with lock=1 before and lock=0 after each transaction */
+typedef void (* PTPLockFunc)	(PTPParams* params, int lock);
 /* debug functions */
 typedef void (* PTPErrorFunc) (void *data, const char *format, va_list args);
 typedef void (* PTPDebugFunc) (void *data, const char *format, va_list args);
@@ -818,6 +822,9 @@ struct _PTPParams {
 	/* Data passed to above functions */
 	void *data;
 
+	/* optional, serializes transactions on connections used from multiple threads */
+	PTPLockFunc lock_func;
+
 	/* ptp transaction ID */
 	uint32_t transaction_id;
 	/* ptp session ID */
@@ -1001,5 +1008,6 @@ uint16_t ptp_chdk_get_script_status(PTPParams* params, unsigned *status);
 uint16_t ptp_chdk_write_script_msg(PTPParams* params, char *data, unsigned size, int target_script_id, int *status);
 uint16_t ptp_chdk_read_script_msg(PTPParams* params, ptp_chdk_script_msg **msg);
 uint16_t ptp_chdk_get_live_data(PTPParams* params, unsigned flags, char **data, unsigned *data_size);
+uint16_t ptp_chdk_get_live_data_alloc(PTPParams* params, unsigned flags, PTPGetdataAllocFunc alloc_func, void *alloc_data, char **data, unsigned *data_size);
 uint16_t ptp_chdk_call_function(PTPParams* params, int *args, int size, int *ret);
 #endif /* __PTP_H__ */
@@ -24,6 +24,10 @@
 
 #define PTPIP_PORT_STR "15740"
 
+#ifdef CHDKPTP_THREADS
+#include <pthread.h>
+#endif
+
 /*
  * structures
  */
@@ -67,6 +71,12 @@ typedef struct {
 	// counters
 	uint64_t write_count;
 	uint64_t read_count;
+	uint64_t live_alloc_count; // buffer allocations by get_live_data
+	uint64_t live_alloc_bytes;
+	struct lvpump_s *live_pump; // background live view fetch, created on first use
+#ifdef CHDKPTP_THREADS
+	pthread_mutex_t ptp_lock; // held for each transaction, see params lock_func
+#endif
 	union {
 		PTP_USB usb;
 		PTP_TCP tcp;
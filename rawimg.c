@@ -18,18 +18,28 @@
 
 based on code from chdk tools/rawconvert.c and core/raw.c
 */
+#include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
+#include <math.h>
 #include <lua.h>
 #include <lualib.h>
 #include <lauxlib.h>
 #include "luautil.h"
 #include "lbuf.h"
 #include "rawimg.h"
+#include "workpool.h"
+#include "lj92.h"
+#include "rawimg_types.h"
+#include "stars.h"
+#include "register.h"
 
 #define RAWIMG_LIST "rawimg.rawimg_list" // keeps references to associated lbufs
 #define RAWIMG_LIST_META "rawimg.rawimg_list_meta" // meta table
+#define RAWSTACK_META "rawimg.rawstack_meta"
+#define STARLIST_META "rawimg.starlist_meta"
 
 
 // funny case for macros
@@ -56,36 +66,6 @@ static const char *endian_strings[] = {
 #define RAW_BLOCK_BYTES_16l 2
 #define RAW_BLOCK_BYTES_16b 2
 
-#define CFA_RED   0
-#define CFA_GREEN 1
-#define CFA_BLUE  2
-
-typedef unsigned (*get_pixel_func_t)(const uint8_t *p, unsigned row_bytes, unsigned x, unsigned y);
-typedef void (*set_pixel_func_t)(uint8_t *p, unsigned row_bytes, unsigned x, unsigned y, unsigned value);
-
-typedef struct {
-	unsigned bpp;
-	unsigned endian;
-	unsigned block_bytes;
-	unsigned block_pixels;
-	get_pixel_func_t get_pixel;
-	set_pixel_func_t set_pixel;
-} raw_format_t;
-
-typedef struct {
-	raw_format_t *fmt;
-	unsigned row_bytes;
-	unsigned width;
-	unsigned height;
-	uint8_t cfa_pattern[4];
-	unsigned active_top;
-	unsigned active_left;
-	unsigned active_bottom;
-	unsigned active_right;
-	unsigned black_level;
-	uint8_t *data;
-} raw_image_t;
-
 // TODO endian doesn't matter, but needs suffix for macros
 unsigned raw_get_pixel_8l(const uint8_t *p, unsigned row_bytes, unsigned x, unsigned y);
 void raw_set_pixel_8l(uint8_t *p, unsigned row_bytes, unsigned x, unsigned y, unsigned value);
@@ -111,6 +91,19 @@ unsigned raw_get_pixel_16b(const uint8_t *p, unsigned row_bytes, unsigned x, uns
 void raw_set_pixel_16b(uint8_t *p, unsigned row_bytes, unsigned x, unsigned y, unsigned value);
 
 
+#define ROW_FUNC_PROTO(BPP,ENDIAN) \
+static void raw_get_row_##BPP##ENDIAN(const uint8_t *p, unsigned row_bytes, unsigned y, unsigned x, unsigned count, uint16_t *out)
+
+ROW_FUNC_PROTO(8,l);
+ROW_FUNC_PROTO(10,l);
+ROW_FUNC_PROTO(10,b);
+ROW_FUNC_PROTO(12,l);
+ROW_FUNC_PROTO(12,b);
+ROW_FUNC_PROTO(14,l);
+ROW_FUNC_PROTO(14,b);
+ROW_FUNC_PROTO(16,l);
+ROW_FUNC_PROTO(16,b);
+
 #define FMT_DEF_SINGLE(BPP,ENDIAN) \
 { \
 	BPP, \
@@ -119,6 +112,7 @@ void raw_set_pixel_16b(uint8_t *p, unsigned row_bytes, unsigned x, unsigned y, u
 	RAW_BLOCK_BYTES_##BPP##ENDIAN*8/BPP, \
 	raw_get_pixel_##BPP##ENDIAN, \
 	raw_set_pixel_##BPP##ENDIAN, \
+	raw_get_row_##BPP##ENDIAN, \
 }
 
 #define FMT_DEF(BPP) \
@@ -147,13 +141,6 @@ static raw_format_t* rawimg_find_format(unsigned bpp, unsigned endian) {
 	return NULL;
 }
 
-/*
-return color for given x,y
-*/
-static unsigned cfa_color(raw_image_t *img, unsigned x, unsigned y) {
-	return img->cfa_pattern[(x&1) + (y&1)*2];
-}
-
 unsigned raw_get_pixel_8l(const uint8_t *p, unsigned row_bytes, unsigned x, unsigned y)
 {
 	return p[y*row_bytes+x];
@@ -361,7 +348,7 @@ unsigned raw_get_pixel_14b(const uint8_t *p, unsigned row_bytes, unsigned x, uns
 void raw_set_pixel_14b(uint8_t *p, unsigned row_bytes, unsigned x, unsigned y, unsigned value)
 {
     uint8_t *addr = p + y * row_bytes + (x/4) * 7;
-    switch (x%8) {
+    switch (x%4) {
         case 0: addr[1]=(addr[1]&0x03)|(value<< 2); addr[0]=value>>6;                                    break;
         case 1: addr[1]=(addr[1]&0xFC)|(value>>12); addr[3]=(addr[3]&0x0F)|(value<<4); addr[2]=value>>4; break;
         case 2: addr[3]=(addr[3]&0xF0)|(value>>10); addr[5]=(addr[5]&0x3F)|(value<<6); addr[4]=value>>2; break;
@@ -390,6 +377,69 @@ void raw_set_pixel_16b(uint8_t *p, unsigned row_bytes, unsigned x, unsigned y, u
 	p[y*row_bytes+x*2+1] = value;
 }
 
+/*
+row unpacking, for operations that process whole rows
+little endian formats use get_pixel, which the compiler can inline
+*/
+#define ROW_FUNC_GENERIC(BPP,ENDIAN) \
+ROW_FUNC_PROTO(BPP,ENDIAN) \
+{ \
+	unsigned end = x + count; \
+	for(; x < end; x++) { \
+		*out++ = raw_get_pixel_##BPP##ENDIAN(p,row_bytes,x,y); \
+	} \
+}
+
+ROW_FUNC_GENERIC(8,l)
+ROW_FUNC_GENERIC(10,l)
+ROW_FUNC_GENERIC(12,l)
+ROW_FUNC_GENERIC(14,l)
+ROW_FUNC_GENERIC(16,l)
+
+// big endian (DNG) formats unpack a block at a time
+ROW_FUNC_PROTO(10,b)
+{
+	const uint8_t *a = p + y*row_bytes + (x/4)*5;
+	unsigned n;
+	for(n=0; n < count; n+=4, a+=5) {
+		*out++ = (a[0] << 2) | (a[1] >> 6);
+		*out++ = ((a[1] & 0x3F) << 4) | (a[2] >> 4);
+		*out++ = ((a[2] & 0x0F) << 6) | (a[3] >> 2);
+		*out++ = ((a[3] & 0x03) << 8) | a[4];
+	}
+}
+
+ROW_FUNC_PROTO(12,b)
+{
+	const uint8_t *a = p + y*row_bytes + (x/2)*3;
+	unsigned n;
+	for(n=0; n < count; n+=2, a+=3) {
+		*out++ = (a[0] << 4) | (a[1] >> 4);
+		*out++ = ((a[1] & 0x0F) << 8) | a[2];
+	}
+}
+
+ROW_FUNC_PROTO(14,b)
+{
+	const uint8_t *a = p + y*row_bytes + (x/4)*7;
+	unsigned n;
+	for(n=0; n < count; n+=4, a+=7) {
+		*out++ = (a[0] << 6) | (a[1] >> 2);
+		*out++ = ((a[1] & 0x03) << 12) | (a[2] << 4) | (a[3] >> 4);
+		*out++ = ((a[3] & 0x0F) << 10) | (a[4] << 2) | (a[5] >> 6);
+		*out++ = ((a[5] & 0x3F) << 8) | a[6];
+	}
+}
+
+ROW_FUNC_PROTO(16,b)
+{
+	const uint8_t *a = p + y*row_bytes + x*2;
+	unsigned n;
+	for(n=0; n < count; n++, a+=2) {
+		*out++ = (a[0] << 8) | a[1];
+	}
+}
+
 /*
 pixel=img:get_pixel(x,y)
 nil if out of bounds
@@ -450,6 +500,10 @@ static int rawimg_lua_get_endian(lua_State *L) {
 	return 1;
 }
 
+/*
+pattern=img:cfa_pattern()
+returns the 4 byte pattern relative to the top left of the raw buffer
+*/
 static int rawimg_lua_get_cfa_pattern(lua_State *L) {
 	raw_image_t* img = (raw_image_t *)luaL_checkudata(L, 1, RAWIMG_META);
 	lua_pushlstring(L, (const char *)img->cfa_pattern,4);
@@ -457,93 +511,177 @@ static int rawimg_lua_get_cfa_pattern(lua_State *L) {
 }
 
 /*
-make a simple, low quality thumbnail image
-thumb=img:make_rgb_thumb(width,height)
+top,left,bottom,right=img:active_area()
 */
-static int rawimg_lua_make_rgb_thumb(lua_State *L) {
+static int rawimg_lua_get_active_area(lua_State *L) {
 	raw_image_t* img = (raw_image_t *)luaL_checkudata(L, 1, RAWIMG_META);
-	unsigned width=luaL_checknumber(L,2);
-	unsigned height=luaL_checknumber(L,3);
-
-	// TODO active area or not should be optional
-	// image active area width
-	unsigned iw = img->active_right - img->active_left;
-	unsigned ih = img->active_bottom - img->active_top;
-	if(width > iw || height > ih) {
-		return luaL_error(L,"thumb cannot be larger than active area");
-	}
-	if(!width  || !height) {
-		return luaL_error(L,"zero dimensions not allowed");
-	}
-	unsigned size = width*height*3;
-	uint8_t *thumb = malloc(size);
-	if(!thumb) {
-		return luaL_error(L,"malloc failed for thumb");
-	}
+	lua_pushnumber(L,img->active_top);
+	lua_pushnumber(L,img->active_left);
+	lua_pushnumber(L,img->active_bottom);
+	lua_pushnumber(L,img->active_right);
+	return 4;
+}
 
-	int rx=0,ry=0,gx=0,gy=0,bx=0,by=0;
-	int i;
+/*
+pixel coordinates for pixel lists, as used by find_bad_pixels and patch_pixel_list
+stored in native order uint32, y in the upper 16 bits and x in the lower, so sorting
+by value sorts by row then column
+*/
+#define PIXEL_LIST_XY(x,y) ((uint32_t)(y)<<16 | (x))
+#define PIXEL_LIST_X(v) ((v) & 0xFFFF)
+#define PIXEL_LIST_Y(v) ((v) >> 16)
+
+static int pixel_list_cmp(const void *a, const void *b) {
+	uint32_t va = *(const uint32_t *)a;
+	uint32_t vb = *(const uint32_t *)b;
+	return (va > vb) - (va < vb);
+}
+
+/*
+interpolated value for a pixel from non-blacklevel neighbors of the same color
+neighbors in skip, a sorted pixel list, are not used
+returns 1 and sets *val if any neighbor was usable, 0 if not
+*/
+static int rawimg_patch_value(raw_image_t *img, unsigned x, unsigned y, const uint32_t *skip, unsigned nskip, unsigned *val) {
+	static const int green_offsets[4][2] = {{-1,-1},{1,-1},{-1,1},{1,1}};
+	static const int other_offsets[4][2] = {{-2,0},{2,0},{0,-2},{0,2}};
+	const int (*offsets)[2] = (cfa_color(img,x,y) == CFA_GREEN)?green_offsets:other_offsets;
+	unsigned i,total = 0,count = 0;
 	for(i=0;i<4;i++) {
-		switch(img->cfa_pattern[i]) {
-			case 0: rx = i&1; ry = (i&2)>>1; break;
-			case 1: gx = i&1; gy = (i&2)>>1; break; // will get hit twice, doesn't matter
-			case 2: bx = i&1; by = (i&2)>>1; break;
+		unsigned nx = x + offsets[i][0];
+		unsigned ny = y + offsets[i][1];
+		// negative offsets wrap to large values
+		if(nx >= img->width || ny >= img->height) {
+			continue;
 		}
-	}
-	unsigned tx,ty;
-	uint8_t *p = thumb;
-	unsigned shift = img->fmt->bpp - 8;
-	for(ty=0;ty<height;ty++) {
-		for(tx=0;tx<width;tx++) {
-			unsigned ix = (img->active_left + tx*iw/width)&~1;
-			unsigned iy = (img->active_top + ty*ih/height)&~1;
-			*p++=img->fmt->get_pixel(img->data,img->row_bytes,ix+rx,iy+ry)>>shift;
-			*p++=img->fmt->get_pixel(img->data,img->row_bytes,ix+gx,iy+gy)>>shift;
-			*p++=img->fmt->get_pixel(img->data,img->row_bytes,bx+gx,iy+by)>>shift;
+		if(skip) {
+			uint32_t key = PIXEL_LIST_XY(nx,ny);
+			if(bsearch(&key,skip,nskip,sizeof(uint32_t),pixel_list_cmp)) {
+				continue;
+			}
+		}
+		unsigned v = img->fmt->get_pixel(img->data,img->row_bytes,nx,ny);
+		if(v > img->black_level) {
+			total += v;
+			count++;
 		}
 	}
-	if(!lbuf_create(L, thumb, size, LBUF_FL_FREE)) {
-		return luaL_error(L,"failed to create lbuf");
+	if(count) {
+		*val = total/count;
+		return 1;
 	}
-	return 1;
+	return 0;
 }
 
-static unsigned rawimg_get_pixel_safe(raw_image_t *img, unsigned x, unsigned y) {
-	if(x >= img->width || y >= img->height) {
-		return 0;
-	}
-	return img->fmt->get_pixel(img->data,img->row_bytes,x,y);
-}
 /*
 interpolate over a pixel, using non-blacklevel neighbors of the same color
 returns 1 if patched, 0 if not
 */
 static int rawimg_patch_pixel(raw_image_t *img,unsigned x, unsigned y) {
-	unsigned c = cfa_color(img,x,y);
-	unsigned neigh[4];
-	if(c == CFA_GREEN) {
-		neigh[0] = rawimg_get_pixel_safe(img,x-1,y-1);
-		neigh[1] = rawimg_get_pixel_safe(img,x+1,y-1);
-		neigh[2] = rawimg_get_pixel_safe(img,x-1,y+1);
-		neigh[3] = rawimg_get_pixel_safe(img,x+1,y+1);
+	unsigned val;
+	if(rawimg_patch_value(img,x,y,NULL,0,&val)) {
+		img->fmt->set_pixel(img->data,img->row_bytes,x,y,val);
+		return 1;
+	}
+	return 0;
+}
+
+static const char *region_strings[] = {
+	"active",
+	"all",
+	NULL,
+};
+
+/*
+get bounds of region (0 = active area, 1 = whole image)
+*/
+static void rawimg_get_region(raw_image_t *img, int region, unsigned *top, unsigned *left, unsigned *bottom, unsigned *right) {
+	if(region == 0) {
+		*top = img->active_top;
+		*left = img->active_left;
+		*bottom = img->active_bottom;
+		*right = img->active_right;
 	} else {
-		neigh[0] = rawimg_get_pixel_safe(img,x-2,y);
-		neigh[1] = rawimg_get_pixel_safe(img,x+2,y);
-		neigh[2] = rawimg_get_pixel_safe(img,x,y-2);
-		neigh[3] = rawimg_get_pixel_safe(img,x,y+2);
+		*top = *left = 0;
+		*bottom = img->height;
+		*right = img->width;
 	}
-	unsigned i,total = 0,count = 0;
-	for(i=0;i<4;i++) {
-		if(neigh[i] > img->black_level) {
-			total += neigh[i];
-			count++;
+}
+
+/*
+per chunk pixel lists, so coordinates found by worker threads can be joined in row order
+*/
+typedef struct {
+	uint32_t *list;
+	unsigned count;
+	unsigned alloc;
+	int failed;
+} pixel_list_t;
+
+/*
+add a coordinate to list, setting failed if allocation fails
+*/
+static void pixel_list_add(pixel_list_t *pl, uint32_t v) {
+	if(pl->failed) {
+		return;
+	}
+	if(pl->count == pl->alloc) {
+		unsigned alloc = (pl->alloc)?pl->alloc*2:1024;
+		uint32_t *p = realloc(pl->list,alloc*sizeof(uint32_t));
+		if(!p) {
+			pl->failed = 1;
+			return;
 		}
+		pl->list = p;
+		pl->alloc = alloc;
 	}
-	if(count) {
-		img->fmt->set_pixel(img->data,img->row_bytes,x,y,total/count);
-		return 1;
+	pl->list[pl->count++] = v;
+}
+
+/*
+concatenate n chunk lists into a single malloc'd list, freeing the chunk lists
+returns NULL if any allocation failed
+*/
+static uint32_t *pixel_lists_join(pixel_list_t *lists, unsigned n, unsigned *count) {
+	unsigned i, total = 0, failed = 0;
+	for(i=0;i<n;i++) {
+		total += lists[i].count;
+		failed |= lists[i].failed;
+	}
+	uint32_t *list = NULL;
+	if(!failed) {
+		// always allocate something, so empty isn't mistaken for failure
+		list = malloc((total?total:1)*sizeof(uint32_t));
+	}
+	*count = 0;
+	for(i=0;i<n;i++) {
+		if(list && lists[i].count) {
+			memcpy(list + *count,lists[i].list,lists[i].count*sizeof(uint32_t));
+			*count += lists[i].count;
+		}
+		free(lists[i].list);
+	}
+	free(lists);
+	return list;
+}
+
+typedef struct {
+	raw_image_t *img;
+	unsigned badval;
+	pixel_list_t *lists;
+} patch_pixels_job_t;
+
+static void rawimg_patch_pixels_rows(void *arg, unsigned chunk, unsigned start, unsigned end) {
+	patch_pixels_job_t *job = (patch_pixels_job_t *)arg;
+	raw_image_t *img = job->img;
+	unsigned x,y;
+	for(y=start;y<end;y++) {
+		for(x=img->active_left;x<img->active_right;x++) {
+			if(img->fmt->get_pixel(img->data,img->row_bytes,x,y) <= job->badval) {
+				pixel_list_add(&job->lists[chunk],PIXEL_LIST_XY(x,y));
+			}
+		}
 	}
-	return 0;
 }
 
 /*
@@ -555,16 +693,221 @@ count: number of pixels actually modified
 static int rawimg_lua_patch_pixels(lua_State *L) {
 	raw_image_t* img = (raw_image_t *)luaL_checkudata(L, 1, RAWIMG_META);
 	unsigned badval=luaL_optnumber(L,2,0);
-	unsigned x,y;
-	unsigned count=0;
-	for(y=img->active_top;y<img->active_bottom;y++) {
-		for(x=img->active_left;x<img->active_right;x++) {
-			unsigned val = img->fmt->get_pixel(img->data,img->row_bytes,x,y);
-			if(val <= badval) {
-				count += rawimg_patch_pixel(img,x,y);
+	if(img->width > 0x10000 || img->height > 0x10000) {
+		return luaL_error(L,"image too large for pixel list");
+	}
+	// bad pixels are found in parallel, then patched in order on this thread, since patching reads neighbors
+	unsigned chunks = workpool_chunk_count(img->active_bottom - img->active_top);
+	patch_pixels_job_t job = {img,badval,calloc(chunks,sizeof(pixel_list_t))};
+	if(!job.lists) {
+		return luaL_error(L,"malloc failed");
+	}
+	workpool_run_rows(rawimg_patch_pixels_rows,&job,img->active_top,img->active_bottom);
+	unsigned n;
+	uint32_t *list = pixel_lists_join(job.lists,chunks,&n);
+	if(!list) {
+		return luaL_error(L,"malloc failed");
+	}
+	unsigned i,count=0;
+	for(i=0;i<n;i++) {
+		count += rawimg_patch_pixel(img,PIXEL_LIST_X(list[i]),PIXEL_LIST_Y(list[i]));
+	}
+	free(list);
+	lua_pushnumber(L,count);
+	return 1;
+}
+
+typedef struct {
+	raw_image_t *img;
+	unsigned left;
+	unsigned right;
+	double vmin;
+	double vmax;
+	double sigma;
+	double mean[3];
+	double sd[3];
+	int pass; // 0, 1 = stats, 2 = find
+	uint64_t (*stats)[9]; // per chunk sum, sum of squares and count for each color
+	pixel_list_t *lists;
+} find_bad_job_t;
+
+static int find_bad_outlier(find_bad_job_t *job, unsigned c, double v) {
+	return (v - job->mean[c] > job->sigma*job->sd[c] || job->mean[c] - v > job->sigma*job->sd[c]);
+}
+
+static void rawimg_find_bad_pixels_rows(void *arg, unsigned chunk, unsigned start, unsigned end) {
+	find_bad_job_t *job = (find_bad_job_t *)arg;
+	raw_image_t *img = job->img;
+	unsigned x,y,c;
+	if(job->pass < 2) {
+		// stats per color, second pass excludes outliers from first so hot pixels don't skew the result
+		uint64_t *st = job->stats[chunk];
+		for(y=start;y<end;y++) {
+			for(x=job->left;x<job->right;x++) {
+				c = cfa_color(img,x,y);
+				if(c > CFA_BLUE) {
+					continue;
+				}
+				uint64_t v = img->fmt->get_pixel(img->data,img->row_bytes,x,y);
+				if(job->pass == 1 && find_bad_outlier(job,c,v)) {
+					continue;
+				}
+				st[c] += v;
+				st[3+c] += v*v;
+				st[6+c]++;
+			}
+		}
+		return;
+	}
+	for(y=start;y<end;y++) {
+		for(x=job->left;x<job->right;x++) {
+			double v = img->fmt->get_pixel(img->data,img->row_bytes,x,y);
+			int bad = 0;
+			if(job->vmin >= 0 && v <= job->vmin) {
+				bad = 1;
+			} else if(job->vmax >= 0 && v >= job->vmax) {
+				bad = 1;
+			} else if(job->sigma >= 0) {
+				c = cfa_color(img,x,y);
+				if(c <= CFA_BLUE && find_bad_outlier(job,c,v)) {
+					bad = 1;
+				}
+			}
+			if(bad) {
+				pixel_list_add(&job->lists[chunk],PIXEL_LIST_XY(x,y));
+			}
+		}
+	}
+}
+
+/*
+find defective pixels, for building a pixel map from dark or flat frames
+list=img:find_bad_pixels(opts)
+opts {
+	min:number -- pixels with value <= min are bad
+	max:number -- pixels with value >= max are bad
+	sigma:number -- pixels more than sigma standard deviations from the mean of their CFA color are bad
+	region:string -- 'active' (default) or 'all'
+}
+at least one of min, max or sigma is required
+list: lbuf of sorted coordinates, see PIXEL_LIST_XY
+*/
+static int rawimg_lua_find_bad_pixels(lua_State *L) {
+	raw_image_t* img = (raw_image_t *)luaL_checkudata(L, 1, RAWIMG_META);
+	if(!lua_istable(L,2)) {
+		return luaL_error(L,"expected table");
+	}
+	find_bad_job_t job;
+	memset(&job,0,sizeof(job));
+	job.img = img;
+	// -1 = not used
+	job.vmin = lu_table_optnumber(L,2,"min",-1);
+	job.vmax = lu_table_optnumber(L,2,"max",-1);
+	job.sigma = lu_table_optnumber(L,2,"sigma",-1);
+	int region = lu_table_checkoption(L,2,"region","active",region_strings);
+	if(job.vmin < 0 && job.vmax < 0 && job.sigma < 0) {
+		return luaL_error(L,"min, max or sigma required");
+	}
+	if(img->width > 0x10000 || img->height > 0x10000) {
+		return luaL_error(L,"image too large for pixel list");
+	}
+	unsigned top,bottom;
+	rawimg_get_region(img,region,&top,&job.left,&bottom,&job.right);
+	unsigned chunks = workpool_chunk_count(bottom - top);
+
+	if(job.sigma >= 0) {
+		job.stats = calloc(chunks,sizeof(*job.stats));
+		if(!job.stats) {
+			return luaL_error(L,"malloc failed");
+		}
+		for(job.pass=0;job.pass<2;job.pass++) {
+			memset(job.stats,0,chunks*sizeof(*job.stats));
+			workpool_run_rows(rawimg_find_bad_pixels_rows,&job,top,bottom);
+			int c;
+			for(c=0;c<3;c++) {
+				uint64_t sum=0,sumsq=0,n=0;
+				unsigned i;
+				for(i=0;i<chunks;i++) {
+					sum += job.stats[i][c];
+					sumsq += job.stats[i][3+c];
+					n += job.stats[i][6+c];
+				}
+				if(n) {
+					job.mean[c] = (double)sum/n;
+					double var = (double)sumsq/n - job.mean[c]*job.mean[c];
+					job.sd[c] = (var > 0)?sqrt(var):0;
+				}
 			}
 		}
+		free(job.stats);
+	}
+
+	job.pass = 2;
+	job.lists = calloc(chunks,sizeof(pixel_list_t));
+	if(!job.lists) {
+		return luaL_error(L,"malloc failed");
+	}
+	workpool_run_rows(rawimg_find_bad_pixels_rows,&job,top,bottom);
+	unsigned count;
+	uint32_t *list = pixel_lists_join(job.lists,chunks,&count);
+	if(!list) {
+		return luaL_error(L,"malloc failed");
+	}
+	if(!lbuf_create(L, (char *)list, count*sizeof(uint32_t), LBUF_FL_FREE)) {
+		free(list);
+		return luaL_error(L,"failed to create lbuf");
+	}
+	return 1;
+}
+
+/*
+interpolate over pixels listed in a pixel list
+count=img:patch_pixel_list(list)
+list: lbuf from find_bad_pixels or equivalent
+count: number of pixels actually modified
+coordinates outside the image are ignored
+listed pixels are not used as neighbors, so clusters of hot pixels are patched
+from the surrounding good pixels
+*/
+static int rawimg_lua_patch_pixel_list(lua_State *L) {
+	raw_image_t* img = (raw_image_t *)luaL_checkudata(L, 1, RAWIMG_META);
+	lBuf_t *list = lbuf_getlbuf(L,2);
+	if(!list) {
+		return luaL_error(L,"expected lbuf");
+	}
+	unsigned n = list->len/sizeof(uint32_t);
+	unsigned i, count = 0;
+	if(!n) {
+		lua_pushnumber(L,0);
+		return 1;
+	}
+	// sorted copy to look up listed neighbors, and replacement values, so listed pixels
+	// are never used to patch each other and the result doesn't depend on list order
+	uint32_t *sorted = malloc(n*sizeof(uint32_t));
+	unsigned *vals = malloc(n*sizeof(unsigned));
+	if(!sorted || !vals) {
+		free(sorted);
+		free(vals);
+		return luaL_error(L,"malloc failed");
+	}
+	memcpy(sorted,list->bytes,n*sizeof(uint32_t));
+	qsort(sorted,n,sizeof(uint32_t),pixel_list_cmp);
+	for(i=0; i < n; i++) {
+		unsigned x = PIXEL_LIST_X(sorted[i]);
+		unsigned y = PIXEL_LIST_Y(sorted[i]);
+		if(x >= img->width || y >= img->height || !rawimg_patch_value(img,x,y,sorted,n,&vals[i])) {
+			// not patched, pixel values are at most 16 bits
+			vals[i] = 0xFFFFFFFF;
+		}
 	}
+	for(i=0; i < n; i++) {
+		if(vals[i] != 0xFFFFFFFF) {
+			img->fmt->set_pixel(img->data,img->row_bytes,PIXEL_LIST_X(sorted[i]),PIXEL_LIST_Y(sorted[i]),vals[i]);
+			count++;
+		}
+	}
+	free(sorted);
+	free(vals);
 	lua_pushnumber(L,count);
 	return 1;
 }
@@ -583,6 +926,51 @@ static const char *valdownmod_strings[] = {
 };
 
 
+/*
+save a reference in the registry to keep the lbuf at lbuf_index from being collected until
+the image at img_index goes away. Bulk operations run on worker threads, but complete before
+returning to Lua, so only the image needs to hold the reference
+*/
+static void rawimg_ref_lbuf(lua_State *L, int img_index, int lbuf_index) {
+	// convert relative indexes before pushing
+	if(img_index < 0) {
+		img_index = lua_gettop(L) + img_index + 1;
+	}
+	if(lbuf_index < 0) {
+		lbuf_index = lua_gettop(L) + lbuf_index + 1;
+	}
+	lua_getfield(L,LUA_REGISTRYINDEX,RAWIMG_LIST);
+	lua_pushvalue(L, img_index); // our user data, for use as key
+	lua_pushvalue(L, lbuf_index); // lbuf, the value
+	lua_settable(L, -3); //set t[img]=lbuf
+	lua_pop(L,1); // done with t
+}
+
+typedef struct {
+	raw_image_t *src;
+	raw_image_t *dst;
+	int shift;
+} convert_job_t;
+
+static void rawimg_convert_rows(void *arg, unsigned chunk, unsigned start, unsigned end) {
+	convert_job_t *job = (convert_job_t *)arg;
+	raw_image_t *img = job->src;
+	raw_image_t *newimg = job->dst;
+	int shift = job->shift;
+	unsigned x,y;
+	for(y=start;y<end;y++) {
+		for(x=0;x<img->width;x++) {
+			unsigned v = img->fmt->get_pixel(img->data,img->row_bytes,x,y);
+			if(shift < 0) {
+				v = v<<-shift;
+			} else {
+				v = v>>shift;
+			}
+			newimg->fmt->set_pixel(newimg->data,newimg->row_bytes,x,y,v);
+		}
+	}
+}
+
 /*
 convert image data to a different format, returning the result in an lbuf and new rawimg
 rawimg,lbuf=img:convert(options)
@@ -626,6 +1014,10 @@ static int rawimg_lua_convert(lua_State *L) {
 	if(!newimg->fmt) {
 		return luaL_error(L,"unknown format");
 	}
+	// rows are processed in parallel, so must not share bytes
+	if(newimg->width % newimg->fmt->block_pixels != 0) {
+		return luaL_error(L,"width not a multiple of block size");
+	}
 	newimg->row_bytes = newimg->width*bpp/8;
 	newimg->black_level = img->black_level >> shift;
 
@@ -646,36 +1038,73 @@ static int rawimg_lua_convert(lua_State *L) {
 		if(lb->len != new_size) {
 			return luaL_error(L,"lbuf size mismatched");
 		}
-		lua_pushvalue(L,2); // ensure lbuf is on top of stack
+		lua_getfield(L,2,"lbuf"); // ensure lbuf is on top of stack
 	}
 	newimg->data = (uint8_t *)lb->bytes;
-	// TODO this should be common code shared with bind_lbuf
-	// save a reference in the registry to keep lbuf from being collected until image goes away
-	lua_getfield(L,LUA_REGISTRYINDEX,RAWIMG_LIST);
-	lua_pushvalue(L, -2); // our user data, for use as key
-	lua_pushvalue(L, 1); // lbuf, the value
-	lua_settable(L, -3); //set t[img]=lbuf
-	lua_pop(L,1); // done with t
-	
+	rawimg_ref_lbuf(L,-2,-1);
+
 	// TODO could optimize the conversions where bpp or bpp and endian don't change
-	int y;
-	for(y=0;y<img->height;y++) {
-		int x;
-		for(x=0;x<img->width;x++) {
-			unsigned v = img->fmt->get_pixel(img->data,img->row_bytes,x,y);
-			if(shift < 0) {
-				v = v<<-shift;
-			} else {
-				v = v>>shift;
-			}
-			newimg->fmt->set_pixel(newimg->data,newimg->row_bytes,x,y,v);
-		}
-	}
+	convert_job_t job = {img,newimg,shift};
+	workpool_run_rows(rawimg_convert_rows,&job,0,img->height);
 
 	return 2;
 }
 
 
+/*
+read the geometry related fields of an imgspec (see bind_lbuf) into img
+width, height, black_level, cfa_pattern and active_area are handled
+*/
+static void rawimg_get_spec_geometry(lua_State *L, int index, raw_image_t *img) {
+	img->width = lu_table_checknumber(L,index,"width");
+	img->height = lu_table_checknumber(L,index,"height");
+
+	img->black_level = lu_table_optnumber(L,index,"black_level",0);
+
+	// active area
+	lua_getfield(L, index, "active_area");
+	if(lua_istable(L,-1)) {
+		// if table present, all required
+		img->active_top = lu_table_checknumber(L,-1,"top");
+		img->active_left = lu_table_checknumber(L,-1,"left");
+		img->active_bottom = lu_table_checknumber(L,-1,"bottom");
+		img->active_right = lu_table_checknumber(L,-1,"right");
+		if(img->active_top >= img->active_bottom) {
+			luaL_error(L,"active top >= bottom");
+		}
+		if(img->active_left >= img->active_right) {
+			luaL_error(L,"active left >= right");
+		}
+		if(img->active_left > img->width) {
+			luaL_error(L,"active right > width");
+		}
+		if(img->active_bottom > img->height) {
+			luaL_error(L,"active bottom > height");
+		}
+	} else {
+		img->active_top = img->active_left = 0;
+		img->active_right = img->width;
+		img->active_bottom = img->height;
+	}
+	lua_pop(L,1); // pop off active area or nil
+
+	size_t cfa_size;
+	const char *cfa_pattern = lu_table_optlstring(L,index,"cfa_pattern",NULL,&cfa_size);
+	if(!cfa_pattern) {
+		memset(img->cfa_pattern,0,4);
+	} else if(cfa_size != 4) {
+		luaL_error(L,"unknown cfa pattern");
+	} else {
+		// TODO should verify contains only R,G,B
+		// DNG cfa is relative to the active area, cfa_color uses absolute coordinates
+		unsigned shift = (img->active_left&1) + (img->active_top&1)*2;
+		int i;
+		for(i=0;i<4;i++) {
+			img->cfa_pattern[i] = cfa_pattern[i ^ shift];
+		}
+	}
+}
+
 /*
 img = rawimg.bind_lbuf(imgspec)
 imgspec {
@@ -688,7 +1117,7 @@ imgspec {
 -- optional fields
 	data_offset:number -- offset into data lbuf, default 0
 	black_level -- default 0
-	cfa_pattern:string -- 4 byte string
+	cfa_pattern:string -- 4 byte string, relative to the active area as in DNG
 	active_area: { -- default 0,0,height,width
 		top:number
 		left:number
@@ -713,83 +1142,2185 @@ static int rawimg_lua_bind_lbuf(lua_State *L) {
 
 	unsigned offset = lu_table_optnumber(L,1,"data_offset",0);
 
-	img->width = lu_table_checknumber(L,1,"width");
-	img->height = lu_table_checknumber(L,1,"height");
 	unsigned bpp = lu_table_checknumber(L,1,"bpp");
 
 	unsigned endian = lu_table_checkoption(L,1,"endian",NULL,endian_strings);
 
-	img->black_level = lu_table_optnumber(L,1,"black_level",0);
+	rawimg_get_spec_geometry(L,1,img);
 
-	size_t cfa_size;
-	// TODO DNG cfa is relative to active area, should shift if top or left is odd
-	const char *cfa_pattern = lu_table_optlstring(L,1,"cfa_pattern",NULL,&cfa_size);
-	if(!cfa_pattern) {
-		memset(img->cfa_pattern,0,4);
-	} else if(cfa_size != 4) {
-		return luaL_error(L,"unknown cfa pattern");
-	} else {
-		// TODO should verify contains only R,G,B
-		memcpy(img->cfa_pattern,cfa_pattern,4);
+	img->fmt = rawimg_find_format(bpp,endian);
+	if(!img->fmt) {
+		return luaL_error(L,"unknown format");
 	}
+	
+	if(img->width % img->fmt->block_pixels != 0) {
+		return luaL_error(L,"width not a multiple of block size");
+	}
+	img->row_bytes = (img->width*img->fmt->bpp)/8;
+	if(offset + img->row_bytes*img->height > buf->len) {
+		return luaL_error(L,"size larger than data");
+	}
+	img->data = (uint8_t *)buf->bytes + offset;
+
+	luaL_getmetatable(L, RAWIMG_META);
+	lua_setmetatable(L, -2);
+	
+	lua_getfield(L,1,"data");
+	rawimg_ref_lbuf(L,-2,-1);
+	lua_pop(L,1);
+
+	return 1;
+}
+
+/*
+live stacking accumulator
+sums and per-pixel counts of added frames, covering the full raw buffer
+pixels outside of min_val and max_val are not accumulated, so counts may differ per pixel
+*/
+#define RAWSTACK_MAX_FRAMES 0xFFFF
+
+typedef struct {
+	unsigned width;
+	unsigned height;
+	unsigned bpp;
+	uint8_t cfa_pattern[4];
+	unsigned active_top;
+	unsigned active_left;
+	unsigned active_bottom;
+	unsigned active_right;
+	unsigned black_level;
+	unsigned min_val;
+	unsigned max_val;
+	unsigned frames; // frames currently in the stack
+	unsigned rejected; // frames removed with reject
+	uint32_t *sum_u32; // only one of sum_u32, sum_f is allocated
+	float *sum_f;
+	uint16_t *count;
+	uint16_t *dark; // optional dark frame, subtracted on add
+	unsigned dark_pedestal; // added back after dark subtraction, the dark frame black level
+} raw_stack_t;
+
+static void rawstack_free_data(raw_stack_t *stack) {
+	free(stack->sum_u32);
+	stack->sum_u32 = NULL;
+	free(stack->sum_f);
+	stack->sum_f = NULL;
+	free(stack->count);
+	stack->count = NULL;
+	free(stack->dark);
+	stack->dark = NULL;
+}
+
+/*
+arguments of rawstack_accumulate, shared by the row chunks run by workpool
+*/
+typedef struct {
+	raw_stack_t *stack;
+	raw_image_t *img;
+	unsigned y_offset;
+	int sign;
+} rawstack_accumulate_job_t;
+
+static void rawstack_accumulate_rows(void *arg, unsigned chunk, unsigned start, unsigned end) {
+	rawstack_accumulate_job_t *job = (rawstack_accumulate_job_t *)arg;
+	raw_stack_t *stack = job->stack;
+	raw_image_t *img = job->img;
+	int sign = job->sign;
+	unsigned w = (img->width < stack->width)?img->width:stack->width;
+	unsigned y;
+	for(y=start; y < end; y++) {
+		unsigned i = (y + job->y_offset)*stack->width;
+		unsigned x;
+		for(x=0; x < w; x++, i++) {
+			int v = img->fmt->get_pixel(img->data,img->row_bytes,x,y);
+			if(v < (int)stack->min_val || v > (int)stack->max_val) {
+				continue;
+			}
+			if(stack->dark) {
+				v = v - stack->dark[i] + stack->dark_pedestal;
+			}
+			if(sign > 0) {
+				if(stack->count[i] == RAWSTACK_MAX_FRAMES) {
+					continue;
+				}
+				stack->count[i]++;
+			} else {
+				// frame being rejected wasn't in the stack, or was added with different settings
+				if(stack->count[i] == 0) {
+					continue;
+				}
+				stack->count[i]--;
+			}
+			if(stack->sum_f) {
+				stack->sum_f[i] += (float)(sign*v);
+			} else {
+				if(v < 0) {
+					v = 0;
+				}
+				if(sign > 0) {
+					stack->sum_u32[i] += v;
+				} else if(stack->sum_u32[i] >= (unsigned)v) {
+					stack->sum_u32[i] -= v;
+				} else {
+					stack->sum_u32[i] = 0;
+				}
+			}
+		}
+	}
+}
+
+/*
+add (sign = 1) or remove (sign = -1) img, with row 0 of img at row y_offset of the stack
+*/
+static void rawstack_accumulate(raw_stack_t *stack, raw_image_t *img, unsigned y_offset, int sign) {
+	unsigned h = img->height;
+	if(y_offset >= stack->height) {
+		return;
+	}
+	if(h > stack->height - y_offset) {
+		h = stack->height - y_offset;
+	}
+	rawstack_accumulate_job_t job = {stack,img,y_offset,sign};
+	workpool_run_rows(rawstack_accumulate_rows,&job,0,h);
+}
+
+/*
+mean value of pixel at index i, black level if no values were accumulated
+*/
+static float rawstack_mean(raw_stack_t *stack, unsigned i) {
+	if(!stack->count[i]) {
+		return stack->black_level;
+	}
+	if(stack->sum_f) {
+		return stack->sum_f[i]/stack->count[i];
+	}
+	return (float)stack->sum_u32[i]/stack->count[i];
+}
+
+static raw_image_t *rawstack_check_frame(lua_State *L, raw_stack_t *stack, int index) {
+	raw_image_t* img = (raw_image_t *)luaL_checkudata(L, index, RAWIMG_META);
+	if(img->fmt->bpp != stack->bpp) {
+		luaL_error(L,"frame bpp does not match stack");
+	}
+	if(img->width != stack->width) {
+		luaL_error(L,"frame width does not match stack");
+	}
+	return img;
+}
+
+/*
+n=stack:add(img[,opts])
+add a frame to the stack, subtracting the dark frame if set
+opts {
+	y_offset:number -- stack row corresponding to row 0 of img, for sub-images. default 0
+}
+n: number of frames in stack
+*/
+static int rawstack_lua_add(lua_State *L) {
+	raw_stack_t *stack = (raw_stack_t *)luaL_checkudata(L, 1, RAWSTACK_META);
+	raw_image_t *img = rawstack_check_frame(L,stack,2);
+	unsigned y_offset = 0;
+	if(lua_istable(L,3)) {
+		y_offset = lu_table_optnumber(L,3,"y_offset",0);
+	}
+	if(stack->frames == RAWSTACK_MAX_FRAMES) {
+		return luaL_error(L,"stack full");
+	}
+	rawstack_accumulate(stack,img,y_offset,1);
+	stack->frames++;
+	lua_pushnumber(L,stack->frames);
+	return 1;
+}
+
+/*
+n=stack:reject(img[,opts])
+remove a previously added frame from the stack
+img and opts must be the same as when the frame was added, and the dark frame must not have changed
+n: number of frames in stack
+*/
+static int rawstack_lua_reject(lua_State *L) {
+	raw_stack_t *stack = (raw_stack_t *)luaL_checkudata(L, 1, RAWSTACK_META);
+	raw_image_t *img = rawstack_check_frame(L,stack,2);
+	unsigned y_offset = 0;
+	if(lua_istable(L,3)) {
+		y_offset = lu_table_optnumber(L,3,"y_offset",0);
+	}
+	if(!stack->frames) {
+		return luaL_error(L,"stack empty");
+	}
+	rawstack_accumulate(stack,img,y_offset,-1);
+	stack->frames--;
+	stack->rejected++;
+	lua_pushnumber(L,stack->frames);
+	return 1;
+}
+
+typedef struct {
+	raw_stack_t *stack;
+	raw_image_t *img;
+	int shift;
+} rawstack_dark_job_t;
+
+static void rawstack_set_dark_rows(void *arg, unsigned chunk, unsigned start, unsigned end) {
+	rawstack_dark_job_t *job = (rawstack_dark_job_t *)arg;
+	raw_image_t *img = job->img;
+	int shift = job->shift;
+	unsigned x,y;
+	uint16_t *p = job->stack->dark + start*img->width;
+	for(y=start;y<end;y++) {
+		for(x=0;x<img->width;x++) {
+			unsigned v = img->fmt->get_pixel(img->data,img->row_bytes,x,y);
+			*p++ = (shift < 0)?(v << -shift):(v >> shift);
+		}
+	}
+}
+
+/*
+stack:set_dark(img)
+set dark frame to be subtracted from subsequently added frames. nil clears
+img must be the full size of the stack. The value is copied, img may be discarded
+if img bpp differs from the stack, values are shifted, so a 16 bit stacked dark may be used
+after dark subtraction, the dark frame black level is added back
+*/
+static int rawstack_lua_set_dark(lua_State *L) {
+	raw_stack_t *stack = (raw_stack_t *)luaL_checkudata(L, 1, RAWSTACK_META);
+	if(lua_isnoneornil(L,2)) {
+		free(stack->dark);
+		stack->dark = NULL;
+		return 0;
+	}
+	raw_image_t* img = (raw_image_t *)luaL_checkudata(L, 2, RAWIMG_META);
+	if(img->width != stack->width || img->height != stack->height) {
+		return luaL_error(L,"dark size does not match stack");
+	}
+	if(!stack->dark) {
+		stack->dark = malloc(stack->width*stack->height*sizeof(uint16_t));
+		if(!stack->dark) {
+			return luaL_error(L,"malloc failed");
+		}
+	}
+	int shift = img->fmt->bpp - stack->bpp;
+	rawstack_dark_job_t job = {stack,img,shift};
+	workpool_run_rows(rawstack_set_dark_rows,&job,0,img->height);
+	stack->dark_pedestal = (shift < 0)?(img->black_level << -shift):(img->black_level >> shift);
+	return 0;
+}
+
+/*
+stack:reset()
+clear all accumulated frames. dark frame is kept
+*/
+static int rawstack_lua_reset(lua_State *L) {
+	raw_stack_t *stack = (raw_stack_t *)luaL_checkudata(L, 1, RAWSTACK_META);
+	unsigned n = stack->width*stack->height;
+	if(stack->sum_f) {
+		memset(stack->sum_f,0,n*sizeof(float));
+	} else {
+		memset(stack->sum_u32,0,n*sizeof(uint32_t));
+	}
+	memset(stack->count,0,n*sizeof(uint16_t));
+	stack->frames = stack->rejected = 0;
+	return 0;
+}
+
+/*
+t=stack:info()
+t {
+	width, height, bpp, frames, rejected:number
+	float:bool
+	dark:bool
+}
+*/
+static int rawstack_lua_info(lua_State *L) {
+	raw_stack_t *stack = (raw_stack_t *)luaL_checkudata(L, 1, RAWSTACK_META);
+	lua_createtable(L,0,7);
+	lua_pushnumber(L,stack->width);
+	lua_setfield(L,-2,"width");
+	lua_pushnumber(L,stack->height);
+	lua_setfield(L,-2,"height");
+	lua_pushnumber(L,stack->bpp);
+	lua_setfield(L,-2,"bpp");
+	lua_pushnumber(L,stack->frames);
+	lua_setfield(L,-2,"frames");
+	lua_pushnumber(L,stack->rejected);
+	lua_setfield(L,-2,"rejected");
+	lua_pushboolean(L,stack->sum_f != NULL);
+	lua_setfield(L,-2,"float");
+	lua_pushboolean(L,stack->dark != NULL);
+	lua_setfield(L,-2,"dark");
+	return 1;
+}
+
+typedef struct {
+	raw_stack_t *stack;
+	raw_image_t *img;
+	float scale;
+} rawstack_mean_job_t;
+
+static void rawstack_get_mean_rows(void *arg, unsigned chunk, unsigned start, unsigned end) {
+	rawstack_mean_job_t *job = (rawstack_mean_job_t *)arg;
+	raw_image_t *img = job->img;
+	unsigned maxval = (1<<img->fmt->bpp) - 1;
+	unsigned x,y,i=start*img->width;
+	for(y=start;y<end;y++) {
+		for(x=0;x<img->width;x++,i++) {
+			float v = rawstack_mean(job->stack,i)*job->scale + 0.5f;
+			img->fmt->set_pixel(img->data,img->row_bytes,x,y,(v <= 0)?0:((v >= maxval)?maxval:(unsigned)v));
+		}
+	}
+}
+
+/*
+get the mean of the stack as a new image
+rawimg,lbuf=stack:get_mean([opts])
+opts {
+	bpp:number -- default 16
+	endian:string -- default little
+	scale:number -- values and black level are multiplied by scale, default 1
+	lbuf:[lbuf] -- optional lbuf to store data in
+}
+*/
+static int rawstack_lua_get_mean(lua_State *L) {
+	raw_stack_t *stack = (raw_stack_t *)luaL_checkudata(L, 1, RAWSTACK_META);
+	unsigned bpp = 16;
+	unsigned endian = RAW_ENDIAN_l;
+	float scale = 1;
+	lBuf_t *lb = NULL;
+	if(lua_istable(L,2)) {
+		bpp = lu_table_optnumber(L,2,"bpp",16);
+		endian = lu_table_checkoption(L,2,"endian","little",endian_strings);
+		scale = lu_table_optnumber(L,2,"scale",1);
+		lb = lu_table_optudata(L,2,"lbuf",LBUF_META,NULL);
+	}
+	raw_image_t *img = (raw_image_t *)lua_newuserdata(L,sizeof(raw_image_t));
+	if(!img) {
+		return luaL_error(L,"failed to create userdata");
+	}
+	img->fmt = rawimg_find_format(bpp,endian);
+	if(!img->fmt) {
+		return luaL_error(L,"unknown format");
+	}
+	if(stack->width % img->fmt->block_pixels != 0) {
+		return luaL_error(L,"width not a multiple of block size");
+	}
+	img->width = stack->width;
+	img->height = stack->height;
+	img->row_bytes = stack->width*bpp/8;
+	memcpy(img->cfa_pattern,stack->cfa_pattern,4);
+	img->active_top = stack->active_top;
+	img->active_left = stack->active_left;
+	img->active_bottom = stack->active_bottom;
+	img->active_right = stack->active_right;
+	img->black_level = stack->black_level*scale + 0.5f;
+
+	luaL_getmetatable(L, RAWIMG_META);
+	lua_setmetatable(L, -2);
+
+	unsigned size = img->row_bytes*img->height;
+	if(!lb) {
+		char *data = malloc(size);
+		if(!data) {
+			return luaL_error(L,"malloc failed");
+		}
+		if(!lbuf_create(L, data, size, LBUF_FL_FREE)) {
+			return luaL_error(L,"failed to create lbuf");
+		}
+		lb = luaL_checkudata(L,-1,LBUF_META);
+	} else {
+		if(lb->len != size) {
+			return luaL_error(L,"lbuf size mismatched");
+		}
+		lua_getfield(L,2,"lbuf");
+	}
+	img->data = (uint8_t *)lb->bytes;
+	rawimg_ref_lbuf(L,-2,-1);
+
+	rawstack_mean_job_t job = {stack,img,scale};
+	workpool_run_rows(rawstack_get_mean_rows,&job,0,img->height);
+	return 2;
+}
+
+/*
+binned RGB previews
+each output pixel averages all pixels of each CFA color in a cell of the active area
+cells are aligned to 2x2 CFA quads, so each contains the same number of each CFA position
+*/
+#define PREVIEW_LUT_SIZE 16384
+#define PREVIEW_HIST_SIZE 4096
+
+typedef struct {
+	float black;
+	float white;
+	float wb[3];
+	float gamma;
+	float auto_pct;
+} preview_opts_t;
+
+typedef struct {
+	unsigned width; // output size
+	unsigned height;
+	unsigned *xs; // per output column, source x start and end
+	unsigned *xe;
+	unsigned *ys; // per output row, source y start and end
+	unsigned *ye;
+	unsigned x0; // first source column read, aligned to format block for rawimg
+	unsigned x1; // end of source columns read
+	uint8_t cfa_pattern[4];
+	// source, only one of img or stack is set
+	raw_image_t *img;
+	unsigned y_offset; // image row of img row 0, rows outside img read as fill
+	uint16_t fill;
+	raw_stack_t *stack;
+	void **rowbufs; // per chunk source row buffer
+	void **colsums; // per chunk column sums for even and odd rows, uint32 for rawimg, double for stack
+	float *vals; // linear RGB values, width*height*3
+	preview_opts_t opts;
+	float scale[3];
+	uint8_t lut[PREVIEW_LUT_SIZE];
+	uint8_t *out;
+} preview_job_t;
+
+/*
+read preview options from the table at index, if present. opts should contain defaults
+*/
+static void preview_get_opts(lua_State *L, int index, preview_opts_t *opts) {
+	if(!lua_istable(L,index)) {
+		return;
+	}
+	opts->black = lu_table_optnumber(L,index,"black",opts->black);
+	opts->white = lu_table_optnumber(L,index,"white",opts->white);
+	opts->gamma = lu_table_optnumber(L,index,"gamma",opts->gamma);
+	opts->auto_pct = lu_table_optnumber(L,index,"auto",opts->auto_pct);
+	lua_getfield(L,index,"wb");
+	if(lua_istable(L,-1)) {
+		int i;
+		for(i=0;i<3;i++) {
+			lua_rawgeti(L,-1,i+1);
+			if(!lua_isnumber(L,-1)) {
+				luaL_error(L,"wb must be an array of 3 numbers");
+			}
+			opts->wb[i] = lua_tonumber(L,-1);
+			lua_pop(L,1);
+		}
+	} else if(!lua_isnil(L,-1)) {
+		luaL_error(L,"wb must be an array of 3 numbers");
+	}
+	lua_pop(L,1);
+}
+
+/*
+compute cell bounds for n output pixels covering size source pixels from start
+cells are at least 2 pixels, so outputs up to size may be made by repeating cells
+*/
+static void preview_cell_bounds(unsigned *s, unsigned *e, unsigned n, unsigned start, unsigned size) {
+	unsigned i;
+	unsigned last = (size&~1) - 2; // start of last full cell
+	for(i=0;i<n;i++) {
+		s[i] = (size*i/n)&~1;
+		e[i] = (size*(i+1)/n)&~1;
+		if(e[i] < s[i] + 2) {
+			if(s[i] > last) {
+				s[i] = last;
+			}
+			e[i] = s[i] + 2;
+		}
+		s[i] += start;
+		e[i] += start;
+	}
+}
+
+/*
+convert sums of each CFA position in a cell to RGB averages
+*/
+static void preview_cell_rgb(preview_job_t *job, double *acc, unsigned quads, float *v) {
+	double rgb[3] = {0,0,0};
+	unsigned n[3] = {0,0,0};
+	int i;
+	for(i=0;i<4;i++) {
+		unsigned c = job->cfa_pattern[i];
+		if(c > CFA_BLUE) {
+			continue;
+		}
+		rgb[c] += acc[i];
+		n[c] += quads;
+	}
+	for(i=0;i<3;i++) {
+		v[i] = (n[i])?rgb[i]/n[i]:job->opts.black;
+	}
+}
+
+static void preview_bin_rows(void *arg, unsigned chunk, unsigned start, unsigned end) {
+	preview_job_t *job = (preview_job_t *)arg;
+	unsigned x0 = job->x0;
+	unsigned n = job->x1 - x0;
+	unsigned ty,tx,y,x;
+	for(ty=start;ty<end;ty++) {
+		// sum the cell rows into columns, separately for even and odd rows
+		// then sum the columns of each cell
+		double acc[4];
+		float *v = job->vals + ty*job->width*3;
+		unsigned qh = (job->ye[ty] - job->ys[ty])/2;
+		if(job->img) {
+			raw_image_t *img = job->img;
+			uint16_t *row = (uint16_t *)job->rowbufs[chunk];
+			uint32_t *cols = (uint32_t *)job->colsums[chunk];
+			memset(cols,0,2*n*sizeof(uint32_t));
+			for(y=job->ys[ty];y<job->ye[ty];y++) {
+				uint32_t *c = cols + (y&1)*n;
+				if(y < job->y_offset || y - job->y_offset >= img->height) {
+					for(x=0;x<n;x++) {
+						row[x] = job->fill;
+					}
+				} else {
+					img->fmt->get_row(img->data,img->row_bytes,y - job->y_offset,x0,n,row);
+				}
+				for(x=0;x<n;x++) {
+					c[x] += row[x];
+				}
+			}
+			for(tx=0;tx<job->width;tx++) {
+				memset(acc,0,sizeof(acc));
+				for(x=job->xs[tx];x<job->xe[tx];x++) {
+					acc[x&1] += cols[x - x0];
+					acc[2 + (x&1)] += cols[n + x - x0];
+				}
+				preview_cell_rgb(job,acc,qh*(job->xe[tx] - job->xs[tx])/2,v);
+				v += 3;
+			}
+		} else {
+			raw_stack_t *stack = job->stack;
+			double *cols = (double *)job->colsums[chunk];
+			memset(cols,0,2*n*sizeof(double));
+			for(y=job->ys[ty];y<job->ye[ty];y++) {
+				double *c = cols + (y&1)*n;
+				unsigned i = y*stack->width + x0;
+				for(x=0;x<n;x++) {
+					c[x] += rawstack_mean(stack,i + x);
+				}
+			}
+			for(tx=0;tx<job->width;tx++) {
+				memset(acc,0,sizeof(acc));
+				for(x=job->xs[tx];x<job->xe[tx];x++) {
+					acc[x&1] += cols[x - x0];
+					acc[2 + (x&1)] += cols[n + x - x0];
+				}
+				preview_cell_rgb(job,acc,qh*(job->xe[tx] - job->xs[tx])/2,v);
+				v += 3;
+			}
+		}
+	}
+}
+
+static void preview_map_rows(void *arg, unsigned chunk, unsigned start, unsigned end) {
+	preview_job_t *job = (preview_job_t *)arg;
+	unsigned i = start*job->width*3;
+	unsigned n = end*job->width*3;
+	float black = job->opts.black;
+	for(;i<n;i++) {
+		float v = (job->vals[i] - black)*job->scale[i%3];
+		int li = (v <= 0)?0:((v >= 1)?PREVIEW_LUT_SIZE-1:(int)(v*(PREVIEW_LUT_SIZE-1) + 0.5f));
+		job->out[i] = job->lut[li];
+	}
+}
+
+/*
+set white to the auto_pct percentile of black subtracted, white balanced values
+*/
+static void preview_auto_white(preview_job_t *job) {
+	unsigned size = job->width*job->height*3;
+	unsigned i;
+	float vmax = 0;
+	for(i=0;i<size;i++) {
+		float v = (job->vals[i] - job->opts.black)*job->opts.wb[i%3];
+		if(v > vmax) {
+			vmax = v;
+		}
+	}
+	if(vmax <= 0) {
+		return;
+	}
+	unsigned hist[PREVIEW_HIST_SIZE];
+	memset(hist,0,sizeof(hist));
+	float hscale = (PREVIEW_HIST_SIZE - 1)/vmax;
+	for(i=0;i<size;i++) {
+		float v = (job->vals[i] - job->opts.black)*job->opts.wb[i%3];
+		hist[(v <= 0)?0:(unsigned)(v*hscale)]++;
+	}
+	float pct = (job->opts.auto_pct > 100)?100:job->opts.auto_pct;
+	unsigned target = (unsigned)(pct*(size - 1)/100);
+	unsigned count = 0;
+	for(i=0;i<PREVIEW_HIST_SIZE;i++) {
+		count += hist[i];
+		if(count > target) {
+			break;
+		}
+	}
+	job->opts.white = job->opts.black + (i + 1)/hscale;
+}
+
+static void preview_free(preview_job_t *job, unsigned chunks) {
+	unsigned i;
+	free(job->xs);
+	free(job->ys);
+	if(job->rowbufs) {
+		for(i=0;i<chunks;i++) {
+			free(job->rowbufs[i]);
+		}
+		free(job->rowbufs);
+	}
+	if(job->colsums) {
+		for(i=0;i<chunks;i++) {
+			free(job->colsums[i]);
+		}
+		free(job->colsums);
+	}
+	free(job->vals);
+	free(job->out);
+}
+
+/*
+make a preview from the source in job, pushing an lbuf of 8 bit RGB
+job must have width, height, opts, cfa_pattern and img or stack set
+*/
+static int preview_make(lua_State *L, preview_job_t *job, unsigned top, unsigned left, unsigned bottom, unsigned right) {
+	unsigned iw = right - left;
+	unsigned ih = bottom - top;
+	if(job->width > iw || job->height > ih) {
+		return luaL_error(L,"thumb cannot be larger than active area");
+	}
+	if(!job->width  || !job->height) {
+		return luaL_error(L,"zero dimensions not allowed");
+	}
+	if(iw < 2 || ih < 2) {
+		return luaL_error(L,"active area too small");
+	}
+	unsigned chunks = workpool_chunk_count(job->height);
+	unsigned size = job->width*job->height*3;
+	job->xs = malloc(job->width*2*sizeof(unsigned));
+	job->ys = malloc(job->height*2*sizeof(unsigned));
+	job->rowbufs = calloc(chunks,sizeof(void *));
+	job->colsums = calloc(chunks,sizeof(void *));
+	job->vals = malloc(size*sizeof(float));
+	job->out = malloc(size);
+	if(!job->xs || !job->ys || !job->rowbufs || !job->colsums || !job->vals || !job->out) {
+		preview_free(job,chunks);
+		return luaL_error(L,"malloc failed");
+	}
+	job->xe = job->xs + job->width;
+	job->ye = job->ys + job->height;
+	preview_cell_bounds(job->xs,job->xe,job->width,left,iw);
+	preview_cell_bounds(job->ys,job->ye,job->height,top,ih);
+	job->x0 = job->xs[0];
+	job->x1 = job->xe[job->width - 1];
+	size_t row_elsize = 0;
+	size_t col_elsize = sizeof(double);
+	if(job->img) {
+		unsigned bp = job->img->fmt->block_pixels;
+		job->x0 = job->x0 - job->x0%bp;
+		job->x1 = (job->x1 + bp - 1) - (job->x1 + bp - 1)%bp;
+		row_elsize = sizeof(uint16_t);
+		col_elsize = sizeof(uint32_t);
+	}
+	unsigned i;
+	for(i=0;i<chunks;i++) {
+		job->colsums[i] = malloc((job->x1 - job->x0)*2*col_elsize);
+		if(row_elsize) {
+			job->rowbufs[i] = malloc((job->x1 - job->x0)*row_elsize);
+		}
+		if(!job->colsums[i] || (row_elsize && !job->rowbufs[i])) {
+			preview_free(job,chunks);
+			return luaL_error(L,"malloc failed");
+		}
+	}
+	workpool_run_rows(preview_bin_rows,job,0,job->height);
+
+	if(job->opts.auto_pct > 0) {
+		preview_auto_white(job);
+	}
+	if(job->opts.white <= job->opts.black) {
+		job->opts.white = job->opts.black + 1;
+	}
+	for(i=0;i<3;i++) {
+		job->scale[i] = job->opts.wb[i]/(job->opts.white - job->opts.black);
+	}
+	double inv_gamma = (job->opts.gamma > 0)?1.0/job->opts.gamma:1.0;
+	for(i=0;i<PREVIEW_LUT_SIZE;i++) {
+		job->lut[i] = 255.0*pow((double)i/(PREVIEW_LUT_SIZE - 1),inv_gamma) + 0.5;
+	}
+	workpool_run_rows(preview_map_rows,job,0,job->height);
+
+	uint8_t *out = job->out;
+	job->out = NULL;
+	preview_free(job,chunks);
+	if(!lbuf_create(L, (char *)out, size, LBUF_FL_FREE)) {
+		return luaL_error(L,"failed to create lbuf");
+	}
+	return 1;
+}
+
+/*
+make an RGB preview image, averaging all pixels of each CFA color in each output pixel
+thumb=img:make_rgb_thumb(width,height[,opts])
+opts {
+	black:number -- value mapped to 0, default black level
+	white:number -- value mapped to 255, default max value for bpp
+	wb:{r,g,b} -- white balance multipliers, applied after black subtraction. default 1,1,1
+	gamma:number -- output gamma, default 2.2. 1 = linear
+	auto:number -- if set, white is set to this percentile (0-100) of white balanced values
+	y_offset:number -- for an img holding rows of a larger image, the row of img row 0. default 0
+	area:{top,left,bottom,right} -- area of the larger image to use, default img active area
+	fill:number -- value of area rows outside img, default max value for bpp
+}
+width and height may be up to the area size
+thumb: lbuf of packed 8 bit RGB
+*/
+static int rawimg_lua_make_rgb_thumb(lua_State *L) {
+	raw_image_t* img = (raw_image_t *)luaL_checkudata(L, 1, RAWIMG_META);
+	preview_job_t job;
+	memset(&job,0,sizeof(job));
+	job.width = luaL_checknumber(L,2);
+	job.height = luaL_checknumber(L,3);
+	job.img = img;
+	memcpy(job.cfa_pattern,img->cfa_pattern,4);
+	job.opts.black = img->black_level;
+	job.opts.white = (1<<img->fmt->bpp) - 1;
+	job.opts.wb[0] = job.opts.wb[1] = job.opts.wb[2] = 1;
+	job.opts.gamma = 2.2;
+	preview_get_opts(L,4,&job.opts);
+	unsigned top = img->active_top;
+	unsigned left = img->active_left;
+	unsigned bottom = img->active_bottom;
+	unsigned right = img->active_right;
+	job.fill = (1<<img->fmt->bpp) - 1;
+	if(lua_istable(L,4)) {
+		job.y_offset = lu_table_optnumber(L,4,"y_offset",0);
+		job.fill = lu_table_optnumber(L,4,"fill",job.fill);
+		lua_getfield(L,4,"area");
+		if(lua_istable(L,-1)) {
+			top = lu_table_checknumber(L,-1,"top");
+			left = lu_table_checknumber(L,-1,"left");
+			bottom = lu_table_checknumber(L,-1,"bottom");
+			right = lu_table_checknumber(L,-1,"right");
+			if(top >= bottom || left >= right || right > img->width) {
+				return luaL_error(L,"invalid area");
+			}
+		} else if(!lua_isnil(L,-1)) {
+			return luaL_error(L,"area must be a table");
+		}
+		lua_pop(L,1);
+		// cfa pattern is relative to img rows
+		if(job.y_offset & 1) {
+			int i;
+			for(i=0;i<4;i++) {
+				job.cfa_pattern[i] = img->cfa_pattern[i^2];
+			}
+		}
+	}
+	return preview_make(L,&job,top,left,bottom,right);
+}
+
+/*
+make an RGB preview of the stack mean, as for img:make_rgb_thumb
+thumb=stack:make_rgb_thumb(width,height[,opts])
+*/
+static int rawstack_lua_make_rgb_thumb(lua_State *L) {
+	raw_stack_t *stack = (raw_stack_t *)luaL_checkudata(L, 1, RAWSTACK_META);
+	preview_job_t job;
+	memset(&job,0,sizeof(job));
+	job.width = luaL_checknumber(L,2);
+	job.height = luaL_checknumber(L,3);
+	job.stack = stack;
+	memcpy(job.cfa_pattern,stack->cfa_pattern,4);
+	job.opts.black = stack->black_level;
+	job.opts.white = (1<<stack->bpp) - 1;
+	job.opts.wb[0] = job.opts.wb[1] = job.opts.wb[2] = 1;
+	job.opts.gamma = 2.2;
+	preview_get_opts(L,4,&job.opts);
+	return preview_make(L,&job,stack->active_top,stack->active_left,stack->active_bottom,stack->active_right);
+}
+
+/*
+full resolution demosaic to 16 bit RGB
+output is produced in bands of rows, so large images can be written without holding the whole result
+each worker chunk is a tile of rows, unpacked with DEMOSAIC_MARGIN extra rows and columns on each side
+so tiles don't depend on each other. Region edges are mirrored in steps of 2 to keep CFA colors
+*/
+#define DEMOSAIC_MARGIN 3
+
+#define DEMOSAIC_BILINEAR 0
+#define DEMOSAIC_EDGE 1
+
+// where neighbors of a color are, relative to a CFA position
+#define DEMOSAIC_NB_SELF 0
+#define DEMOSAIC_NB_HORIZ 1
+#define DEMOSAIC_NB_VERT 2
+#define DEMOSAIC_NB_DIAG 3
+
+static const char *demosaic_method_strings[] = {
+	"bilinear",
+	"edge",
+	NULL,
+};
+
+typedef struct {
+	raw_image_t *img;
+	int method;
+	unsigned top; // region
+	unsigned left;
+	unsigned bottom;
+	unsigned right;
+	unsigned y0; // first output row of the band, absolute
+	unsigned x0; // first source column read, aligned to format block
+	unsigned x1; // end of source columns read
+	int sw; // scratch row length, region width + 2*DEMOSAIC_MARGIN
+	uint16_t **rowbufs; // per chunk source row buffer
+	float **raw; // per chunk black subtracted source, with margins
+	float **green; // per chunk interpolated green, same layout as raw
+	uint8_t nb[4][3]; // per CFA position and color, DEMOSAIC_NB_*
+	int nb_offs[4][4]; // scratch offsets of neighbors for DEMOSAIC_NB_*
+	unsigned nb_count[4];
+	float black;
+	float scale[3];
+	uint16_t *lut; // gamma curve, NULL for linear
+	int big_endian;
+	int planar; // band of red rows, then green, then blue
+	uint16_t sign; // xor'd with output values, 0x8000 for signed
+	unsigned rows; // rows in the band
+	uint8_t *out;
+} demosaic_job_t;
+
+static int demosaic_mirror(int v, int lo, int hi) {
+	if(v < lo) {
+		return 2*lo - v;
+	}
+	if(v >= hi) {
+		return 2*(hi - 1) - v;
+	}
+	return v;
+}
+
+/*
+set up neighbor tables, returns 0 if the pattern is not bayer
+*/
+static int demosaic_init_cfa(demosaic_job_t *job) {
+	const uint8_t *cfa = job->img->cfa_pattern;
+	int sw = job->sw;
+	unsigned p,c;
+	if(cfa[0] == CFA_GREEN) {
+		if(cfa[3] != CFA_GREEN || cfa[1] == CFA_GREEN || cfa[2] == CFA_GREEN || cfa[1] == cfa[2]) {
+			return 0;
+		}
+	} else if(cfa[1] != CFA_GREEN || cfa[2] != CFA_GREEN || cfa[0] == cfa[3]
+			|| cfa[0] > CFA_BLUE || cfa[3] > CFA_BLUE) {
+		return 0;
+	}
+	for(p=0;p<4;p++) {
+		for(c=0;c<3;c++) {
+			if(cfa[p] == c) {
+				job->nb[p][c] = DEMOSAIC_NB_SELF;
+			} else if(cfa[p^1] == c) {
+				job->nb[p][c] = DEMOSAIC_NB_HORIZ;
+			} else if(cfa[p^2] == c) {
+				job->nb[p][c] = DEMOSAIC_NB_VERT;
+			} else {
+				job->nb[p][c] = DEMOSAIC_NB_DIAG;
+			}
+		}
+	}
+	job->nb_count[DEMOSAIC_NB_HORIZ] = 2;
+	job->nb_offs[DEMOSAIC_NB_HORIZ][0] = -1;
+	job->nb_offs[DEMOSAIC_NB_HORIZ][1] = 1;
+	job->nb_count[DEMOSAIC_NB_VERT] = 2;
+	job->nb_offs[DEMOSAIC_NB_VERT][0] = -sw;
+	job->nb_offs[DEMOSAIC_NB_VERT][1] = sw;
+	job->nb_count[DEMOSAIC_NB_DIAG] = 4;
+	job->nb_offs[DEMOSAIC_NB_DIAG][0] = -sw - 1;
+	job->nb_offs[DEMOSAIC_NB_DIAG][1] = -sw + 1;
+	job->nb_offs[DEMOSAIC_NB_DIAG][2] = sw - 1;
+	job->nb_offs[DEMOSAIC_NB_DIAG][3] = sw + 1;
+	return 1;
+}
+
+/*
+green at a non-green pixel
+edge: interpolate along the direction with the smaller gradient, with a laplacian correction from
+the pixel's own color (Hamilton-Adams)
+*/
+static float demosaic_green(const float *r, int sw, int method) {
+	float gh = (r[-1] + r[1])*0.5f;
+	float gv = (r[-sw] + r[sw])*0.5f;
+	if(method == DEMOSAIC_BILINEAR) {
+		return (gh + gv)*0.5f;
+	}
+	float lh = 2*r[0] - r[-2] - r[2];
+	float lv = 2*r[0] - r[-2*sw] - r[2*sw];
+	float dh = fabsf(r[-1] - r[1]) + fabsf(lh);
+	float dv = fabsf(r[-sw] - r[sw]) + fabsf(lv);
+	gh += lh*0.25f;
+	gv += lv*0.25f;
+	if(dh < dv) {
+		return gh;
+	}
+	if(dv < dh) {
+		return gv;
+	}
+	return (gh + gv)*0.5f;
+}
+
+static void demosaic_rows(void *arg, unsigned chunk, unsigned start, unsigned end) {
+	demosaic_job_t *job = (demosaic_job_t *)arg;
+	raw_image_t *img = job->img;
+	const int m = DEMOSAIC_MARGIN;
+	int w = job->right - job->left;
+	int sw = job->sw;
+	int ys = (int)start - m; // absolute row of the first scratch row
+	uint16_t *row = job->rowbufs[chunk];
+	float *raw = job->raw[chunk];
+	float *green = job->green[chunk];
+	int x,y;
+	// unpack source rows with mirrored margins
+	for(y=ys;y<(int)end + m;y++) {
+		unsigned sy = demosaic_mirror(y,job->top,job->bottom);
+		img->fmt->get_row(img->data,img->row_bytes,sy,job->x0,job->x1 - job->x0,row);
+		const uint16_t *src = row + job->left - job->x0;
+		float *r = raw + (y - ys)*sw + m;
+		for(x=0;x<w;x++) {
+			r[x] = (float)src[x] - job->black;
+		}
+		for(x=1;x<=m;x++) {
+			r[-x] = r[x];
+			r[w - 1 + x] = r[w - 1 - x];
+		}
+	}
+	// green plane, including one row and column outside the tile for the red and blue pass
+	for(y=(int)start - 1;y<(int)end + 1;y++) {
+		const float *r = raw + (y - ys)*sw + m;
+		float *g = green + (y - ys)*sw + m;
+		for(x=-1;x<w + 1;x++) {
+			if(img->cfa_pattern[((job->left + x)&1) + (y&1)*2] == CFA_GREEN) {
+				g[x] = r[x];
+			} else {
+				g[x] = demosaic_green(r + x,sw,job->method);
+			}
+		}
+	}
+	// red and blue, from neighbor averages for bilinear or color differences for edge
+	for(y=start;y<(int)end;y++) {
+		const float *r = raw + (y - ys)*sw + m;
+		const float *g = green + (y - ys)*sw + m;
+		uint8_t *o[3];
+		unsigned step;
+		unsigned c;
+		if(job->planar) {
+			for(c=0;c<3;c++) {
+				o[c] = job->out + ((size_t)c*job->rows + y - job->y0)*w*2;
+			}
+			step = 2;
+		} else {
+			for(c=0;c<3;c++) {
+				o[c] = job->out + (size_t)(y - job->y0)*w*6 + c*2;
+			}
+			step = 6;
+		}
+		for(x=0;x<w;x++) {
+			unsigned p = ((job->left + x)&1) + (y&1)*2;
+			float v[3];
+			for(c=0;c<3;c++) {
+				unsigned nb = job->nb[p][c];
+				if(c == CFA_GREEN) {
+					v[c] = g[x];
+				} else if(nb == DEMOSAIC_NB_SELF) {
+					v[c] = r[x];
+				} else {
+					const int *offs = job->nb_offs[nb];
+					unsigned n = job->nb_count[nb];
+					unsigned i;
+					float s = 0;
+					if(job->method == DEMOSAIC_BILINEAR) {
+						for(i=0;i<n;i++) {
+							s += r[x + offs[i]];
+						}
+						v[c] = s/n;
+					} else {
+						for(i=0;i<n;i++) {
+							s += r[x + offs[i]] - g[x + offs[i]];
+						}
+						v[c] = g[x] + s/n;
+					}
+				}
+			}
+			for(c=0;c<3;c++) {
+				float f = v[c]*job->scale[c];
+				unsigned u = (f <= 0)?0:((f >= 65535)?65535:(unsigned)(f + 0.5f));
+				if(job->lut) {
+					u = job->lut[u];
+				}
+				u ^= job->sign;
+				if(job->big_endian) {
+					o[c][0] = u >> 8;
+					o[c][1] = u & 0xFF;
+				} else {
+					o[c][0] = u & 0xFF;
+					o[c][1] = u >> 8;
+				}
+				o[c] += step;
+			}
+		}
+	}
+}
+
+static void demosaic_free(demosaic_job_t *job, unsigned chunks) {
+	unsigned i;
+	for(i=0;i<chunks;i++) {
+		if(job->rowbufs) {
+			free(job->rowbufs[i]);
+		}
+		if(job->raw) {
+			free(job->raw[i]);
+		}
+		if(job->green) {
+			free(job->green[i]);
+		}
+	}
+	free(job->rowbufs);
+	free(job->raw);
+	free(job->green);
+	free(job->lut);
+}
+
+/*
+demosaic a band of rows to 16 bit RGB
+lb,width,rows=img:demosaic([opts])
+opts {
+	method:string -- 'bilinear' or 'edge', default edge
+	region:string -- 'active' or 'all', default active
+	top:number -- first row of the band, relative to the region. default 0
+	rows:number -- rows in the band, default to the bottom of the region
+	black, white, wb, gamma -- as for make_rgb_thumb, except gamma defaults to 1 (linear). auto is not supported
+	endian:string -- output byte order, default big
+	planar:bool -- output the band as rows of red, then green, then blue instead of packed RGB
+	signed:bool -- subtract 32768 from output values, as FITS BITPIX 16 with BZERO 32768
+	lbuf:lbuf -- lbuf to store the result in, must be at least width*rows*6 bytes. default new
+}
+rows near the band edges use source rows outside the band, so the output does not depend on band size
+lb: packed RGB or planes, width*rows*6 bytes are set
+*/
+static int rawimg_lua_demosaic(lua_State *L) {
+	raw_image_t* img = (raw_image_t *)luaL_checkudata(L, 1, RAWIMG_META);
+	demosaic_job_t job;
+	preview_opts_t opts;
+	memset(&job,0,sizeof(job));
+	job.img = img;
+	opts.black = img->black_level;
+	opts.white = (1<<img->fmt->bpp) - 1;
+	opts.wb[0] = opts.wb[1] = opts.wb[2] = 1;
+	opts.gamma = 1;
+	opts.auto_pct = 0;
+	preview_get_opts(L,2,&opts);
+	job.method = DEMOSAIC_EDGE;
+	int region = 0;
+	unsigned top = 0;
+	unsigned rows = 0;
+	lBuf_t *lb = NULL;
+	if(lua_istable(L,2)) {
+		job.method = lu_table_checkoption(L,2,"method","edge",demosaic_method_strings);
+		region = lu_table_checkoption(L,2,"region","active",region_strings);
+		top = lu_table_optnumber(L,2,"top",0);
+		rows = lu_table_optnumber(L,2,"rows",0);
+		job.big_endian = lu_table_checkoption(L,2,"endian","big",endian_strings);
+		job.planar = lu_table_optboolean(L,2,"planar",0);
+		job.sign = lu_table_optboolean(L,2,"signed",0)?0x8000:0;
+		lb = lu_table_optudata(L,2,"lbuf",LBUF_META,NULL);
+	} else {
+		job.big_endian = 1;
+	}
+	rawimg_get_region(img,region,&job.top,&job.left,&job.bottom,&job.right);
+	unsigned w = job.right - job.left;
+	unsigned h = job.bottom - job.top;
+	if(w < DEMOSAIC_MARGIN + 1 || h < DEMOSAIC_MARGIN + 1) {
+		return luaL_error(L,"region too small");
+	}
+	if(top >= h) {
+		return luaL_error(L,"top outside region");
+	}
+	if(!rows || rows > h - top) {
+		rows = h - top;
+	}
+	size_t size = (size_t)w*rows*6;
+	job.sw = w + 2*DEMOSAIC_MARGIN;
+	if(!demosaic_init_cfa(&job)) {
+		return luaL_error(L,"unsupported cfa pattern");
+	}
+	if(opts.white <= opts.black) {
+		opts.white = opts.black + 1;
+	}
+	job.black = opts.black;
+	unsigned i;
+	for(i=0;i<3;i++) {
+		job.scale[i] = opts.wb[i]*65535.0f/(opts.white - opts.black);
+	}
+
+	if(lb) {
+		if(lb->len < size) {
+			return luaL_error(L,"lbuf too small");
+		}
+		lua_getfield(L,2,"lbuf");
+	} else {
+		char *data = malloc(size);
+		if(!data) {
+			return luaL_error(L,"malloc failed");
+		}
+		if(!lbuf_create(L, data, size, LBUF_FL_FREE)) {
+			return luaL_error(L,"failed to create lbuf");
+		}
+		lb = luaL_checkudata(L,-1,LBUF_META);
+	}
+	job.out = (uint8_t *)lb->bytes;
+
+	unsigned bp = img->fmt->block_pixels;
+	job.x0 = job.left - job.left%bp;
+	job.x1 = (job.right + bp - 1) - (job.right + bp - 1)%bp;
+
+	// the last chunk is the largest
+	unsigned chunks = workpool_chunk_count(rows);
+	unsigned chunk_rows = rows - (chunks - 1)*(rows/chunks);
+	size_t plane_size = (size_t)(chunk_rows + 2*DEMOSAIC_MARGIN)*job.sw*sizeof(float);
+	job.rowbufs = calloc(chunks,sizeof(uint16_t *));
+	job.raw = calloc(chunks,sizeof(float *));
+	job.green = calloc(chunks,sizeof(float *));
+	if(!job.rowbufs || !job.raw || !job.green) {
+		demosaic_free(&job,0);
+		return luaL_error(L,"malloc failed");
+	}
+	for(i=0;i<chunks;i++) {
+		job.rowbufs[i] = malloc((job.x1 - job.x0)*sizeof(uint16_t));
+		job.raw[i] = malloc(plane_size);
+		job.green[i] = malloc(plane_size);
+		if(!job.rowbufs[i] || !job.raw[i] || !job.green[i]) {
+			demosaic_free(&job,chunks);
+			return luaL_error(L,"malloc failed");
+		}
+	}
+	if(opts.gamma > 0 && opts.gamma != 1) {
+		job.lut = malloc(65536*sizeof(uint16_t));
+		if(!job.lut) {
+			demosaic_free(&job,chunks);
+			return luaL_error(L,"malloc failed");
+		}
+		double inv_gamma = 1.0/opts.gamma;
+		for(i=0;i<65536;i++) {
+			job.lut[i] = 65535.0*pow(i/65535.0,inv_gamma) + 0.5;
+		}
+	}
+	job.y0 = job.top + top;
+	job.rows = rows;
+	workpool_run_rows(demosaic_rows,&job,job.y0,job.y0 + rows);
+	demosaic_free(&job,chunks);
+	lua_pushnumber(L,w);
+	lua_pushnumber(L,rows);
+	return 3;
+}
+
+static const char *stars_plane_strings[] = {
+	"bin",
+	"green",
+	NULL,
+};
+
+/*
+stars=img:find_stars([opts])
+opts {
+	plane:string -- 'bin' mean of each CFA quad or 'green' mean of greens. default bin
+	region:string -- 'active' or 'all', default active
+	sigma:number -- detection threshold, in noise standard deviations of the 3x3 mean. default 5
+	grid:number -- background cell size in raw pixels, default 64
+	min_pix:number -- minimum detected plane pixels in a star, default 3
+	max_pix:number -- maximum detected plane pixels in a star, default 4096
+	max_stars:number -- keep only the brightest N, default 1000. 0 = no limit
+	max_radius:number -- measurement aperture limit in raw pixels, default 32
+	black:number -- default black level
+	sat:number -- raw value considered saturated, default max value for bpp
+}
+stars: starlist, sorted by flux, brightest first
+*/
+static int rawimg_lua_find_stars(lua_State *L) {
+	raw_image_t* img = (raw_image_t *)luaL_checkudata(L, 1, RAWIMG_META);
+	stars_opts_t opts;
+	int region = 0;
+	opts.plane = STARS_PLANE_BIN;
+	opts.sigma = 5;
+	opts.grid = 64;
+	opts.min_pix = 3;
+	opts.max_pix = 4096;
+	opts.max_stars = 1000;
+	opts.max_radius = 32;
+	opts.black = img->black_level;
+	opts.sat_level = (1<<img->fmt->bpp) - 1;
+	if(lua_istable(L,2)) {
+		opts.plane = lu_table_checkoption(L,2,"plane","bin",stars_plane_strings);
+		region = lu_table_checkoption(L,2,"region","active",region_strings);
+		opts.sigma = lu_table_optnumber(L,2,"sigma",opts.sigma);
+		opts.grid = lu_table_optnumber(L,2,"grid",opts.grid);
+		opts.min_pix = lu_table_optnumber(L,2,"min_pix",opts.min_pix);
+		opts.max_pix = lu_table_optnumber(L,2,"max_pix",opts.max_pix);
+		opts.max_stars = lu_table_optnumber(L,2,"max_stars",opts.max_stars);
+		opts.max_radius = lu_table_optnumber(L,2,"max_radius",opts.max_radius);
+		opts.black = lu_table_optnumber(L,2,"black",opts.black);
+		opts.sat_level = lu_table_optnumber(L,2,"sat",opts.sat_level);
+	}
+	rawimg_get_region(img,region,&opts.top,&opts.left,&opts.bottom,&opts.right);
+
+	star_list_t *list = (star_list_t *)lua_newuserdata(L,sizeof(star_list_t));
+	memset(list,0,sizeof(star_list_t));
+	luaL_getmetatable(L, STARLIST_META);
+	lua_setmetatable(L, -2);
+	const char *err = stars_find(img,&opts,list);
+	if(err) {
+		return luaL_error(L,"%s",err);
+	}
+	return 1;
+}
+
+static int starlist_gc(lua_State *L) {
+	star_list_t *list = (star_list_t *)luaL_checkudata(L,1,STARLIST_META);
+	free(list->stars);
+	list->stars = NULL;
+	list->count = 0;
+	return 0;
+}
+
+/*
+n=stars:count()
+*/
+static int starlist_lua_count(lua_State *L) {
+	star_list_t *list = (star_list_t *)luaL_checkudata(L,1,STARLIST_META);
+	lua_pushnumber(L,list->count);
+	return 1;
+}
 
-	// active area
-	lua_getfield(L, 1, "active_area");
-	if(lua_istable(L,-1)) {
-		// if table present, all required
-		img->active_top = lu_table_checknumber(L,-1,"top");
-		img->active_left = lu_table_checknumber(L,-1,"left");
-		img->active_bottom = lu_table_checknumber(L,-1,"bottom");
-		img->active_right = lu_table_checknumber(L,-1,"right");
-		if(img->active_top >= img->active_bottom) {
-			return luaL_error(L,"active top >= bottom");
+/*
+star=stars:get(i)
+i is 0 based
+star {
+	x, y -- centroid in raw image coordinates
+	flux -- background subtracted sum in the aperture
+	peak -- maximum background subtracted value
+	hfr -- half flux radius (flux weighted mean radius) in raw pixels
+	fwhm -- full width half maximum in raw pixels, from second moments
+	ecc -- eccentricity, 0 for round
+	npix -- detected pixels, at half resolution
+	saturated -- true if any pixel in the detected area reached sat
+}
+*/
+static int starlist_lua_get(lua_State *L) {
+	star_list_t *list = (star_list_t *)luaL_checkudata(L,1,STARLIST_META);
+	unsigned i = luaL_checknumber(L,2);
+	if(i >= list->count) {
+		return 0;
+	}
+	star_t *s = &list->stars[i];
+	lua_createtable(L,0,9);
+	lua_pushnumber(L,s->x);
+	lua_setfield(L,-2,"x");
+	lua_pushnumber(L,s->y);
+	lua_setfield(L,-2,"y");
+	lua_pushnumber(L,s->flux);
+	lua_setfield(L,-2,"flux");
+	lua_pushnumber(L,s->peak);
+	lua_setfield(L,-2,"peak");
+	lua_pushnumber(L,s->hfr);
+	lua_setfield(L,-2,"hfr");
+	lua_pushnumber(L,s->fwhm);
+	lua_setfield(L,-2,"fwhm");
+	lua_pushnumber(L,s->ecc);
+	lua_setfield(L,-2,"ecc");
+	lua_pushnumber(L,s->npix);
+	lua_setfield(L,-2,"npix");
+	lua_pushboolean(L,s->flags & STAR_FL_SATURATED);
+	lua_setfield(L,-2,"saturated");
+	return 1;
+}
+
+/*
+t=stars:stats()
+t {
+	count -- stars in the list
+	detected -- components found before size limits and max_stars
+	background -- median background, raw units above black
+	noise -- median background noise
+	hfr, fwhm, ecc -- medians of unsaturated stars, 0 if none
+}
+*/
+static int starlist_lua_stats(lua_State *L) {
+	star_list_t *list = (star_list_t *)luaL_checkudata(L,1,STARLIST_META);
+	lua_createtable(L,0,7);
+	lua_pushnumber(L,list->count);
+	lua_setfield(L,-2,"count");
+	lua_pushnumber(L,list->detected);
+	lua_setfield(L,-2,"detected");
+	lua_pushnumber(L,list->background);
+	lua_setfield(L,-2,"background");
+	lua_pushnumber(L,list->noise);
+	lua_setfield(L,-2,"noise");
+	lua_pushnumber(L,list->hfr);
+	lua_setfield(L,-2,"hfr");
+	lua_pushnumber(L,list->fwhm);
+	lua_setfield(L,-2,"fwhm");
+	lua_pushnumber(L,list->ecc);
+	lua_setfield(L,-2,"ecc");
+	return 1;
+}
+
+static const char *match_model_strings[] = {
+	"similarity",
+	"affine",
+	NULL,
+};
+
+typedef struct {
+	double xx, xy, tx;
+	double yx, yy, ty;
+} xform_t;
+
+/*
+xform=rawimg.match_stars(ref_stars,stars[,opts])
+find the transform from the coordinates of stars to ref_stars
+opts {
+	model:string -- 'similarity' (shift, rotation and scale) or 'affine', default similarity
+	n:number -- number of brightest stars used to form triangles, default 30, max 64
+	tol:number -- match tolerance in raw pixels, default 3
+	tri_tol:number -- triangle shape tolerance, default 0.01
+	min_side:number -- ignore triangles with sides shorter than this, default 20
+	iterations:number -- RANSAC iterations, default 1000
+	min_matches:number -- default 6
+}
+xform {
+	xx, xy, tx, yx, yy, ty -- xr = xx*x + xy*y + tx, yr = yx*x + yy*y + ty
+	matches -- number of stars used in the final fit
+	rms -- rms residual of matched stars, in raw pixels
+	scale -- mean scale
+	rotation -- rotation in degrees
+}
+returns false,message if no transform is found
+*/
+static int rawimg_lua_match_stars(lua_State *L) {
+	star_list_t *rl = (star_list_t *)luaL_checkudata(L,1,STARLIST_META);
+	star_list_t *fl = (star_list_t *)luaL_checkudata(L,2,STARLIST_META);
+	register_opts_t opts;
+	register_result_t r;
+	opts.model = REGISTER_SIMILARITY;
+	opts.n = 30;
+	opts.tol = 3;
+	opts.tri_tol = 0.01;
+	opts.min_side = 20;
+	opts.iterations = 1000;
+	opts.min_matches = 6;
+	if(lua_istable(L,3)) {
+		opts.model = lu_table_checkoption(L,3,"model","similarity",match_model_strings);
+		opts.n = lu_table_optnumber(L,3,"n",opts.n);
+		opts.tol = lu_table_optnumber(L,3,"tol",opts.tol);
+		opts.tri_tol = lu_table_optnumber(L,3,"tri_tol",opts.tri_tol);
+		opts.min_side = lu_table_optnumber(L,3,"min_side",opts.min_side);
+		opts.iterations = lu_table_optnumber(L,3,"iterations",opts.iterations);
+		opts.min_matches = lu_table_optnumber(L,3,"min_matches",opts.min_matches);
+	}
+	if(!register_match_stars(rl,fl,&opts,&r)) {
+		return luaL_error(L,"malloc failed");
+	}
+	if(r.err[0]) {
+		lua_pushboolean(L,0);
+		lua_pushstring(L,r.err);
+		return 2;
+	}
+	lua_createtable(L,0,10);
+	lua_pushnumber(L,r.xf.xx);
+	lua_setfield(L,-2,"xx");
+	lua_pushnumber(L,r.xf.xy);
+	lua_setfield(L,-2,"xy");
+	lua_pushnumber(L,r.xf.tx);
+	lua_setfield(L,-2,"tx");
+	lua_pushnumber(L,r.xf.yx);
+	lua_setfield(L,-2,"yx");
+	lua_pushnumber(L,r.xf.yy);
+	lua_setfield(L,-2,"yy");
+	lua_pushnumber(L,r.xf.ty);
+	lua_setfield(L,-2,"ty");
+	lua_pushnumber(L,r.matches);
+	lua_setfield(L,-2,"matches");
+	lua_pushnumber(L,r.rms);
+	lua_setfield(L,-2,"rms");
+	lua_pushnumber(L,sqrt(fabs(r.xf.xx*r.xf.yy - r.xf.xy*r.xf.yx)));
+	lua_setfield(L,-2,"scale");
+	lua_pushnumber(L,atan2(r.xf.yx - r.xf.xy,r.xf.xx + r.xf.yy)*180/3.14159265358979323846);
+	lua_setfield(L,-2,"rotation");
+	return 1;
+}
+
+static void xform_get(lua_State *L, int index, register_xform_t *t) {
+	if(!lua_istable(L,index)) {
+		luaL_error(L,"expected transform table");
+	}
+	t->xx = lu_table_checknumber(L,index,"xx");
+	t->xy = lu_table_checknumber(L,index,"xy");
+	t->tx = lu_table_checknumber(L,index,"tx");
+	t->yx = lu_table_checknumber(L,index,"yx");
+	t->yy = lu_table_checknumber(L,index,"yy");
+	t->ty = lu_table_checknumber(L,index,"ty");
+}
+
+/*
+resample the image into the reference grid of a transform from rawimg.match_stars
+img,lb=img:warp(xform[,opts])
+opts {
+	dst:rawimg -- image to write to, must have the same size and cfa pattern. default new image in the same format
+	lbuf:lbuf -- if dst is not given, lbuf to store the new image data in, must be the same size as the original
+	fill:number -- value for pixels that map outside the source, default 0
+}
+each output pixel is interpolated from source pixels of the same CFA color
+returns the destination image, and its lbuf if a new image was created
+*/
+static int rawimg_lua_warp(lua_State *L) {
+	raw_image_t* img = (raw_image_t *)luaL_checkudata(L, 1, RAWIMG_META);
+	register_xform_t t,inv;
+	unsigned fill = 0;
+	xform_get(L,2,&t);
+	if(!register_invert(&t,&inv)) {
+		return luaL_error(L,"transform not invertible");
+	}
+	raw_image_t *dst = NULL;
+	int nret = 1;
+	if(lua_istable(L,3)) {
+		fill = lu_table_optnumber(L,3,"fill",0);
+		dst = lu_table_optudata(L,3,"dst",RAWIMG_META,NULL);
+	}
+	if(dst) {
+		if(dst->width != img->width || dst->height != img->height
+			|| memcmp(dst->cfa_pattern,img->cfa_pattern,4) != 0) {
+			return luaL_error(L,"dst size or cfa mismatch");
 		}
-		if(img->active_left >= img->active_right) {
-			return luaL_error(L,"active left >= right");
+		if(dst->data == img->data) {
+			return luaL_error(L,"dst must not be the source");
 		}
-		if(img->active_left > img->width) {
-			return luaL_error(L,"active right > width");
+		lua_getfield(L,3,"dst");
+	} else {
+		unsigned size = img->row_bytes*img->height;
+		dst = (raw_image_t *)lua_newuserdata(L,sizeof(raw_image_t));
+		memcpy(dst,img,sizeof(raw_image_t));
+		luaL_getmetatable(L, RAWIMG_META);
+		lua_setmetatable(L, -2);
+		lBuf_t *lb = NULL;
+		if(lua_istable(L,3)) {
+			lb = lu_table_optudata(L,3,"lbuf",LBUF_META,NULL);
 		}
-		if(img->active_bottom > img->height) {
-			return luaL_error(L,"active bottom > height");
+		if(lb) {
+			if(lb->len != size) {
+				return luaL_error(L,"lbuf size mismatched");
+			}
+			lua_getfield(L,3,"lbuf");
+		} else {
+			char *data = malloc(size);
+			if(!data) {
+				return luaL_error(L,"malloc failed");
+			}
+			if(!lbuf_create(L, data, size, LBUF_FL_FREE)) {
+				return luaL_error(L,"failed to create lbuf");
+			}
+			lb = luaL_checkudata(L,-1,LBUF_META);
 		}
+		dst->data = (uint8_t *)lb->bytes;
+		rawimg_ref_lbuf(L,-2,-1);
+		nret = 2;
+	}
+	if(!register_warp(img,dst,&inv,fill)) {
+		return luaL_error(L,"malloc failed");
+	}
+	return nret;
+}
+
+static int rawstack_gc(lua_State *L) {
+	raw_stack_t *stack = (raw_stack_t *)luaL_checkudata(L, 1, RAWSTACK_META);
+	rawstack_free_data(stack);
+	return 0;
+}
+
+/*
+stack = rawimg.stack_new(stackspec)
+stackspec {
+-- required
+	width:number
+	height:number
+	bpp:number
+-- optional
+	black_level, cfa_pattern, active_area -- as for bind_lbuf
+	float:bool -- use floating point sums rather than 32 bit integers, default false
+	min:number -- pixels values outside min-max are not accumulated. default 0
+	max:number -- default max value for bpp
+}
+integer sums clamp dark subtracted values at 0, float does not
+*/
+static int rawimg_lua_stack_new(lua_State *L) {
+	if(!lua_istable(L,1)) {
+		return luaL_error(L,"expected table");
+	}
+	raw_image_t spec;
+	rawimg_get_spec_geometry(L,1,&spec);
+	unsigned bpp = lu_table_checknumber(L,1,"bpp");
+	if(bpp < 8 || bpp > 16) {
+		return luaL_error(L,"invalid bpp");
+	}
+	if(!spec.width || !spec.height) {
+		return luaL_error(L,"zero dimensions not allowed");
+	}
+	int is_float = lu_table_optboolean(L,1,"float",0);
+
+	raw_stack_t *stack = (raw_stack_t *)lua_newuserdata(L,sizeof(raw_stack_t));
+	if(!stack) {
+		return luaL_error(L,"failed to create userdata");
+	}
+	memset(stack,0,sizeof(raw_stack_t));
+	luaL_getmetatable(L, RAWSTACK_META);
+	lua_setmetatable(L, -2);
+
+	stack->width = spec.width;
+	stack->height = spec.height;
+	stack->bpp = bpp;
+	memcpy(stack->cfa_pattern,spec.cfa_pattern,4);
+	stack->active_top = spec.active_top;
+	stack->active_left = spec.active_left;
+	stack->active_bottom = spec.active_bottom;
+	stack->active_right = spec.active_right;
+	stack->black_level = spec.black_level;
+	stack->min_val = lu_table_optnumber(L,1,"min",0);
+	stack->max_val = lu_table_optnumber(L,1,"max",(1<<bpp)-1);
+
+	unsigned n = stack->width*stack->height;
+	if(is_float) {
+		stack->sum_f = calloc(n,sizeof(float));
 	} else {
-		img->active_top = img->active_left = 0;
-		img->active_right = img->width;
-		img->active_bottom = img->height;
+		stack->sum_u32 = calloc(n,sizeof(uint32_t));
 	}
-	lua_pop(L,1); // pop off active area or nil
-	
+	stack->count = calloc(n,sizeof(uint16_t));
+	if(!(stack->sum_f || stack->sum_u32) || !stack->count) {
+		rawstack_free_data(stack);
+		return luaL_error(L,"malloc failed");
+	}
+	return 1;
+}
+
+/*
+n=rawimg.set_threads(n)
+set the number of threads used by bulk operations like convert and stack add, including the calling thread
+n: 0 = number of CPUs (default), 1 = single threaded
+returns the number actually used, always 1 if built without thread support
+*/
+static int rawimg_lua_set_threads(lua_State *L) {
+	lua_pushnumber(L,workpool_set_threads(luaL_checknumber(L,1)));
+	return 1;
+}
+
+/*
+n=rawimg.get_threads()
+*/
+static int rawimg_lua_get_threads(lua_State *L) {
+	lua_pushnumber(L,workpool_get_threads());
+	return 1;
+}
+
+/*
+buffered file writer for write_dng
+*/
+#define DNG_WRITE_BUF_SIZE (256*1024)
+typedef struct {
+	FILE *fh;
+	uint8_t *buf;
+	size_t used;
+	int err;
+} dng_writer_t;
+
+static void dng_writer_flush(dng_writer_t *w) {
+	if(w->used && !w->err && fwrite(w->buf,w->used,1,w->fh) != 1) {
+		w->err = 1;
+	}
+	w->used = 0;
+}
+
+static void dng_swap_pairs(uint8_t * restrict dst, const uint8_t * restrict src, size_t len) {
+	size_t i;
+	for(i=0;i<len;i+=2) {
+		uint16_t v;
+		memcpy(&v,src+i,2);
+		v = (uint16_t)((v >> 8) | (v << 8));
+		memcpy(dst+i,&v,2);
+	}
+}
+
+/*
+copy len bytes to the write buffer, swapping byte pairs if swap is set
+if src is NULL, fill with pad
+*/
+static void dng_writer_put(dng_writer_t *w, const uint8_t *src, size_t len, int swap, uint8_t pad) {
+	while(len && !w->err) {
+		size_t n = DNG_WRITE_BUF_SIZE - w->used;
+		if(n > len) {
+			n = len;
+		}
+		// swapped pairs are counted from the start of src, don't split one at the end of the buffer
+		if(src && swap && n < len) {
+			n &= ~1;
+		}
+		if(!n) {
+			dng_writer_flush(w);
+			continue;
+		}
+		uint8_t *p = w->buf + w->used;
+		if(!src) {
+			memset(p,pad,n);
+		} else if(swap) {
+			// odd final byte is left as is, as in lbuf:reverse_bytes
+			size_t pairs = n & ~1;
+			dng_swap_pairs(p,src,pairs);
+			if(n & 1) {
+				p[pairs] = src[pairs];
+			}
+			src += n;
+		} else {
+			memcpy(p,src,n);
+			src += n;
+		}
+		w->used += n;
+		len -= n;
+	}
+}
+
+static lBuf_t *dng_write_get_part(lua_State *L, int index, const char *name, int required) {
+	lua_getfield(L,index,name);
+	lBuf_t *buf = lbuf_getlbuf(L,-1);
+	if(!buf && (required || !lua_isnil(L,-1))) {
+		luaL_error(L,"%s must be an lbuf",name);
+	}
+	lua_pop(L,1); // lbuf is referenced by the parts table
+	return buf;
+}
+
+/*
+write a DNG file in one pass, from the header and the raw data in CHDK byte order
+rawimg.write_dng(file,parts)
+file: file handle open for binary writing
+parts {
+	header=lbuf -- DNG header
+	thumb=lbuf -- optional, thumbnail data following the header
+	data=lbuf -- raw data in little endian (CHDK) order, swapped to big endian as it is written
+	data_offset=number -- bytes of padding before data, for sub-images. default 0
+	data_size=number -- total size of the raw strip including padding. default data_offset + data length
+	pad=number -- padding byte value, default 0xff
+	swap=bool -- swap byte pairs of data, default true. false for data already in file order, like LJ92 tiles
+	trailer=lbuf -- optional, data following the raw strip
+}
+data is not modified, and no full size copy is made
+*/
+static int rawimg_lua_write_dng(lua_State *L) {
+	FILE **pf = ((FILE **)luaL_checkudata(L, 1, LUA_FILEHANDLE));
+	if(!*pf) {
+		return luaL_error(L,"attempt to access closed file");
+	}
+	luaL_checktype(L,2,LUA_TTABLE);
+	lBuf_t *header = dng_write_get_part(L,2,"header",1);
+	lBuf_t *thumb = dng_write_get_part(L,2,"thumb",0);
+	lBuf_t *data = dng_write_get_part(L,2,"data",1);
+	lBuf_t *trailer = dng_write_get_part(L,2,"trailer",0);
+	size_t data_offset = lu_table_optnumber(L,2,"data_offset",0);
+	size_t data_size = lu_table_optnumber(L,2,"data_size",data_offset + data->len);
+	uint8_t pad = lu_table_optnumber(L,2,"pad",0xff);
+	int swap = lu_table_optboolean(L,2,"swap",1);
+	if(data_offset + data->len > data_size) {
+		return luaL_error(L,"data larger than data_size");
+	}
+
+	dng_writer_t w;
+	w.fh = *pf;
+	w.used = 0;
+	w.err = 0;
+	w.buf = malloc(DNG_WRITE_BUF_SIZE);
+	if(!w.buf) {
+		return luaL_error(L,"malloc failed");
+	}
+	dng_writer_put(&w,(uint8_t *)header->bytes,header->len,0,0);
+	if(thumb) {
+		dng_writer_put(&w,(uint8_t *)thumb->bytes,thumb->len,0,0);
+	}
+	dng_writer_put(&w,NULL,data_offset,0,pad);
+	dng_writer_put(&w,(uint8_t *)data->bytes,data->len,swap,0);
+	dng_writer_put(&w,NULL,data_size - data_offset - data->len,0,pad);
+	if(trailer) {
+		dng_writer_put(&w,(uint8_t *)trailer->bytes,trailer->len,0,0);
+	}
+	dng_writer_flush(&w);
+	free(w.buf);
+	if(w.err) {
+		return luaL_error(L,"write failed");
+	}
+	return 0;
+}
+
+#define FITS_BLOCK_SIZE 2880
+/*
+write raw pixels as FITS data, padded to a multiple of the FITS block size
+size=img:write_fits(file[,opts])
+file: file handle open for binary writing, positioned after the FITS header
+opts {
+	region=string -- 'active' or 'all', default active
+	bitpix=number -- 16 or 32, default 16
+	black=number -- subtracted from each pixel, default 0. with bitpix 16, results below 0 are 0
+}
+bitpix 16 values are stored with 32768 subtracted, for BZERO 32768. bitpix 32 values are signed
+returns the size of the data, without padding
+*/
+static int rawimg_lua_write_fits(lua_State *L) {
+	raw_image_t *img = (raw_image_t *)luaL_checkudata(L, 1, RAWIMG_META);
+	FILE **pf = ((FILE **)luaL_checkudata(L, 2, LUA_FILEHANDLE));
+	if(!*pf) {
+		return luaL_error(L,"attempt to access closed file");
+	}
+	int region = 0;
+	unsigned bitpix = 16;
+	int black = 0;
+	if(lua_istable(L,3)) {
+		region = lu_table_checkoption(L,3,"region","active",region_strings);
+		bitpix = lu_table_optnumber(L,3,"bitpix",16);
+		black = lu_table_optnumber(L,3,"black",0);
+	}
+	if(bitpix != 16 && bitpix != 32) {
+		return luaL_error(L,"invalid bitpix %d",bitpix);
+	}
+	unsigned top,left,bottom,right;
+	rawimg_get_region(img,region,&top,&left,&bottom,&right);
+	if(right <= left || bottom <= top) {
+		return luaL_error(L,"empty region");
+	}
+	unsigned w = right - left;
+	unsigned bp = img->fmt->block_pixels;
+	unsigned x0 = left - left%bp;
+	unsigned x1 = (right + bp - 1) - (right + bp - 1)%bp;
+	unsigned bytes = bitpix/8;
+
+	dng_writer_t wr;
+	wr.fh = *pf;
+	wr.used = 0;
+	wr.err = 0;
+	wr.buf = malloc(DNG_WRITE_BUF_SIZE);
+	uint16_t *row = malloc((x1 - x0)*sizeof(uint16_t));
+	uint8_t *out = malloc(w*bytes);
+	if(!wr.buf || !row || !out) {
+		free(wr.buf);
+		free(row);
+		free(out);
+		return luaL_error(L,"malloc failed");
+	}
+	unsigned x,y;
+	for(y=top;y<bottom && !wr.err;y++) {
+		img->fmt->get_row(img->data,img->row_bytes,y,x0,x1 - x0,row);
+		const uint16_t *src = row + left - x0;
+		uint8_t *o = out;
+		if(bitpix == 16) {
+			for(x=0;x<w;x++) {
+				int v = (int)src[x] - black;
+				uint16_t u = ((v < 0)?0:v) ^ 0x8000;
+				o[0] = u >> 8;
+				o[1] = u & 0xFF;
+				o += 2;
+			}
+		} else {
+			for(x=0;x<w;x++) {
+				uint32_t u = (uint32_t)((int32_t)src[x] - black);
+				o[0] = u >> 24;
+				o[1] = (u >> 16) & 0xFF;
+				o[2] = (u >> 8) & 0xFF;
+				o[3] = u & 0xFF;
+				o += 4;
+			}
+		}
+		dng_writer_put(&wr,out,w*bytes,0,0);
+	}
+	size_t size = (size_t)w*(bottom - top)*bytes;
+	dng_writer_put(&wr,NULL,(FITS_BLOCK_SIZE - size%FITS_BLOCK_SIZE)%FITS_BLOCK_SIZE,0,0);
+	dng_writer_flush(&wr);
+	free(wr.buf);
+	free(row);
+	free(out);
+	if(wr.err) {
+		return luaL_error(L,"write failed");
+	}
+	lua_pushnumber(L,size);
+	return 1;
+}
+
+typedef struct {
+	raw_image_t *img;
+	lj92_frame_t frame;
+	unsigned tile_width;
+	unsigned tile_height;
+	unsigned tiles_across;
+	unsigned predictor;
+	int y_offset;
+	unsigned height;
+	unsigned fill;
+	uint8_t **tiles;
+	size_t *sizes;
+} lj92_encode_job_t;
+
+static void rawimg_encode_lj92_tiles(void *arg, unsigned chunk, unsigned start, unsigned end) {
+	lj92_encode_job_t *job = (lj92_encode_job_t *)arg;
+	raw_image_t *img = job->img;
+	unsigned tw = job->tile_width;
+	unsigned th = job->tile_height;
+	uint16_t *samples = malloc(tw*th*sizeof(uint16_t));
+	uint16_t *diffs = malloc(tw*th*sizeof(uint16_t));
+	uint8_t *buf = malloc(lj92_max_size(job->frame.width,job->frame.height,job->frame.components));
+	unsigned t,r,x;
+	// failed tiles are left NULL
+	if(!samples || !diffs || !buf) {
+		goto done;
+	}
+	for(t=start;t<end;t++) {
+		unsigned x0 = (t % job->tiles_across)*tw;
+		unsigned y0 = (t / job->tiles_across)*th;
+		unsigned n = img->width - x0;
+		if(n > tw) {
+			n = tw;
+		}
+		for(r=0;r<th;r++) {
+			uint16_t *row = samples + r*tw;
+			unsigned y = y0 + r;
+			int sy = (int)y - job->y_offset;
+			// edge tiles are padded by repeating the nearest row or column of the same color
+			if(y >= job->height) {
+				memcpy(row,row - ((r >= 2)?2:1)*tw,tw*sizeof(uint16_t));
+				continue;
+			}
+			if(sy >= 0 && (unsigned)sy < img->height) {
+				img->fmt->get_row(img->data,img->row_bytes,sy,x0,n,row);
+			} else {
+				for(x=0;x<n;x++) {
+					row[x] = job->fill;
+				}
+			}
+			for(x=n;x<tw;x++) {
+				row[x] = row[(x >= 2)?x - 2:0];
+			}
+		}
+		size_t size = lj92_encode(samples,&job->frame,job->predictor,diffs,buf);
+		job->tiles[t] = malloc(size);
+		if(job->tiles[t]) {
+			memcpy(job->tiles[t],buf,size);
+			job->sizes[t] = size;
+		}
+	}
+done:
+	free(samples);
+	free(diffs);
+	free(buf);
+}
+
+/*
+compress the image as lossless JPEG tiles, for DNG Compression=7
+data,sizes=img:encode_lj92([opts])
+opts {
+	tile_width=number -- default 256, multiple of 16
+	tile_height=number -- default 256, multiple of 16
+	predictor=number -- 1-7, default 1
+	y_offset=number -- row of the full image the first row of img is, for sub-images. default 0
+	height=number -- full image height, default y_offset + image height
+	fill=number -- value of rows of the full image outside img, default the maximum value
+}
+returns an lbuf with the tiles in DNG order (left to right, top to bottom) and an array of tile sizes
+each tile is encoded as two interleaved components of half the tile width, so each component
+is a single CFA color within a row. tiles are encoded in parallel
+*/
+static int rawimg_lua_encode_lj92(lua_State *L) {
+	raw_image_t *img = (raw_image_t *)luaL_checkudata(L, 1, RAWIMG_META);
+	lj92_encode_job_t job;
+	job.img = img;
+	job.tile_width = job.tile_height = 256;
+	job.predictor = 1;
+	job.y_offset = 0;
+	job.fill = (1<<img->fmt->bpp) - 1;
+	if(lua_istable(L,2)) {
+		job.tile_width = lu_table_optnumber(L,2,"tile_width",job.tile_width);
+		job.tile_height = lu_table_optnumber(L,2,"tile_height",job.tile_height);
+		job.predictor = lu_table_optnumber(L,2,"predictor",job.predictor);
+		job.y_offset = lu_table_optnumber(L,2,"y_offset",job.y_offset);
+		job.fill = lu_table_optnumber(L,2,"fill",job.fill);
+	}
+	job.height = job.y_offset + img->height;
+	if(lua_istable(L,2)) {
+		job.height = lu_table_optnumber(L,2,"height",job.height);
+	}
+	if(!job.tile_width || job.tile_width % 16 || !job.tile_height || job.tile_height % 16) {
+		return luaL_error(L,"tile size must be a multiple of 16");
+	}
+	if(job.predictor < 1 || job.predictor > 7) {
+		return luaL_error(L,"invalid predictor");
+	}
+	if(job.tile_width/2 > 0xffff || job.tile_height > 0xffff || !job.height) {
+		return luaL_error(L,"invalid size");
+	}
+	job.frame.width = job.tile_width/2;
+	job.frame.height = job.tile_height;
+	job.frame.components = 2;
+	job.frame.precision = img->fmt->bpp;
+	job.tiles_across = (img->width + job.tile_width - 1)/job.tile_width;
+	unsigned count = job.tiles_across*((job.height + job.tile_height - 1)/job.tile_height);
+	// temporary arrays are userdata, so they are collected on error
+	job.tiles = (uint8_t **)lua_newuserdata(L,count*sizeof(uint8_t *));
+	job.sizes = (size_t *)lua_newuserdata(L,count*sizeof(size_t));
+	memset(job.tiles,0,count*sizeof(uint8_t *));
+
+	workpool_run_tasks(rawimg_encode_lj92_tiles,&job,count);
+
+	unsigned i;
+	size_t total = 0;
+	for(i=0;i<count;i++) {
+		if(!job.tiles[i]) {
+			break;
+		}
+		total += job.sizes[i];
+	}
+	char *data = (i == count)?malloc(total):NULL;
+	if(data) {
+		size_t off = 0;
+		for(i=0;i<count;i++) {
+			memcpy(data + off,job.tiles[i],job.sizes[i]);
+			off += job.sizes[i];
+		}
+	}
+	for(i=0;i<count;i++) {
+		free(job.tiles[i]);
+	}
+	if(!data) {
+		return luaL_error(L,"malloc failed");
+	}
+	if(!lbuf_create(L, data, total, LBUF_FL_FREE)) {
+		return luaL_error(L,"failed to create lbuf");
+	}
+	lua_createtable(L,count,0);
+	for(i=0;i<count;i++) {
+		lua_pushnumber(L,job.sizes[i]);
+		lua_rawseti(L,-2,i+1);
+	}
+	return 2;
+}
+
+typedef struct {
+	raw_image_t *img;
+	const uint8_t *data;
+	const size_t *offsets;
+	const size_t *sizes;
+	unsigned tile_width;
+	unsigned tile_height;
+	unsigned tiles_across;
+	const char **errors;
+} lj92_decode_job_t;
+
+static void rawimg_decode_lj92_tiles(void *arg, unsigned chunk, unsigned start, unsigned end) {
+	lj92_decode_job_t *job = (lj92_decode_job_t *)arg;
+	raw_image_t *img = job->img;
+	unsigned tw = job->tile_width;
+	unsigned max = (1<<img->fmt->bpp) - 1;
+	unsigned t,r,x;
+	for(t=start;t<end;t++) {
+		const uint8_t *src = job->data + job->offsets[t];
+		lj92_frame_t frame;
+		const char *err = lj92_read_frame(src,job->sizes[t],&frame);
+		if(err) {
+			job->errors[t] = err;
+			continue;
+		}
+		size_t count = (size_t)frame.width*frame.height*frame.components;
+		if(count < (size_t)tw*job->tile_height) {
+			job->errors[t] = "frame smaller than tile";
+			continue;
+		}
+		uint16_t *samples = malloc(count*sizeof(uint16_t));
+		if(!samples) {
+			job->errors[t] = "malloc failed";
+			continue;
+		}
+		err = lj92_decode(src,job->sizes[t],samples,count);
+		if(err) {
+			job->errors[t] = err;
+			free(samples);
+			continue;
+		}
+		// samples fill the tile row by row, whatever the frame shape
+		unsigned x0 = (t % job->tiles_across)*tw;
+		unsigned y0 = (t / job->tiles_across)*job->tile_height;
+		unsigned n = img->width - x0;
+		if(n > tw) {
+			n = tw;
+		}
+		for(r=0;r<job->tile_height && y0 + r < img->height;r++) {
+			const uint16_t *row = samples + r*tw;
+			for(x=0;x<n;x++) {
+				unsigned v = row[x];
+				img->fmt->set_pixel(img->data,img->row_bytes,x0 + x,y0 + r,(v > max)?max:v);
+			}
+		}
+		free(samples);
+	}
+}
+
+/*
+read an array of count sizes or offsets from field name of the table at index
+*/
+static size_t *rawimg_get_size_array(lua_State *L, int index, const char *name, unsigned count) {
+	lua_getfield(L,index,name);
+	if(!lua_istable(L,-1) || lua_objlen(L,-1) != count) {
+		luaL_error(L,"%s must be an array of %d numbers",name,count);
+	}
+	size_t *r = (size_t *)lua_newuserdata(L,count*sizeof(size_t));
+	unsigned i;
+	for(i=0;i<count;i++) {
+		lua_rawgeti(L,-2,i+1);
+		r[i] = luaL_checknumber(L,-1);
+		lua_pop(L,1);
+	}
+	lua_remove(L,-2); // array, leaving the userdata on the stack
+	return r;
+}
 
+/*
+decode lossless JPEG compressed tiles, as in DNG Compression=7, into a new image
+img,lb=rawimg.decode_lj92(imgspec,tiles)
+imgspec: as bind_lbuf, describing the decoded image. data is optional, a new lbuf is created if not given
+tiles {
+	data=lbuf -- compressed data, normally the whole file
+	offsets=array -- offset of each tile in data, in DNG order
+	sizes=array -- size of each tile
+	tile_width=number
+	tile_height=number
+}
+strips can be decoded as tiles of the image width. tiles are decoded in parallel
+decoded samples fill each tile row by row, so any frame shape with enough samples is accepted
+values above the maximum for bpp are clipped
+*/
+static int rawimg_lua_decode_lj92(lua_State *L) {
+	luaL_checktype(L,1,LUA_TTABLE);
+	luaL_checktype(L,2,LUA_TTABLE);
+	raw_image_t *img = (raw_image_t *)lua_newuserdata(L,sizeof(raw_image_t));
+	int img_index = lua_gettop(L);
+	unsigned bpp = lu_table_checknumber(L,1,"bpp");
+	unsigned endian = lu_table_checkoption(L,1,"endian",NULL,endian_strings);
+	rawimg_get_spec_geometry(L,1,img);
 	img->fmt = rawimg_find_format(bpp,endian);
 	if(!img->fmt) {
 		return luaL_error(L,"unknown format");
 	}
-	
 	if(img->width % img->fmt->block_pixels != 0) {
 		return luaL_error(L,"width not a multiple of block size");
 	}
 	img->row_bytes = (img->width*img->fmt->bpp)/8;
-	if(offset + img->row_bytes*img->height > buf->len) {
-		return luaL_error(L,"size larger than data");
+
+	lj92_decode_job_t job;
+	job.img = img;
+	lBuf_t *src = (lBuf_t *)lu_table_checkudata(L,2,"data",LBUF_META);
+	job.data = (uint8_t *)src->bytes;
+	job.tile_width = lu_table_checknumber(L,2,"tile_width");
+	job.tile_height = lu_table_checknumber(L,2,"tile_height");
+	if(!job.tile_width || !job.tile_height) {
+		return luaL_error(L,"invalid tile size");
 	}
-	img->data = (uint8_t *)buf->bytes + offset;
+	job.tiles_across = (img->width + job.tile_width - 1)/job.tile_width;
+	// tiles are written in parallel, so must not share bytes
+	if(job.tiles_across > 1 && job.tile_width % img->fmt->block_pixels != 0) {
+		return luaL_error(L,"tile width not a multiple of block size");
+	}
+	unsigned count = job.tiles_across*((img->height + job.tile_height - 1)/job.tile_height);
+	job.offsets = rawimg_get_size_array(L,2,"offsets",count);
+	job.sizes = rawimg_get_size_array(L,2,"sizes",count);
+	unsigned i;
+	for(i=0;i<count;i++) {
+		if(job.offsets[i] > src->len || job.sizes[i] > src->len - job.offsets[i]) {
+			return luaL_error(L,"tile %d outside of data",i);
+		}
+	}
+	job.errors = (const char **)lua_newuserdata(L,count*sizeof(const char *));
+	memset(job.errors,0,count*sizeof(const char *));
 
-	luaL_getmetatable(L, RAWIMG_META);
-	lua_setmetatable(L, -2);
-	
-	// save a reference in the registry to keep lbuf from being collected until image goes away
-	lua_getfield(L,LUA_REGISTRYINDEX,RAWIMG_LIST);
-	lua_pushvalue(L, -2); // our user data, for use as key
-	lua_pushvalue(L, 1); // lbuf, the value
-	lua_settable(L, -3); //set t[img]=lbuf
-	lua_pop(L,1); // done with t
+	size_t size = img->row_bytes*img->height;
+	lBuf_t *lb = lu_table_optudata(L,1,"data",LBUF_META,NULL);
+	if(!lb) {
+		char *data = malloc(size);
+		if(!data) {
+			return luaL_error(L,"malloc failed");
+		}
+		if(!lbuf_create(L, data, size, LBUF_FL_FREE)) {
+			return luaL_error(L,"failed to create lbuf");
+		}
+		lb = luaL_checkudata(L,-1,LBUF_META);
+		img->data = (uint8_t *)lb->bytes;
+	} else {
+		unsigned offset = lu_table_optnumber(L,1,"data_offset",0);
+		if(offset + size > lb->len) {
+			return luaL_error(L,"size larger than data");
+		}
+		if(lb->flags & LBUF_FL_READONLY) {
+			return luaL_error(L,"lbuf is read only");
+		}
+		lua_getfield(L,1,"data");
+		img->data = (uint8_t *)lb->bytes + offset;
+	}
 
-	return 1;
+	workpool_run_tasks(rawimg_decode_lj92_tiles,&job,count);
+
+	for(i=0;i<count;i++) {
+		if(job.errors[i]) {
+			return luaL_error(L,"tile %d: %s",i,job.errors[i]);
+		}
+	}
+	luaL_getmetatable(L, RAWIMG_META);
+	lua_setmetatable(L, img_index);
+	lua_pushvalue(L,img_index);
+	lua_pushvalue(L,-2); // lbuf
+	rawimg_ref_lbuf(L,-2,-1);
+	return 2;
 }
 
+static const luaL_Reg rawstack_methods[] = {
+	{"add",rawstack_lua_add},
+	{"reject",rawstack_lua_reject},
+	{"set_dark",rawstack_lua_set_dark},
+	{"reset",rawstack_lua_reset},
+	{"info",rawstack_lua_info},
+	{"make_rgb_thumb",rawstack_lua_make_rgb_thumb},
+	{"get_mean",rawstack_lua_get_mean},
+	{NULL, NULL}
+};
+
+static const luaL_Reg rawstack_meta_methods[] = {
+	{"__gc", rawstack_gc},
+	{NULL, NULL}
+};
+
+static const luaL_Reg starlist_methods[] = {
+	{"count",starlist_lua_count},
+	{"get",starlist_lua_get},
+	{"stats",starlist_lua_stats},
+	{NULL, NULL}
+};
+
+static const luaL_Reg starlist_meta_methods[] = {
+	{"__gc", starlist_gc},
+	{NULL, NULL}
+};
+
 static const luaL_Reg rawimg_lib[] = {
 	{"bind_lbuf",rawimg_lua_bind_lbuf},
+	{"stack_new",rawimg_lua_stack_new},
+	{"match_stars",rawimg_lua_match_stars},
+	{"set_threads",rawimg_lua_set_threads},
+	{"get_threads",rawimg_lua_get_threads},
+	{"write_dng",rawimg_lua_write_dng},
+	{"decode_lj92",rawimg_lua_decode_lj92},
 	{NULL, NULL}
 };
 
@@ -815,9 +3346,17 @@ static const luaL_Reg rawimg_methods[] = {
 	{"bpp",rawimg_lua_get_bpp},
 	{"endian",rawimg_lua_get_endian},
 	{"cfa_pattern",rawimg_lua_get_cfa_pattern},
+	{"active_area",rawimg_lua_get_active_area},
 	{"make_rgb_thumb",rawimg_lua_make_rgb_thumb},
 	{"patch_pixels",rawimg_lua_patch_pixels},
+	{"find_bad_pixels",rawimg_lua_find_bad_pixels},
+	{"patch_pixel_list",rawimg_lua_patch_pixel_list},
 	{"convert",rawimg_lua_convert},
+	{"demosaic",rawimg_lua_demosaic},
+	{"find_stars",rawimg_lua_find_stars},
+	{"warp",rawimg_lua_warp},
+	{"encode_lj92",rawimg_lua_encode_lj92},
+	{"write_fits",rawimg_lua_write_fits},
 	{NULL, NULL}
 };
 
@@ -831,6 +3370,20 @@ int luaopen_rawimg(lua_State *L) {
 	lua_setfield(L,-2,"__index");
 	lua_pop(L,1); // done with meta table
 	
+	luaL_newmetatable(L,RAWSTACK_META);
+	luaL_register(L, NULL, rawstack_meta_methods);
+	lua_newtable(L);
+	luaL_register(L, NULL, rawstack_methods);
+	lua_setfield(L,-2,"__index");
+	lua_pop(L,1); // done with meta table
+
+	luaL_newmetatable(L,STARLIST_META);
+	luaL_register(L, NULL, starlist_meta_methods);
+	lua_newtable(L);
+	luaL_register(L, NULL, starlist_methods);
+	lua_setfield(L,-2,"__index");
+	lua_pop(L,1); // done with meta table
+
 	// create a table to keep track of lbufs referenced by raw images
 	lua_newtable(L);
 	// metatable for above
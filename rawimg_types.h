@@ -0,0 +1,61 @@
+/*
+ * raw image layout, shared by rawimg.c and the modules that process raw data without Lua
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#ifndef RAWIMG_TYPES_H
+#define RAWIMG_TYPES_H
+
+#define CFA_RED   0
+#define CFA_GREEN 1
+#define CFA_BLUE  2
+
+typedef unsigned (*get_pixel_func_t)(const uint8_t *p, unsigned row_bytes, unsigned x, unsigned y);
+typedef void (*set_pixel_func_t)(uint8_t *p, unsigned row_bytes, unsigned x, unsigned y, unsigned value);
+// unpack count pixels of row y starting at x. x and count must be multiples of block_pixels
+typedef void (*get_row_func_t)(const uint8_t *p, unsigned row_bytes, unsigned y, unsigned x, unsigned count, uint16_t *out);
+
+typedef struct {
+	unsigned bpp;
+	unsigned endian;
+	unsigned block_bytes;
+	unsigned block_pixels;
+	get_pixel_func_t get_pixel;
+	set_pixel_func_t set_pixel;
+	get_row_func_t get_row;
+} raw_format_t;
+
+typedef struct {
+	raw_format_t *fmt;
+	unsigned row_bytes;
+	unsigned width;
+	unsigned height;
+	uint8_t cfa_pattern[4];
+	unsigned active_top;
+	unsigned active_left;
+	unsigned active_bottom;
+	unsigned active_right;
+	unsigned black_level;
+	uint8_t *data;
+} raw_image_t;
+
+/*
+return color for given x,y
+*/
+static inline unsigned cfa_color(const raw_image_t *img, unsigned x, unsigned y) {
+	return img->cfa_pattern[(x&1) + (y&1)*2];
+}
+
+#endif
@@ -0,0 +1,451 @@
+/*
+ * star registration: matching star lists and resampling raw images to a reference
+ * no Lua, warping is split between workpool threads
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "rawimg_types.h"
+#include "workpool.h"
+#include "stars.h"
+#include "register.h"
+
+typedef struct {
+	float u; // middle / longest side
+	float v; // shortest / longest side
+	float len; // longest side
+	uint8_t vert[3]; // star indexes, opposite the shortest, middle and longest side
+} match_tri_t;
+
+typedef struct {
+	unsigned f; // frame star
+	unsigned r; // reference star
+} match_pair_t;
+
+static int match_cmp_tri(const void *a, const void *b) {
+	float ua = ((const match_tri_t *)a)->u;
+	float ub = ((const match_tri_t *)b)->u;
+	return (ua > ub) - (ua < ub);
+}
+
+/*
+build triangles from the first n stars, returns the number made
+skips triangles with any side shorter than min_side, which have poorly defined shapes
+*/
+static unsigned match_make_tris(const star_t *stars, unsigned n, float min_side, match_tri_t *tris) {
+	unsigned i,j,k,count = 0;
+	for(i=0;i<n;i++) {
+		for(j=i+1;j<n;j++) {
+			for(k=j+1;k<n;k++) {
+				unsigned idx[3] = {i,j,k};
+				float side[3]; // side[m] is opposite idx[m]
+				unsigned m;
+				for(m=0;m<3;m++) {
+					const star_t *a = &stars[idx[(m + 1)%3]];
+					const star_t *b = &stars[idx[(m + 2)%3]];
+					side[m] = sqrtf((a->x - b->x)*(a->x - b->x) + (a->y - b->y)*(a->y - b->y));
+				}
+				// sort sides ascending, carrying the opposite vertex
+				unsigned o[3] = {0,1,2};
+				unsigned t;
+				if(side[o[0]] > side[o[1]]) { t = o[0]; o[0] = o[1]; o[1] = t; }
+				if(side[o[1]] > side[o[2]]) { t = o[1]; o[1] = o[2]; o[2] = t; }
+				if(side[o[0]] > side[o[1]]) { t = o[0]; o[0] = o[1]; o[1] = t; }
+				if(side[o[0]] < min_side) {
+					continue;
+				}
+				match_tri_t *tri = &tris[count++];
+				tri->len = side[o[2]];
+				tri->u = side[o[1]]/tri->len;
+				tri->v = side[o[0]]/tri->len;
+				for(m=0;m<3;m++) {
+					tri->vert[m] = idx[o[m]];
+				}
+			}
+		}
+	}
+	return count;
+}
+
+static void xform_apply(const register_xform_t *t, double x, double y, double *xr, double *yr) {
+	*xr = t->xx*x + t->xy*y + t->tx;
+	*yr = t->yx*x + t->yy*y + t->ty;
+}
+
+/*
+inverse of t, see register.h
+*/
+int register_invert(const register_xform_t *t, register_xform_t *inv) {
+	double det = t->xx*t->yy - t->xy*t->yx;
+	if(fabs(det) < 1e-12) {
+		return 0;
+	}
+	inv->xx = t->yy/det;
+	inv->xy = -t->xy/det;
+	inv->yx = -t->yx/det;
+	inv->yy = t->xx/det;
+	inv->tx = -(inv->xx*t->tx + inv->xy*t->ty);
+	inv->ty = -(inv->yx*t->tx + inv->yy*t->ty);
+	return 1;
+}
+
+/*
+least squares fit of pairs, returns 0 if degenerate
+*/
+static int xform_fit(int model, const star_t *fs, const star_t *rs, const match_pair_t *pairs, unsigned n, register_xform_t *t) {
+	double mx = 0, my = 0, mxr = 0, myr = 0;
+	unsigned i;
+	if(n < (unsigned)((model == REGISTER_AFFINE)?3:2)) {
+		return 0;
+	}
+	for(i=0;i<n;i++) {
+		mx += fs[pairs[i].f].x;
+		my += fs[pairs[i].f].y;
+		mxr += rs[pairs[i].r].x;
+		myr += rs[pairs[i].r].y;
+	}
+	mx /= n; my /= n; mxr /= n; myr /= n;
+	if(model == REGISTER_SIMILARITY) {
+		double sa = 0, sb = 0, ss = 0;
+		for(i=0;i<n;i++) {
+			double x = fs[pairs[i].f].x - mx, y = fs[pairs[i].f].y - my;
+			double xr = rs[pairs[i].r].x - mxr, yr = rs[pairs[i].r].y - myr;
+			sa += x*xr + y*yr;
+			sb += x*yr - y*xr;
+			ss += x*x + y*y;
+		}
+		if(ss < 1e-9) {
+			return 0;
+		}
+		t->xx = t->yy = sa/ss;
+		t->yx = sb/ss;
+		t->xy = -t->yx;
+	} else {
+		double sxx = 0, sxy = 0, syy = 0, sxxr = 0, syxr = 0, sxyr = 0, syyr = 0;
+		for(i=0;i<n;i++) {
+			double x = fs[pairs[i].f].x - mx, y = fs[pairs[i].f].y - my;
+			double xr = rs[pairs[i].r].x - mxr, yr = rs[pairs[i].r].y - myr;
+			sxx += x*x; sxy += x*y; syy += y*y;
+			sxxr += x*xr; syxr += y*xr;
+			sxyr += x*yr; syyr += y*yr;
+		}
+		double det = sxx*syy - sxy*sxy;
+		if(fabs(det) < 1e-9) {
+			return 0;
+		}
+		t->xx = (sxxr*syy - syxr*sxy)/det;
+		t->xy = (syxr*sxx - sxxr*sxy)/det;
+		t->yx = (sxyr*syy - syyr*sxy)/det;
+		t->yy = (syyr*sxx - sxyr*sxy)/det;
+	}
+	t->tx = mxr - t->xx*mx - t->xy*my;
+	t->ty = myr - t->yx*mx - t->yy*my;
+	return 1;
+}
+
+static double xform_err2(const register_xform_t *t, const star_t *f, const star_t *r) {
+	double x,y;
+	xform_apply(t,f->x,f->y,&x,&y);
+	return (x - r->x)*(x - r->x) + (y - r->y)*(y - r->y);
+}
+
+/*
+pair each frame star with the nearest reference star within tol of its transformed position
+*/
+static unsigned match_all(const register_xform_t *t, const star_list_t *fl, const star_list_t *rl, double tol, match_pair_t *pairs) {
+	unsigned i,j,n = 0;
+	for(i=0;i<fl->count;i++) {
+		double best = tol*tol;
+		unsigned best_j = rl->count;
+		double x,y;
+		xform_apply(t,fl->stars[i].x,fl->stars[i].y,&x,&y);
+		for(j=0;j<rl->count;j++) {
+			double d = (x - rl->stars[j].x)*(x - rl->stars[j].x) + (y - rl->stars[j].y)*(y - rl->stars[j].y);
+			if(d < best) {
+				best = d;
+				best_j = j;
+			}
+		}
+		if(best_j < rl->count) {
+			pairs[n].f = i;
+			pairs[n].r = best_j;
+			n++;
+		}
+	}
+	return n;
+}
+
+/*
+find the transform from fl to rl, see register.h
+*/
+int register_match_stars(const star_list_t *rl, const star_list_t *fl, const register_opts_t *opts, register_result_t *r) {
+	int model = opts->model;
+	unsigned nstars = opts->n;
+	double tol = opts->tol;
+	float tri_tol = opts->tri_tol;
+	float min_side = opts->min_side;
+	unsigned iterations = opts->iterations;
+	unsigned min_matches = opts->min_matches;
+	r->err[0] = 0;
+	if(nstars > REGISTER_MAX_STARS) {
+		nstars = REGISTER_MAX_STARS;
+	}
+	unsigned min_pairs = (model == REGISTER_AFFINE)?3:2;
+	if(min_matches < min_pairs + 1) {
+		min_matches = min_pairs + 1;
+	}
+	unsigned nr = (rl->count < nstars)?rl->count:nstars;
+	unsigned nf = (fl->count < nstars)?fl->count:nstars;
+	if(nr < 3 || nf < 3) {
+		snprintf(r->err,sizeof(r->err),"too few stars");
+		return 1;
+	}
+	unsigned max_tris = REGISTER_MAX_STARS*(REGISTER_MAX_STARS-1)*(REGISTER_MAX_STARS-2)/6;
+	match_tri_t *rtris = malloc(2*max_tris*sizeof(match_tri_t));
+	unsigned *votes = calloc(REGISTER_MAX_STARS*REGISTER_MAX_STARS,sizeof(unsigned));
+	unsigned maxp = (fl->count > REGISTER_MAX_STARS)?fl->count:REGISTER_MAX_STARS;
+	match_pair_t *pairs = malloc(maxp*sizeof(match_pair_t));
+	match_pair_t *inl = malloc(maxp*sizeof(match_pair_t));
+	if(!rtris || !votes || !pairs || !inl) {
+		free(rtris);
+		free(votes);
+		free(pairs);
+		free(inl);
+		return 0;
+	}
+	match_tri_t *ftris = rtris + max_tris;
+	unsigned nrt = match_make_tris(rl->stars,nr,min_side,rtris);
+	unsigned nft = match_make_tris(fl->stars,nf,min_side,ftris);
+	qsort(rtris,nrt,sizeof(match_tri_t),match_cmp_tri);
+	unsigned i,j,k;
+	// vote for vertex correspondences of similar triangles
+	for(i=0;i<nft;i++) {
+		match_tri_t *ft = &ftris[i];
+		unsigned lo = 0, hi = nrt;
+		while(lo < hi) {
+			unsigned mid = (lo + hi)/2;
+			if(rtris[mid].u < ft->u - tri_tol) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+		for(j=lo;j<nrt && rtris[j].u <= ft->u + tri_tol;j++) {
+			if(fabsf(rtris[j].v - ft->v) > tri_tol) {
+				continue;
+			}
+			for(k=0;k<3;k++) {
+				votes[ft->vert[k]*REGISTER_MAX_STARS + rtris[j].vert[k]]++;
+			}
+		}
+	}
+	// candidate pairs: each frame star with the reference star it most voted for, if mutual
+	unsigned npairs = 0;
+	for(i=0;i<nf;i++) {
+		unsigned best = 0, best_j = 0;
+		for(j=0;j<nr;j++) {
+			if(votes[i*REGISTER_MAX_STARS + j] > best) {
+				best = votes[i*REGISTER_MAX_STARS + j];
+				best_j = j;
+			}
+		}
+		if(best < 2) {
+			continue;
+		}
+		for(k=0;k<nf;k++) {
+			if(k != i && votes[k*REGISTER_MAX_STARS + best_j] > best) {
+				break;
+			}
+		}
+		if(k == nf) {
+			pairs[npairs].f = i;
+			pairs[npairs].r = best_j;
+			npairs++;
+		}
+	}
+	free(rtris);
+	free(votes);
+
+	// RANSAC over the candidates, with a fixed seed so results are repeatable
+	register_xform_t best_t;
+	unsigned best_inliers = 0;
+	uint32_t seed = 12345;
+	unsigned iter;
+	for(iter=0;npairs >= min_pairs && iter<iterations;iter++) {
+		match_pair_t sample[3];
+		unsigned s;
+		for(s=0;s<min_pairs;s++) {
+			seed = seed*1103515245 + 12345;
+			sample[s] = pairs[(seed >> 8)%npairs];
+			for(k=0;k<s;k++) {
+				if(sample[k].f == sample[s].f) {
+					break;
+				}
+			}
+			if(k < s) {
+				s--; // duplicate, try again
+			}
+		}
+		register_xform_t t;
+		if(!xform_fit(model,fl->stars,rl->stars,sample,min_pairs,&t)) {
+			continue;
+		}
+		unsigned n = 0;
+		for(k=0;k<npairs;k++) {
+			if(xform_err2(&t,&fl->stars[pairs[k].f],&rl->stars[pairs[k].r]) < tol*tol) {
+				n++;
+			}
+		}
+		if(n > best_inliers) {
+			best_inliers = n;
+			best_t = t;
+		}
+	}
+	if(best_inliers < min_pairs + 1) {
+		free(pairs);
+		free(inl);
+		snprintf(r->err,sizeof(r->err),"no consistent star matches");
+		return 1;
+	}
+	// refine with inliers, then with all stars matched by position
+	unsigned n = 0;
+	for(k=0;k<npairs;k++) {
+		if(xform_err2(&best_t,&fl->stars[pairs[k].f],&rl->stars[pairs[k].r]) < tol*tol) {
+			inl[n++] = pairs[k];
+		}
+	}
+	xform_fit(model,fl->stars,rl->stars,inl,n,&best_t);
+	for(iter=0;iter<2;iter++) {
+		n = match_all(&best_t,fl,rl,tol,inl);
+		if(!xform_fit(model,fl->stars,rl->stars,inl,n,&best_t)) {
+			break;
+		}
+	}
+	n = match_all(&best_t,fl,rl,tol,inl);
+	double err = 0;
+	for(k=0;k<n;k++) {
+		err += xform_err2(&best_t,&fl->stars[inl[k].f],&rl->stars[inl[k].r]);
+	}
+	free(pairs);
+	free(inl);
+	if(n < min_matches) {
+		snprintf(r->err,sizeof(r->err),"too few matches %d",n);
+		return 1;
+	}
+	r->xf = best_t;
+	r->matches = n;
+	r->rms = sqrt(err/n);
+	return 1;
+}
+
+typedef struct {
+	raw_image_t *src;
+	raw_image_t *dst;
+	uint16_t *pixels; // unpacked source
+	register_xform_t inv; // reference to source coordinates
+	unsigned fill;
+	unsigned max_val;
+} warp_job_t;
+
+static void warp_unpack_rows(void *arg, unsigned chunk, unsigned start, unsigned end) {
+	warp_job_t *job = (warp_job_t *)arg;
+	raw_image_t *img = job->src;
+	unsigned y;
+	for(y=start;y<end;y++) {
+		img->fmt->get_row(img->data,img->row_bytes,y,0,img->width,job->pixels + y*img->width);
+	}
+}
+
+/*
+bilinear interpolation on the lattice of CFA position p, at source position sx,sy
+returns 0 if any of the needed pixels are outside the image
+*/
+static int warp_sample(warp_job_t *job, unsigned p, double sx, double sy, double *v) {
+	unsigned ox = p&1, oy = p>>1;
+	unsigned w = job->src->width;
+	double fx = (sx - ox)*0.5, fy = (sy - oy)*0.5;
+	double flx = floor(fx), fly = floor(fy);
+	if(flx < 0 || fly < 0) {
+		return 0;
+	}
+	unsigned x0 = ox + 2*(unsigned)flx;
+	unsigned y0 = oy + 2*(unsigned)fly;
+	if(x0 + 2 >= w || y0 + 2 >= job->src->height) {
+		return 0;
+	}
+	double wx = fx - flx, wy = fy - fly;
+	const uint16_t *a = job->pixels + y0*w + x0;
+	const uint16_t *b = a + 2*w;
+	double top = a[0]*(1 - wx) + a[2]*wx;
+	double bottom = b[0]*(1 - wx) + b[2]*wx;
+	*v = top*(1 - wy) + bottom*wy;
+	return 1;
+}
+
+static void warp_rows(void *arg, unsigned chunk, unsigned start, unsigned end) {
+	warp_job_t *job = (warp_job_t *)arg;
+	raw_image_t *src = job->src;
+	raw_image_t *dst = job->dst;
+	unsigned x,y,p;
+	for(y=start;y<end;y++) {
+		for(x=0;x<dst->width;x++) {
+			unsigned c = cfa_color(dst,x,y);
+			double sx,sy;
+			double sum = 0;
+			unsigned n = 0;
+			xform_apply(&job->inv,x,y,&sx,&sy);
+			// each lattice of the same color, i.e. both greens
+			for(p=0;p<4;p++) {
+				double v;
+				if(src->cfa_pattern[p] == c && warp_sample(job,p,sx,sy,&v)) {
+					sum += v;
+					n++;
+				}
+			}
+			unsigned out = job->fill;
+			if(n) {
+				out = (unsigned)(sum/n + 0.5);
+				if(out > job->max_val) {
+					out = job->max_val;
+				}
+			}
+			dst->fmt->set_pixel(dst->data,dst->row_bytes,x,y,out);
+		}
+	}
+}
+
+/*
+resample src into dst, see register.h
+*/
+int register_warp(raw_image_t *src, raw_image_t *dst, const register_xform_t *inv, unsigned fill) {
+	warp_job_t job;
+	job.src = src;
+	job.dst = dst;
+	job.inv = *inv;
+	job.fill = fill;
+	job.max_val = (1<<dst->fmt->bpp) - 1;
+	job.pixels = malloc(src->width*src->height*sizeof(uint16_t));
+	if(!job.pixels) {
+		return 0;
+	}
+	workpool_run_rows(warp_unpack_rows,&job,0,src->height);
+	workpool_run_rows(warp_rows,&job,0,dst->height);
+	free(job.pixels);
+	return 1;
+}
@@ -0,0 +1,79 @@
+/*
+ * star registration: matching star lists and resampling raw images to a reference
+ * no Lua
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef REGISTER_H
+#define REGISTER_H
+
+/*
+star registration
+frames are matched to a reference by voting with similar triangles formed from the brightest stars,
+then a similarity or affine transform is fitted to the candidate pairs with RANSAC and refined by
+least squares over all stars within tolerance
+transforms map frame coordinates to reference coordinates, in raw pixels
+	xr = xx*x + xy*y + tx
+	yr = yx*x + yy*y + ty
+*/
+#define REGISTER_SIMILARITY 0
+#define REGISTER_AFFINE 1
+
+// maximum stars used to form triangles
+#define REGISTER_MAX_STARS 64
+
+typedef struct {
+	double xx, xy, tx;
+	double yx, yy, ty;
+} register_xform_t;
+
+typedef struct {
+	int model; // REGISTER_SIMILARITY or REGISTER_AFFINE
+	unsigned n; // number of brightest stars used to form triangles, at most REGISTER_MAX_STARS
+	double tol; // match tolerance, raw pixels
+	float tri_tol; // triangle shape tolerance
+	float min_side; // ignore triangles with sides shorter than this
+	unsigned iterations; // RANSAC iterations
+	unsigned min_matches;
+} register_opts_t;
+
+typedef struct {
+	register_xform_t xf;
+	unsigned matches; // stars used in the final fit
+	double rms; // rms residual of matched stars, raw pixels
+	char err[64]; // why no transform was found, empty on success
+} register_result_t;
+
+/*
+find the transform from the coordinates of fl to rl
+returns 0 on malloc failure, otherwise 1 with r->xf set, or r->err if no transform was found
+*/
+int register_match_stars(const star_list_t *rl, const star_list_t *fl, const register_opts_t *opts, register_result_t *r);
+
+/*
+returns 0 if t is not invertible
+*/
+int register_invert(const register_xform_t *t, register_xform_t *inv);
+
+/*
+resample src into dst, which must have the same size and cfa pattern. inv maps dst to src coordinates
+each output pixel is interpolated from source pixels of the same CFA color, pixels that map outside src are set to fill
+returns 0 on malloc failure
+uses workpool, must only be called from the Lua thread
+*/
+int register_warp(raw_image_t *src, raw_image_t *dst, const register_xform_t *inv, unsigned fill);
+
+#endif
@@ -33,6 +33,7 @@ TODO might want to just use luasocket code
 #include <windows.h>
 #else
 #include <errno.h>
+#include <fcntl.h>
 #include <sys/socket.h>
 #include <netdb.h>
 #include <unistd.h>
@@ -204,3 +205,24 @@ void sockutil_close(socket_t sock) {
 #endif
 }
 
+
+int sockutil_set_nonblock(socket_t sock) {
+#ifdef WIN32
+	u_long mode = 1;
+	return ioctlsocket(sock,FIONBIO,&mode) == 0;
+#else
+	int flags = fcntl(sock,F_GETFL,0);
+	if(flags == -1) {
+		return 0;
+	}
+	return fcntl(sock,F_SETFL,flags | O_NONBLOCK) != -1;
+#endif
+}
+
+int sockutil_would_block(int err) {
+#ifdef WIN32
+	return err == WSAEWOULDBLOCK || err == WSAEINTR;
+#else
+	return err == EAGAIN || err == EWOULDBLOCK || err == EINTR;
+#endif
+}
@@ -35,4 +35,8 @@ void sockutil_cleanup(void);
 int sockutil_errno(void);
 const char *sockutil_strerror(int err);
 void sockutil_close(socket_t sock);
+// returns 0 on failure
+int sockutil_set_nonblock(socket_t sock);
+// true if err from sockutil_errno means a non-blocking call should be retried later
+int sockutil_would_block(int err);
 #endif
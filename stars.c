@@ -0,0 +1,654 @@
+/*
+ * star detection and measurement on raw images
+ * no Lua, processing is split between workpool threads
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+#include "rawimg_types.h"
+#include "workpool.h"
+#include "stars.h"
+
+#define STARS_MASK_DET 1
+#define STARS_MASK_SAT 2
+
+// background cells are sampled with at most this many values per side
+#define STARS_GRID_SAMPLES 32
+
+typedef struct {
+	unsigned y;
+	unsigned xs; // run is xs to xe-1
+	unsigned xe;
+	unsigned label;
+} star_run_t;
+
+typedef struct {
+	unsigned npix;
+	double sum; // residual sums for the initial centroid
+	double sx;
+	double sy;
+	unsigned sat;
+	unsigned x0; // bounding box, inclusive
+	unsigned y0;
+	unsigned x1;
+	unsigned y1;
+} star_comp_t;
+
+typedef struct {
+	raw_image_t *img;
+	int plane_type;
+	unsigned top; // region
+	unsigned left;
+	unsigned x0; // source columns read, aligned to format block
+	unsigned x1;
+	unsigned pw; // plane size
+	unsigned ph;
+	float black;
+	unsigned sat_level;
+	float sigma; // detection threshold
+	unsigned grid; // grid cell size, plane pixels
+	unsigned gw; // grid size
+	unsigned gh;
+	float *bg; // per cell background and noise
+	float *noise;
+	unsigned *gx0; // per plane column, interpolation cells and weight
+	unsigned *gx1;
+	float *gxw;
+	uint16_t **rowbufs; // per chunk, two source rows
+	float **samples; // per chunk background samples
+	float *plane; // values, then residuals after background subtraction
+	uint8_t *mask; // STARS_MASK_*
+	star_comp_t *comps;
+	star_t *stars;
+	float max_radius; // aperture limit, plane pixels
+} stars_job_t;
+
+static int stars_cmp_flux(const void *a, const void *b) {
+	float fa = ((const star_t *)a)->flux;
+	float fb = ((const star_t *)b)->flux;
+	return (fa < fb) - (fa > fb);
+}
+
+/*
+median of n values, reorders the array
+*/
+static float stars_median(float *v, unsigned n) {
+	if(!n) {
+		return 0;
+	}
+	// quickselect the upper middle element
+	unsigned k = n/2;
+	unsigned lo = 0, hi = n - 1;
+	while(lo < hi) {
+		float pivot = v[(lo + hi)/2];
+		unsigned i = lo, j = hi;
+		while(i <= j) {
+			while(v[i] < pivot) {
+				i++;
+			}
+			while(v[j] > pivot) {
+				j--;
+			}
+			if(i <= j) {
+				float t = v[i];
+				v[i] = v[j];
+				v[j] = t;
+				i++;
+				if(j == 0) {
+					break;
+				}
+				j--;
+			}
+		}
+		if(k <= j) {
+			hi = j;
+		} else if(k >= i) {
+			lo = i;
+		} else {
+			break;
+		}
+	}
+	if(n&1) {
+		return v[k];
+	}
+	// lower middle is the largest value below k
+	float lower = v[0];
+	unsigned i;
+	for(i=1;i<k;i++) {
+		if(v[i] > lower) {
+			lower = v[i];
+		}
+	}
+	return (lower + v[k])*0.5f;
+}
+
+static void stars_plane_rows(void *arg, unsigned chunk, unsigned start, unsigned end) {
+	stars_job_t *job = (stars_job_t *)arg;
+	raw_image_t *img = job->img;
+	unsigned n = job->x1 - job->x0;
+	uint16_t *r0 = job->rowbufs[chunk];
+	uint16_t *r1 = r0 + n;
+	unsigned off = job->left - job->x0;
+	unsigned py,px;
+	for(py=start;py<end;py++) {
+		unsigned y = job->top + py*2;
+		float *p = job->plane + py*job->pw;
+		uint8_t *m = job->mask + py*job->pw;
+		img->fmt->get_row(img->data,img->row_bytes,y,job->x0,n,r0);
+		img->fmt->get_row(img->data,img->row_bytes,y + 1,job->x0,n,r1);
+		for(px=0;px<job->pw;px++) {
+			unsigned i = off + px*2;
+			unsigned a = r0[i], b = r0[i + 1], c = r1[i], d = r1[i + 1];
+			unsigned vmax = a;
+			if(b > vmax) vmax = b;
+			if(c > vmax) vmax = c;
+			if(d > vmax) vmax = d;
+			m[px] = (vmax >= job->sat_level)?STARS_MASK_SAT:0;
+			if(job->plane_type == STARS_PLANE_GREEN) {
+				unsigned x = job->left + px*2;
+				float g;
+				if(cfa_color(img,x,y) == CFA_GREEN) {
+					g = a + d;
+				} else {
+					g = b + c;
+				}
+				p[px] = g*0.5f - job->black;
+			} else {
+				p[px] = (a + b + c + d)*0.25f - job->black;
+			}
+		}
+	}
+}
+
+/*
+median and MAD based noise of each background cell in grid rows start to end-1
+*/
+static void stars_grid_rows(void *arg, unsigned chunk, unsigned start, unsigned end) {
+	stars_job_t *job = (stars_job_t *)arg;
+	float *s = job->samples[chunk];
+	unsigned step = (job->grid + STARS_GRID_SAMPLES - 1)/STARS_GRID_SAMPLES;
+	unsigned gy,gx,x,y;
+	for(gy=start;gy<end;gy++) {
+		unsigned y0 = gy*job->grid;
+		unsigned y1 = y0 + job->grid;
+		if(y1 > job->ph) {
+			y1 = job->ph;
+		}
+		for(gx=0;gx<job->gw;gx++) {
+			unsigned x0 = gx*job->grid;
+			unsigned x1 = x0 + job->grid;
+			unsigned n = 0;
+			if(x1 > job->pw) {
+				x1 = job->pw;
+			}
+			for(y=y0;y<y1;y+=step) {
+				const float *p = job->plane + y*job->pw;
+				for(x=x0;x<x1;x+=step) {
+					s[n++] = p[x];
+				}
+			}
+			float med = stars_median(s,n);
+			for(x=0;x<n;x++) {
+				s[x] = fabsf(s[x] - med);
+			}
+			job->bg[gy*job->gw + gx] = med;
+			job->noise[gy*job->gw + gx] = 1.4826f*stars_median(s,n);
+		}
+	}
+}
+
+/*
+bilinear interpolation of a grid value at plane row py, column px
+*/
+static float stars_grid_interp(stars_job_t *job, const float *g, unsigned gy0, unsigned gy1, float wy, unsigned px) {
+	unsigned gx0 = job->gx0[px], gx1 = job->gx1[px];
+	float wx = job->gxw[px];
+	float top = g[gy0*job->gw + gx0]*(1 - wx) + g[gy0*job->gw + gx1]*wx;
+	float bottom = g[gy1*job->gw + gx0]*(1 - wx) + g[gy1*job->gw + gx1]*wx;
+	return top*(1 - wy) + bottom*wy;
+}
+
+static void stars_grid_pos(unsigned grid, unsigned n, unsigned p, unsigned *i0, unsigned *i1, float *w) {
+	float f = (p + 0.5f)/grid - 0.5f;
+	if(f <= 0) {
+		*i0 = *i1 = 0;
+		*w = 0;
+		return;
+	}
+	*i0 = (unsigned)f;
+	if(*i0 >= n - 1) {
+		*i0 = *i1 = n - 1;
+		*w = 0;
+		return;
+	}
+	*i1 = *i0 + 1;
+	*w = f - *i0;
+}
+
+static void stars_residual_rows(void *arg, unsigned chunk, unsigned start, unsigned end) {
+	stars_job_t *job = (stars_job_t *)arg;
+	unsigned py,px;
+	for(py=start;py<end;py++) {
+		unsigned gy0,gy1;
+		float wy;
+		float *p = job->plane + py*job->pw;
+		stars_grid_pos(job->grid,job->gh,py,&gy0,&gy1,&wy);
+		for(px=0;px<job->pw;px++) {
+			p[px] -= stars_grid_interp(job,job->bg,gy0,gy1,wy,px);
+		}
+	}
+}
+
+/*
+mark pixels where the 3x3 mean of the residual is above sigma times its noise (noise/3)
+the outermost rows and columns are never marked
+*/
+static void stars_threshold_rows(void *arg, unsigned chunk, unsigned start, unsigned end) {
+	stars_job_t *job = (stars_job_t *)arg;
+	unsigned pw = job->pw;
+	unsigned py,px;
+	for(py=start;py<end;py++) {
+		uint8_t *m = job->mask + py*pw;
+		if(py == 0 || py == job->ph - 1) {
+			continue;
+		}
+		unsigned gy0,gy1;
+		float wy;
+		const float *p = job->plane + py*pw;
+		const float *pa = p - pw;
+		const float *pb = p + pw;
+		stars_grid_pos(job->grid,job->gh,py,&gy0,&gy1,&wy);
+		for(px=1;px<pw - 1;px++) {
+			float s = pa[px - 1] + pa[px] + pa[px + 1]
+					+ p[px - 1] + p[px] + p[px + 1]
+					+ pb[px - 1] + pb[px] + pb[px + 1];
+			float t = 3*job->sigma*stars_grid_interp(job,job->noise,gy0,gy1,wy,px);
+			if(s > t && s > 0) {
+				m[px] |= STARS_MASK_DET;
+			}
+		}
+	}
+}
+
+static unsigned stars_find_root(star_run_t *runs, unsigned i) {
+	while(runs[i].label != i) {
+		runs[i].label = runs[runs[i].label].label;
+		i = runs[i].label;
+	}
+	return i;
+}
+
+/*
+label 8-connected runs of detected pixels
+returns an array of runs with label set to the index of the root run, or NULL on malloc failure
+*/
+static star_run_t *stars_label(stars_job_t *job, unsigned *count) {
+	unsigned n = 0;
+	unsigned size = 1024;
+	star_run_t *runs = malloc(size*sizeof(star_run_t));
+	unsigned prev_start = 0, prev_end = 0; // runs of the previous row
+	unsigned py,px;
+	if(!runs) {
+		return NULL;
+	}
+	for(py=0;py<job->ph;py++) {
+		const uint8_t *m = job->mask + py*job->pw;
+		unsigned row_start = n;
+		unsigned pi = prev_start;
+		px = 0;
+		while(px < job->pw) {
+			if(!(m[px] & STARS_MASK_DET)) {
+				px++;
+				continue;
+			}
+			unsigned xs = px;
+			while(px < job->pw && (m[px] & STARS_MASK_DET)) {
+				px++;
+			}
+			if(n == size) {
+				size *= 2;
+				star_run_t *r = realloc(runs,size*sizeof(star_run_t));
+				if(!r) {
+					free(runs);
+					return NULL;
+				}
+				runs = r;
+			}
+			star_run_t *r = &runs[n];
+			r->y = py;
+			r->xs = xs;
+			r->xe = px;
+			r->label = n;
+			// skip previous row runs entirely to the left, then union with all that touch
+			while(pi < prev_end && runs[pi].xe + 1 <= xs) {
+				pi++;
+			}
+			unsigned j;
+			for(j=pi;j<prev_end && runs[j].xs <= px;j++) {
+				unsigned a = stars_find_root(runs,j);
+				unsigned b = stars_find_root(runs,n);
+				if(a < b) {
+					runs[b].label = a;
+				} else if(b < a) {
+					runs[a].label = b;
+				}
+			}
+			n++;
+		}
+		prev_start = row_start;
+		prev_end = n;
+	}
+	for(px=0;px<n;px++) {
+		runs[px].label = stars_find_root(runs,px);
+	}
+	*count = n;
+	return runs;
+}
+
+/*
+measure stars start to end-1, comps must be set. Sets npix to 0 for rejected stars
+*/
+static void stars_measure_rows(void *arg, unsigned chunk, unsigned start, unsigned end) {
+	stars_job_t *job = (stars_job_t *)arg;
+	unsigned pw = job->pw, ph = job->ph;
+	unsigned i;
+	for(i=start;i<end;i++) {
+		star_comp_t *c = &job->comps[i];
+		star_t *s = &job->stars[i];
+		float cx = c->sx/c->sum;
+		float cy = c->sy/c->sum;
+		float bw = c->x1 - c->x0 + 1;
+		float bh = c->y1 - c->y0 + 1;
+		float r = ((bw > bh)?bw:bh)*0.5f + 1;
+		if(r < 3) {
+			r = 3;
+		}
+		if(r > job->max_radius) {
+			r = job->max_radius;
+		}
+		int iter;
+		double sum = 0, sxx = 0, syy = 0, sxy = 0, sr = 0;
+		float peak = 0;
+		// refine the centroid in the aperture, then measure around it
+		for(iter=0;iter<2;iter++) {
+			int x0 = (int)floorf(cx - r), x1 = (int)ceilf(cx + r);
+			int y0 = (int)floorf(cy - r), y1 = (int)ceilf(cy + r);
+			int x,y;
+			double sx = 0, sy = 0;
+			if(x0 < 0) x0 = 0;
+			if(y0 < 0) y0 = 0;
+			if(x1 > (int)pw - 1) x1 = pw - 1;
+			if(y1 > (int)ph - 1) y1 = ph - 1;
+			sum = sxx = syy = sxy = sr = 0;
+			peak = 0;
+			for(y=y0;y<=y1;y++) {
+				const float *p = job->plane + y*pw;
+				float dy = y - cy;
+				for(x=x0;x<=x1;x++) {
+					float dx = x - cx;
+					float d2 = dx*dx + dy*dy;
+					float v = p[x];
+					if(v <= 0 || d2 > r*r) {
+						continue;
+					}
+					if(v > peak) {
+						peak = v;
+					}
+					sum += v;
+					sx += v*x;
+					sy += v*y;
+					sxx += v*dx*dx;
+					syy += v*dy*dy;
+					sxy += v*dx*dy;
+					sr += v*sqrtf(d2);
+				}
+			}
+			if(sum <= 0) {
+				break;
+			}
+			if(iter == 0) {
+				cx = sx/sum;
+				cy = sy/sum;
+			}
+		}
+		if(sum <= 0) {
+			s->npix = 0;
+			continue;
+		}
+		sxx /= sum;
+		syy /= sum;
+		sxy /= sum;
+		double tr = (sxx + syy)*0.5;
+		double d = sqrt((sxx - syy)*(sxx - syy)*0.25 + sxy*sxy);
+		double lmax = tr + d, lmin = tr - d;
+		s->x = job->left + cx*2 + 0.5f;
+		s->y = job->top + cy*2 + 0.5f;
+		s->flux = sum;
+		s->peak = peak;
+		s->hfr = 2*sr/sum;
+		s->fwhm = 2*2.3548*sqrt(tr);
+		s->ecc = (lmax > 0 && lmin > 0)?sqrt(1 - lmin/lmax):0;
+		s->npix = c->npix;
+		s->flags = c->sat?STAR_FL_SATURATED:0;
+	}
+}
+
+static void stars_free(stars_job_t *job, unsigned chunks) {
+	unsigned i;
+	for(i=0;i<chunks;i++) {
+		if(job->rowbufs) {
+			free(job->rowbufs[i]);
+		}
+		if(job->samples) {
+			free(job->samples[i]);
+		}
+	}
+	free(job->rowbufs);
+	free(job->samples);
+	free(job->bg);
+	free(job->noise);
+	free(job->gx0);
+	free(job->plane);
+	free(job->mask);
+	free(job->comps);
+	free(job->stars);
+}
+
+/*
+allocate per chunk buffers, each of size bytes
+*/
+static int stars_alloc_chunks(void ***bufs, unsigned chunks, size_t size) {
+	unsigned i;
+	*bufs = calloc(chunks,sizeof(void *));
+	if(!*bufs) {
+		return 0;
+	}
+	for(i=0;i<chunks;i++) {
+		(*bufs)[i] = malloc(size);
+		if(!(*bufs)[i]) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+median of a star field over unsaturated stars, field is the offset of a float in star_t
+*/
+static float stars_list_median(star_list_t *list, size_t field, float *tmp) {
+	unsigned i,n = 0;
+	for(i=0;i<list->count;i++) {
+		if(!(list->stars[i].flags & STAR_FL_SATURATED)) {
+			tmp[n++] = *(float *)((char *)&list->stars[i] + field);
+		}
+	}
+	return stars_median(tmp,n);
+}
+
+/*
+find stars in the region of img given by opts, see stars.h
+*/
+const char *stars_find(raw_image_t *img, const stars_opts_t *opts, star_list_t *list) {
+	stars_job_t job;
+	memset(&job,0,sizeof(job));
+	memset(list,0,sizeof(star_list_t));
+	job.img = img;
+	job.plane_type = opts->plane;
+	job.sigma = opts->sigma;
+	job.black = opts->black;
+	job.sat_level = opts->sat_level;
+	job.top = opts->top;
+	job.left = opts->left;
+	job.pw = (opts->right - opts->left)/2;
+	job.ph = (opts->bottom - opts->top)/2;
+	job.grid = opts->grid/2;
+	job.max_radius = opts->max_radius/2;
+	if(job.grid < 4) {
+		return "grid too small";
+	}
+	if(job.pw < 8 || job.ph < 8) {
+		return "region too small";
+	}
+	job.gw = (job.pw + job.grid - 1)/job.grid;
+	job.gh = (job.ph + job.grid - 1)/job.grid;
+	unsigned bp = img->fmt->block_pixels;
+	job.x0 = opts->left - opts->left%bp;
+	job.x1 = opts->left + job.pw*2;
+	job.x1 = (job.x1 + bp - 1) - (job.x1 + bp - 1)%bp;
+
+	// chunk buffers are shared between passes, allocate for the pass with the most chunks
+	unsigned chunks = workpool_chunk_count(job.ph);
+	unsigned step = (job.grid + STARS_GRID_SAMPLES - 1)/STARS_GRID_SAMPLES;
+	unsigned side = (job.grid + step - 1)/step;
+	unsigned gcells = job.gw*job.gh;
+	unsigned i;
+	job.plane = malloc(job.pw*job.ph*sizeof(float));
+	job.mask = malloc(job.pw*job.ph);
+	job.bg = malloc(gcells*sizeof(float));
+	job.noise = malloc(gcells*sizeof(float));
+	job.gx0 = malloc(job.pw*sizeof(unsigned)*2 + job.pw*sizeof(float));
+	if(!job.plane || !job.mask || !job.bg || !job.noise || !job.gx0
+		|| !stars_alloc_chunks((void ***)&job.rowbufs,chunks,(job.x1 - job.x0)*2*sizeof(uint16_t))
+		|| !stars_alloc_chunks((void ***)&job.samples,chunks,side*side*sizeof(float))) {
+		stars_free(&job,chunks);
+		return "malloc failed";
+	}
+	job.gx1 = job.gx0 + job.pw;
+	job.gxw = (float *)(job.gx1 + job.pw);
+	for(i=0;i<job.pw;i++) {
+		stars_grid_pos(job.grid,job.gw,i,&job.gx0[i],&job.gx1[i],&job.gxw[i]);
+	}
+
+	workpool_run_rows(stars_plane_rows,&job,0,job.ph);
+	// grid has fewer rows than the plane, so never more chunks
+	workpool_run_rows(stars_grid_rows,&job,0,job.gh);
+	workpool_run_rows(stars_residual_rows,&job,0,job.ph);
+	workpool_run_rows(stars_threshold_rows,&job,0,job.ph);
+
+	unsigned nruns;
+	star_run_t *runs = stars_label(&job,&nruns);
+	if(!runs) {
+		stars_free(&job,chunks);
+		return "malloc failed";
+	}
+	// collect components, runs of each are in label order so roots come first
+	unsigned ncomps = 0;
+	unsigned *comp_index = malloc(nruns*sizeof(unsigned) + 1);
+	job.comps = malloc(nruns*sizeof(star_comp_t) + 1);
+	if(!comp_index || !job.comps) {
+		free(runs);
+		free(comp_index);
+		stars_free(&job,chunks);
+		return "malloc failed";
+	}
+	for(i=0;i<nruns;i++) {
+		star_run_t *r = &runs[i];
+		star_comp_t *c;
+		if(r->label == i) {
+			comp_index[i] = ncomps;
+			c = &job.comps[ncomps++];
+			memset(c,0,sizeof(*c));
+			c->x0 = r->xs;
+			c->x1 = r->xe - 1;
+			c->y0 = c->y1 = r->y;
+		} else {
+			c = &job.comps[comp_index[r->label]];
+			if(r->xs < c->x0) c->x0 = r->xs;
+			if(r->xe - 1 > c->x1) c->x1 = r->xe - 1;
+			if(r->y > c->y1) c->y1 = r->y;
+		}
+		const float *p = job.plane + r->y*job.pw;
+		const uint8_t *m = job.mask + r->y*job.pw;
+		unsigned x;
+		for(x=r->xs;x<r->xe;x++) {
+			float v = (p[x] > 0)?p[x]:0;
+			c->sum += v;
+			c->sx += v*x;
+			c->sy += v*r->y;
+			c->sat |= (m[x] & STARS_MASK_SAT);
+		}
+		c->npix += r->xe - r->xs;
+	}
+	free(runs);
+	free(comp_index);
+	list->detected = ncomps;
+	// drop components outside the size limits
+	unsigned n = 0;
+	for(i=0;i<ncomps;i++) {
+		star_comp_t *c = &job.comps[i];
+		if(c->npix >= opts->min_pix && c->npix <= opts->max_pix && c->sum > 0) {
+			job.comps[n++] = *c;
+		}
+	}
+	job.stars = malloc(n*sizeof(star_t) + 1);
+	if(!job.stars) {
+		stars_free(&job,chunks);
+		return "malloc failed";
+	}
+	workpool_run_rows(stars_measure_rows,&job,0,n);
+	ncomps = n;
+	n = 0;
+	for(i=0;i<ncomps;i++) {
+		if(job.stars[i].npix) {
+			job.stars[n++] = job.stars[i];
+		}
+	}
+	qsort(job.stars,n,sizeof(star_t),stars_cmp_flux);
+	if(opts->max_stars && n > opts->max_stars) {
+		n = opts->max_stars;
+	}
+
+	list->count = n;
+	list->stars = job.stars;
+	job.stars = NULL;
+	// medians, reusing the background arrays as scratch
+	memcpy(job.plane,job.bg,gcells*sizeof(float));
+	list->background = stars_median(job.plane,gcells);
+	memcpy(job.plane,job.noise,gcells*sizeof(float));
+	list->noise = stars_median(job.plane,gcells);
+	float *tmp = malloc(n*sizeof(float) + 1);
+	if(tmp) {
+		list->hfr = stars_list_median(list,offsetof(star_t,hfr),tmp);
+		list->fwhm = stars_list_median(list,offsetof(star_t,fwhm),tmp);
+		list->ecc = stars_list_median(list,offsetof(star_t,ecc),tmp);
+		free(tmp);
+	}
+	stars_free(&job,chunks);
+	return NULL;
+}
@@ -0,0 +1,80 @@
+/*
+ * star detection and measurement on raw images
+ * no Lua
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef STARS_H
+#define STARS_H
+
+#define STARS_PLANE_BIN 0
+#define STARS_PLANE_GREEN 1
+
+#define STAR_FL_SATURATED 1
+
+typedef struct {
+	float x; // centroid, raw image coordinates
+	float y;
+	float flux; // background subtracted sum over the aperture, plane units
+	float peak; // max background subtracted plane value
+	float hfr; // flux weighted mean radius, raw pixels
+	float fwhm; // from second moments, raw pixels
+	float ecc; // eccentricity from second moments, 0 = round
+	unsigned npix; // plane pixels above threshold
+	unsigned flags;
+} star_t;
+
+typedef struct {
+	unsigned count;
+	unsigned detected; // components found, before filtering
+	float background; // median of background cells, raw units above black
+	float noise; // median of cell noise estimates
+	float hfr; // medians of unsaturated stars
+	float fwhm;
+	float ecc;
+	star_t *stars;
+} star_list_t;
+
+typedef struct {
+	int plane; // STARS_PLANE_*
+	unsigned top; // region, raw pixels
+	unsigned left;
+	unsigned bottom;
+	unsigned right;
+	float sigma; // detection threshold, in noise standard deviations of the 3x3 mean
+	unsigned grid; // background cell size, raw pixels
+	unsigned min_pix; // detected plane pixels in a star
+	unsigned max_pix;
+	unsigned max_stars; // keep only the brightest N, 0 = no limit
+	float max_radius; // measurement aperture limit, raw pixels
+	float black;
+	unsigned sat_level; // raw value considered saturated
+} stars_opts_t;
+
+/*
+find stars in the region of img given by opts
+works on a half resolution plane, each value the mean of a 2x2 CFA quad (bin) or of its two greens (green),
+black subtracted. Background and noise are estimated on a coarse grid and interpolated, pixels where the
+3x3 smoothed residual is above threshold are labeled as connected components, then each component is
+measured in a circular aperture around its centroid
+positions and sizes are reported in raw pixels
+stars are sorted by flux, brightest first. list->stars is allocated with malloc, and must be freed by the caller
+returns NULL or an error message, list->stars is NULL on error
+uses workpool, must only be called from the Lua thread
+*/
+const char *stars_find(raw_image_t *img, const stars_opts_t *opts, star_list_t *list);
+
+#endif
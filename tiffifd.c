@@ -0,0 +1,402 @@
+/*
+ * TIFF / DNG IFD parser
+ * parses the IFD tree of a little endian TIFF in an lbuf into flat arrays of IFDs and entries
+ * values are not decoded, dng.lua reads them from the lbuf on demand
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+#include "lbuf.h"
+#include "tiffifd.h"
+
+#define TIFF_TAG_SUBIFDS 0x14a
+#define TIFF_TAG_EXIFIFD 0x8769
+
+// guard against loops and corrupt files
+#define TIFFIFD_MAX_IFDS 64
+#define TIFFIFD_MAX_DEPTH 4
+
+#define TIFFIFD_KIND_MAIN 0
+#define TIFFIFD_KIND_SUB 1
+#define TIFFIFD_KIND_EXIF 2
+
+static const char *kind_strings[] = {
+	"main",
+	"sub",
+	"exif",
+};
+
+typedef struct {
+	uint32_t off; // offset of the entry in the buffer
+	uint16_t tag;
+	uint16_t type;
+	uint32_t count;
+	uint32_t valoff; // value or offset
+} tiff_entry_t;
+
+typedef struct {
+	uint32_t off;
+	uint32_t first_entry; // index in entries
+	uint16_t n_entries;
+	uint16_t kind;
+	int32_t parent; // index of parent ifd, -1 for main chain
+} tiff_ifd_t;
+
+// userdata, variable size
+typedef struct {
+	uint16_t byte_order;
+	uint16_t id;
+	uint32_t ifd0_off;
+	uint32_t data_end;
+	unsigned n_ifds;
+	unsigned n_entries;
+	tiff_ifd_t *ifds; // point into the userdata
+	tiff_entry_t *entries;
+} tiff_t;
+
+typedef struct {
+	const uint8_t *p;
+	uint32_t len;
+	tiff_ifd_t ifds[TIFFIFD_MAX_IFDS];
+	unsigned n_ifds;
+	tiff_entry_t *entries;
+	unsigned n_entries;
+	unsigned max_entries;
+	uint64_t data_end;
+	const char *err;
+} tiff_parse_t;
+
+static uint16_t get_u16(const uint8_t *p) {
+	return p[0] | (p[1]<<8);
+}
+
+static uint32_t get_u32(const uint8_t *p) {
+	return p[0] | (p[1]<<8) | (p[2]<<16) | ((uint32_t)p[3]<<24);
+}
+
+// element sizes by TIFF type id, 0 = unknown
+static const unsigned type_sizes[] = {0,1,1,2,4,8,1,1,2,4,8,4,8};
+
+static void tiff_parse_extend(tiff_parse_t *p, uint64_t end) {
+	if(end > p->data_end) {
+		p->data_end = end;
+	}
+}
+
+/*
+parse a chain of IFDs starting at off, recursing into sub and exif IFDs
+returns 0 and sets p->err on error
+*/
+static int tiff_parse_chain(tiff_parse_t *p, uint32_t off, int32_t parent, uint16_t kind, unsigned depth) {
+	if(depth > TIFFIFD_MAX_DEPTH) {
+		p->err = "ifds nested too deep";
+		return 0;
+	}
+	while(off) {
+		unsigned i;
+		if(off >= p->len || p->len - off < 2) {
+			p->err = "ifd outside of data";
+			return 0;
+		}
+		uint16_t n = get_u16(p->p + off);
+		if(p->len - off < 2 + n*12 + 4) {
+			p->err = "ifd entries outside of data";
+			return 0;
+		}
+		for(i=0; i<p->n_ifds; i++) {
+			if(p->ifds[i].off == off) {
+				p->err = "ifd loop";
+				return 0;
+			}
+		}
+		if(p->n_ifds == TIFFIFD_MAX_IFDS) {
+			p->err = "too many ifds";
+			return 0;
+		}
+		if(p->n_entries + n > p->max_entries) {
+			unsigned max = p->max_entries*2;
+			if(max < p->n_entries + n) {
+				max = p->n_entries + n;
+			}
+			tiff_entry_t *e = realloc(p->entries,max*sizeof(tiff_entry_t));
+			if(!e) {
+				p->err = "realloc failed";
+				return 0;
+			}
+			p->entries = e;
+			p->max_entries = max;
+		}
+		tiff_parse_extend(p,off + 2 + n*12 + 4);
+		int32_t index = p->n_ifds++;
+		tiff_ifd_t *ifd = &p->ifds[index];
+		ifd->off = off;
+		ifd->first_entry = p->n_entries;
+		ifd->n_entries = n;
+		ifd->kind = kind;
+		ifd->parent = parent;
+		// all entries of this ifd first, so they are contiguous
+		for(i=0; i<n; i++) {
+			const uint8_t *ep = p->p + off + 2 + i*12;
+			tiff_entry_t *e = &p->entries[p->n_entries++];
+			e->off = off + 2 + i*12;
+			e->tag = get_u16(ep);
+			e->type = get_u16(ep + 2);
+			e->count = get_u32(ep + 4);
+			e->valoff = get_u32(ep + 8);
+			if(e->type < sizeof(type_sizes)/sizeof(type_sizes[0])) {
+				uint64_t size = (uint64_t)type_sizes[e->type]*e->count;
+				if(size > 4) {
+					tiff_parse_extend(p,(uint64_t)e->valoff + size);
+				}
+			}
+		}
+		for(i=0; i<n; i++) {
+			// entries may be reallocated by recursion
+			tiff_entry_t e = p->entries[p->ifds[index].first_entry + i];
+			if(e.tag == TIFF_TAG_SUBIFDS && e.count) {
+				unsigned j;
+				if(e.count == 1) {
+					if(!tiff_parse_chain(p,e.valoff,index,TIFFIFD_KIND_SUB,depth+1)) {
+						return 0;
+					}
+					continue;
+				}
+				// array of offsets
+				if(e.valoff >= p->len || (p->len - e.valoff)/4 < e.count) {
+					p->err = "subifd offsets outside of data";
+					return 0;
+				}
+				for(j=0; j<e.count; j++) {
+					if(!tiff_parse_chain(p,get_u32(p->p + e.valoff + j*4),index,TIFFIFD_KIND_SUB,depth+1)) {
+						return 0;
+					}
+				}
+			} else if(e.tag == TIFF_TAG_EXIFIFD && e.count == 1) {
+				if(!tiff_parse_chain(p,e.valoff,index,TIFFIFD_KIND_EXIF,depth+1)) {
+					return 0;
+				}
+			}
+		}
+		off = get_u32(p->p + off + 2 + n*12);
+	}
+	return 1;
+}
+
+/*
+tiff=tiffifd.parse(lb)
+parse the TIFF header and IFD tree of a little endian TIFF file in lbuf lb
+returns tiff object or false,error
+IFDs are numbered in the order parsed: each IFD of the main chain is followed by its sub and exif IFDs
+the parsed data is a copy, the lbuf is not referenced
+*/
+static int tiffifd_parse(lua_State *L) {
+	lBuf_t *lb = lbuf_getlbuf(L,1);
+	if(!lb) {
+		return luaL_error(L,"expected lbuf");
+	}
+	if(lb->len < 8) {
+		lua_pushboolean(L,0);
+		lua_pushstring(L,"data too short");
+		return 2;
+	}
+	const uint8_t *p = (const uint8_t *)lb->bytes;
+	uint16_t byte_order = get_u16(p);
+	uint16_t id = get_u16(p+2);
+	if(byte_order != 0x4949) {
+		lua_pushboolean(L,0);
+		if(byte_order == 0x4d4d) {
+			lua_pushstring(L,"big endian unsupported");
+		} else {
+			lua_pushfstring(L,"invalid byte order 0x%x",byte_order);
+		}
+		return 2;
+	}
+	if(id != 42) {
+		lua_pushboolean(L,0);
+		lua_pushfstring(L,"invalid id %d, expected 42",id);
+		return 2;
+	}
+	tiff_parse_t *parse = malloc(sizeof(tiff_parse_t));
+	if(!parse) {
+		return luaL_error(L,"malloc failed");
+	}
+	parse->p = p;
+	parse->len = lb->len;
+	parse->n_ifds = 0;
+	parse->entries = NULL;
+	parse->n_entries = 0;
+	parse->max_entries = 0;
+	parse->data_end = 8;
+	parse->err = NULL;
+	uint32_t ifd0_off = get_u32(p+4);
+	if(!tiff_parse_chain(parse,ifd0_off,-1,TIFFIFD_KIND_MAIN,0)) {
+		free(parse->entries);
+		lua_pushboolean(L,0);
+		lua_pushstring(L,parse->err);
+		free(parse);
+		return 2;
+	}
+	size_t ifd_size = parse->n_ifds*sizeof(tiff_ifd_t);
+	size_t entry_size = parse->n_entries*sizeof(tiff_entry_t);
+	tiff_t *tiff = lua_newuserdata(L,sizeof(tiff_t) + ifd_size + entry_size);
+	tiff->byte_order = byte_order;
+	tiff->id = id;
+	tiff->ifd0_off = ifd0_off;
+	tiff->data_end = (parse->data_end > 0xFFFFFFFF)?0xFFFFFFFF:(uint32_t)parse->data_end;
+	tiff->n_ifds = parse->n_ifds;
+	tiff->n_entries = parse->n_entries;
+	tiff->ifds = (tiff_ifd_t *)(tiff + 1);
+	tiff->entries = (tiff_entry_t *)((char *)tiff->ifds + ifd_size);
+	memcpy(tiff->ifds,parse->ifds,ifd_size);
+	if(entry_size) {
+		memcpy(tiff->entries,parse->entries,entry_size);
+	}
+	free(parse->entries);
+	free(parse);
+	luaL_getmetatable(L, TIFFIFD_META);
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
+static tiff_ifd_t *tiffifd_checkifd(lua_State *L, tiff_t *tiff, int narg) {
+	lua_Integer i = luaL_checkinteger(L,narg);
+	if(i < 0 || i >= (lua_Integer)tiff->n_ifds) {
+		luaL_argerror(L,narg,"invalid ifd index");
+	}
+	return &tiff->ifds[i];
+}
+
+static int tiffifd_push_entry(lua_State *L, tiff_entry_t *e) {
+	lua_pushnumber(L,e->tag);
+	lua_pushnumber(L,e->type);
+	lua_pushnumber(L,e->count);
+	lua_pushnumber(L,e->valoff);
+	lua_pushnumber(L,e->off);
+	return 5;
+}
+
+/*
+byte_order,id,ifd0_off=tiff:header()
+*/
+static int tiffifd_lua_header(lua_State *L) {
+	tiff_t *tiff = (tiff_t *)luaL_checkudata(L,1,TIFFIFD_META);
+	lua_pushnumber(L,tiff->byte_order);
+	lua_pushnumber(L,tiff->id);
+	lua_pushnumber(L,tiff->ifd0_off);
+	return 3;
+}
+
+/*
+n=tiff:data_end()
+end of the header data: the largest offset used by IFDs and out of line values, not including image data
+may be larger than the lbuf, if the lbuf only contains the start of the file
+*/
+static int tiffifd_lua_data_end(lua_State *L) {
+	tiff_t *tiff = (tiff_t *)luaL_checkudata(L,1,TIFFIFD_META);
+	lua_pushnumber(L,tiff->data_end);
+	return 1;
+}
+
+/*
+n=tiff:ifd_count()
+*/
+static int tiffifd_lua_ifd_count(lua_State *L) {
+	tiff_t *tiff = (tiff_t *)luaL_checkudata(L,1,TIFFIFD_META);
+	lua_pushnumber(L,tiff->n_ifds);
+	return 1;
+}
+
+/*
+off,n_entries,kind,parent=tiff:ifd(i)
+i: 0 based ifd index
+kind: 'main', 'sub' or 'exif'
+parent: index of the ifd containing the SubIFDs or ExifIFD tag, or -1 for the main chain
+*/
+static int tiffifd_lua_ifd(lua_State *L) {
+	tiff_t *tiff = (tiff_t *)luaL_checkudata(L,1,TIFFIFD_META);
+	tiff_ifd_t *ifd = tiffifd_checkifd(L,tiff,2);
+	lua_pushnumber(L,ifd->off);
+	lua_pushnumber(L,ifd->n_entries);
+	lua_pushstring(L,kind_strings[ifd->kind]);
+	lua_pushnumber(L,ifd->parent);
+	return 4;
+}
+
+/*
+tag,type_id,count,valoff,off=tiff:entry(i,e)
+i: 0 based ifd index
+e: 0 based entry index within the ifd
+*/
+static int tiffifd_lua_entry(lua_State *L) {
+	tiff_t *tiff = (tiff_t *)luaL_checkudata(L,1,TIFFIFD_META);
+	tiff_ifd_t *ifd = tiffifd_checkifd(L,tiff,2);
+	lua_Integer e = luaL_checkinteger(L,3);
+	if(e < 0 || e >= ifd->n_entries) {
+		return luaL_argerror(L,3,"invalid entry index");
+	}
+	return tiffifd_push_entry(L,&tiff->entries[ifd->first_entry + e]);
+}
+
+/*
+e,tag,type_id,count,valoff,off=tiff:find(i,tag)
+find tag in ifd i, returns nil if not present
+if the tag appears more than once, the last is returned
+*/
+static int tiffifd_lua_find(lua_State *L) {
+	tiff_t *tiff = (tiff_t *)luaL_checkudata(L,1,TIFFIFD_META);
+	tiff_ifd_t *ifd = tiffifd_checkifd(L,tiff,2);
+	unsigned tag = luaL_checknumber(L,3);
+	int i;
+	for(i=ifd->n_entries-1; i>=0; i--) {
+		tiff_entry_t *e = &tiff->entries[ifd->first_entry + i];
+		if(e->tag == tag) {
+			lua_pushnumber(L,i);
+			return 1 + tiffifd_push_entry(L,e);
+		}
+	}
+	lua_pushnil(L);
+	return 1;
+}
+
+static const luaL_Reg tiffifd_methods[] = {
+	{"header",tiffifd_lua_header},
+	{"data_end",tiffifd_lua_data_end},
+	{"ifd_count",tiffifd_lua_ifd_count},
+	{"ifd",tiffifd_lua_ifd},
+	{"entry",tiffifd_lua_entry},
+	{"find",tiffifd_lua_find},
+	{NULL, NULL}
+};
+
+static const luaL_Reg tiffifd_lib[] = {
+	{"parse",tiffifd_parse},
+	{NULL, NULL}
+};
+
+int luaopen_tiffifd(lua_State *L) {
+	luaL_newmetatable(L,TIFFIFD_META);
+	lua_newtable(L);
+	luaL_register(L, NULL, tiffifd_methods);
+	lua_setfield(L,-2,"__index");
+	lua_pop(L,1); // done with meta table
+
+	luaL_register(L, "tiffifd", tiffifd_lib);
+	return 1;
+}
@@ -0,0 +1,238 @@
+/*
+ * worker thread pool for splitting bulk image operations into row ranges
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#include <stdlib.h>
+#ifdef CHDKPTP_THREADS
+#include <pthread.h>
+#endif
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+#include "workpool.h"
+
+/*
+the pool is started lazily on the first run with more than one thread.
+the calling thread works on chunks along with the workers, so n threads = n-1 workers
+*/
+static struct {
+	unsigned threads; // configured count, including caller. 0 = not set yet
+#ifdef CHDKPTP_THREADS
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond; // signaled when a job is posted or on shutdown
+	pthread_cond_t done_cond; // signaled when the last chunk of a job completes
+	pthread_t workers[WORKPOOL_MAX_THREADS];
+	unsigned num_workers; // running worker threads
+	int shutdown;
+	unsigned job_id; // incremented for each job
+	// current job
+	workpool_rows_func_t func;
+	void *arg;
+	unsigned start;
+	unsigned end;
+	unsigned chunk_rows;
+	unsigned chunks;
+	unsigned next_chunk;
+	unsigned chunks_done;
+#endif
+} pool;
+
+unsigned workpool_cpu_count(void) {
+	long n;
+#ifdef _WIN32
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+	n = si.dwNumberOfProcessors;
+#elif defined(_SC_NPROCESSORS_ONLN)
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+#else
+	n = 1;
+#endif
+	if(n < 1) {
+		return 1;
+	}
+	if(n > WORKPOOL_MAX_THREADS) {
+		return WORKPOOL_MAX_THREADS;
+	}
+	return (unsigned)n;
+}
+
+unsigned workpool_get_threads(void) {
+#ifdef CHDKPTP_THREADS
+	if(!pool.threads) {
+		pool.threads = workpool_cpu_count();
+	}
+	return pool.threads;
+#else
+	return 1;
+#endif
+}
+
+unsigned workpool_chunk_count(unsigned rows) {
+	unsigned threads = workpool_get_threads();
+	if(threads == 1 || rows < 2*WORKPOOL_MIN_CHUNK_ROWS) {
+		return 1;
+	}
+	unsigned chunks = threads*WORKPOOL_CHUNKS_PER_THREAD;
+	if(chunks > rows/WORKPOOL_MIN_CHUNK_ROWS) {
+		chunks = rows/WORKPOOL_MIN_CHUNK_ROWS;
+	}
+	return chunks;
+}
+
+#ifdef CHDKPTP_THREADS
+/*
+run chunks of the current job until none are left. called with lock held, returns with lock held
+*/
+static void workpool_do_chunks(void) {
+	while(pool.next_chunk < pool.chunks) {
+		unsigned chunk = pool.next_chunk++;
+		unsigned start = pool.start + chunk*pool.chunk_rows;
+		unsigned end = (chunk == pool.chunks - 1)?pool.end:start + pool.chunk_rows;
+		workpool_rows_func_t func = pool.func;
+		void *arg = pool.arg;
+		pthread_mutex_unlock(&pool.lock);
+		func(arg,chunk,start,end);
+		pthread_mutex_lock(&pool.lock);
+		if(++pool.chunks_done == pool.chunks) {
+			pthread_cond_signal(&pool.done_cond);
+		}
+	}
+}
+
+static void *workpool_worker(void *unused) {
+	unsigned last_job;
+	pthread_mutex_lock(&pool.lock);
+	last_job = pool.job_id;
+	while(1) {
+		while(pool.job_id == last_job && !pool.shutdown) {
+			pthread_cond_wait(&pool.work_cond,&pool.lock);
+		}
+		if(pool.shutdown) {
+			break;
+		}
+		last_job = pool.job_id;
+		workpool_do_chunks();
+	}
+	pthread_mutex_unlock(&pool.lock);
+	return NULL;
+}
+
+static void workpool_stop(void) {
+	unsigned i;
+	if(!pool.num_workers) {
+		return;
+	}
+	pthread_mutex_lock(&pool.lock);
+	pool.shutdown = 1;
+	pthread_cond_broadcast(&pool.work_cond);
+	pthread_mutex_unlock(&pool.lock);
+	for(i=0; i<pool.num_workers; i++) {
+		pthread_join(pool.workers[i],NULL);
+	}
+	pool.num_workers = 0;
+	pool.shutdown = 0;
+}
+
+/*
+start workers if needed. If thread creation fails, runs with whatever was created
+*/
+static void workpool_start(void) {
+	static int initialized;
+	if(!initialized) {
+		pthread_mutex_init(&pool.lock,NULL);
+		pthread_cond_init(&pool.work_cond,NULL);
+		pthread_cond_init(&pool.done_cond,NULL);
+		initialized = 1;
+	}
+	while(pool.num_workers < pool.threads - 1) {
+		if(pthread_create(&pool.workers[pool.num_workers],NULL,workpool_worker,NULL) != 0) {
+			break;
+		}
+		pool.num_workers++;
+	}
+}
+#endif
+
+unsigned workpool_set_threads(unsigned n) {
+#ifdef CHDKPTP_THREADS
+	if(n == 0) {
+		n = workpool_cpu_count();
+	} else if(n > WORKPOOL_MAX_THREADS) {
+		n = WORKPOOL_MAX_THREADS;
+	}
+	if(n != pool.threads) {
+		workpool_stop();
+		pool.threads = n;
+	}
+	return n;
+#else
+	return 1;
+#endif
+}
+
+/*
+run func over start to end-1 split into chunks
+*/
+static void workpool_run_chunks(workpool_rows_func_t func, void *arg, unsigned start, unsigned end, unsigned chunks) {
+#ifdef CHDKPTP_THREADS
+	if(chunks > 1) {
+		workpool_start();
+	}
+	if(chunks > 1 && pool.num_workers) {
+		pthread_mutex_lock(&pool.lock);
+		pool.func = func;
+		pool.arg = arg;
+		pool.start = start;
+		pool.end = end;
+		pool.chunks = chunks;
+		pool.chunk_rows = (end - start)/chunks;
+		pool.next_chunk = 0;
+		pool.chunks_done = 0;
+		pool.job_id++;
+		pthread_cond_broadcast(&pool.work_cond);
+		workpool_do_chunks();
+		while(pool.chunks_done < pool.chunks) {
+			pthread_cond_wait(&pool.done_cond,&pool.lock);
+		}
+		pthread_mutex_unlock(&pool.lock);
+		return;
+	}
+#endif
+	// single threaded, same chunk boundaries so per-chunk results don't depend on threading
+	unsigned chunk_rows = (end - start)/chunks;
+	unsigned chunk;
+	for(chunk=0; chunk < chunks; chunk++) {
+		unsigned cstart = start + chunk*chunk_rows;
+		func(arg,chunk,cstart,(chunk == chunks - 1)?end:cstart + chunk_rows);
+	}
+}
+
+void workpool_run_rows(workpool_rows_func_t func, void *arg, unsigned start, unsigned end) {
+	if(end <= start) {
+		return;
+	}
+	workpool_run_chunks(func,arg,start,end,workpool_chunk_count(end - start));
+}
+
+void workpool_run_tasks(workpool_rows_func_t func, void *arg, unsigned count) {
+	if(!count) {
+		return;
+	}
+	workpool_run_chunks(func,arg,0,count,(workpool_get_threads() == 1)?1:count);
+}
@@ -0,0 +1,64 @@
+/*
+ * worker thread pool for splitting bulk image operations into row ranges
+ * without CHDKPTP_THREADS, everything runs on the calling thread
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef WORKPOOL_H
+#define WORKPOOL_H
+
+#define WORKPOOL_MAX_THREADS 64
+
+// rows per chunk are at least this, so small images don't pay thread overhead
+#define WORKPOOL_MIN_CHUNK_ROWS 16
+
+// chunks per thread, for load balancing
+#define WORKPOOL_CHUNKS_PER_THREAD 4
+
+/*
+process rows start to end-1. chunk is the index of the chunk, 0 to workpool_chunk_count()-1
+called from worker threads, must not call Lua or raise errors
+*/
+typedef void (*workpool_rows_func_t)(void *arg, unsigned chunk, unsigned start, unsigned end);
+
+/*
+set the number of threads used, including the caller. 0 = number of CPUs
+returns the number actually set
+*/
+unsigned workpool_set_threads(unsigned n);
+unsigned workpool_get_threads(void);
+unsigned workpool_cpu_count(void);
+
+/*
+number of chunks workpool_run_rows will use for rows, for callers that need per-chunk results
+*/
+unsigned workpool_chunk_count(unsigned rows);
+
+/*
+run func over rows start to end-1, split into workpool_chunk_count(end-start) chunks
+returns when all chunks are complete, so data referenced by arg need only remain valid for the call
+must only be called from the Lua thread, not re-entrant
+*/
+void workpool_run_rows(workpool_rows_func_t func, void *arg, unsigned start, unsigned end);
+
+/*
+run func for count independent tasks 0 to count-1, each task is a chunk with start=task, end=task+1
+for coarse work items like compressed tiles, where row chunking would leave threads idle
+as workpool_run_rows, except when single threaded, func is called once with 0,count
+*/
+void workpool_run_tasks(workpool_rows_func_t func, void *arg, unsigned count);
+
+#endif